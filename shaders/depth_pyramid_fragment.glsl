@@ -0,0 +1,24 @@
+#version 330
+
+// One level of the depth pyramid (see DepthPyramid): the farthest depth of the source texels under every texel of
+// the level. The source is the depth copy (up to 3x3 texels per texel, the level is the viewport rounded down to
+// powers of two) or the level before (2x2 texels).
+uniform sampler2D source;
+uniform vec2 target_size;
+
+out float farthest;
+
+void main()
+{
+	ivec2 source_size = textureSize(source, 0);
+	vec2 ratio = vec2(source_size) / target_size;
+	vec2 texel = floor(gl_FragCoord.xy);
+	ivec2 begin = ivec2(floor(texel * ratio));
+	ivec2 end = min(ivec2(ceil((texel + 1.0) * ratio)), source_size);
+
+	float depth = 0.0;
+	for (int y = begin.y; y < end.y; ++y)
+		for (int x = begin.x; x < end.x; ++x)
+			depth = max(depth, texelFetch(source, ivec2(x, y), 0).r);
+	farthest = depth;
+}
@@ -0,0 +1,132 @@
+#version 330
+
+const int LIGHTS_COUNT = 2;
+
+out vec4 final_color;
+
+in VertexData
+{
+	vec3 position_ws;
+	vec2 view_uv[3];
+} inData;
+
+flat in vec2 view_origin[3];
+flat in vec3 view_weight;
+flat in mat3 rotation;
+flat in vec3 to_eye;
+flat in float world_radius;
+
+uniform CameraData
+{
+	mat4 view_matrix;
+	mat4 projection_matrix;
+	vec3 eye_position;
+};
+
+struct Light
+{
+	vec4 light_position;
+	vec4 light_ambient_color;
+	vec4 light_diffuse_color;
+	vec4 light_specular_color;
+	vec4 light_size;
+};
+
+uniform LightData
+{
+	Light lights[LIGHTS_COUNT];
+};
+
+uniform MaterialData
+{
+	uniform vec4 material_ambient_color;
+	uniform vec4 material_diffuse_color;
+	uniform vec4 material_specular_color;
+	uniform float material_shininess;
+};
+
+// Atlases of the baked views: color and coverage, model space normal and depth towards the viewer in radii
+uniform sampler2D albedo_tex;
+uniform sampler2D normal_depth_tex;
+uniform float impostor_frames;
+
+// Share of the dither pattern drawn by this LOD, the neighbouring LOD draws the rest during a transition
+flat in vec2 lod_share;
+
+// 4x4 ordered dither
+const float BAYER[16] = float[](0.0, 8.0, 2.0, 10.0, 12.0, 4.0, 14.0, 6.0, 3.0, 11.0, 1.0, 9.0, 15.0, 7.0, 13.0, 5.0);
+
+// Baked terrain ambient occlusion, the terrain covers [-50, 50] on X and Z
+uniform sampler2D occlusion_tex;
+
+float terrain_occlusion(vec3 position)
+{
+	vec2 size = vec2(textureSize(occlusion_tex, 0));
+	return texture(occlusion_tex, position.xz / 100.0 + 0.5 + 0.5 / size).r;
+}
+
+void main()
+{
+	ivec2 cell = ivec2(gl_FragCoord.xy) & 3;
+	float threshold = (BAYER[cell.y * 4 + cell.x] + 0.5) / 16.0;
+	if (threshold >= lod_share.x || threshold < lod_share.y)
+		discard;
+
+	// The three views weighted by their coverage, positions outside a view are empty
+	vec4 color = vec4(0.0);
+	vec4 normal_depth = vec4(0.0);
+	vec2 inset = vec2(0.5 / textureSize(albedo_tex, 0).x) * impostor_frames;
+	for (int k = 0; k < 3; ++k) {
+		vec2 uv = inData.view_uv[k];
+		if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0))))
+			continue;
+		vec2 atlas = view_origin[k] + clamp(uv, inset, 1.0 - inset) / impostor_frames;
+		vec4 albedo = texture(albedo_tex, atlas);
+		float weight = view_weight[k] * albedo.a;
+		color += vec4(albedo.rgb * weight, weight);
+		normal_depth += texture(normal_depth_tex, atlas) * weight;
+	}
+	if (color.a < 0.5)
+		discard;
+	vec3 tex_color = color.rgb / color.a;
+	normal_depth /= color.a;
+
+	// The baked depth moves the fragment from the quad onto the surface of the mesh
+	vec3 position_ws = inData.position_ws + to_eye * (normal_depth.a * 2.0 - 1.0) * world_radius;
+	vec4 clip = projection_matrix * view_matrix * vec4(position_ws, 1.0);
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+
+	// Lights, as in tree_fragment.glsl
+	vec3 N = normalize(rotation * (normal_depth.rgb * 2.0 - 1.0));
+	vec3 Eye = normalize(eye_position - position_ws);
+
+	vec4 mat_ambient = material_ambient_color * vec4(tex_color, 1.0) * terrain_occlusion(position_ws);
+	vec4 mat_diffuse = material_diffuse_color * vec4(tex_color, 1.0);
+	vec4 mat_specular = material_specular_color;
+
+	vec4 light = vec4(0.0, 0.0, 0.0, 0.0);
+
+	for (int l=0; l < LIGHTS_COUNT; l++){
+		vec3 L;
+		if (lights[l].light_position.w == 0.0)
+			L = normalize(lights[l].light_position.xyz);
+		else
+			L = normalize(lights[l].light_position.xyz - position_ws);
+
+		vec3 H = normalize(L + Eye);
+
+		float Idiff = max(dot(N, L), 0.0);
+		float Ispec = Idiff * pow(max(dot(N, H), 0.0), material_shininess);
+		float Ipow = 1.0;
+		if (lights[l].light_position.w != 0.0) {
+			float d = distance(position_ws, lights[l].light_position.xyz);
+			Ipow = max(0, 1 - (d / lights[l].light_size.x));
+		}
+
+		light += mat_ambient * lights[l].light_ambient_color * Ipow +
+			mat_diffuse * lights[l].light_diffuse_color * Idiff * Ipow +
+			mat_specular * lights[l].light_specular_color * Ispec * Ipow;
+	}
+
+	final_color = vec4(light.rgb, 1.0);
+}
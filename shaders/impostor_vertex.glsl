@@ -0,0 +1,152 @@
+#version 330
+
+// Corner of the quad, -1 to 1
+in vec2 position;
+// Instance transform (see InstanceBuffer): packed position, yaw, tilts and scale, or a full model matrix
+layout(location = 3) in vec3 instance_position;
+layout(location = 4) in uvec4 instance_packed;
+layout(location = 5) in mat4 instance_matrix;
+
+const float TILT_STEP = 1.0 / 256.0;
+
+uniform bool packed_instances;
+uniform mat4 model_matrix;
+
+// Impostor (see Impostor): model space center and radius of the baked views, and the views along each side of the atlas
+uniform vec4 impostor_bounds;
+uniform float impostor_frames;
+
+// LOD transitions, as in tree_vertex.glsl
+uniform vec4 lod_fade;
+uniform vec4 lod_bounds;
+uniform vec3 lod_eye;
+
+uniform CameraData
+{
+	mat4 view_matrix;
+	mat4 projection_matrix;
+	vec3 eye_position;
+};
+
+out VertexData
+{
+	vec3 position_ws;
+	// Position in each of the three views, in [0, 1] inside the view
+	vec2 view_uv[3];
+} outData;
+
+// Atlas corners of the three views, their weights and the instance rotation (model to world)
+flat out vec2 view_origin[3];
+flat out vec3 view_weight;
+flat out mat3 rotation;
+// Direction to the eye (world) and world units per baked radius
+flat out vec3 to_eye;
+flat out float world_radius;
+
+flat out vec2 lod_share;
+
+// translate(position) * rotate_z(tilt_z) * rotate_x(tilt_x) * rotate_y(yaw) * scale, as PackedInstance::Matrix
+mat4 unpackInstance()
+{
+	float yaw = float(instance_packed.x) * (6.2831853 / 256.0);
+	vec2 tilt = (vec2(instance_packed.yz) - 128.0) * TILT_STEP;
+	vec3 c = cos(vec3(yaw, tilt));
+	vec3 s = sin(vec3(yaw, tilt));
+	mat3 ry = mat3(c.x, 0.0, -s.x, 0.0, 1.0, 0.0, s.x, 0.0, c.x);
+	mat3 rz = mat3(c.y, s.y, 0.0, -s.y, c.y, 0.0, 0.0, 0.0, 1.0);
+	mat3 rx = mat3(1.0, 0.0, 0.0, 0.0, c.z, s.z, 0.0, -s.z, c.z);
+	mat3 r = rz * rx * ry * (float(instance_packed.w) / 64.0);
+	return mat4(vec4(r[0], 0.0), vec4(r[1], 0.0), vec4(r[2], 0.0), vec4(instance_position, 1.0));
+}
+
+float nextShare(float size, float pixels)
+{
+	return clamp((size * (1.0 + lod_fade.z) - pixels) / max(2.0 * lod_fade.z * size, 1e-6), 0.0, 1.0);
+}
+
+// Impostor::Direction
+vec3 viewDirection(vec2 uv)
+{
+	vec2 p = uv * 2.0 - 1.0;
+	float x = (p.x + p.y) * 0.5;
+	float z = (p.x - p.y) * 0.5;
+	return normalize(vec3(x, 1.0 - abs(x) - abs(z), z));
+}
+
+// Inverse of viewDirection for the upper hemisphere
+vec2 viewCoordinate(vec3 direction)
+{
+	direction /= abs(direction.x) + abs(direction.y) + abs(direction.z);
+	return vec2(direction.x + direction.z, direction.x - direction.z) * 0.5 + 0.5;
+}
+
+// Impostor::FrameAxes
+void frameAxes(vec3 direction, out vec3 right, out vec3 up)
+{
+	right = cross(vec3(0.0, 1.0, 0.0), direction);
+	float len = length(right);
+	right = len > 1e-4 ? right / len : vec3(1.0, 0.0, 0.0);
+	up = cross(direction, right);
+}
+
+void main()
+{
+	mat4 instance = packed_instances ? unpackInstance() : instance_matrix;
+	float scale = length(instance[0].xyz);
+	rotation = mat3(instance) / scale;
+
+	vec3 center = vec3(instance * model_matrix * vec4(impostor_bounds.xyz, 1.0));
+	world_radius = impostor_bounds.w * scale;
+
+	lod_share = vec2(1.0, 0.0);
+	if (lod_fade.w > 0.0) {
+		vec3 lod_center = vec3(instance * model_matrix * vec4(lod_bounds.xyz, 1.0));
+		float pixels = 2.0 * lod_bounds.w * scale * lod_fade.w / max(distance(lod_center, lod_eye), 1e-6);
+		if (lod_fade.x > 0.0)
+			lod_share.x = nextShare(lod_fade.x, pixels);
+		if (lod_fade.y > 0.0)
+			lod_share.y = nextShare(lod_fade.y, pixels);
+	}
+
+	// View direction of the instance in model space, the views only cover the upper hemisphere
+	to_eye = normalize(eye_position - center);
+	vec3 view = transpose(rotation) * to_eye;
+	view = normalize(vec3(view.x, max(view.y, 0.0), view.z));
+
+	// The three views around it: the corners of the half cell of the view grid holding the direction
+	float last = impostor_frames - 1.0;
+	vec2 grid = viewCoordinate(view) * last;
+	vec2 cell = clamp(floor(grid), vec2(0.0), vec2(last - 1.0));
+	vec2 t = grid - cell;
+	vec2 frames[3];
+	if (t.x + t.y < 1.0) {
+		frames[0] = cell;
+		view_weight = vec3(1.0 - t.x - t.y, t.x, t.y);
+	}
+	else {
+		frames[0] = cell + vec2(1.0);
+		view_weight = vec3(t.x + t.y - 1.0, 1.0 - t.y, 1.0 - t.x);
+	}
+	frames[1] = cell + vec2(1.0, 0.0);
+	frames[2] = cell + vec2(0.0, 1.0);
+
+	// Camera facing quad around the bounds
+	vec3 camera_right = vec3(view_matrix[0][0], view_matrix[1][0], view_matrix[2][0]);
+	vec3 camera_up = vec3(view_matrix[0][1], view_matrix[1][1], view_matrix[2][1]);
+	vec3 corner = center + (camera_right * position.x + camera_up * position.y) * world_radius;
+
+	// The ray through the corner meets the plane of each view, its position there samples the view
+	vec3 local = transpose(rotation) * (corner - center) / world_radius;
+	for (int k = 0; k < 3; ++k) {
+		vec3 direction = viewDirection(frames[k] / last);
+		vec3 right, up;
+		frameAxes(direction, right, up);
+		vec3 on_plane = local - view * dot(local, direction) / max(dot(view, direction), 0.1);
+		outData.view_uv[k] = vec2(dot(on_plane, right), dot(on_plane, up)) * 0.5 + 0.5;
+		view_origin[k] = frames[k] / impostor_frames;
+	}
+
+	outData.position_ws = corner;
+	gl_ClipDistance[0] = corner.y;
+	gl_Position = projection_matrix * view_matrix * vec4(corner, 1.0);
+}
@@ -0,0 +1,154 @@
+#version 430
+
+// Frustum and occlusion culling and LOD selection of one vegetation type (see GpuCulling). Every invocation tests
+// one instance and appends it to the region of its LOD, the instance counts of the indirect draws are the append
+// counters.
+
+layout(local_size_x = 64) in;
+
+const int MAX_LODS = 4;
+const float TILT_STEP = 1.0 / 256.0;
+
+struct PackedInstance
+{
+	vec3 position;
+	// yaw, tilt_z, tilt_x, scale: one byte each, lowest first
+	uint bits;
+};
+
+// DrawArraysIndirectCommand
+struct DrawCommand
+{
+	uint count;
+	uint instance_count;
+	uint first;
+	uint base_instance;
+};
+
+layout(std430, binding = 0) readonly buffer Source
+{
+	PackedInstance source[];
+};
+
+layout(std430, binding = 1) writeonly buffer Visible
+{
+	PackedInstance visible[];
+};
+
+layout(std430, binding = 2) buffer Commands
+{
+	DrawCommand commands[];
+};
+
+// Instances dropped by the occlusion test, one counter per type and view
+layout(std430, binding = 3) buffer Occluded
+{
+	uint occluded[];
+};
+
+uniform uint instance_count;
+// Instances per LOD region of 'visible'
+uniform uint capacity;
+// First command of this type and view
+uniform uint first_command;
+
+uniform vec4 planes[6];
+uniform float min_y;
+uniform vec3 eye_position;
+// LOD i is used up to lod_distance[i], the last one without limit
+uniform int lod_count;
+uniform float lod_distance[MAX_LODS];
+
+uniform mat4 model_matrix;
+// Bounding sphere in model space
+uniform vec4 bounds;
+
+// Depth pyramid of the view (see DepthPyramid), rendered with occlusion_view_projection
+uniform bool occlusion;
+uniform sampler2D depth_pyramid;
+uniform int pyramid_levels;
+uniform mat4 occlusion_view_projection;
+
+// Same transform as the vegetation vertex shader
+mat4 unpackInstance(PackedInstance instance)
+{
+	uvec4 p = uvec4(instance.bits & 255u, (instance.bits >> 8) & 255u, (instance.bits >> 16) & 255u, instance.bits >> 24);
+	float yaw = float(p.x) * (6.2831853 / 256.0);
+	vec2 tilt = (vec2(p.yz) - 128.0) * TILT_STEP;
+	vec3 c = cos(vec3(yaw, tilt));
+	vec3 s = sin(vec3(yaw, tilt));
+	mat3 ry = mat3(c.x, 0.0, -s.x, 0.0, 1.0, 0.0, s.x, 0.0, c.x);
+	mat3 rz = mat3(c.y, s.y, 0.0, -s.y, c.y, 0.0, 0.0, 0.0, 1.0);
+	mat3 rx = mat3(1.0, 0.0, 0.0, 0.0, c.z, s.z, 0.0, -s.z, c.z);
+	mat3 r = rz * rx * ry * (float(p.w) / 64.0);
+	return mat4(vec4(r[0], 0.0), vec4(r[1], 0.0), vec4(r[2], 0.0), vec4(instance.position, 1.0));
+}
+
+// Whether the box around the sphere lies behind the farthest depth of the pyramid texels under it, as
+// HiZMap::SphereVisible. Bounds crossing the near plane or leaving the viewport are kept.
+bool hidden(vec3 center, float radius)
+{
+	vec4 clip = occlusion_view_projection * vec4(center, 1.0);
+	vec4 extent = (abs(occlusion_view_projection[0]) + abs(occlusion_view_projection[1]) + abs(occlusion_view_projection[2])) * radius;
+	float w_near = clip.w - extent.w;
+	float w_far = clip.w + extent.w;
+	if (w_near <= 1e-5)
+		return false;
+
+	// Bounds of the projected corners: the numerator over the denominator that moves it furthest. The nearest depth
+	// is that of the nearest w, both grow together for a perspective camera.
+	vec3 lower = clip.xyz - extent.xyz;
+	vec3 upper = clip.xyz + extent.xyz;
+	vec2 lowest = mix(lower.xy / w_near, lower.xy / w_far, greaterThanEqual(lower.xy, vec2(0.0)));
+	vec2 highest = mix(upper.xy / w_far, upper.xy / w_near, greaterThanEqual(upper.xy, vec2(0.0)));
+	float nearest = lower.z / w_near;
+	if (nearest <= -1.0)
+		return false;
+	vec2 low = clamp(lowest * 0.5 + 0.5, 0.0, 1.0);
+	vec2 high = clamp(highest * 0.5 + 0.5, 0.0, 1.0);
+	if (any(greaterThanEqual(low, high)))
+		return false;
+
+	// The level where the rectangle spans at most 2x2 texels
+	vec2 span = (high - low) * vec2(textureSize(depth_pyramid, 0));
+	int level = min(int(ceil(log2(max(max(span.x, span.y), 1.0)))), pyramid_levels - 1);
+	ivec2 size = textureSize(depth_pyramid, level);
+	ivec2 first = min(ivec2(low * vec2(size)), size - 1);
+	ivec2 last = min(ivec2(high * vec2(size)), size - 1);
+	float farthest = 0.0;
+	for (int y = first.y; y <= last.y; ++y)
+		for (int x = first.x; x <= last.x; ++x)
+			farthest = max(farthest, texelFetch(depth_pyramid, ivec2(x, y), level).r);
+	return nearest * 0.5 + 0.5 > farthest;
+}
+
+void main()
+{
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= instance_count)
+		return;
+
+	PackedInstance instance = source[i];
+	float scale = float(instance.bits >> 24) / 64.0;
+	vec3 center = vec3(unpackInstance(instance) * model_matrix * vec4(bounds.xyz, 1.0));
+	float radius = bounds.w * scale;
+
+	if (center.y + radius <= min_y)
+		return;
+	for (int p = 0; p < 6; ++p) {
+		if (dot(planes[p].xyz, center) + planes[p].w + radius < 0.0)
+			return;
+	}
+	if (occlusion && hidden(center, radius)) {
+		atomicAdd(occluded[first_command / uint(MAX_LODS)], 1u);
+		return;
+	}
+
+	int lod = 0;
+	float distance = length(center - eye_position);
+	while (lod < lod_count - 1 && distance > lod_distance[lod])
+		++lod;
+
+	uint slot = atomicAdd(commands[first_command + uint(lod)].instance_count, 1u);
+	visible[uint(lod) * capacity + slot] = instance;
+}
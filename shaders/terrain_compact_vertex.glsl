@@ -0,0 +1,45 @@
+#version 330
+
+uniform mat4 model_matrix;
+
+// Height (R16) and normal X/Z (RG8 snorm), texel (x, z) is the terrain sample (x, z)
+uniform sampler2D height_tex;
+uniform sampler2D normal_tex;
+
+uniform CameraData
+{
+	mat4 view_matrix;
+	mat4 projection_matrix;
+	vec3 eye_position;
+};
+
+out VertexData
+{
+	vec3 normal_ws;
+	vec3 position_ws;
+	vec2 tex_coord;
+} outData;
+
+void main()
+{
+	// One triangle strip per row: gl_InstanceID is the row, gl_VertexID alternates between the rows z + 1 and z
+	ivec2 terrain_size = textureSize(height_tex, 0);
+	ivec2 sample_pos = ivec2(gl_VertexID / 2, gl_InstanceID + 1 - (gl_VertexID % 2));
+	vec2 st = vec2(sample_pos) / vec2(terrain_size);
+
+	float height = texelFetch(height_tex, sample_pos, 0).r;
+	vec2 normal_xz = texelFetch(normal_tex, sample_pos, 0).rg;
+
+	vec4 position = vec4(-0.5 + st.x, height, -0.5 + st.y, 1.0);
+
+	outData.position_ws = vec3(model_matrix * position);
+	
+	// No transformations applied!
+	outData.normal_ws = normalize(vec3(normal_xz.x, sqrt(max(0.0, 1.0 - dot(normal_xz, normal_xz))), normal_xz.y));
+
+	gl_ClipDistance[0] = outData.position_ws.y;
+
+	outData.tex_coord = st;
+
+	gl_Position = projection_matrix * view_matrix * model_matrix * position;
+}
@@ -6,6 +6,9 @@ out vec4 final_color;
 
 const float triplanar_blend_sharpness = 1.0;
 
+// Model scale of the single terrain, its normals are in the unit terrain space
+const vec3 terrain_scale = vec3(100.0, 15.0, 100.0);
+
 in VertexData
 {
 	vec3 normal_ws;
@@ -45,14 +48,44 @@ uniform MaterialData
 uniform sampler2D grass_tex;
 uniform sampler2D rocks_tex;
 
-void main()
+// Full resolution normals (RG8 snorm X/Z) of a coarse mesh, replace the interpolated vertex normals
+uniform sampler2D normal_map_tex;
+uniform bool use_normal_map;
+
+// Baked terrain ambient occlusion, the terrain covers [-50, 50] on X and Z
+uniform sampler2D occlusion_tex;
+
+// Baked material weights of the single terrain (R rock, G triplanar), same placement as the occlusion.
+// Without it (streamed tiles) the material is chosen per fragment from the slope.
+uniform sampler2D splat_tex;
+uniform bool use_splat_map;
+
+// Mean material colors of the single terrain, one texel per macro_step x macro_step samples. Past macro_distance
+// (0 = never) from the eye they replace the detail textures, which fade out over the last fifth before it.
+uniform sampler2D macro_tex;
+uniform float macro_step;
+uniform float macro_distance;
+
+float terrain_occlusion(vec3 position)
 {
-	
-	// Difuse
-    vec3 tex_color_x, tex_color_y, tex_color_z;
+	vec2 size = vec2(textureSize(occlusion_tex, 0));
+	return texture(occlusion_tex, position.xz / 100.0 + 0.5 + 0.5 / size).r;
+}
+
+// Triplanar blend weights of a normal
+vec3 triplanar_weights(vec3 normal)
+{
+	vec3 weights = pow(abs(normal), vec3(triplanar_blend_sharpness, triplanar_blend_sharpness, triplanar_blend_sharpness));
+	return weights / (weights.x + weights.y + weights.z);
+}
+
+// Three projections at every fragment, the material picked from the slope
+vec3 slope_material(vec3 normal)
+{
+	vec3 tex_color_x, tex_color_y, tex_color_z;
 	vec2 texture_scale = vec2(1.0, 1.0);
-	
-	float m = 1 - dot(inData.normal_ws, vec3(0, 1, 0));
+
+	float m = 1 - dot(normal, vec3(0, 1, 0));
 
 	if(inData.position_ws.y < 0.1) {
 		m = 1;
@@ -68,16 +101,80 @@ void main()
 		tex_color_z = texture(rocks_tex, inData.position_ws.xy * texture_scale).rgb;
 	}
 
-	vec3 blendWeights = pow(abs(inData.normal_ws), vec3(triplanar_blend_sharpness, triplanar_blend_sharpness, triplanar_blend_sharpness));
-	blendWeights = blendWeights / (blendWeights.x + blendWeights.y + blendWeights.z);
+	vec3 blendWeights = triplanar_weights(normal);
+	return tex_color_x * blendWeights.x + tex_color_y * blendWeights.y + tex_color_z * blendWeights.z;
+}
 
-	vec4 tex_color = vec4(tex_color_x * blendWeights.x + tex_color_y * blendWeights.y + tex_color_z * blendWeights.z, 1.0);
+// Top projection of one layer, plus the side projections where the splat map asks for them. The gradients are
+// taken outside the branches, sampling with implicit derivatives in non-uniform control flow is undefined.
+vec3 splat_layer(sampler2D tex, vec3 position, vec3 dpdx, vec3 dpdy, vec3 weights, float triplanar)
+{
+	vec3 color = textureGrad(tex, position.xz, dpdx.xz, dpdy.xz).rgb;
+	if (triplanar > 0.0) {
+		vec3 sides = textureGrad(tex, position.zy, dpdx.zy, dpdy.zy).rgb * weights.x +
+			textureGrad(tex, position.xy, dpdx.xy, dpdy.xy).rgb * weights.z;
+		color = mix(color, sides + color * weights.y, triplanar);
+	}
+	return color;
+}
+
+// One planar sample per layer on flat ground, only texels mixing grass and rock sample both layers. The projections
+// are blended by the world space normal, like the splat map decides where they are needed.
+vec3 splat_material(vec3 normal, vec3 dpdx, vec3 dpdy)
+{
+	vec3 position = inData.position_ws;
+	vec2 size = vec2(textureSize(splat_tex, 0));
+	vec2 splat = textureLod(splat_tex, position.xz / 100.0 + 0.5 + 0.5 / size, 0.0).rg;
+	vec3 weights = triplanar_weights(normalize(normal / terrain_scale));
+
+	vec3 color = vec3(0.0);
+	if (splat.r < 1.0)
+		color += splat_layer(grass_tex, position, dpdx, dpdy, weights, splat.g) * (1.0 - splat.r);
+	if (splat.r > 0.0)
+		color += splat_layer(rocks_tex, position, dpdx, dpdy, weights, splat.g) * splat.r;
+	return color;
+}
+
+// Macro texel center (x + 0.5) * macro_step - 0.5 is at that sample, sample s at uv (s + 0.5) / size
+vec3 macro_material(vec3 dpdx, vec3 dpdy)
+{
+	vec2 samples = vec2(textureSize(splat_tex, 0));
+	vec2 covered = macro_step * vec2(textureSize(macro_tex, 0));
+	vec2 uv = ((inData.position_ws.xz / 100.0 + 0.5) * samples + 0.5) / covered;
+	vec2 scale = samples / (100.0 * covered);
+	return textureGrad(macro_tex, uv, dpdx.xz * scale, dpdy.xz * scale).rgb;
+}
+
+void main()
+{
+	vec3 normal_ws = inData.normal_ws;
+	if (use_normal_map) {
+		vec2 normal_xz = texture(normal_map_tex, inData.tex_coord + 0.5 / vec2(textureSize(normal_map_tex, 0))).rg;
+		normal_ws = vec3(normal_xz.x, sqrt(max(0.0, 1.0 - dot(normal_xz, normal_xz))), normal_xz.y);
+	}
+
+	// Difuse
+	vec3 dpdx = dFdx(inData.position_ws);
+	vec3 dpdy = dFdy(inData.position_ws);
+	vec3 albedo = vec3(0.0);
+	if (use_splat_map) {
+		float macro = 0.0;
+		if (macro_distance > 0.0)
+			macro = smoothstep(0.8 * macro_distance, macro_distance, distance(eye_position, inData.position_ws));
+		if (macro < 1.0)
+			albedo += splat_material(normal_ws, dpdx, dpdy) * (1.0 - macro);
+		if (macro > 0.0)
+			albedo += macro_material(dpdx, dpdy) * macro;
+	}
+	else
+		albedo = slope_material(normal_ws);
+	vec4 tex_color = vec4(albedo, 1.0);
 	
 	// Lights
-    vec3 N = normalize(inData.normal_ws);
+    vec3 N = normalize(normal_ws);
 	vec3 Eye = normalize(eye_position - inData.position_ws);
 
-	vec4 mat_ambient = material_ambient_color * tex_color;
+	vec4 mat_ambient = material_ambient_color * tex_color * terrain_occlusion(inData.position_ws);
 	vec4 mat_diffuse = material_diffuse_color * tex_color;
 	vec4 mat_specular = material_specular_color;
 
@@ -42,8 +42,27 @@ uniform MaterialData
 
 uniform sampler2D tree_tex;
 
+// Share of the dither pattern drawn by this LOD, the neighbouring LOD draws the rest during a transition
+flat in vec2 lod_share;
+
+// 4x4 ordered dither
+const float BAYER[16] = float[](0.0, 8.0, 2.0, 10.0, 12.0, 4.0, 14.0, 6.0, 3.0, 11.0, 1.0, 9.0, 15.0, 7.0, 13.0, 5.0);
+
+// Baked terrain ambient occlusion, the terrain covers [-50, 50] on X and Z
+uniform sampler2D occlusion_tex;
+
+float terrain_occlusion(vec3 position)
+{
+	vec2 size = vec2(textureSize(occlusion_tex, 0));
+	return texture(occlusion_tex, position.xz / 100.0 + 0.5 + 0.5 / size).r;
+}
+
 void main()
 {
+	ivec2 cell = ivec2(gl_FragCoord.xy) & 3;
+	float threshold = (BAYER[cell.y * 4 + cell.x] + 0.5) / 16.0;
+	if (threshold >= lod_share.x || threshold < lod_share.y)
+		discard;
 
 	// Difuse
     vec4 tex_color = texture(tree_tex, inData.tex_coord);
@@ -55,7 +74,7 @@ void main()
     vec3 N = normalize(inData.normal_ws);
 	vec3 Eye = normalize(eye_position - inData.position_ws);
 
-	vec4 mat_ambient = material_ambient_color * tex_color;
+	vec4 mat_ambient = material_ambient_color * tex_color * terrain_occlusion(inData.position_ws);
 	vec4 mat_diffuse = material_diffuse_color * tex_color;
 	vec4 mat_specular = material_specular_color;
 
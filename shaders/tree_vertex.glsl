@@ -1,20 +1,27 @@
 #version 330
 
-const int TREE_COUNT = 500;
-
 in vec4 position;
 in vec3 normal;
 in vec2 tex_coord;
+// Instance transform (see InstanceBuffer): packed position, yaw, tilts and scale, or a full model matrix
+layout(location = 3) in vec3 instance_position;
+layout(location = 4) in uvec4 instance_packed;
+layout(location = 5) in mat4 instance_matrix;
+
+const float TILT_STEP = 1.0 / 256.0;
 
+uniform bool packed_instances;
 uniform mat4 model_matrix;
+
+// LOD transitions (see InstanceCulling::LodSettings): projected sizes of the near and far switch of this LOD (0 for
+// none), the band and the pixels per world unit at distance 1 (0 disables the cross-fade). The projected size is
+// the diameter of the bounding sphere (model space) seen from lod_eye.
+uniform vec4 lod_fade;
+uniform vec4 lod_bounds;
+uniform vec3 lod_eye;
 uniform float wind_height;
 uniform float app_time;
 
-uniform TreeData
-{
-       mat4 tree_model_matrix[TREE_COUNT];
-};
-
 uniform CameraData
 {
 	mat4 view_matrix;
@@ -29,11 +36,46 @@ out VertexData
 	vec2 tex_coord;
 } outData;
 
+// Share of the dither pattern drawn by this LOD: below x and from y on
+flat out vec2 lod_share;
+
+// translate(position) * rotate_z(tilt_z) * rotate_x(tilt_x) * rotate_y(yaw) * scale, as PackedInstance::Matrix
+mat4 unpackInstance()
+{
+	float yaw = float(instance_packed.x) * (6.2831853 / 256.0);
+	vec2 tilt = (vec2(instance_packed.yz) - 128.0) * TILT_STEP;
+	vec3 c = cos(vec3(yaw, tilt));
+	vec3 s = sin(vec3(yaw, tilt));
+	mat3 ry = mat3(c.x, 0.0, -s.x, 0.0, 1.0, 0.0, s.x, 0.0, c.x);
+	mat3 rz = mat3(c.y, s.y, 0.0, -s.y, c.y, 0.0, 0.0, 0.0, 1.0);
+	mat3 rx = mat3(1.0, 0.0, 0.0, 0.0, c.z, s.z, 0.0, -s.z, c.z);
+	mat3 r = rz * rx * ry * (float(instance_packed.w) / 64.0);
+	return mat4(vec4(r[0], 0.0), vec4(r[1], 0.0), vec4(r[2], 0.0), vec4(instance_position, 1.0));
+}
+
+// Share of the next LOD at a switch of 'size' pixels for an instance of 'pixels'
+float nextShare(float size, float pixels)
+{
+	return clamp((size * (1.0 + lod_fade.z) - pixels) / max(2.0 * lod_fade.z * size, 1e-6), 0.0, 1.0);
+}
+
 void main()
 {
-	vec4 instance_pos = tree_model_matrix[gl_InstanceID] * model_matrix * position;
+	mat4 instance = packed_instances ? unpackInstance() : instance_matrix;
+
+	lod_share = vec2(1.0, 0.0);
+	if (lod_fade.w > 0.0) {
+		vec3 center = vec3(instance * model_matrix * vec4(lod_bounds.xyz, 1.0));
+		float pixels = 2.0 * lod_bounds.w * length(instance[0].xyz) * lod_fade.w / max(distance(center, lod_eye), 1e-6);
+		if (lod_fade.x > 0.0)
+			lod_share.x = nextShare(lod_fade.x, pixels);
+		if (lod_fade.y > 0.0)
+			lod_share.y = nextShare(lod_fade.y, pixels);
+	}
+	vec4 instance_pos = instance * model_matrix * position;
 	
-	float w = pow(position.y / wind_height, 3) * max(0.1, sin(gl_InstanceID / 17.0));
+	// The sway phase follows the instance position, the instance order changes with culling
+	float w = pow(position.y / wind_height, 3) * max(0.1, sin((instance[3].x + instance[3].z) * 0.37));
 	float wx = w * sin(app_time * 0.7) * cos(app_time * 0.01);
 	float wy = w * cos(app_time * 0.3) * sin(app_time * 0.43);
 	instance_pos += vec4(wx, 0.0, wy, 0.0);
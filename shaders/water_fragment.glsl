@@ -9,6 +9,7 @@ in VertexData
 	vec3 normal_ws;
 	vec3 position_ws;
 	vec2 tex_coord;
+	vec2 ocean_uv;
 } inData;
 
 uniform CameraData
@@ -41,17 +42,29 @@ uniform MaterialData
 };
 
 uniform sampler2D reflection_tex;
+// Projection of the reflection pass, may be a few frames older than the camera (the reflection is reprojected)
+uniform mat4 reflection_view_projection;
+
+// FFT ocean normals (see OceanWaves), per fragment, the mesh is coarser than the waves
+uniform bool use_ocean;
+uniform sampler2D ocean_normal_tex;
 
 void main()
 {
+	vec3 normal = inData.normal_ws;
+	if (use_ocean)
+		normal = texture(ocean_normal_tex, inData.ocean_uv).xyz * 2.0 - 1.0;
+
 	// Reflection
-	vec2 reflectOffset = inData.normal_ws.xz * 0.1;
+	vec2 reflectOffset = normal.xz * 0.1;
 
-	vec4 tex_color = texture(reflection_tex, (gl_FragCoord.xy) / textureSize(reflection_tex, 0) + reflectOffset);
+	vec4 reflection_position = reflection_view_projection * vec4(inData.position_ws, 1.0);
+	vec2 reflection_coord = reflection_position.xy / reflection_position.w * 0.5 + 0.5;
+	vec4 tex_color = texture(reflection_tex, reflection_coord + reflectOffset);
 	tex_color.a = 0.5;
 
 	// Lights
-    vec3 N = normalize(inData.normal_ws);
+    vec3 N = normalize(normal);
 	vec3 Eye = normalize(eye_position - inData.position_ws);
 
 	vec4 mat_ambient = material_ambient_color * tex_color;
@@ -0,0 +1,81 @@
+#version 330
+
+// Projected grid: a regular grid in screen space, every vertex is the point of the water plane seen through it.
+// The vertex density follows the screen, dense near the camera and sparse towards the horizon.
+uniform mat4 inverse_view_projection;
+// Vertices along the screen X and Y
+uniform ivec2 grid_size;
+// The grid reaches this far past the screen edges (NDC), the wave displacement would pull it into view
+uniform float overscan;
+// Greatest horizontal distance of the water from the eye, rays above the horizon end there
+uniform float horizon;
+uniform float water_level;
+// Water rectangle (min X, min Z, max X, max Z), vertices outside are pulled onto its border
+uniform vec4 water_bounds;
+uniform float app_time;
+
+uniform CameraData
+{
+	mat4 view_matrix;
+	mat4 projection_matrix;
+	vec3 eye_position;
+};
+
+out VertexData
+{
+	vec3 normal_ws;
+	vec3 position_ws;
+	vec2 tex_coord;
+	vec2 ocean_uv;
+} outData;
+
+uniform sampler2D water_normal_tex;
+
+// FFT ocean (see OceanWaves), displacement of a repeating patch of ocean_patch world units
+uniform bool use_ocean;
+uniform sampler2D ocean_displacement_tex;
+uniform float ocean_patch;
+
+vec3 unproject(vec2 ndc, float depth)
+{
+	vec4 position = inverse_view_projection * vec4(ndc, depth, 1.0);
+	return position.xyz / position.w;
+}
+
+void main()
+{
+	// One triangle strip per row: gl_InstanceID is the row, gl_VertexID alternates between the rows y + 1 and y
+	ivec2 cell = ivec2(gl_VertexID / 2, gl_InstanceID + 1 - (gl_VertexID % 2));
+	vec2 ndc = (vec2(cell) / vec2(grid_size - 1) * 2.0 - 1.0) * (1.0 + overscan);
+
+	vec3 near = unproject(ndc, -1.0);
+	vec3 ray = unproject(ndc, 1.0) - near;
+	vec2 heading = length(ray.xz) > 0.0 ? normalize(ray.xz) : vec2(0.0);
+	float reach = horizon;
+	if (ray.y < 0.0)
+		reach = min(max((water_level - near.y) / ray.y, 0.0) * length(ray.xz), horizon);
+	vec2 xz = clamp(near.xz + heading * reach, water_bounds.xy, water_bounds.zw);
+
+	outData.tex_coord = xz / 100.0 + 0.5;
+	outData.ocean_uv = xz / ocean_patch;
+	if (use_ocean) {
+		// Mip level of the vertex spacing: one grid row covers about 2 (1 + overscan) / (P[1][1] (rows - 1)) radians
+		vec3 position = vec3(xz.x, water_level, xz.y);
+		float spacing = distance(eye_position, position) * 2.0 * (1.0 + overscan) / (projection_matrix[1][1] * float(grid_size.y - 1));
+		float texel = ocean_patch / float(textureSize(ocean_displacement_tex, 0).x);
+		float lod = log2(max(spacing / texel, 1.0));
+		outData.position_ws = position + textureLod(ocean_displacement_tex, outData.ocean_uv, lod).xyz;
+		// The fragment shader reads the normal texture
+		outData.normal_ws = vec3(0.0, 1.0, 0.0);
+	}
+	else {
+		// Same waves as the water grid (water_vertex.glsl), texture coordinates of the single terrain
+		vec3 moved_normal = texture(water_normal_tex, outData.tex_coord * 10 + vec2(app_time, app_time)).rbg - vec3(0.5, 0.5, 0.5);
+		outData.position_ws = vec3(xz.x, water_level, xz.y) + moved_normal * 0.015 * vec3(100.0, 0.2, 100.0);
+		outData.normal_ws = moved_normal;
+	}
+
+	gl_ClipDistance[0] = outData.position_ws.y;
+
+	gl_Position = projection_matrix * view_matrix * vec4(outData.position_ws, 1.0);
+}
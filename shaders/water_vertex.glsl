@@ -19,21 +19,40 @@ out VertexData
 	vec3 normal_ws;
 	vec3 position_ws;
 	vec2 tex_coord;
+	vec2 ocean_uv;
 } outData;
 
 uniform sampler2D water_normal_tex;
 
+// FFT ocean (see OceanWaves): displacement of a repeating patch of ocean_patch world units. The grid is much
+// coarser than the texture, ocean_lod picks the mip level matching the vertex spacing.
+uniform bool use_ocean;
+uniform sampler2D ocean_displacement_tex;
+uniform float ocean_patch;
+uniform float ocean_lod;
+
 void main()
 {	
+	outData.tex_coord = tex_coord;
+	if (use_ocean) {
+		vec3 position_ws = vec3(model_matrix * position);
+		outData.ocean_uv = position_ws.xz / ocean_patch;
+		outData.position_ws = position_ws + textureLod(ocean_displacement_tex, outData.ocean_uv, ocean_lod).xyz;
+		// The fragment shader reads the normal texture
+		outData.normal_ws = vec3(0.0, 1.0, 0.0);
+		gl_ClipDistance[0] = outData.position_ws.y;
+		gl_Position = projection_matrix * view_matrix * vec4(outData.position_ws, 1.0);
+		return;
+	}
+
 	vec3 moved_normal = texture(water_normal_tex, tex_coord.st * 10 + vec2(app_time, app_time)).rbg - vec3(0.5, 0.5, 0.5);
 	vec4 moved_pos = position + vec4(moved_normal * 0.3, 0.0) * 0.05;
 	
 	outData.position_ws = vec3(model_matrix * moved_pos);
 	outData.normal_ws = moved_normal;
+	outData.ocean_uv = vec2(0.0);
 	
 	gl_ClipDistance[0] = outData.position_ws.y;
-	
-	outData.tex_coord = tex_coord;
 
 	gl_Position = projection_matrix * view_matrix * model_matrix * moved_pos;
 }
@@ -4,9 +4,26 @@
 #include "CameraInput.h"
 #include "ConstantsAndStructs.h"
 #include "InputHandler.h"
+#include "TerrainStreamer.h"
+#include "ProceduralTerrain.h"
+#include "TerrainRaycaster.h"
+#include "TerrainVisibility.h"
+#include "TerrainOcclusion.h"
+#include "Benchmark.h"
+#include "GpuTimer.h"
+#include "ReflectionCulling.h"
+#include "InstanceCulling.h"
+#include "GpuCulling.h"
+#include "DepthPyramid.h"
+#include "OcclusionRasterizer.h"
+#include "VegetationPlacement.h"
+#include "Impostor.h"
 #include <iostream>
 #include <random>
 #include <sstream>
+#include <memory>
+#include <chrono>
+#include <cfloat>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -62,6 +79,291 @@ InputHandler handle_input;
 float app_time = 0.0f;
 float animation_speed = 0.020f;
 
+// Attribute-less terrain (-compact-terrain)
+bool compact_terrain = false;
+
+// Heightmap source (-heightmap <file>): image, .r16, .f32 or tiled .hft
+std::basic_string<maybewchar> heightmap_file = MAYBEWIDE("resources/heightmap.png");
+
+// Streamed tiled world (-streaming), the heightmap is mirror-repeated around the camera
+bool streaming_world = false;
+std::unique_ptr<TerrainStreamer> terrain_streamer;
+TiledHeightfield streamed_heightfield;
+
+// Scripted fly-through over the streamed world (-benchmark flythrough)
+bool benchmark_flythrough = false;
+CameraPath benchmark_path;
+FrameStats benchmark_frames;
+std::chrono::steady_clock::time_point benchmark_last_frame;
+
+// Noise generated terrain (-procedural <seed>, -procedural-size <samples>) instead of the heightmap,
+// the streamed world then generates every tile instead of mirroring the heightmap
+bool procedural_terrain = false;
+int procedural_size = 256;
+ProceduralTerrain::Settings procedural_settings;
+
+// Times the generation of a 8192x8192 procedural map and exits (-benchmark noise)
+bool benchmark_noise = false;
+
+// Times the deformation brushes on the loaded terrain and exits (-benchmark brush)
+bool benchmark_brush = false;
+
+// Ray queries against the single terrain (brush picking)
+TerrainRaycaster terrain_raycaster;
+
+// Times terrain ray queries on the heightmap and on a 8192x8192 procedural map and exits (-benchmark raycast)
+bool benchmark_raycast = false;
+
+// Precomputed terrain visibility (-pvs <file>), baked and saved when the file is missing or was baked from other heights
+bool use_pvs = false;
+std::basic_string<maybewchar> pvs_file = MAYBEWIDE("resources/terrain.pvs");
+TerrainVisibility terrain_visibility;
+// Camera cell the visible chunks and instances were selected for
+int pvs_cell = -2;
+std::vector<char> pvs_visible;
+// Set by the first brush stroke, the PVS holds for the heights it was baked from only and every cell is drawn since
+bool pvs_edited = false;
+
+// Bakes the visibility of the heightmap, reports the culling along a camera loop and exits (-benchmark pvs)
+bool benchmark_pvs = false;
+
+// Ambient occlusion of the single terrain, baked at load and after brush edits
+TerrainOcclusion::Settings occlusion_settings;
+std::vector<uint8_t> terrain_occlusion;
+
+// Times the occlusion bake on 1024x1024 and 4096x4096 procedural maps and exits (-benchmark ao)
+bool benchmark_ao = false;
+
+// Coarse terrain mesh shaded from a baked normal map (-mesh-step <samples>)
+int mesh_step = 1;
+
+// Compares the shading of coarse meshes with and without the normal map to the full mesh and exits (-benchmark normalmap)
+bool benchmark_normal_map = false;
+
+// Reports the water triangles removed by the tile mask and by frustum culling along the terrain loop and exits (-benchmark water)
+bool benchmark_water = false;
+
+// Water mesh projected from the camera every frame, -tiled-water selects the masked and culled world grid
+bool projected_water = true;
+
+// Water waves from the CPU FFT ocean, -static-water selects the scrolling normal map
+// (-ocean-resolution <samples>, -ocean-rate <updates per second>)
+bool ocean_waves = true;
+
+// Times the ocean FFT and a whole ocean update at 128, 256 and 512 samples and exits (-benchmark fft)
+bool benchmark_fft = false;
+
+// Planar reflection pass: resolution relative to the window (-reflection-scale <0..1>), rendered every
+// reflection_interval frames and reprojected in between (-reflection-interval <frames>), drawn from its own cull
+// list unless -reflection-no-cull is given. The pass is skipped while no water is in view.
+float reflection_scale = 0.5f;
+int reflection_interval = 2;
+bool reflection_culling = true;
+ReflectionCulling reflection_culler;
+std::vector<char> reflection_chunks;
+// Frames since the reflection was rendered, invalid after a resize and while the water is hidden
+int reflection_age = 0;
+bool reflection_valid = false;
+
+// Model space bounds of the tree and bush models, with room for the rotation around Y
+const InstanceCulling::Sphere TREE_BOUNDS = { glm::vec3(0.0f, 6.9f, 0.0f), 10.0f };
+const InstanceCulling::Sphere BUSH_BOUNDS = { glm::vec3(0.0f, 1.0f, 0.0f), 1.9f };
+const InstanceCulling::Sphere GRASS_BOUNDS = { glm::vec3(0.0f, 0.48f, 0.0f), 0.8f };
+
+// Per frame frustum culling of the vegetation of the single terrain, -no-instance-cull draws all instances
+bool instance_culling = true;
+
+// LODs of the vegetation of the single terrain by projected size, with dithered transitions. The coarse meshes are
+// clustered from the full ones at load time, the grass has no coarse mesh and is dropped below grass_cutoff pixels.
+// -no-lod draws the full meshes, -grass-cutoff <pixels> (0 keeps all grass).
+bool vegetation_lods = true;
+float grass_cutoff = 24.0f;
+// Cluster cell sizes of the coarse meshes (relative to the model size) and the sizes in pixels where they take over
+const float TREE_LOD_CELLS[] = { 0.06f, 0.12f };
+const float TREE_LOD_PIXELS[] = { 400.0f, 240.0f };
+const float BUSH_LOD_CELLS[] = { 0.25f, 0.4f };
+const float BUSH_LOD_PIXELS[] = { 150.0f, 60.0f };
+// Octahedral impostors of the trees and bushes replace their coarsest LOD (the trees below 240 pixels, about 100 units
+// away at scale 1). The atlases are cooked next to the meshes and baked again when the mesh or its texture changes.
+// -no-impostors keeps the meshes, -cook-impostors bakes the atlases without a window and exits.
+bool use_impostors = true;
+// Views of the trees hold about as many pixels as the trees cover at the switch
+const Impostor::Settings TREE_IMPOSTOR_SETTINGS = { 12, 128, 2 };
+const Impostor::Settings BUSH_IMPOSTOR_SETTINGS = { 12, 64, 2 };
+// Vegetation triangles drawn in the current frame (reflection and main pass)
+uint64_t nature_triangles = 0;
+
+// Culling and LOD selection of the vegetation of the single terrain in a compute shader, drawn with indirect draws
+// (-gpu-culling, needs OpenGL 4.3, otherwise the CPU culling is kept). Layer 0 holds the trees, 1 the bushes and
+// 2 to 13 the grass kinds.
+bool gpu_culling = false;
+GpuCulling gpu_culler;
+const int GPU_TREE_LAYER = 0;
+const int GPU_BUSH_LAYER = 1;
+const int GPU_GRASS_LAYER = 2;
+
+// Times the culling of 1M instances on the CPU and exits (-benchmark cull)
+bool benchmark_cull = false;
+
+// Occlusion culling of the main pass behind the terrain, which is drawn first (-no-occlusion-cull). A depth pyramid
+// (Hi-Z) built from the terrain depth culls the vegetation in the same frame on the GPU culling path. A coarse level
+// read back a frame or two later culls the vegetation on the CPU path and the terrain chunks (vertex mode), its
+// bounds grown by the camera movement since. Only the single terrain and its vegetation.
+bool occlusion_culling = true;
+DepthPyramid depth_pyramid;
+// Readback used by the CPU tests of the current frame, null until the first one arrived
+HiZMap* hiz_map = nullptr;
+// The CPU tests use the terrain rasterized on the CPU in the same frame instead of the readback (-software-occlusion),
+// the GPU culling path keeps the depth pyramid
+bool software_occlusion = false;
+OcclusionRasterizer occlusion_rasterizer;
+// Width of the software depth buffer, the height follows the window
+const int SOFTWARE_OCCLUSION_WIDTH = 256;
+
+// Times the software occlusion rasterizer and its tests on the heightmap and exits (-benchmark raster)
+bool benchmark_raster = false;
+// Checks the software occlusion rasterizer on a synthetic heightfield and exits with 1 on a failure (-check raster)
+bool check_raster = false;
+// Terrain chunks of the main pass without the hidden ones, empty when no chunk is occlusion culled
+std::vector<char> main_chunks;
+// Main pass terrain chunks and vegetation instances (CPU culling) dropped by the occlusion test in the current frame
+int occluded_chunks = 0;
+int occluded_instances = 0;
+
+// Looks from the lowest dry ground towards the highest peak, first without and then with the occlusion culling,
+// and reports the frame time, the GPU time of the main pass and what the occlusion test drops (-benchmark occlusion)
+bool benchmark_occlusion = false;
+int occlusion_benchmark_frame = 0;
+const int OCCLUSION_BENCHMARK_FRAMES = 300;
+// Frames of every run left out while the readbacks arrive
+const int OCCLUSION_WARMUP_FRAMES = 10;
+glm::vec3 valley_eye, valley_target;
+GpuTimer main_pass_timer;
+FrameStats occlusion_cpu_frames[2];
+FrameStats occlusion_gpu_frames[2];
+double occluded_chunk_sum[2] = {};
+double occluded_instance_sum[2] = {};
+uint64_t occlusion_triangle_sum[2] = {};
+int occlusion_counted_frames[2] = {};
+// Instances drawn and hidden on the GPU culling path, read back on the last frame of every run
+int occlusion_gpu_visible[2] = {};
+int occlusion_gpu_hidden[2] = {};
+std::chrono::steady_clock::time_point occlusion_last_frame;
+
+// Poisson disk placement of the vegetation of the single terrain. The same seed places the same vegetation
+// (-vegetation-seed).
+uint32_t vegetation_seed = 1;
+// Times the placement at millions of candidates and exits (-benchmark placement)
+bool benchmark_placement = false;
+
+// Flies the terrain loop once per reflection setup and reports the frame time and the GPU time of the
+// reflection pass (-benchmark reflection)
+struct ReflectionSetup
+{
+	const char* name;
+	float scale;
+	int interval;
+	bool culling;
+};
+const ReflectionSetup REFLECTION_SETUPS[] = {
+	{ "full resolution, every frame, whole scene", 1.0f, 1, false },
+	{ "half resolution", 0.5f, 1, false },
+	{ "cull list", 1.0f, 1, true },
+	{ "every 2nd frame", 1.0f, 2, false },
+	{ "every 4th frame", 1.0f, 4, false },
+	{ "half resolution, cull list, every 2nd frame", 0.5f, 2, true },
+};
+const int REFLECTION_SETUP_COUNT = sizeof(REFLECTION_SETUPS) / sizeof(REFLECTION_SETUPS[0]);
+bool benchmark_reflection = false;
+int reflection_setup = 0;
+int reflection_benchmark_frame = 0;
+CameraPath reflection_path;
+GpuTimer reflection_timer;
+FrameStats reflection_gpu_frames;
+FrameStats reflection_cpu_frames;
+std::chrono::steady_clock::time_point reflection_last_frame;
+
+// Looks at the water from the map center at several pitch angles, first with the tiled grid and then with the
+// projected grid, and reports the vertex counts, the GPU time of the water pass and the frame time (-benchmark waterlod)
+bool benchmark_water_lod = false;
+int water_lod_frame = 0;
+const int WATER_LOD_FRAMES = 120;
+const float WATER_LOD_PITCH[] = { 0.0f, 10.0f, 25.0f, 45.0f, 80.0f };
+const int WATER_LOD_VIEWS = sizeof(WATER_LOD_PITCH) / sizeof(WATER_LOD_PITCH[0]);
+GpuTimer water_timer;
+FrameStats water_gpu_frames[2][WATER_LOD_VIEWS];
+FrameStats water_cpu_frames[2][WATER_LOD_VIEWS];
+std::chrono::steady_clock::time_point water_lod_last_frame;
+
+// Format of the vegetation instance buffers, -matrix-instances uploads full model matrices
+InstanceBuffer::Format instance_format = InstanceBuffer::Format::Packed;
+
+// Places 10k, 100k and 1M instances of every vegetation type (the grass spread over its kinds), 10k and 100k also
+// without impostors, then 1M grass instances as matrices and packed. Looks across the map and reports the placement, the upload, the GPU time of the
+// vegetation pass, the triangles and the frame time (-benchmark instances).
+struct InstanceSetup
+{
+	const char* name;
+	int trees;
+	int bushes;
+	// Over all grass kinds
+	int grass;
+	InstanceBuffer::Format format;
+	bool culling;
+	// Culled on the GPU, skipped without -gpu-culling
+	bool gpu;
+	bool lods;
+	bool impostors;
+};
+const InstanceSetup INSTANCE_SETUPS[] = {
+	{ "10k per type", 10000, 10000, 10000, InstanceBuffer::Format::Packed, true, false, true, true },
+	{ "10k per type, no impostors", 10000, 10000, 10000, InstanceBuffer::Format::Packed, true, false, true, false },
+	{ "100k per type", 100000, 100000, 100000, InstanceBuffer::Format::Packed, true, false, true, true },
+	{ "100k per type, no impostors", 100000, 100000, 100000, InstanceBuffer::Format::Packed, true, false, true, false },
+	{ "1M per type", 1000000, 1000000, 1000000, InstanceBuffer::Format::Packed, true, false, true, true },
+	{ "1M per type, full meshes", 1000000, 1000000, 1000000, InstanceBuffer::Format::Packed, true, false, false, false },
+	{ "1M per type, GPU culling", 1000000, 1000000, 1000000, InstanceBuffer::Format::Packed, true, true, true, false },
+	{ "1M per type, no culling", 1000000, 1000000, 1000000, InstanceBuffer::Format::Packed, false, false, false, false },
+	{ "1M grass, matrices, no culling", 0, 0, 1000000, InstanceBuffer::Format::Matrix, false, false, false, false },
+	{ "1M grass, packed, no culling", 0, 0, 1000000, InstanceBuffer::Format::Packed, false, false, false, false },
+};
+const int INSTANCE_SETUP_COUNT = sizeof(INSTANCE_SETUPS) / sizeof(INSTANCE_SETUPS[0]);
+bool benchmark_instances = false;
+int instance_benchmark_frame = 0;
+const int INSTANCE_BENCHMARK_FRAMES = 120;
+GpuTimer nature_timer;
+FrameStats nature_gpu_frames;
+FrameStats nature_cpu_frames;
+FrameStats nature_cull_frames;
+GpuTimer cull_timer;
+FrameStats nature_gpu_cull_frames;
+uint64_t nature_triangle_sum = 0;
+int nature_triangle_frames = 0;
+std::chrono::steady_clock::time_point instance_last_frame;
+
+// Terrain material from the baked splat map, -no-splat selects the per fragment slope test
+bool use_splat_map = true;
+
+// Flies the terrain loop twice, with the per fragment slope test and with the splat map, and reports the GPU
+// time of the main terrain pass (-benchmark splat)
+bool benchmark_splat = false;
+CameraPath splat_path;
+
+// Distance from the eye beyond which the terrain shows the macro color map only (-macro-distance <units>, 0 = off)
+float macro_distance = 35.0f;
+
+// Renders a view across the whole map, first without and then with the macro color map, and reports the GPU
+// time of the main terrain pass (-benchmark macro)
+bool benchmark_macro = false;
+int macro_benchmark_frame = 0;
+const int MACRO_BENCHMARK_FRAMES = 300;
+float macro_benchmark_distance = 0.0f;
+
+// GPU time of the main terrain pass in the two runs of the splat and macro benchmarks
+GpuTimer terrain_timer;
+FrameStats terrain_gpu_frames[2];
+int terrain_benchmark_run = 0;
+
 #pragma region input handle
 // Called when the user presses a key
 void key_down(unsigned char key, int mouseX, int mouseY)
@@ -82,16 +384,87 @@ void mouse_moved(int x, int y)
 }
 #pragma endregion
 
+// Loads a vegetation mesh with two coarser LODs clustered with 'cells' (none when null) used below 'pixels'
+Geometry loadVegetation(const char* file_name, const float* cells, const float* pixels, MeshLods& lods, int position_loc, int normal_loc, int tex_coord_loc) {
+	lods.settings.count = cells ? 3 : 1;
+	for (int i = 0; i + 1 < lods.settings.count; ++i)
+		lods.settings.pixels[i] = pixels[i];
+	Geometry geometry = Loader::LoadOBJLods(file_name, lods.settings.count, cells, lods.first, lods.vertices, position_loc, normal_loc, tex_coord_loc);
+	if (cells)
+		std::cout << file_name << ": " << lods.vertices[0] / 3 << ", " << lods.vertices[1] / 3 << " and " << lods.vertices[2] / 3 << " triangles" << std::endl;
+	return geometry;
+}
+
+// Loads the impostor of a vegetation mesh from its cache file, unless 'rebake' or the cache is missing or stale,
+// else bakes it and writes the cache. Needs no GL context. Returns false if the mesh cannot be read.
+bool prepareImpostor(Impostor& impostor, const char* mesh_file, const maybewchar* texture_file, const maybewchar* cache_file,
+	const InstanceCulling::Sphere& bounds, const Impostor::Settings& settings, bool rebake = false) {
+	std::vector<glm::vec3> vertices, normals;
+	std::vector<glm::vec2> tex_coords;
+	if (!Loader::ParseOBJFile(mesh_file, vertices, normals, tex_coords))
+		return false;
+	// Untextured (white) when the texture is missing, like the mesh drawn with an empty texture
+	int width = 0, height = 0;
+	std::vector<uint8_t> texels;
+	const uint8_t* texture = Loader::LoadImageRGBA(texture_file, width, height, texels) ? texels.data() : nullptr;
+
+	// The views fit the mesh around the center of its bounds
+	float radius = 0.0f;
+	for (const glm::vec3& vertex : vertices)
+		radius = std::max(radius, glm::distance(vertex, bounds.center));
+	uint32_t checksum = Impostor::Checksum(vertices, normals, tex_coords, texture, width, height, bounds.center, radius);
+	if (!rebake && impostor.Load(cache_file, checksum, settings))
+		return true;
+
+	impostor.Bake(vertices, normals, tex_coords, texture, width, height, bounds.center, radius, settings);
+	bool saved = impostor.Save(cache_file);
+	std::cout << mesh_file << ": impostor of " << impostor.Frames() << "x" << impostor.Frames() << " views (" << impostor.AtlasSize()
+		<< " pixel atlas) baked in " << impostor.bake_ms << " ms" << (saved ? "" : ", the cache cannot be written") << std::endl;
+	return true;
+}
+
+// The impostors replace the coarsest LODs of the trees and bushes when enabled and created
+void setImpostorLods() {
+	nature_data.tree_lods.impostor = use_impostors && nature_data.tree_impostor.albedo_tex != 0 && nature_data.tree_lods.settings.count > 1;
+	nature_data.bush_lods.impostor = use_impostors && nature_data.bush_impostor.albedo_tex != 0 && nature_data.bush_lods.settings.count > 1;
+}
+
+// Bakes the impostors of the trees and bushes and writes their caches, without a window (-cook-impostors)
+bool cookImpostors() {
+	bool cooked = prepareImpostor(nature_data.tree_impostor, "resources/tree1.obj", MAYBEWIDE("resources/tree1.png"), MAYBEWIDE("resources/tree1.impostor"),
+		TREE_BOUNDS, TREE_IMPOSTOR_SETTINGS, true)
+		&& prepareImpostor(nature_data.bush_impostor, "resources/bush.obj", MAYBEWIDE("resources/bush.tga"), MAYBEWIDE("resources/bush.impostor"),
+		BUSH_BOUNDS, BUSH_IMPOSTOR_SETTINGS, true);
+	std::cout << (cooked ? "Cooked the impostors" : "Failed to cook the impostors") << std::endl;
+	return cooked;
+}
+
 // Initializes OpenGL stuff
 void createGeometries(int position_loc,int normal_loc, int tex_coord_loc) {
-	terrain_data.geometry = Terrain::LoadHeightmapTerrain(MAYBEWIDE("resources/heightmap.png"), position_loc, normal_loc, tex_coord_loc);
-	nature_data.tree_geometry = Loader::LoadOBJ("resources/tree1.obj", position_loc, normal_loc, tex_coord_loc);
-	nature_data.bush_geometry = Loader::LoadOBJ("resources/bush.obj", position_loc, normal_loc, tex_coord_loc);
-	water_data.geometry = Loader::CreateGrid(200, position_loc, normal_loc, tex_coord_loc);
+	if (procedural_terrain) {
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::vector<float>> height = ProceduralTerrain::Generate(procedural_settings, procedural_size, procedural_size);
+		std::cout << "Generated " << procedural_size << "x" << procedural_size << " terrain (seed " << procedural_settings.seed << ") in "
+			<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+		if (compact_terrain)
+			terrain_data.geometry = Terrain::CreateCompactTerrain(std::move(height));
+		else
+			terrain_data.geometry = Terrain::CreateTerrain(std::move(height), position_loc, normal_loc, tex_coord_loc, mesh_step);
+	}
+	else if (compact_terrain)
+		terrain_data.geometry = Terrain::LoadCompactHeightmapTerrain(heightmap_file.c_str());
+	else
+		terrain_data.geometry = Terrain::LoadHeightmapTerrain(heightmap_file.c_str(), position_loc, normal_loc, tex_coord_loc, mesh_step);
+	nature_data.tree_geometry = loadVegetation("resources/tree1.obj", TREE_LOD_CELLS, TREE_LOD_PIXELS, nature_data.tree_lods, position_loc, normal_loc, tex_coord_loc);
+	nature_data.bush_geometry = loadVegetation("resources/bush.obj", BUSH_LOD_CELLS, BUSH_LOD_PIXELS, nature_data.bush_lods, position_loc, normal_loc, tex_coord_loc);
+	water_data.surface.Build(terrain_data.geometry.height, 200, water_data.settings);
+	water_data.surface.Upload(Loader::CreateGrid(200, position_loc, normal_loc, tex_coord_loc));
+	water_data.projected_grid = ProjectedWater::CreateGrid(water_data.projected_settings);
 	for (int i = 0; i < 12; ++i) {
 		std::ostringstream buffer;
 		buffer << "resources/grass" << std::to_string(i + 1) << ".obj";
-		nature_data.long_grass_geometry[i] = Loader::LoadOBJ(buffer.str().c_str(), position_loc, normal_loc, tex_coord_loc);
+		nature_data.long_grass_geometry[i] = loadVegetation(buffer.str().c_str(), nullptr, nullptr, nature_data.long_grass_lods[i], position_loc, normal_loc, tex_coord_loc);
+		nature_data.long_grass_lods[i].settings.cutoff_pixels = grass_cutoff;
 	}
 	nature_data.lamp_geometry = Loader::LoadOBJ("resources/lamp.obj", position_loc, normal_loc, tex_coord_loc);
 }
@@ -117,6 +490,69 @@ void initTerrain(int position_loc, int normal_loc, int tex_coord_loc) {
 	terrain_data.rocks_tex_loc = glGetUniformLocation(terrain_data.program, "rocks_tex");
 
 	terrain_data.model_matrix_loc = glGetUniformLocation(terrain_data.program, "model_matrix");
+	terrain_data.occlusion_tex_loc = glGetUniformLocation(terrain_data.program, "occlusion_tex");
+	terrain_data.normal_map_tex_loc = glGetUniformLocation(terrain_data.program, "normal_map_tex");
+	terrain_data.use_normal_map_loc = glGetUniformLocation(terrain_data.program, "use_normal_map");
+	terrain_data.splat_tex_loc = glGetUniformLocation(terrain_data.program, "splat_tex");
+	terrain_data.use_splat_map_loc = glGetUniformLocation(terrain_data.program, "use_splat_map");
+	terrain_data.macro_tex_loc = glGetUniformLocation(terrain_data.program, "macro_tex");
+	terrain_data.macro_step_loc = glGetUniformLocation(terrain_data.program, "macro_step");
+	terrain_data.macro_distance_loc = glGetUniformLocation(terrain_data.program, "macro_distance");
+
+	if (!terrain_data.geometry.compact)
+		return;
+
+	terrain_data.compact_program = Loader::CreateAndLinkProgram("shaders/terrain_compact_vertex.glsl", "shaders/terrain_fragment.glsl");
+	if (0 == terrain_data.compact_program)
+		Loader::WaitForEnterAndExit();
+
+	terrain_light_loc = glGetUniformBlockIndex(terrain_data.compact_program, "LightData");
+	glUniformBlockBinding(terrain_data.compact_program, terrain_light_loc, 0);
+
+	terrain_camera_loc = glGetUniformBlockIndex(terrain_data.compact_program, "CameraData");
+	glUniformBlockBinding(terrain_data.compact_program, terrain_camera_loc, 1);
+
+	terrain_material_loc = glGetUniformBlockIndex(terrain_data.compact_program, "MaterialData");
+	glUniformBlockBinding(terrain_data.compact_program, terrain_material_loc, 2);
+
+	terrain_data.compact_grass_tex_loc = glGetUniformLocation(terrain_data.compact_program, "grass_tex");
+	terrain_data.compact_rocks_tex_loc = glGetUniformLocation(terrain_data.compact_program, "rocks_tex");
+	terrain_data.height_tex_loc = glGetUniformLocation(terrain_data.compact_program, "height_tex");
+	terrain_data.normal_tex_loc = glGetUniformLocation(terrain_data.compact_program, "normal_tex");
+	terrain_data.compact_occlusion_tex_loc = glGetUniformLocation(terrain_data.compact_program, "occlusion_tex");
+	terrain_data.compact_splat_tex_loc = glGetUniformLocation(terrain_data.compact_program, "splat_tex");
+	terrain_data.compact_use_splat_map_loc = glGetUniformLocation(terrain_data.compact_program, "use_splat_map");
+	terrain_data.compact_macro_tex_loc = glGetUniformLocation(terrain_data.compact_program, "macro_tex");
+	terrain_data.compact_macro_step_loc = glGetUniformLocation(terrain_data.compact_program, "macro_step");
+	terrain_data.compact_macro_distance_loc = glGetUniformLocation(terrain_data.compact_program, "macro_distance");
+
+	terrain_data.compact_model_matrix_loc = glGetUniformLocation(terrain_data.compact_program, "model_matrix");
+}
+
+// Pixels per world unit at distance 1 for a viewport of 'height' pixels
+float pixelScale(int height) {
+	return height / (2.0f * tanf(glm::radians(45.0f) * 0.5f));
+}
+
+// The mesh LODs for the GPU culling, switched by distance for instances of scale 1 and without the cross-fade. The
+// cutoff becomes an empty last LOD. The coarsest mesh is drawn instead of the impostor.
+void setGpuLods(int layer, const Geometry& geometry, const MeshLods& lods, const InstanceCulling::Sphere& bounds) {
+	if (!vegetation_lods) {
+		gpu_culler.SetLods(layer, geometry);
+		return;
+	}
+	int first[InstanceCulling::MAX_LODS], vertices[InstanceCulling::MAX_LODS];
+	float distance[InstanceCulling::MAX_LODS];
+	const InstanceCulling::LodSettings& settings = lods.settings;
+	int count = std::min(settings.count + (settings.cutoff_pixels > 0.0f ? 1 : 0), static_cast<int>(InstanceCulling::MAX_LODS));
+	for (int lod = 0; lod < count; ++lod) {
+		bool cutoff = lod >= settings.count;
+		first[lod] = cutoff ? 0 : lods.first[lod];
+		vertices[lod] = cutoff ? 0 : lods.vertices[lod];
+		float pixels = lod + 1 < settings.count ? settings.pixels[lod] : settings.cutoff_pixels;
+		distance[lod] = pixels > 0.0f ? 2.0f * bounds.radius * pixelScale(WIN_HEIGHT) / pixels : FLT_MAX;
+	}
+	gpu_culler.SetLods(layer, count, first, vertices, distance);
 }
 
 void initNature(int position_loc, int normal_loc, int tex_coord_loc) {
@@ -134,10 +570,8 @@ void initNature(int position_loc, int normal_loc, int tex_coord_loc) {
 	int tree_material_loc = glGetUniformBlockIndex(nature_data.program, "MaterialData");
 	glUniformBlockBinding(nature_data.program, tree_material_loc, 2);
 
-	int tree_tree_data_loc = glGetUniformBlockIndex(nature_data.program, "TreeData");
-	glUniformBlockBinding(nature_data.program, tree_tree_data_loc, 3);
-
 	nature_data.tex_loc = glGetUniformLocation(nature_data.program, "tree_tex");
+	nature_data.occlusion_tex_loc = glGetUniformLocation(nature_data.program, "occlusion_tex");
 
 	nature_data.model_matrix_loc = glGetUniformLocation(nature_data.program, "model_matrix");
 
@@ -145,6 +579,81 @@ void initNature(int position_loc, int normal_loc, int tex_coord_loc) {
 
 	nature_data.app_time_loc = glGetUniformLocation(nature_data.program, "app_time");
 
+	nature_data.packed_instances_loc = glGetUniformLocation(nature_data.program, "packed_instances");
+
+	nature_data.lod_fade_loc = glGetUniformLocation(nature_data.program, "lod_fade");
+	nature_data.lod_bounds_loc = glGetUniformLocation(nature_data.program, "lod_bounds");
+	nature_data.lod_eye_loc = glGetUniformLocation(nature_data.program, "lod_eye");
+
+	if (gpu_culling) {
+		if (gpu_culler.Initialize(GPU_GRASS_LAYER + 12)) {
+			setGpuLods(GPU_TREE_LAYER, nature_data.tree_geometry, nature_data.tree_lods, TREE_BOUNDS);
+			setGpuLods(GPU_BUSH_LAYER, nature_data.bush_geometry, nature_data.bush_lods, BUSH_BOUNDS);
+			for (int i = 0; i < 12; ++i)
+				setGpuLods(GPU_GRASS_LAYER + i, nature_data.long_grass_geometry[i], nature_data.long_grass_lods[i], GRASS_BOUNDS);
+		}
+		else {
+			std::cout << "GPU culling needs OpenGL 4.3, culling the vegetation on the CPU" << std::endl;
+			gpu_culling = false;
+		}
+	}
+}
+
+// Program and atlases of the impostors (the atlases from their caches or baked) for the coarsest LOD of the trees
+// and bushes
+void initImpostors(int position_loc, int normal_loc, int tex_coord_loc) {
+	if (!use_impostors)
+		return;
+	nature_data.impostor_program = Loader::CreateAndLinkProgram("shaders/impostor_vertex.glsl", "shaders/impostor_fragment.glsl",
+		position_loc, "position", normal_loc, "normal", tex_coord_loc, "tex_coord");
+	if (0 == nature_data.impostor_program)
+		Loader::WaitForEnterAndExit();
+
+	int impostor_light_loc = glGetUniformBlockIndex(nature_data.impostor_program, "LightData");
+	glUniformBlockBinding(nature_data.impostor_program, impostor_light_loc, 0);
+
+	int impostor_camera_loc = glGetUniformBlockIndex(nature_data.impostor_program, "CameraData");
+	glUniformBlockBinding(nature_data.impostor_program, impostor_camera_loc, 1);
+
+	int impostor_material_loc = glGetUniformBlockIndex(nature_data.impostor_program, "MaterialData");
+	glUniformBlockBinding(nature_data.impostor_program, impostor_material_loc, 2);
+
+	nature_data.impostor_model_matrix_loc = glGetUniformLocation(nature_data.impostor_program, "model_matrix");
+	nature_data.impostor_packed_instances_loc = glGetUniformLocation(nature_data.impostor_program, "packed_instances");
+	nature_data.impostor_bounds_loc = glGetUniformLocation(nature_data.impostor_program, "impostor_bounds");
+	nature_data.impostor_frames_loc = glGetUniformLocation(nature_data.impostor_program, "impostor_frames");
+	nature_data.impostor_albedo_tex_loc = glGetUniformLocation(nature_data.impostor_program, "albedo_tex");
+	nature_data.impostor_normal_depth_tex_loc = glGetUniformLocation(nature_data.impostor_program, "normal_depth_tex");
+	nature_data.impostor_occlusion_tex_loc = glGetUniformLocation(nature_data.impostor_program, "occlusion_tex");
+	nature_data.impostor_lod_fade_loc = glGetUniformLocation(nature_data.impostor_program, "lod_fade");
+	nature_data.impostor_lod_bounds_loc = glGetUniformLocation(nature_data.impostor_program, "lod_bounds");
+	nature_data.impostor_lod_eye_loc = glGetUniformLocation(nature_data.impostor_program, "lod_eye");
+
+	if (prepareImpostor(nature_data.tree_impostor, "resources/tree1.obj", MAYBEWIDE("resources/tree1.png"), MAYBEWIDE("resources/tree1.impostor"),
+		TREE_BOUNDS, TREE_IMPOSTOR_SETTINGS))
+		nature_data.tree_impostor.CreateTextures();
+	if (prepareImpostor(nature_data.bush_impostor, "resources/bush.obj", MAYBEWIDE("resources/bush.tga"), MAYBEWIDE("resources/bush.impostor"),
+		BUSH_BOUNDS, BUSH_IMPOSTOR_SETTINGS))
+		nature_data.bush_impostor.CreateTextures();
+	setImpostorLods();
+}
+
+// Depth pyramid of the main pass for the occlusion culling, the streamed world is drawn without
+void initOcclusionCulling() {
+	if (!occlusion_culling || streaming_world) {
+		occlusion_culling = false;
+		return;
+	}
+	if (!depth_pyramid.Initialize()) {
+		std::cout << "Could not create the depth pyramid, drawing without occlusion culling" << std::endl;
+		occlusion_culling = false;
+		return;
+	}
+	depth_pyramid.Resize(WIN_WIDTH, WIN_HEIGHT);
+	if (software_occlusion) {
+		occlusion_rasterizer.Build(terrain_data.geometry.height);
+		occlusion_rasterizer.Resize(SOFTWARE_OCCLUSION_WIDTH, SOFTWARE_OCCLUSION_WIDTH * WIN_HEIGHT / WIN_WIDTH);
+	}
 }
 
 void initWater(int position_loc, int normal_loc, int tex_coord_loc) {
@@ -166,6 +675,78 @@ void initWater(int position_loc, int normal_loc, int tex_coord_loc) {
 	water_data.app_time_loc = glGetUniformLocation(water_data.program, "app_time");
 	water_data.normal_tex_loc = glGetUniformLocation(water_data.program, "water_normal_tex");
 	water_data.reflection_tex_loc = glGetUniformLocation(water_data.program, "reflection_tex");
+
+	water_data.projected_program = Loader::CreateAndLinkProgram("shaders/water_projected_vertex.glsl", "shaders/water_fragment.glsl");
+	if (0 == water_data.projected_program)
+		Loader::WaitForEnterAndExit();
+
+	water_light_loc = glGetUniformBlockIndex(water_data.projected_program, "LightData");
+	glUniformBlockBinding(water_data.projected_program, water_light_loc, 0);
+
+	water_camera_loc = glGetUniformBlockIndex(water_data.projected_program, "CameraData");
+	glUniformBlockBinding(water_data.projected_program, water_camera_loc, 1);
+
+	water_material_loc = glGetUniformBlockIndex(water_data.projected_program, "MaterialData");
+	glUniformBlockBinding(water_data.projected_program, water_material_loc, 2);
+
+	water_data.projected_app_time_loc = glGetUniformLocation(water_data.projected_program, "app_time");
+	water_data.projected_normal_tex_loc = glGetUniformLocation(water_data.projected_program, "water_normal_tex");
+	water_data.projected_reflection_tex_loc = glGetUniformLocation(water_data.projected_program, "reflection_tex");
+	water_data.inverse_view_projection_loc = glGetUniformLocation(water_data.projected_program, "inverse_view_projection");
+	water_data.grid_size_loc = glGetUniformLocation(water_data.projected_program, "grid_size");
+	water_data.overscan_loc = glGetUniformLocation(water_data.projected_program, "overscan");
+	water_data.horizon_loc = glGetUniformLocation(water_data.projected_program, "horizon");
+	water_data.water_level_loc = glGetUniformLocation(water_data.projected_program, "water_level");
+	water_data.water_bounds_loc = glGetUniformLocation(water_data.projected_program, "water_bounds");
+
+	water_data.reflection_view_projection_loc = glGetUniformLocation(water_data.program, "reflection_view_projection");
+	water_data.projected_reflection_view_projection_loc = glGetUniformLocation(water_data.projected_program, "reflection_view_projection");
+
+	water_data.use_ocean_loc = glGetUniformLocation(water_data.program, "use_ocean");
+	water_data.ocean_displacement_tex_loc = glGetUniformLocation(water_data.program, "ocean_displacement_tex");
+	water_data.ocean_normal_tex_loc = glGetUniformLocation(water_data.program, "ocean_normal_tex");
+	water_data.ocean_patch_loc = glGetUniformLocation(water_data.program, "ocean_patch");
+	water_data.ocean_lod_loc = glGetUniformLocation(water_data.program, "ocean_lod");
+	water_data.projected_use_ocean_loc = glGetUniformLocation(water_data.projected_program, "use_ocean");
+	water_data.projected_ocean_displacement_tex_loc = glGetUniformLocation(water_data.projected_program, "ocean_displacement_tex");
+	water_data.projected_ocean_normal_tex_loc = glGetUniformLocation(water_data.projected_program, "ocean_normal_tex");
+	water_data.projected_ocean_patch_loc = glGetUniformLocation(water_data.projected_program, "ocean_patch");
+}
+
+void initStreaming(int position_loc, int normal_loc, int tex_coord_loc) {
+	// Tiled heightmaps are read through the memory mapping, only the touched tiles are paged in
+	TerrainStreamer::HeightSource source = TerrainStreamer::MirroredSource(&terrain_data.geometry.height);
+	if (procedural_terrain)
+		source = ProceduralTerrain::Source(procedural_settings);
+	else if (streamed_heightfield.Open(heightmap_file.c_str()))
+		source = TerrainStreamer::MirroredSource(&streamed_heightfield);
+
+	terrain_streamer.reset(new TerrainStreamer(source, position_loc, normal_loc, tex_coord_loc));
+
+	camera_input.SetBounds(-1.0e6f, 1.0e6f);
+	camera_input.SetHeightQuery([](float x, float z) { return terrain_streamer->GetHeight(x, z, TERRAIN_HEIGHT * 0.5f); });
+}
+
+// Applies every brush repeatedly around the terrain center, including the GPU update
+void runBrushBenchmark() {
+	const char* names[] = { "Raise", "Lower", "Flatten", "Smooth" };
+	const float strengths[] = { 0.002f, 0.002f, 0.2f, 0.5f };
+	const float radius = 5.0f;
+	Terrain& terrain = terrain_data.geometry;
+
+	std::cout << "Brush benchmark, " << terrain.size_x << "x" << terrain.size_z << " terrain ("
+		<< (terrain.compact ? "compact" : "vertex") << " mode), radius " << radius << std::endl;
+	for (int b = 0; b < 4; ++b) {
+		FrameStats stats;
+		for (int i = 0; i < 100; ++i) {
+			float angle = 0.1f * i;
+			auto start = std::chrono::steady_clock::now();
+			terrain.ApplyBrush(static_cast<Terrain::Brush>(b), 10.0f * cos(angle), 10.0f * sin(angle), radius, strengths[b]);
+			glFinish();
+			stats.Add(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		}
+		stats.Report(names[b]);
+	}
 }
 
 void initLight() {
@@ -182,25 +763,595 @@ void initLight() {
 	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
+// Places the vegetation of the single terrain, trees first: bushes and grass keep off the trunks, grass off the bushes.
+// The 12 grass kinds are one layer, so no two clumps of any kind are closer than its spacing, and the kind of a clump
+// follows its rank in the placement. Fewer instances than asked for are placed when the terrain is full.
+void generateInstances(const Terrain& terrain) {
+	std::vector<VegetationPlacement::Layer> layers = {
+		{ nature_data.tree_count, 2.5f, 0.6f, [](float, float y, float) { return y < 0.2f ? 0.0f : y; } },
+		{ nature_data.bush_count, 1.5f, 0.4f, [](float, float y, float) { return y < 0.3f ? 0.0f : 1.0f; } },
+		{ nature_data.grass_count * 12, 0.3f, 0.0f, [](float, float y, float) { return y < 0.15f ? 0.02f : 1.0f - y / 2.0f; } },
+	};
+	std::vector<std::vector<PackedInstance>> placed = VegetationPlacement::Place(terrain.height, layers, vegetation_seed);
+
+	nature_data.tree_instances = std::move(placed[0]);
+	nature_data.bush_instances = std::move(placed[1]);
+	for (int i = 0; i < 12; ++i) {
+		nature_data.long_grass_instances[i].clear();
+		nature_data.long_grass_instances[i].reserve(placed[2].size() / 12 + 1);
+	}
+	for (size_t rank = 0; rank < placed[2].size(); ++rank)
+		nature_data.long_grass_instances[rank % 12].push_back(placed[2][rank]);
+}
+
+// Whether the instance stands on a visible cell (always without a PVS)
+bool instanceOnVisibleCell(const PackedInstance& instance) {
+	int cell = terrain_visibility.Empty() ? -1 : terrain_visibility.CellAt(instance.position.x, instance.position.z);
+	return cell < 0 || pvs_visible.empty() || pvs_visible[cell];
+}
+
+// Uploads the instances standing on visible cells (all of them without a PVS)
+void uploadInstances(InstanceBuffer& buffer, const std::vector<PackedInstance>& instances) {
+	std::vector<PackedInstance> visible;
+	visible.reserve(instances.size());
+	for (const PackedInstance& instance : instances) {
+		if (instanceOnVisibleCell(instance))
+			visible.push_back(instance);
+	}
+	buffer.Upload(visible, instance_format);
+}
+
+// Writes the instances inside the frustum whose bounds reach above 'min_y' (and stand on visible PVS cells) to the buffer,
+// sorted into the LODs seen from 'eye' unless -no-lod. Instances hidden in 'occlusion' (when given) are dropped and counted.
+void cullInstances(const InstanceCulling& culling, InstanceBuffer& buffer, const MeshLods& lods, LodCounts& lod_counts, const Frustum& frustum,
+	float min_y, const glm::vec3& eye, float pixel_scale, const HiZMap* occlusion = nullptr) {
+	const std::vector<char>* cells = pvs_visible.empty() ? nullptr : &pvs_visible;
+	lod_counts.selected = vegetation_lods;
+	if (vegetation_lods) {
+		int total = culling.SelectLods(frustum, min_y, cells, occlusion, lods.settings, eye, pixel_scale, lod_counts.count);
+		if (occlusion)
+			occluded_instances += culling.Occluded();
+		if (instance_format == InstanceBuffer::Format::Packed) {
+			PackedInstance* out = buffer.Map(total);
+			if (out) {
+				culling.WriteLods(out);
+				buffer.Unmap(total);
+				return;
+			}
+		}
+		std::vector<PackedInstance> visible(total);
+		culling.WriteLods(visible.data());
+		buffer.Upload(visible, instance_format);
+		return;
+	}
+	if (instance_format == InstanceBuffer::Format::Packed) {
+		// Compacted straight into the buffer
+		PackedInstance* out = buffer.Map(culling.Size());
+		if (out) {
+			buffer.Unmap(culling.Cull(frustum, min_y, cells, occlusion, out));
+			if (occlusion)
+				occluded_instances += culling.Occluded();
+			return;
+		}
+	}
+	std::vector<PackedInstance> visible(culling.Size());
+	visible.resize(culling.Cull(frustum, min_y, cells, occlusion, visible.data()));
+	if (occlusion)
+		occluded_instances += culling.Occluded();
+	buffer.Upload(visible, instance_format);
+}
+
+// Eye of the reflection pass, mirrored at the water
+glm::vec3 reflectionEye() {
+	glm::vec3 eye = camera_input.GetEyePosition();
+	return glm::vec3(eye.x, 2.0f * water_data.settings.level - eye.y, eye.z);
+}
+
+// Vegetation of the main pass from the camera frustum, without the instances hidden behind the terrain: in the
+// depth pyramid of this frame on the GPU, in the last readback on the CPU
+void cullNature(const Frustum& frustum) {
+	if (gpu_culling) {
+		glm::mat4 model_matrix = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.0f, 0.0f));
+		gpu_culler.Cull(0, frustum, model_matrix, camera_input.GetEyePosition(), -FLT_MAX, -1, occlusion_culling ? &depth_pyramid : nullptr);
+		return;
+	}
+	glm::vec3 eye = camera_input.GetEyePosition();
+	float pixel_scale = pixelScale(WIN_HEIGHT);
+	cullInstances(nature_data.tree_culling, nature_data.tree_buffer, nature_data.tree_lods, nature_data.tree_lod_counts, frustum, -FLT_MAX, eye, pixel_scale,
+		hiz_map);
+	cullInstances(nature_data.bush_culling, nature_data.bush_buffer, nature_data.bush_lods, nature_data.bush_lod_counts, frustum, -FLT_MAX, eye, pixel_scale,
+		hiz_map);
+	for (int i = 0; i < 12; ++i)
+		cullInstances(nature_data.long_grass_culling[i], nature_data.long_grass_buffer[i], nature_data.long_grass_lods[i], nature_data.long_grass_lod_counts[i],
+			frustum, -FLT_MAX, eye, pixel_scale, hiz_map);
+}
+
+// Terrain chunks of the main pass: the PVS selection (all chunks without a PVS) without the chunks hidden in the last
+// readback of the depth pyramid
+void occludeChunks() {
+	main_chunks.clear();
+	occluded_chunks = 0;
+	if (!hiz_map || reflection_culler.Empty())
+		return;
+	const Terrain& terrain = terrain_data.geometry;
+	if (pvs_visible.empty())
+		main_chunks.assign(size_t(terrain.chunks_x) * terrain.chunks_z, 1);
+	else
+		main_chunks = pvs_visible;
+	occluded_chunks = reflection_culler.OccludeChunks(*hiz_map, main_chunks);
+}
+
+// Cull list of the reflection pass from the frustum of the mirrored camera. Without the cull list the vegetation
+// is still frustum culled (unless -no-instance-cull), but not against the water plane.
+void cullReflection(const Frustum& frustum) {
+	if (terrain_streamer)
+		return;
+	if (reflection_culling && !reflection_culler.Empty()) {
+		reflection_culler.CullChunks(frustum, water_data.settings.level, reflection_chunks);
+		for (size_t i = 0; i < pvs_visible.size() && i < reflection_chunks.size(); ++i)
+			reflection_chunks[i] = reflection_chunks[i] && pvs_visible[i];
+	}
+	if (reflection_culling || instance_culling) {
+		float min_y = reflection_culling ? water_data.settings.level : -FLT_MAX;
+		if (gpu_culling) {
+			// Trees and bushes, the grass is not reflected
+			glm::mat4 model_matrix = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.0f, 0.0f));
+			gpu_culler.Cull(1, frustum, model_matrix, camera_input.GetEyePosition(), min_y, GPU_BUSH_LAYER + 1);
+			return;
+		}
+		// LODs from the mirrored eye at the resolution of the reflection
+		glm::vec3 eye = reflectionEye();
+		float pixel_scale = pixelScale(water_data.reflection_height);
+		cullInstances(nature_data.tree_culling, nature_data.reflection_tree_buffer, nature_data.tree_lods, nature_data.reflection_tree_lod_counts,
+			frustum, min_y, eye, pixel_scale);
+		cullInstances(nature_data.bush_culling, nature_data.reflection_bush_buffer, nature_data.bush_lods, nature_data.reflection_bush_lod_counts,
+			frustum, min_y, eye, pixel_scale);
+	}
+}
+
+// Bounds of the placed vegetation for the culling, again after the PVS is loaded
+void buildInstanceCulling() {
+	// Placement of the vegetation, see renderNature
+	glm::mat4 model_matrix = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.0f, 0.0f));
+	nature_data.tree_culling.Build(nature_data.tree_instances, model_matrix, TREE_BOUNDS, &terrain_visibility);
+	nature_data.bush_culling.Build(nature_data.bush_instances, model_matrix, BUSH_BOUNDS, &terrain_visibility);
+	for (int i = 0; i < 12; ++i)
+		nature_data.long_grass_culling[i].Build(nature_data.long_grass_instances[i], model_matrix, GRASS_BOUNDS, &terrain_visibility);
+
+	if (gpu_culler.Ready()) {
+		gpu_culler.SetInstances(GPU_TREE_LAYER, nature_data.tree_instances, TREE_BOUNDS);
+		gpu_culler.SetInstances(GPU_BUSH_LAYER, nature_data.bush_instances, BUSH_BOUNDS);
+		for (int i = 0; i < 12; ++i)
+			gpu_culler.SetInstances(GPU_GRASS_LAYER + i, nature_data.long_grass_instances[i], GRASS_BOUNDS);
+	}
+}
+
+void uploadAllInstances() {
+	// Drawn whole with the full meshes
+	nature_data.tree_lod_counts.selected = false;
+	nature_data.bush_lod_counts.selected = false;
+	for (int i = 0; i < 12; ++i)
+		nature_data.long_grass_lod_counts[i].selected = false;
+	uploadInstances(nature_data.tree_buffer, nature_data.tree_instances);
+	uploadInstances(nature_data.bush_buffer, nature_data.bush_instances);
+	for (int i = 0; i < 12; ++i)
+		uploadInstances(nature_data.long_grass_buffer[i], nature_data.long_grass_instances[i]);
+}
+
+// Drops the PVS selection after the terrain was edited: a lowered ridge uncovers the cells behind it, not only the
+// edited ones, so every chunk and instance is drawn (still frustum and occlusion culled)
+void invalidateVisibility() {
+	if (terrain_visibility.Empty() || pvs_edited)
+		return;
+	pvs_edited = true;
+	pvs_visible.assign(terrain_visibility.CellCount(), 1);
+	if (!instance_culling)
+		uploadAllInstances();
+}
+
+// Puts the vegetation standing on the brushed 'region' back on the ground and rebuilds its culling and buffers
+void reseatInstances(Terrain::Region region) {
+	const std::vector<std::vector<float>>& height = terrain_data.geometry.height;
+	int moved = VegetationPlacement::Reseat(height, region, nature_data.tree_instances);
+	moved += VegetationPlacement::Reseat(height, region, nature_data.bush_instances);
+	for (int i = 0; i < 12; ++i)
+		moved += VegetationPlacement::Reseat(height, region, nature_data.long_grass_instances[i]);
+	if (moved == 0)
+		return;
+	buildInstanceCulling();
+	if (!instance_culling)
+		uploadAllInstances();
+}
+
 void randomGeneration() {
-	Terrain::GenerateRandomModel(terrain_data.geometry, nature_data.tree_data, TREE_COUNT, [](float x, float y, float z) { return y < 0.2 ? 0.0 : y; });
-	glGenBuffers(1, &(ubo.tree));
-	glBindBuffer(GL_UNIFORM_BUFFER, ubo.tree);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(nature_data.tree_data), &(nature_data.tree_data), GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	generateInstances(terrain_data.geometry);
+	buildInstanceCulling();
+	if (!instance_culling)
+		uploadAllInstances();
+}
 
-	Terrain::GenerateRandomModel(terrain_data.geometry, nature_data.tree_data, BUSH_COUNT, [](float x, float y, float z) { return y < 0.3 ? 0.0f : 1.0; });
-	glGenBuffers(1, &(ubo.bush));
-	glBindBuffer(GL_UNIFORM_BUFFER, ubo.bush);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(nature_data.tree_data), &(nature_data.tree_data), GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+// Replaces the vegetation of the single terrain for the instance benchmark
+void placeBenchmarkInstances(const InstanceSetup& setup) {
+	nature_data.tree_count = setup.trees;
+	nature_data.bush_count = setup.bushes;
+	nature_data.grass_count = setup.grass / 12;
+	instance_format = setup.format;
+	instance_culling = setup.culling;
+	gpu_culling = setup.gpu;
+	vegetation_lods = setup.lods;
+	use_impostors = setup.impostors;
+	setImpostorLods();
+
+	auto start = std::chrono::steady_clock::now();
+	generateInstances(terrain_data.geometry);
+	double place_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	// All instances are uploaded once to compare the formats, the culling replaces them every frame
+	start = std::chrono::steady_clock::now();
+	uploadAllInstances();
+	glFinish();
+	double upload_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	buildInstanceCulling();
+
+	size_t bytes = (nature_data.tree_buffer.count + nature_data.bush_buffer.count) * nature_data.tree_buffer.Stride();
+	for (int i = 0; i < 12; ++i)
+		bytes += nature_data.long_grass_buffer[i].count * nature_data.long_grass_buffer[i].Stride();
+	std::cout << "Instances " << setup.name << ": placed in " << place_ms << " ms, " << bytes / (1024.0 * 1024.0)
+		<< " MiB uploaded in " << upload_ms << " ms" << std::endl;
+}
 
-	for (int i = 0; i < 12; ++i) {
-		Terrain::GenerateRandomModel(terrain_data.geometry, nature_data.tree_data, GRASS_COUNT, [](float x, float y, float z) { return y < 0.15 ? 0.02 : 1 - y / 2; });
-		glGenBuffers(1, &(ubo.long_grass[i]));
-		glBindBuffer(GL_UNIFORM_BUFFER, ubo.long_grass[i]);
-		glBufferData(GL_UNIFORM_BUFFER, sizeof(nature_data.tree_data), &(nature_data.tree_data), GL_STATIC_DRAW);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+// Bakes the visibility of a heightfield placed like the single terrain and prints the bake time
+void bakeVisibility(const std::vector<std::vector<float>>& height, const TerrainRaycaster& raycaster) {
+	TerrainVisibility::Settings settings;
+	auto start = std::chrono::steady_clock::now();
+	terrain_visibility.Bake(height, raycaster, settings);
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Terrain visibility " << settings.cells_x << "x" << settings.cells_z << " cells baked in " << ms << " ms ("
+		<< terrain_visibility.RayCount() << " rays, " << ThreadPool::Shared().ThreadCount() + 1 << " threads)" << std::endl;
+}
+
+// Bakes the terrain occlusion into a texture, the streamed tiles are not baked and get a white texel
+void initOcclusion() {
+	glGenTextures(1, &terrain_data.occlusion_tex);
+	glBindTexture(GL_TEXTURE_2D, terrain_data.occlusion_tex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (streaming_world) {
+		uint8_t white = 255;
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, 1, 1, 0, GL_RED, GL_UNSIGNED_BYTE, &white);
+	}
+	else {
+		const Terrain& terrain = terrain_data.geometry;
+		auto start = std::chrono::steady_clock::now();
+		terrain_occlusion = TerrainOcclusion::Bake(terrain.height, occlusion_settings);
+		std::cout << "Terrain occlusion baked in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+			<< " ms" << std::endl;
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, terrain.size_x, terrain.size_z, 0, GL_RED, GL_UNSIGNED_BYTE, terrain_occlusion.data());
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Re-bakes and uploads the occlusion that depends on the heights of 'region'
+void updateOcclusion(Terrain::Region region) {
+	const Terrain& terrain = terrain_data.geometry;
+	region = TerrainOcclusion::AffectedRegion(terrain.height, occlusion_settings, region);
+	TerrainOcclusion::BakeRegion(terrain.height, occlusion_settings, region, terrain_occlusion);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, terrain.size_x);
+	glBindTexture(GL_TEXTURE_2D, terrain_data.occlusion_tex);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, region.x0, region.z0, region.x1 - region.x0 + 1, region.z1 - region.z0 + 1, GL_RED, GL_UNSIGNED_BYTE,
+		&terrain_occlusion[size_t(region.z0) * terrain.size_x + region.x0]);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+void initVisibility() {
+	Terrain& terrain = terrain_data.geometry;
+	if (streaming_world || terrain.compact) {
+		std::cout << "Terrain visibility needs the single terrain in vertex mode, ignoring -pvs" << std::endl;
+		return;
+	}
+
+	if (!terrain_visibility.Load(pvs_file.c_str(), terrain.height)) {
+		bakeVisibility(terrain.height, terrain_raycaster);
+		if (!terrain_visibility.Save(pvs_file.c_str()))
+			std::cout << "Could not write the terrain visibility file" << std::endl;
+	}
+	terrain.BuildChunks(terrain_visibility.CellsX(), terrain_visibility.CellsZ());
+	buildInstanceCulling();
+}
+
+// Selects the chunks and instances visible from the camera cell when it changes
+void updateVisibility(const glm::vec3& eye) {
+	int cell = terrain_visibility.CellAt(eye.x, eye.z);
+	if (cell == pvs_cell || pvs_edited)
+		return;
+	pvs_cell = cell;
+	terrain_visibility.VisibleFrom(cell, pvs_visible);
+	// The culling reads pvs_visible every frame
+	if (!instance_culling)
+		uploadAllInstances();
+}
+
+// Shading error of the coarse meshes against the full mesh: the vertex normals interpolated over the coarse
+// triangles, and the normal map. Reports the angle between the normals and the difference of the Lambert term
+// (in 8-bit levels) for a low sun. Needs no GL context.
+void runNormalMapBenchmark() {
+	std::vector<std::vector<float>> height = procedural_terrain ? ProceduralTerrain::Generate(procedural_settings, procedural_size, procedural_size)
+		: Terrain::ReadHeightmap(heightmap_file.c_str());
+	int size_x = static_cast<int>(height.size());
+	int size_z = static_cast<int>(height[0].size());
+	std::vector<std::vector<glm::vec3>> reference = Terrain::ComputeNormals(height);
+
+	Terrain::Region all;
+	all.x1 = size_x - 1;
+	all.z1 = size_z - 1;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<GLbyte> normal_map = Terrain::BakeNormalMap(height, all);
+	std::cout << "Normal map " << size_x << "x" << size_z << " baked in "
+		<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+
+	const glm::vec3 sun = glm::normalize(glm::vec3(1.0f, 0.5f, 0.3f));
+	auto report = [&](const char* name, size_t triangles, std::function<glm::vec3(int, int)> normal) {
+		double angle_sum = 0.0, level_sum = 0.0, angle_max = 0.0;
+		size_t visible = 0;
+		for (int x = 0; x < size_x; x++) {
+			for (int z = 0; z < size_z; z++) {
+				glm::vec3 n = normal(x, z);
+				const glm::vec3& r = reference[x][z];
+				double angle = glm::degrees(acos(glm::clamp(double(glm::dot(n, r)), -1.0, 1.0)));
+				double levels = 255.0 * fabs(std::max(glm::dot(n, sun), 0.0f) - std::max(glm::dot(r, sun), 0.0f));
+				angle_sum += angle;
+				angle_max = std::max(angle_max, angle);
+				level_sum += levels;
+				// Two levels is about the smallest step visible on a smooth gradient
+				visible += levels > 2.0;
+			}
+		}
+		double samples = double(size_x) * size_z;
+		std::cout << name << ": " << triangles << " triangles, normal error mean " << angle_sum / samples << " deg (max " << angle_max
+			<< "), shading error mean " << level_sum / samples << " levels, " << 100.0 * visible / samples << "% of samples over 2 levels" << std::endl;
+	};
+
+	for (int step : { 1, 2, 4 }) {
+		size_t triangles = Terrain::TriangleCount(size_x, size_z, step);
+		std::ostringstream name;
+		name << "Mesh step " << step;
+		// The coarse vertices keep the full resolution normals, in between the rasterizer interpolates them
+		report((name.str() + " vertex normals").c_str(), triangles, [&](int x, int z) {
+			int x0 = std::min(x / step * step, size_x - 1), z0 = std::min(z / step * step, size_z - 1);
+			int x1 = std::min(x0 + step, size_x - 1), z1 = std::min(z0 + step, size_z - 1);
+			float u = x1 > x0 ? float(x - x0) / (x1 - x0) : 0.0f;
+			float v = z1 > z0 ? float(z - z0) / (z1 - z0) : 0.0f;
+			glm::vec3 n = glm::mix(glm::mix(reference[x0][z0], reference[x1][z0], u), glm::mix(reference[x0][z1], reference[x1][z1], u), v);
+			return glm::normalize(n);
+		});
+		report((name.str() + " normal map").c_str(), triangles, [&](int x, int z) {
+			const GLbyte* texel = &normal_map[(size_t(z) * size_x + x) * 2];
+			glm::vec2 xz(texel[0] / 127.0f, texel[1] / 127.0f);
+			return glm::normalize(glm::vec3(xz.x, sqrt(std::max(0.0f, 1.0f - glm::dot(xz, xz))), xz.y));
+		});
+	}
+}
+
+// Bakes the heightmap visibility and walks a loop over the terrain, averaging the terrain triangles and
+// vegetation instances on hidden cells. Needs no GL context.
+void runVisibilityBenchmark() {
+	Terrain terrain;
+	terrain.height = procedural_terrain ? ProceduralTerrain::Generate(procedural_settings, procedural_size, procedural_size)
+		: Terrain::ReadHeightmap(heightmap_file.c_str());
+	terrain.size_x = static_cast<int>(terrain.height.size());
+	terrain.size_z = static_cast<int>(terrain.height[0].size());
+	TerrainRaycaster raycaster(terrain.height);
+
+	bakeVisibility(terrain.height, raycaster);
+	if (!terrain_visibility.Save(pvs_file.c_str()))
+		std::cout << "Could not write the terrain visibility file" << std::endl;
+	std::cout << "Matrix " << terrain_visibility.RawBytes() << " bytes, file " << terrain_visibility.FileBytes() << " bytes" << std::endl;
+
+	// Triangles per cell (two per quad) and vegetation instances per cell
+	int cells = terrain_visibility.CellCount();
+	std::vector<double> triangles(cells), instances(cells);
+	for (int cz = 0; cz < terrain_visibility.CellsZ(); ++cz) {
+		for (int cx = 0; cx < terrain_visibility.CellsX(); ++cx) {
+			int w = Terrain::ChunkBegin(cx + 1, terrain_visibility.CellsX(), terrain.size_x - 1) - Terrain::ChunkBegin(cx, terrain_visibility.CellsX(), terrain.size_x - 1);
+			int h = Terrain::ChunkBegin(cz + 1, terrain_visibility.CellsZ(), terrain.size_z - 1) - Terrain::ChunkBegin(cz, terrain_visibility.CellsZ(), terrain.size_z - 1);
+			triangles[cz * terrain_visibility.CellsX() + cx] = 2.0 * w * h;
+		}
+	}
+	generateInstances(terrain);
+	std::vector<const std::vector<PackedInstance>*> types = { &nature_data.tree_instances, &nature_data.bush_instances };
+	for (int i = 0; i < 12; ++i)
+		types.push_back(&nature_data.long_grass_instances[i]);
+	for (const std::vector<PackedInstance>* type : types)
+		for (const PackedInstance& instance : *type) {
+			int cell = terrain_visibility.CellAt(instance.position.x, instance.position.z);
+			if (cell >= 0)
+				instances[cell] += 1.0;
+		}
+
+	double total_triangles = 0.0, total_instances = 0.0;
+	for (int c = 0; c < cells; ++c) {
+		total_triangles += triangles[c];
+		total_instances += instances[c];
+	}
+
+	CameraPath path = CameraPath::TerrainLoop();
+	glm::vec3 eye, target;
+	FrameStats terrain_culled, instances_culled;
+	std::vector<char> visible;
+	while (path.Step(eye, target)) {
+		terrain_visibility.VisibleFrom(terrain_visibility.CellAt(eye.x, eye.z), visible);
+		double hidden_triangles = 0.0, hidden_instances = 0.0;
+		for (int c = 0; c < cells; ++c) {
+			if (!visible[c]) {
+				hidden_triangles += triangles[c];
+				hidden_instances += instances[c];
+			}
+		}
+		terrain_culled.Add(100.0 * hidden_triangles / total_triangles);
+		instances_culled.Add(100.0 * hidden_instances / total_instances);
+	}
+	std::cout << "Along the terrain loop (" << terrain_culled.Count() << " views): terrain triangles culled " << terrain_culled.Mean()
+		<< "% (median " << terrain_culled.Median() << "%), vegetation instances culled " << instances_culled.Mean()
+		<< "% (median " << instances_culled.Median() << "%)" << std::endl;
+}
+
+// Texture fetches of the terrain material per height sample: three per fragment with the slope test, with the
+// splat map one for the map plus one per layer, three where a layer needs the triplanar projection.
+// Samples weigh equally, unlike the fragments of a view.
+void reportSplatCost(const Terrain& terrain) {
+	Terrain::Region all;
+	all.x1 = terrain.size_x - 1;
+	all.z1 = terrain.size_z - 1;
+	std::vector<GLubyte> splat = Terrain::BakeSplatMap(terrain.height, Terrain::ComputeNormals(terrain.height, all), all);
+
+	double fetches = 0.0, triplanar = 0.0, mixed = 0.0;
+	size_t samples = splat.size() / 2;
+	for (size_t i = 0; i < samples; ++i) {
+		int layers = (splat[i * 2] < 255) + (splat[i * 2] > 0);
+		bool sides = splat[i * 2 + 1] > 0;
+		fetches += 1.0 + layers * (sides ? 3.0 : 1.0);
+		triplanar += sides;
+		mixed += layers == 2;
+	}
+	std::cout << "Splat map " << terrain.size_x << "x" << terrain.size_z << ": " << 100.0 * triplanar / samples << "% of samples triplanar, "
+		<< 100.0 * mixed / samples << "% blend grass and rock, " << fetches / samples << " material fetches per sample (slope test: 3)" << std::endl;
+}
+
+// Water tiles under the heightmap terrain, and the tiles left after frustum culling along the terrain loop with
+// the projection of the main pass. Needs no GL context.
+void runWaterBenchmark() {
+	Terrain terrain;
+	terrain.height = procedural_terrain ? ProceduralTerrain::Generate(procedural_settings, procedural_size, procedural_size)
+		: Terrain::ReadHeightmap(heightmap_file.c_str());
+	terrain.size_x = static_cast<int>(terrain.height.size());
+	terrain.size_z = static_cast<int>(terrain.height[0].size());
+
+	WaterSurface surface;
+	surface.Build(terrain.height, 200, water_data.settings);
+	double total = double(surface.TriangleCount());
+	double masked = surface.TriangleCount(surface.Mask());
+	// The grid is uniform, the share of triangles is also the share of the water surface (and of the fragments
+	// rasterized for it before the depth test)
+	std::cout << "Water grid " << surface.TileCount() << " tiles, " << total << " triangles: the terrain mask removes "
+		<< 100.0 * (1.0 - masked / total) << "% of the triangles and of the water area" << std::endl;
+
+	CameraPath path = CameraPath::TerrainLoop();
+	glm::mat4 projection = glm::perspective(glm::radians(45.0f), float(WIN_WIDTH) / float(WIN_HEIGHT), 0.1f, 1000.0f);
+	glm::vec3 eye, target;
+	FrameStats removed;
+	std::vector<char> visible;
+	while (path.Step(eye, target)) {
+		eye.y = terrain.SampleHeight(eye.x, eye.z) * TERRAIN_HEIGHT;
+		target.y += eye.y;
+		surface.Cull(Frustum(projection * glm::lookAt(eye, target, glm::vec3(0.0f, 1.0f, 0.0f))), visible);
+		removed.Add(100.0 * (1.0 - surface.TriangleCount(visible) / total));
+	}
+	std::cout << "Along the terrain loop (" << removed.Count() << " views), mask and frustum remove " << removed.Mean()
+		<< "% of the water triangles (median " << removed.Median() << "%, min " << removed.Percentile(0.0) << "%)" << std::endl;
+}
+
+// Benchmark view 'view' of -benchmark waterlod: above the water at the map center, looking along +X
+void waterLodPose(int view, glm::vec3& eye, glm::vec3& target) {
+	float ground = terrain_data.geometry.SampleHeight(0.0f, 0.0f) * TERRAIN_HEIGHT;
+	float pitch = glm::radians(WATER_LOD_PITCH[view]);
+	eye = glm::vec3(0.0f, std::max(ground, water_data.settings.level) + 4.0f, 0.0f);
+	target = eye + glm::vec3(cosf(pitch), -sinf(pitch), 0.0f);
+}
+
+// Vertex counts of both water meshes in every benchmark view and the timings of both runs
+void reportWaterLod() {
+	glm::mat4 projection = glm::perspective(glm::radians(45.0f), float(WIN_WIDTH) / float(WIN_HEIGHT), 0.1f, 1000.0f);
+	const ProjectedWater::Settings& settings = water_data.projected_settings;
+	glm::vec4 bounds(-50.0f, -50.0f, 50.0f, 50.0f);
+	std::vector<char> visible;
+	for (int view = 0; view < WATER_LOD_VIEWS; ++view) {
+		glm::vec3 eye, target;
+		waterLodPose(view, eye, target);
+		glm::mat4 view_projection = projection * glm::lookAt(eye, target, glm::vec3(0.0f, 1.0f, 0.0f));
+		water_data.surface.Cull(Frustum(view_projection), visible);
+
+		// Projected vertices that land on the water, the others are pulled onto its border
+		glm::mat4 inverse_view_projection = glm::inverse(view_projection);
+		size_t on_water = 0;
+		for (int row = 0; row < settings.rows; ++row) {
+			for (int column = 0; column < settings.columns; ++column) {
+				bool inside;
+				ProjectedWater::VertexPosition(inverse_view_projection, settings, water_data.settings.level, bounds, column, row, inside);
+				on_water += inside;
+			}
+		}
+
+		std::cout << "Pitch " << WATER_LOD_PITCH[view] << " deg: tiled grid " << water_data.surface.TriangleCount(visible)
+			<< " triangles after culling, projected grid " << ProjectedWater::TriangleCount(settings) << " triangles, "
+			<< on_water << " of " << ProjectedWater::VertexCount(settings) << " vertices on the water" << std::endl;
+		for (int run = 0; run < 2; ++run) {
+			std::ostringstream name;
+			name << "  " << (run == 0 ? "tiled" : "projected") << " water pass GPU time";
+			water_gpu_frames[run][view].Report(name.str());
+			name.str("");
+			name << "  " << (run == 0 ? "tiled" : "projected") << " frame time";
+			water_cpu_frames[run][view].Report(name.str());
+		}
+	}
+}
+
+// Benchmark view of -benchmark occlusion: the walking camera on the lowest dry ground of the inner map, looking level
+// towards the highest peak, so that the slopes in between hide much of the map
+void valleyPose(glm::vec3& eye, glm::vec3& target) {
+	const Terrain& terrain = terrain_data.geometry;
+	eye = glm::vec3(0.0f, terrain.SampleHeight(0.0f, 0.0f) * TERRAIN_HEIGHT - 2.0f, 0.0f);
+	target = glm::vec3(1.0f, eye.y, 0.0f);
+	float lowest = FLT_MAX, highest = -FLT_MAX;
+	for (int x = 0; x < terrain.size_x; ++x) {
+		for (int z = 0; z < terrain.size_z; ++z) {
+			// Placement of the single terrain: translate(0, -2, 0) * scale(100, TERRAIN_HEIGHT, 100)
+			glm::vec3 ground(float(x) / terrain.size_x * 100.0f - 50.0f, terrain.height[x][z] * TERRAIN_HEIGHT - 2.0f, float(z) / terrain.size_z * 100.0f - 50.0f);
+			if (ground.y > highest) {
+				highest = ground.y;
+				target = ground;
+			}
+			bool inner = std::abs(ground.x) < 40.0f && std::abs(ground.z) < 40.0f;
+			if (inner && ground.y > water_data.settings.level + 0.5f && ground.y < lowest) {
+				lowest = ground.y;
+				eye = ground;
+			}
+		}
+	}
+	eye.y += 2.0f;
+	target.y = eye.y;
+}
+
+// Frame times, GPU time of the main pass and the culled counts of both runs of -benchmark occlusion
+void reportOcclusion() {
+	if (!depth_pyramid.Ready()) {
+		std::cout << "Occlusion benchmark: skipped, the depth pyramid is not available" << std::endl;
+		return;
+	}
+	std::cout << "Occlusion benchmark from (" << valley_eye.x << ", " << valley_eye.y << ", " << valley_eye.z << ") towards ("
+		<< valley_target.x << ", " << valley_target.z << "), " << (gpu_culling ? "GPU" : "CPU") << " culling"
+		<< (software_occlusion ? ", software occlusion" : "") << std::endl;
+	const char* names[2] = { "without occlusion culling", "with occlusion culling" };
+	for (int run = 0; run < 2; ++run) {
+		std::cout << "Occlusion " << names[run] << ":" << std::endl;
+		occlusion_cpu_frames[run].Report("  frame time");
+		occlusion_gpu_frames[run].Report("  main pass GPU time");
+		int frames = std::max(occlusion_counted_frames[run], 1);
+		std::cout << "  terrain chunks hidden per frame: " << occluded_chunk_sum[run] / frames << std::endl;
+		if (gpu_culling)
+			std::cout << "  vegetation instances drawn: " << occlusion_gpu_visible[run] << ", hidden: " << occlusion_gpu_hidden[run] << " (last frame)" << std::endl;
+		else
+			std::cout << "  vegetation instances hidden per frame: " << occluded_instance_sum[run] / frames << ", vegetation triangles per frame: "
+				<< occlusion_triangle_sum[run] / frames << std::endl;
+	}
+	if (occlusion_cpu_frames[0].Count() > 0 && occlusion_cpu_frames[1].Count() > 0) {
+		double before = occlusion_cpu_frames[0].Median(), after = occlusion_cpu_frames[1].Median();
+		std::cout << "Median frame time gain: " << before - after << " ms (" << (before > 0.0 ? 100.0 * (before - after) / before : 0.0) << "%)" << std::endl;
 	}
 }
 
@@ -227,10 +1378,28 @@ void initMaterial() {
 	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
+// (Re)allocates the reflection color and depth buffers at reflection_scale of the window
+void resizeReflection() {
+	water_data.reflection_width = std::max(static_cast<int>(WIN_WIDTH * reflection_scale), 1);
+	water_data.reflection_height = std::max(static_cast<int>(WIN_HEIGHT * reflection_scale), 1);
+
+	glBindTexture(GL_TEXTURE_2D, water_data.reflection_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, water_data.reflection_width, water_data.reflection_height, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	// A smaller reflection is magnified, filter it
+	GLint filter = reflection_scale < 1.0f ? GL_LINEAR : GL_NEAREST;
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, water_data.reflection_depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, water_data.reflection_width, water_data.reflection_height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	reflection_valid = false;
+}
+
 void initReflection() {
 	glGenRenderbuffers(1, &(water_data.reflection_depth));
-	glBindRenderbuffer(GL_RENDERBUFFER, water_data.reflection_depth);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, WIN_WIDTH, WIN_HEIGHT);
+	resizeReflection();
 	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, water_data.reflection_depth);
 
 	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, water_data.reflection_tex, 0);
@@ -246,7 +1415,8 @@ void applyTextures() {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+	if (GLEW_EXT_texture_filter_anisotropic)
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
 	glGenerateMipmap(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
@@ -257,10 +1427,14 @@ void applyTextures() {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+	if (GLEW_EXT_texture_filter_anisotropic)
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
 	glGenerateMipmap(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
+	// Distant terrain, the mean colors of the detail textures mixed by the splat weights
+	terrain_data.geometry.CreateMacroMap(Loader::AverageColor(terrain_data.grass_tex), Loader::AverageColor(terrain_data.rocks_tex));
+
 	// Tree texture
 	nature_data.tree_tex = Loader::CreateAndLoadTexture(MAYBEWIDE("resources/tree1.png"));
 	glBindTexture(GL_TEXTURE_2D, nature_data.tree_tex);
@@ -268,7 +1442,8 @@ void applyTextures() {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+	if (GLEW_EXT_texture_filter_anisotropic)
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
 	glGenerateMipmap(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
@@ -279,7 +1454,8 @@ void applyTextures() {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+	if (GLEW_EXT_texture_filter_anisotropic)
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
 	glGenerateMipmap(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
@@ -290,7 +1466,8 @@ void applyTextures() {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+	if (GLEW_EXT_texture_filter_anisotropic)
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
 	glGenerateMipmap(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
@@ -303,17 +1480,21 @@ void applyTextures() {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
+	// Ocean displacement and normal textures, updated every frame by render()
+	if (ocean_waves) {
+		water_data.ocean.Initialize(water_data.ocean_settings);
+		water_data.ocean.CreateTextures();
+	}
+
 	// Reflection texture
 	glGenFramebuffers(1, &(water_data.reflection_framebuffer));
 	glBindFramebuffer(GL_FRAMEBUFFER, water_data.reflection_framebuffer);
 
+	// Storage and filtering are set by resizeReflection
 	glGenTextures(1, &(water_data.reflection_tex));
 	glBindTexture(GL_TEXTURE_2D, water_data.reflection_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, WIN_WIDTH, WIN_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); //GL_MIRRORED_REPEAT
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 }
 
 void init()
@@ -328,10 +1509,16 @@ void init()
 
 	// Create geometries
 	createGeometries(position_loc, normal_loc, tex_coord_loc);
+	if (!streaming_world)
+		terrain_raycaster.Build(terrain_data.geometry.height);
 	
 	camera_input = CameraInput(&(terrain_data.geometry), 0.0f, 0.0f);
 	handle_input = InputHandler(&camera_input);
 
+	// Streamed world
+	if (streaming_world)
+		initStreaming(position_loc, normal_loc, tex_coord_loc);
+
 	// Create terrain program
 	initTerrain(position_loc, normal_loc, tex_coord_loc);
 
@@ -353,8 +1540,25 @@ void init()
 	// Tree locations buffer
 	randomGeneration();
 
+	if (use_pvs)
+		initVisibility();
+
+	// Chunks for the reflection cull list, the PVS already split the terrain
+	if (!streaming_world && !terrain_data.geometry.compact) {
+		if (terrain_visibility.Empty())
+			terrain_data.geometry.BuildChunks(16, 16);
+		reflection_culler.Build(terrain_data.geometry);
+	}
+
+	// Impostors
+	initImpostors(position_loc, normal_loc, tex_coord_loc);
+
+	initOcclusionCulling();
+
 	applyTextures();
 
+	initOcclusion();
+
 	initReflection();
 
 	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
@@ -363,9 +1567,14 @@ void init()
 #pragma endregion
 
 #pragma region render
-void renderTerrain() {
+// 'reflection' draws the cull list of the reflection pass
+void renderTerrain(bool reflection = false) {
+	bool compact = terrain_data.geometry.compact;
 
-	glUseProgram(terrain_data.program);
+	// The streamed tiles always use vertex buffers
+	compact = compact && !terrain_streamer;
+
+	glUseProgram(compact ? terrain_data.compact_program : terrain_data.program);
 
 	glBindVertexArray(terrain_data.geometry.VertexArrayObject);
 
@@ -381,19 +1590,79 @@ void renderTerrain() {
 	glm::mat4 model_matrix(1.0f);
 	model_matrix = glm::translate(model_matrix, glm::vec3(0.0f, -2.0f, 0.0f));
 	model_matrix = glm::scale(model_matrix, glm::vec3(100.0f, TERRAIN_HEIGHT, 100.0f));
-	glUniformMatrix4fv(terrain_data.model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+	glUniformMatrix4fv(compact ? terrain_data.compact_model_matrix_loc : terrain_data.model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
 
-	glUniform1i(terrain_data.grass_tex_loc, 0);
+	glUniform1i(compact ? terrain_data.compact_grass_tex_loc : terrain_data.grass_tex_loc, 0);
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, terrain_data.grass_tex);
 
-	glUniform1i(terrain_data.rocks_tex_loc, 1);
+	glUniform1i(compact ? terrain_data.compact_rocks_tex_loc : terrain_data.rocks_tex_loc, 1);
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, terrain_data.rocks_tex);
 
+	glUniform1i(compact ? terrain_data.compact_occlusion_tex_loc : terrain_data.occlusion_tex_loc, 4);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, terrain_data.occlusion_tex);
+
+	// The streamed tiles are not covered by the splat map
+	glUniform1i(compact ? terrain_data.compact_use_splat_map_loc : terrain_data.use_splat_map_loc,
+		use_splat_map && terrain_data.geometry.splat_tex != 0 && !terrain_streamer);
+	glUniform1i(compact ? terrain_data.compact_splat_tex_loc : terrain_data.splat_tex_loc, 6);
+	glActiveTexture(GL_TEXTURE6);
+	glBindTexture(GL_TEXTURE_2D, terrain_data.geometry.splat_tex);
+
+	glUniform1f(compact ? terrain_data.compact_macro_distance_loc : terrain_data.macro_distance_loc,
+		terrain_data.geometry.macro_tex != 0 ? macro_distance : 0.0f);
+	glUniform1f(compact ? terrain_data.compact_macro_step_loc : terrain_data.macro_step_loc, float(terrain_data.geometry.macro_step));
+	glUniform1i(compact ? terrain_data.compact_macro_tex_loc : terrain_data.macro_tex_loc, 7);
+	glActiveTexture(GL_TEXTURE7);
+	glBindTexture(GL_TEXTURE_2D, terrain_data.geometry.macro_tex);
+
+	if (!compact) {
+		// The streamed tiles are full meshes
+		glUniform1i(terrain_data.use_normal_map_loc, terrain_data.geometry.normal_map_tex != 0 && !terrain_streamer);
+		glUniform1i(terrain_data.normal_map_tex_loc, 5);
+		glActiveTexture(GL_TEXTURE5);
+		glBindTexture(GL_TEXTURE_2D, terrain_data.geometry.normal_map_tex);
+	}
+
+	if (terrain_streamer) {
+		glEnable(GL_PRIMITIVE_RESTART);
+		glPrimitiveRestartIndex(2643261405U);
+		for (const TerrainTile* tile : terrain_streamer->VisibleTiles()) {
+			glm::mat4 tile_matrix = TerrainStreamer::TileModelMatrix(tile->tx, tile->tz);
+			glUniformMatrix4fv(terrain_data.model_matrix_loc, 1, GL_FALSE, glm::value_ptr(tile_matrix));
+			glBindVertexArray(tile->geometry.VertexArrayObject);
+			Loader::DrawGeometry(tile->geometry);
+		}
+		glDisable(GL_PRIMITIVE_RESTART);
+		return;
+	}
+
+	if (compact) {
+		glUniform1i(terrain_data.height_tex_loc, 2);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, terrain_data.geometry.height_tex);
+
+		glUniform1i(terrain_data.normal_tex_loc, 3);
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, terrain_data.geometry.normal_tex);
+
+		// One instance per row strip
+		Loader::DrawGeometryInstanced(terrain_data.geometry, terrain_data.geometry.size_z - 1);
+		return;
+	}
+
 	glEnable(GL_PRIMITIVE_RESTART);
 	glPrimitiveRestartIndex(2643261405U);
-	Loader::DrawGeometry(terrain_data.geometry);
+	if (reflection && reflection_culling && !reflection_chunks.empty())
+		terrain_data.geometry.DrawChunks(reflection_chunks);
+	else if (!reflection && !main_chunks.empty())
+		terrain_data.geometry.DrawChunks(main_chunks);
+	else if (terrain_visibility.Empty())
+		Loader::DrawGeometry(terrain_data.geometry);
+	else
+		terrain_data.geometry.DrawChunks(pvs_visible);
 	glDisable(GL_PRIMITIVE_RESTART);
 }
 
@@ -413,9 +1682,11 @@ void renderLamp() {
 	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
 	glm::mat4 model_matrix(1.0f);
-	model_matrix = glm::translate(model_matrix, glm::vec3(-10.0f, terrain_data.geometry.height[103][103] * TERRAIN_HEIGHT - 2.0f, -10.0f));
+	model_matrix = glm::translate(model_matrix, glm::vec3(-10.0f, terrain_data.geometry.SampleHeight(-10.0f, -10.0f) * TERRAIN_HEIGHT - 2.0f, -10.0f));
 	model_matrix = glm::scale(model_matrix, glm::vec3(1.0f, 1.0f, 1.0f));
 	glUniformMatrix4fv(terrain_data.model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+	glUniform1i(terrain_data.use_normal_map_loc, 0);
+	glUniform1i(terrain_data.use_splat_map_loc, 0);
 
 	glUniform1i(terrain_data.grass_tex_loc, 0);
 	glActiveTexture(GL_TEXTURE0);
@@ -429,7 +1700,64 @@ void renderLamp() {
 
 }
 
-void renderNature() {
+// Draws the instances [first, first + count) of a buffer with the impostor program and returns to the vegetation program
+void drawImpostors(const InstanceBuffer& buffer, int first, int count, const Impostor& impostor, const InstanceCulling::Sphere& bounds, const glm::vec4& lod_fade) {
+	if (count <= 0)
+		return;
+	glUseProgram(nature_data.impostor_program);
+	glUniform4f(nature_data.impostor_bounds_loc, impostor.center.x, impostor.center.y, impostor.center.z, impostor.radius);
+	glUniform1f(nature_data.impostor_frames_loc, float(impostor.Frames()));
+	glUniform4fv(nature_data.impostor_lod_fade_loc, 1, glm::value_ptr(lod_fade));
+	glUniform4f(nature_data.impostor_lod_bounds_loc, bounds.center.x, bounds.center.y, bounds.center.z, bounds.radius);
+
+	glUniform1i(nature_data.impostor_albedo_tex_loc, 2);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, impostor.albedo_tex);
+	glUniform1i(nature_data.impostor_normal_depth_tex_loc, 3);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, impostor.normal_depth_tex);
+	glActiveTexture(GL_TEXTURE0);
+
+	buffer.DrawRange(impostor.quad, nature_data.impostor_packed_instances_loc, first, count, 0, impostor.quad.DrawArraysCount);
+	glUseProgram(nature_data.program);
+}
+
+// Draws a vegetation buffer LOD after LOD with the transitions cross-faded when the LOD selection filled it, else all
+// instances with the full mesh. The impostor draws the last LOD when it replaces it. Counts the triangles.
+void drawVegetation(const InstanceBuffer& buffer, const LodCounts& lod_counts, const Geometry& geometry, const MeshLods& lods,
+	const InstanceCulling::Sphere& bounds, float pixel_scale, const Impostor* impostor = nullptr) {
+	if (!lod_counts.selected) {
+		glUniform4f(nature_data.lod_fade_loc, 0.0f, 0.0f, 0.0f, 0.0f);
+		buffer.Draw(geometry, nature_data.packed_instances_loc);
+		nature_triangles += uint64_t(buffer.count) * geometry.DrawArraysCount / 3;
+		return;
+	}
+
+	const InstanceCulling::LodSettings& settings = lods.settings;
+	glUniform4f(nature_data.lod_bounds_loc, bounds.center.x, bounds.center.y, bounds.center.z, bounds.radius);
+	int first = 0;
+	for (int lod = 0; lod < settings.count; ++lod) {
+		float near_switch = lod > 0 ? settings.pixels[lod - 1] : 0.0f;
+		float far_switch = lod + 1 < settings.count ? settings.pixels[lod] : settings.cutoff_pixels;
+		if (lods.impostor && impostor && lod + 1 == settings.count) {
+			drawImpostors(buffer, first, lod_counts.count[lod], *impostor, bounds, glm::vec4(near_switch, far_switch, settings.band, pixel_scale));
+			nature_triangles += uint64_t(lod_counts.count[lod]) * 2;
+			break;
+		}
+		glUniform4f(nature_data.lod_fade_loc, near_switch, far_switch, settings.band, pixel_scale);
+		buffer.DrawRange(geometry, nature_data.packed_instances_loc, first, lod_counts.count[lod], lods.first[lod], lods.vertices[lod]);
+		nature_triangles += uint64_t(lod_counts.count[lod]) * lods.vertices[lod] / 3;
+		first += lod_counts.count[lod];
+	}
+}
+
+// 'reflection' draws the cull list of the reflection pass, without the grass
+void renderNature(bool reflection = false) {
+	bool culled = reflection && (reflection_culling || instance_culling) && !terrain_streamer;
+	// Survivors of the GPU culling of this pass
+	bool gpu_culled = gpu_culling && !terrain_streamer && (reflection ? culled : instance_culling);
+	int view = reflection ? 1 : 0;
+
 	glUseProgram(nature_data.program);
 
 	glEnable(GL_BLEND);
@@ -437,6 +1765,12 @@ void renderNature() {
 
 	glUniform1f(nature_data.app_time_loc, app_time);
 
+	// LODs are selected from the eye of the pass at its resolution, the streamed tiles and the GPU culling draw without cross-fade
+	float pixel_scale = pixelScale(reflection ? water_data.reflection_height : WIN_HEIGHT);
+	glm::vec3 lod_eye = reflection ? reflectionEye() : camera_input.GetEyePosition();
+	glUniform3fv(nature_data.lod_eye_loc, 1, glm::value_ptr(lod_eye));
+	glUniform4f(nature_data.lod_fade_loc, 0.0f, 0.0f, 0.0f, 0.0f);
+
 	material.ambient_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
 	material.diffuse_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
 	material.specular_color = glm::vec4(0.1f, 0.1f, 0.1f, 0.1f);
@@ -452,31 +1786,70 @@ void renderNature() {
 	model_matrix = glm::scale(model_matrix, glm::vec3(1.0f, 1.0f, 1.0f));
 	glUniformMatrix4fv(nature_data.model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
 
-	//Tree render
-	glBindVertexArray(nature_data.tree_geometry.VertexArrayObject);
+	// Per pass state of the impostors drawn among the LODs
+	if (nature_data.impostor_program != 0) {
+		glUseProgram(nature_data.impostor_program);
+		glUniformMatrix4fv(nature_data.impostor_model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+		glUniform3fv(nature_data.impostor_lod_eye_loc, 1, glm::value_ptr(lod_eye));
+		glUniform1i(nature_data.impostor_occlusion_tex_loc, 1);
+		glUseProgram(nature_data.program);
+	}
 
+	// Darkens the vegetation in valleys
+	glUniform1i(nature_data.occlusion_tex_loc, 1);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, terrain_data.occlusion_tex);
+
+	//Tree render
 	glUniform1f(nature_data.wind_height_loc, 20.0);
 
 	glUniform1i(nature_data.tex_loc, 0);
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, nature_data.tree_tex);
 
-	glBindBufferBase(GL_UNIFORM_BUFFER, 3, ubo.tree);
-
-	Loader::DrawGeometryInstanced(nature_data.tree_geometry, TREE_COUNT);
+	if (terrain_streamer) {
+		for (const TerrainTile* tile : terrain_streamer->VisibleTiles())
+			tile->trees.Draw(nature_data.tree_geometry, nature_data.packed_instances_loc);
+	}
+	else if (gpu_culled)
+		gpu_culler.Draw(view, GPU_TREE_LAYER, nature_data.tree_geometry, nature_data.packed_instances_loc);
+	else if (culled)
+		drawVegetation(nature_data.reflection_tree_buffer, nature_data.reflection_tree_lod_counts, nature_data.tree_geometry, nature_data.tree_lods, TREE_BOUNDS,
+			pixel_scale, &nature_data.tree_impostor);
+	else
+		drawVegetation(nature_data.tree_buffer, nature_data.tree_lod_counts, nature_data.tree_geometry, nature_data.tree_lods, TREE_BOUNDS, pixel_scale,
+			&nature_data.tree_impostor);
 
 	//Bush render
-	glBindVertexArray(nature_data.bush_geometry.VertexArrayObject);
-
 	glUniform1f(nature_data.wind_height_loc, 5.0);
 
 	glUniform1i(nature_data.tex_loc, 0);
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, nature_data.bush_tex);
 
-	glBindBufferBase(GL_UNIFORM_BUFFER, 3, ubo.bush);
+	if (terrain_streamer) {
+		for (const TerrainTile* tile : terrain_streamer->VisibleTiles())
+			tile->bushes.Draw(nature_data.bush_geometry, nature_data.packed_instances_loc);
 
-	Loader::DrawGeometryInstanced(nature_data.bush_geometry, BUSH_COUNT);
+		// Grass is only placed on the single terrain
+		glDisable(GL_BLEND);
+		return;
+	}
+
+	if (gpu_culled)
+		gpu_culler.Draw(view, GPU_BUSH_LAYER, nature_data.bush_geometry, nature_data.packed_instances_loc);
+	else if (culled)
+		drawVegetation(nature_data.reflection_bush_buffer, nature_data.reflection_bush_lod_counts, nature_data.bush_geometry, nature_data.bush_lods, BUSH_BOUNDS,
+			pixel_scale, &nature_data.bush_impostor);
+	else
+		drawVegetation(nature_data.bush_buffer, nature_data.bush_lod_counts, nature_data.bush_geometry, nature_data.bush_lods, BUSH_BOUNDS, pixel_scale,
+			&nature_data.bush_impostor);
+
+	// Grass is too small to matter in the reflection
+	if (culled) {
+		glDisable(GL_BLEND);
+		return;
+	}
 
 	//Grass render
 	glUniform1f(nature_data.wind_height_loc, 2.5);
@@ -486,24 +1859,54 @@ void renderNature() {
 	glBindTexture(GL_TEXTURE_2D, nature_data.long_grass_tex);
 
 	for (int i = 0; i < 12; ++i) {
-		glBindVertexArray(nature_data.long_grass_geometry[i].VertexArrayObject);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 3, ubo.long_grass[i]);
-		Loader::DrawGeometryInstanced(nature_data.long_grass_geometry[i], GRASS_COUNT);
+		if (gpu_culled)
+			gpu_culler.Draw(view, GPU_GRASS_LAYER + i, nature_data.long_grass_geometry[i], nature_data.packed_instances_loc);
+		else
+			drawVegetation(nature_data.long_grass_buffer[i], nature_data.long_grass_lod_counts[i], nature_data.long_grass_geometry[i], nature_data.long_grass_lods[i],
+				GRASS_BOUNDS, pixel_scale);
 	}
 
 	glDisable(GL_BLEND);
 }
 
+// Water rectangle: the single terrain, or the streamed area around the camera tile
+void waterArea(glm::vec3& center, float& extent) {
+	center = glm::vec3(0.0f);
+	extent = 100.0f;
+	if (terrain_streamer) {
+		// Follow the camera tile and cover the streamed area
+		float tile_size = TerrainStreamer::TileWorldSize();
+		glm::vec3 eye = camera_input.GetEyePosition();
+		center = glm::vec3(floorf((eye.x + 50.0f) / tile_size) * tile_size - 50.0f + tile_size * 0.5f, 0.0f,
+			floorf((eye.z + 50.0f) / tile_size) * tile_size - 50.0f + tile_size * 0.5f);
+		extent = tile_size * 7.0f;
+	}
+}
+
+// Flags the water tiles in view for renderWater, returns false when no water is in view
+bool cullWater(const Frustum& frustum) {
+	// The streamed world has no mask and moves the grid with the camera, it is drawn whole
+	if (terrain_streamer) {
+		glm::vec3 center;
+		float extent;
+		waterArea(center, extent);
+		water_data.visible.assign(water_data.surface.TileCount(), 1);
+		glm::vec3 half(extent * 0.5f, water_data.settings.margin, extent * 0.5f);
+		center.y = water_data.settings.level;
+		return frustum.IntersectsBox(center - half, center + half);
+	}
+	water_data.surface.Cull(frustum, water_data.visible);
+	return std::find(water_data.visible.begin(), water_data.visible.end(), 1) != water_data.visible.end();
+}
+
 void renderWater() {
 	glm::mat4 model_matrix;
 
-	glUseProgram(water_data.program);
+	glUseProgram(projected_water ? water_data.projected_program : water_data.program);
 
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	glBindVertexArray(water_data.geometry.VertexArrayObject);
-
 	material.ambient_color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
 	material.diffuse_color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
 	material.specular_color = glm::vec4(8.0f, 8.0f, 8.0f, 1.0f);
@@ -513,22 +1916,65 @@ void renderWater() {
 	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Material), &material);
 	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-	model_matrix = glm::scale(glm::mat4(1.0f), glm::vec3(100.0f, 0.2f, 100.0f));
-	glUniformMatrix4fv(water_data.model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+	glm::vec3 center;
+	float extent;
+	waterArea(center, extent);
 
-	glUniform1f(water_data.app_time_loc, app_time * 0.02f);
+	glUniform1f(projected_water ? water_data.projected_app_time_loc : water_data.app_time_loc, app_time * 0.02f);
 
-	glUniform1i(water_data.normal_tex_loc, 0);
+	glUniform1i(projected_water ? water_data.projected_normal_tex_loc : water_data.normal_tex_loc, 0);
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, water_data.normal_tex);
 
-	glUniform1i(water_data.reflection_tex_loc, 1);
+	glUniform1i(projected_water ? water_data.projected_reflection_tex_loc : water_data.reflection_tex_loc, 1);
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, water_data.reflection_tex);
+	glUniformMatrix4fv(projected_water ? water_data.projected_reflection_view_projection_loc : water_data.reflection_view_projection_loc,
+		1, GL_FALSE, glm::value_ptr(water_data.reflection_view_projection));
+
+	glUniform1i(projected_water ? water_data.projected_use_ocean_loc : water_data.use_ocean_loc, ocean_waves);
+	if (ocean_waves) {
+		const OceanWaves::Settings& ocean = water_data.ocean.GetSettings();
+		glUniform1f(projected_water ? water_data.projected_ocean_patch_loc : water_data.ocean_patch_loc, ocean.patch_size);
 
+		glUniform1i(projected_water ? water_data.projected_ocean_displacement_tex_loc : water_data.ocean_displacement_tex_loc, 2);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, water_data.ocean.displacement_tex);
+
+		glUniform1i(projected_water ? water_data.projected_ocean_normal_tex_loc : water_data.ocean_normal_tex_loc, 3);
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, water_data.ocean.normal_tex);
+	}
+
+	if (projected_water) {
+		const ProjectedWater::Settings& settings = water_data.projected_settings;
+		glm::mat4 inverse_view_projection = glm::inverse(camera.projection_matrix * camera.view_matrix);
+		glUniformMatrix4fv(water_data.inverse_view_projection_loc, 1, GL_FALSE, glm::value_ptr(inverse_view_projection));
+		glUniform2i(water_data.grid_size_loc, settings.columns, settings.rows);
+		glUniform1f(water_data.overscan_loc, settings.overscan);
+		glUniform1f(water_data.horizon_loc, settings.horizon);
+		glUniform1f(water_data.water_level_loc, water_data.settings.level);
+		glUniform4f(water_data.water_bounds_loc, center.x - extent * 0.5f, center.z - extent * 0.5f, center.x + extent * 0.5f, center.z + extent * 0.5f);
+
+		glBindVertexArray(water_data.projected_grid.VertexArrayObject);
+		Loader::DrawGeometryInstanced(water_data.projected_grid, settings.rows - 1);
+		glDisable(GL_BLEND);
+		return;
+	}
+
+	model_matrix = glm::translate(glm::mat4(1.0f), center) * glm::scale(glm::mat4(1.0f), glm::vec3(extent, 0.2f, extent));
+	glUniformMatrix4fv(water_data.model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+	if (ocean_waves) {
+		// Mip level of the ocean texels under one cell of the 200x200 grid
+		const OceanWaves::Settings& ocean = water_data.ocean.GetSettings();
+		glUniform1f(water_data.ocean_lod_loc, std::max(log2f((extent / 200.0f) / (ocean.patch_size / ocean.resolution)), 0.0f));
+	}
+
+	// Tiles flagged by cullWater
+	glBindVertexArray(water_data.surface.geometry.VertexArrayObject);
 	glEnable(GL_PRIMITIVE_RESTART);
 	glPrimitiveRestartIndex(2643261405U);
-	Loader::DrawGeometry(water_data.geometry);
+	water_data.surface.Draw(water_data.visible);
 	glDisable(GL_PRIMITIVE_RESTART);
 
 	glDisable(GL_BLEND);
@@ -544,7 +1990,7 @@ void setLightPosition(float day_time) {
 	lights[0].ambient_color = glm::vec4(0.4f, 0.4f, 0.4f, 1.0f) * day_time;
 	lights[0].size = glm::vec4(10000.0f, 10000.0f, 10000.0f, 1.0f);
 
-	lights[1].position = glm::vec4(-10.0f, terrain_data.geometry.height[103][103] * TERRAIN_HEIGHT, -10.0f, 1.0f);
+	lights[1].position = glm::vec4(-10.0f, terrain_data.geometry.SampleHeight(-10.0f, -10.0f) * TERRAIN_HEIGHT, -10.0f, 1.0f);
 	lights[1].diffuse_color = glm::vec4(3 * 1.00f, 3 * 0.98f, 3 * 0.56f, 1.0f) * (1 - day_time);
 	lights[1].ambient_color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f) * (1 - day_time);
 	lights[1].size = glm::vec4(20.0f, 20.0f, 20.0f, 1.0f);
@@ -561,7 +2007,7 @@ void setCameraPosition(bool isReflection) {
 	camera.eye_position = camera_input.GetEyePosition();
 
 	if (isReflection) {
-		camera.view_matrix = glm::scale(camera.view_matrix, glm::vec3(1.0, -1.0, 1.0));
+		camera.view_matrix = camera.view_matrix * ReflectionCulling::Mirror(water_data.settings.level);
 	}
 
 	glBindBuffer(GL_UNIFORM_BUFFER, ubo.camera);
@@ -572,6 +2018,226 @@ void setCameraPosition(bool isReflection) {
 // Called when the window needs to be rerendered
 void render()
 {
+	if (benchmark_flythrough) {
+		auto now = std::chrono::steady_clock::now();
+		if (benchmark_frames.Count() > 0 || benchmark_path.Progress() > 0.0f)
+			benchmark_frames.Add(std::chrono::duration<double, std::milli>(now - benchmark_last_frame).count());
+		benchmark_last_frame = now;
+
+		glm::vec3 eye, target;
+		if (!benchmark_path.Step(eye, target)) {
+			const TerrainStreamer::Stats& stats = terrain_streamer->GetStats();
+			benchmark_frames.Report("Fly-through");
+			std::cout << "Residency: " << stats.loaded << " tiles loaded, " << stats.evicted << " evicted, "
+				<< stats.reloaded << " reloaded after eviction, " << stats.discarded << " discarded before upload, "
+				<< stats.resident << " resident (" << stats.bytes / (1024 * 1024) << " MiB)" << std::endl;
+			glutLeaveMainLoop();
+			return;
+		}
+		eye.y = terrain_streamer->GetHeight(eye.x, eye.z, TERRAIN_HEIGHT * 0.5f) + 2.0f;
+		target.y += eye.y;
+		camera_input.SetPose(eye, target);
+	}
+
+	if (benchmark_splat) {
+		glm::vec3 eye, target;
+		if (!splat_path.Step(eye, target)) {
+			terrain_timer.Collect(terrain_gpu_frames[terrain_benchmark_run], true);
+			if (terrain_benchmark_run == 1) {
+				terrain_gpu_frames[0].Report("Terrain pass GPU time, slope test");
+				terrain_gpu_frames[1].Report("Terrain pass GPU time, splat map");
+				glutLeaveMainLoop();
+				return;
+			}
+			// Second run over the same views
+			terrain_benchmark_run = 1;
+			use_splat_map = true;
+			splat_path = CameraPath::TerrainLoop();
+			splat_path.Step(eye, target);
+		}
+		// Eye height of the walking camera
+		eye.y = terrain_data.geometry.SampleHeight(eye.x, eye.z) * TERRAIN_HEIGHT;
+		target.y += eye.y;
+		camera_input.SetPose(eye, target);
+	}
+
+	if (benchmark_macro) {
+		if (macro_benchmark_frame == MACRO_BENCHMARK_FRAMES * (terrain_benchmark_run + 1)) {
+			terrain_timer.Collect(terrain_gpu_frames[terrain_benchmark_run], true);
+			if (terrain_benchmark_run == 1) {
+				terrain_gpu_frames[0].Report("Terrain pass GPU time, detail textures only");
+				std::ostringstream name;
+				name << "Terrain pass GPU time, macro map beyond " << macro_distance << " units";
+				terrain_gpu_frames[1].Report(name.str());
+				glutLeaveMainLoop();
+				return;
+			}
+			terrain_benchmark_run = 1;
+			macro_distance = macro_benchmark_distance;
+		}
+		macro_benchmark_frame++;
+		// From above one corner across the whole map to the opposite one
+		glm::vec3 eye(-48.0f, 0.0f, -48.0f);
+		eye.y = terrain_data.geometry.SampleHeight(eye.x, eye.z) * TERRAIN_HEIGHT + 4.0f;
+		camera_input.SetPose(eye, glm::vec3(48.0f, eye.y - 6.0f, 48.0f));
+	}
+
+	if (benchmark_water_lod) {
+		// Both runs step through the views, the first frame of every view is not timed
+		int slot = water_lod_frame / WATER_LOD_FRAMES;
+		auto now = std::chrono::steady_clock::now();
+		if (water_lod_frame % WATER_LOD_FRAMES != 0)
+			water_cpu_frames[slot / WATER_LOD_VIEWS][slot % WATER_LOD_VIEWS].Add(std::chrono::duration<double, std::milli>(now - water_lod_last_frame).count());
+		water_lod_last_frame = now;
+
+		if (water_lod_frame % WATER_LOD_FRAMES == 0 && slot > 0)
+			water_timer.Collect(water_gpu_frames[(slot - 1) / WATER_LOD_VIEWS][(slot - 1) % WATER_LOD_VIEWS], true);
+		if (slot == 2 * WATER_LOD_VIEWS) {
+			reportWaterLod();
+			glutLeaveMainLoop();
+			return;
+		}
+		water_lod_frame++;
+
+		projected_water = slot >= WATER_LOD_VIEWS;
+		glm::vec3 eye, target;
+		waterLodPose(slot % WATER_LOD_VIEWS, eye, target);
+		camera_input.SetPose(eye, target);
+	}
+
+	if (benchmark_reflection) {
+		// The first frame of every setup is not timed
+		auto now = std::chrono::steady_clock::now();
+		if (reflection_benchmark_frame > 0)
+			reflection_cpu_frames.Add(std::chrono::duration<double, std::milli>(now - reflection_last_frame).count());
+		reflection_last_frame = now;
+
+		glm::vec3 eye, target;
+		if (!reflection_path.Step(eye, target)) {
+			reflection_timer.Collect(reflection_gpu_frames, true);
+			const ReflectionSetup& setup = REFLECTION_SETUPS[reflection_setup];
+			std::cout << "Reflection " << setup.name << ": rendered in " << reflection_gpu_frames.Count() << " of "
+				<< reflection_benchmark_frame << " frames" << std::endl;
+			reflection_cpu_frames.Report("  frame time");
+			reflection_gpu_frames.Report("  reflection pass GPU time");
+			if (++reflection_setup == REFLECTION_SETUP_COUNT) {
+				glutLeaveMainLoop();
+				return;
+			}
+			const ReflectionSetup& next = REFLECTION_SETUPS[reflection_setup];
+			reflection_scale = next.scale;
+			reflection_interval = next.interval;
+			reflection_culling = next.culling;
+			resizeReflection();
+			reflection_cpu_frames.Clear();
+			reflection_gpu_frames.Clear();
+			reflection_benchmark_frame = 0;
+			reflection_path = CameraPath::TerrainLoop();
+			reflection_path.Step(eye, target);
+		}
+		reflection_benchmark_frame++;
+		// Eye height of the walking camera
+		eye.y = terrain_data.geometry.SampleHeight(eye.x, eye.z) * TERRAIN_HEIGHT;
+		target.y += eye.y;
+		camera_input.SetPose(eye, target);
+	}
+
+	if (benchmark_instances) {
+		// Every count is placed on the first frame of its run, the frame after the placement is not timed
+		int step = instance_benchmark_frame / INSTANCE_BENCHMARK_FRAMES;
+		int frame = instance_benchmark_frame % INSTANCE_BENCHMARK_FRAMES;
+		auto now = std::chrono::steady_clock::now();
+		if (frame > 1)
+			nature_cpu_frames.Add(std::chrono::duration<double, std::milli>(now - instance_last_frame).count());
+		instance_last_frame = now;
+
+		if (frame == 0) {
+			if (step > 0) {
+				nature_timer.Collect(nature_gpu_frames, true);
+				nature_cpu_frames.Report("  frame time");
+				nature_gpu_frames.Report("  vegetation pass GPU time");
+				if (nature_cull_frames.Count() > 0)
+					nature_cull_frames.Report("  main pass culling CPU time");
+				cull_timer.Collect(nature_gpu_cull_frames, true);
+				if (nature_gpu_cull_frames.Count() > 0)
+					nature_gpu_cull_frames.Report("  main pass culling GPU time");
+				// Unknown with the GPU culling (no readback of the draw commands)
+				if (!INSTANCE_SETUPS[step - 1].gpu && nature_triangle_frames > 0)
+					std::cout << "  vegetation triangles per frame: " << nature_triangle_sum / nature_triangle_frames << std::endl;
+				nature_triangle_sum = 0;
+				nature_triangle_frames = 0;
+				nature_cpu_frames.Clear();
+				nature_gpu_frames.Clear();
+				nature_cull_frames.Clear();
+				nature_gpu_cull_frames.Clear();
+			}
+			while (step < INSTANCE_SETUP_COUNT && INSTANCE_SETUPS[step].gpu && !gpu_culler.Ready()) {
+				std::cout << "Instances " << INSTANCE_SETUPS[step].name << ": skipped, needs -gpu-culling" << std::endl;
+				instance_benchmark_frame += INSTANCE_BENCHMARK_FRAMES;
+				++step;
+			}
+			if (step == INSTANCE_SETUP_COUNT) {
+				glutLeaveMainLoop();
+				return;
+			}
+			placeBenchmarkInstances(INSTANCE_SETUPS[step]);
+		}
+		instance_benchmark_frame++;
+		// From above one corner across the whole map
+		glm::vec3 eye(-48.0f, 0.0f, -48.0f);
+		eye.y = terrain_data.geometry.SampleHeight(eye.x, eye.z) * TERRAIN_HEIGHT + 8.0f;
+		camera_input.SetPose(eye, glm::vec3(0.0f, eye.y - 10.0f, 0.0f));
+	}
+
+	if (benchmark_occlusion) {
+		// Both runs look from the same pose, the frame after the switch is not timed
+		int run = occlusion_benchmark_frame / OCCLUSION_BENCHMARK_FRAMES;
+		int frame = occlusion_benchmark_frame % OCCLUSION_BENCHMARK_FRAMES;
+		auto now = std::chrono::steady_clock::now();
+		if (frame > OCCLUSION_WARMUP_FRAMES + 1)
+			occlusion_cpu_frames[run].Add(std::chrono::duration<double, std::milli>(now - occlusion_last_frame).count());
+		occlusion_last_frame = now;
+
+		if (frame == 0 && run > 0)
+			main_pass_timer.Collect(occlusion_gpu_frames[run - 1], true);
+		if (run == 2 || !depth_pyramid.Ready()) {
+			reportOcclusion();
+			glutLeaveMainLoop();
+			return;
+		}
+		occlusion_benchmark_frame++;
+		occlusion_culling = run == 1;
+		camera_input.SetPose(valley_eye, valley_target);
+	}
+
+	if (terrain_streamer)
+		terrain_streamer->Update(camera_input.GetEyePosition());
+
+	if (ocean_waves)
+		water_data.ocean.Update(app_time);
+
+	// Terrain editing, the held brush deforms the ground where the view direction (the screen center) hits it
+	if (handle_input.brush_active && !terrain_streamer) {
+		glm::vec3 eye = camera_input.GetEyePosition();
+		RayHit hit = terrain_raycaster.Raycast(eye, camera_input.GetViewOrientation() - eye, 100.0f);
+		if (hit.hit) {
+			bool additive = handle_input.brush == Terrain::Brush::Raise || handle_input.brush == Terrain::Brush::Lower;
+			Terrain::Region region = terrain_data.geometry.ApplyBrush(handle_input.brush, hit.position.x, hit.position.z, 4.0f, additive ? 0.002f : 0.2f);
+			terrain_raycaster.UpdateRegion(terrain_data.geometry.height, region);
+			occlusion_rasterizer.UpdateRegion(terrain_data.geometry.height, region);
+			water_data.surface.UpdateMask(terrain_data.geometry.height, region);
+			updateOcclusion(region);
+			invalidateVisibility();
+			reseatInstances(region);
+			if (!reflection_culler.Empty())
+				reflection_culler.Build(terrain_data.geometry);
+		}
+	}
+
+	// Hidden terrain chunks and vegetation, the reflection pass uses the same selection
+	if (!terrain_visibility.Empty())
+		updateVisibility(camera_input.GetEyePosition());
+
 	float day_time = 1 - pow(sin(app_time / 120.0f), 4.0f);
 
 	glClearColor(0.66f * day_time, 0.76f * day_time, 0.90f * day_time, 1.0f);
@@ -583,26 +2249,47 @@ void render()
 
 	setLightPosition(day_time);
 
-	// Reflection rendering
-	glBindFramebuffer(GL_FRAMEBUFFER, water_data.reflection_framebuffer);
-	glViewport(0, 0, WIN_WIDTH, WIN_HEIGHT);
-
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	glEnable(GL_CLIP_DISTANCE0);
-
-	setCameraPosition(true);
+	nature_triangles = 0;
 
-	// Geometries
-	renderTerrain();
-	renderLamp();
-	renderNature();
-
-	glDisable(GL_CLIP_DISTANCE0);
-
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glViewport(0, 0, WIN_WIDTH, WIN_HEIGHT);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	setCameraPosition(false);
+	bool water_visible = cullWater(Frustum(camera.projection_matrix * camera.view_matrix));
+	if (!water_visible)
+		reflection_valid = false;
+
+	// Reflection rendering, skipped while the water is hidden. Between the updates the water shaders reproject
+	// the last reflection through its own camera.
+	if (water_visible && (!reflection_valid || ++reflection_age >= reflection_interval)) {
+		reflection_age = 0;
+		reflection_valid = true;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, water_data.reflection_framebuffer);
+		glViewport(0, 0, water_data.reflection_width, water_data.reflection_height);
+
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		glEnable(GL_CLIP_DISTANCE0);
+
+		setCameraPosition(true);
+		water_data.reflection_view_projection = camera.projection_matrix * camera.view_matrix;
+		cullReflection(Frustum(water_data.reflection_view_projection));
+
+		// Geometries
+		if (benchmark_reflection)
+			reflection_timer.Begin();
+		renderTerrain(true);
+		renderLamp();
+		renderNature(true);
+		if (benchmark_reflection) {
+			reflection_timer.End();
+			reflection_timer.Collect(reflection_gpu_frames);
+		}
+
+		glDisable(GL_CLIP_DISTANCE0);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, WIN_WIDTH, WIN_HEIGHT);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	}
 
 	/*
 		Main rendering
@@ -610,11 +2297,100 @@ void render()
 
 	setCameraPosition(false);
 
+	// The newest readback of the depth pyramid, grown by the camera movement since, or the software rasterized
+	// terrain of this frame hides terrain chunks now and vegetation on the CPU after the terrain is drawn
+	hiz_map = nullptr;
+	occluded_instances = 0;
+	if (occlusion_culling && !terrain_streamer) {
+		if (software_occlusion) {
+			hiz_map = &occlusion_rasterizer.Rasterize(camera.projection_matrix * camera.view_matrix, camera_input.GetEyePosition());
+		}
+		else {
+			hiz_map = depth_pyramid.Readback();
+			if (hiz_map)
+				hiz_map->margin = glm::distance(camera_input.GetEyePosition(), hiz_map->eye);
+		}
+	}
+	occludeChunks();
+
+	// Main pass of the occlusion benchmark, the first frames of a run are not timed
+	bool timed_main = benchmark_occlusion && (occlusion_benchmark_frame - 1) % OCCLUSION_BENCHMARK_FRAMES > OCCLUSION_WARMUP_FRAMES;
+	if (timed_main)
+		main_pass_timer.Begin();
+
 	// Geometries
+	bool timed = benchmark_splat || benchmark_macro;
+	if (timed)
+		terrain_timer.Begin();
 	renderTerrain();
+	if (timed) {
+		terrain_timer.End();
+		terrain_timer.Collect(terrain_gpu_frames[terrain_benchmark_run]);
+	}
 	renderLamp();
+
+	// Depth pyramid of the terrain for the vegetation
+	if (occlusion_culling && !terrain_streamer && (!software_occlusion || gpu_culling))
+		depth_pyramid.Build(camera.projection_matrix * camera.view_matrix, camera_input.GetEyePosition());
+	if (instance_culling && !terrain_streamer) {
+		bool timed_gpu = benchmark_instances && gpu_culling;
+		if (timed_gpu)
+			cull_timer.Begin();
+		auto start = std::chrono::steady_clock::now();
+		cullNature(Frustum(camera.projection_matrix * camera.view_matrix));
+		if (benchmark_instances)
+			nature_cull_frames.Add(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		if (timed_gpu) {
+			cull_timer.End();
+			cull_timer.Collect(nature_gpu_cull_frames);
+		}
+	}
+	if (benchmark_instances)
+		nature_timer.Begin();
 	renderNature();
-	renderWater();
+	if (benchmark_instances) {
+		nature_timer.End();
+		// The first frame of a count is not timed
+		if (instance_benchmark_frame % INSTANCE_BENCHMARK_FRAMES != 1) {
+			nature_timer.Collect(nature_gpu_frames);
+			nature_triangle_sum += nature_triangles;
+			nature_triangle_frames++;
+		}
+		else {
+			FrameStats placement;
+			nature_timer.Collect(placement, true);
+		}
+	}
+	if (benchmark_occlusion) {
+		int run = (occlusion_benchmark_frame - 1) / OCCLUSION_BENCHMARK_FRAMES;
+		int frame = (occlusion_benchmark_frame - 1) % OCCLUSION_BENCHMARK_FRAMES;
+		if (timed_main) {
+			main_pass_timer.End();
+			main_pass_timer.Collect(occlusion_gpu_frames[run]);
+			occluded_chunk_sum[run] += occluded_chunks;
+			occluded_instance_sum[run] += occluded_instances;
+			occlusion_triangle_sum[run] += nature_triangles;
+			occlusion_counted_frames[run]++;
+		}
+		// Counted once per run on the GPU path, the readback waits for the GPU
+		if (frame == OCCLUSION_BENCHMARK_FRAMES - 1 && gpu_culling) {
+			for (int layer = 0; layer < GPU_GRASS_LAYER + 12; ++layer) {
+				int visible = 0, hidden = 0;
+				gpu_culler.ReadCounts(0, layer, visible, hidden);
+				occlusion_gpu_visible[run] += visible;
+				occlusion_gpu_hidden[run] += hidden;
+			}
+		}
+	}
+	if (benchmark_water_lod) {
+		int slot = (water_lod_frame - 1) / WATER_LOD_FRAMES;
+		water_timer.Begin();
+		renderWater();
+		water_timer.End();
+		water_timer.Collect(water_gpu_frames[slot / WATER_LOD_VIEWS][slot % WATER_LOD_VIEWS]);
+	}
+	else if (water_visible)
+		renderWater();
 
 	glBindVertexArray(0);
 	glUseProgram(0);
@@ -653,10 +2429,261 @@ int main(int argc, char** argv)
 
 	// Initialize GLUT
 	glutInit(&argc, argv);
+
+	// Application options (GLUT already removed its own arguments)
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-compact-terrain")
+			compact_terrain = true;
+		else if (arg == "-streaming")
+			streaming_world = true;
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "flythrough") {
+			++i;
+			streaming_world = true;
+			benchmark_flythrough = true;
+			benchmark_path = CameraPath::FlyThrough();
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "noise") {
+			++i;
+			benchmark_noise = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "brush") {
+			++i;
+			benchmark_brush = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "raycast") {
+			++i;
+			benchmark_raycast = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "pvs") {
+			++i;
+			benchmark_pvs = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "ao") {
+			++i;
+			benchmark_ao = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "normalmap") {
+			++i;
+			benchmark_normal_map = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "splat") {
+			++i;
+			benchmark_splat = true;
+			use_splat_map = false;
+			splat_path = CameraPath::TerrainLoop();
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "macro") {
+			++i;
+			benchmark_macro = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "water") {
+			++i;
+			benchmark_water = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "waterlod") {
+			++i;
+			benchmark_water_lod = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "fft") {
+			++i;
+			benchmark_fft = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "reflection") {
+			++i;
+			benchmark_reflection = true;
+			reflection_path = CameraPath::TerrainLoop();
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "instances") {
+			++i;
+			benchmark_instances = true;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "occlusion") {
+			++i;
+			benchmark_occlusion = true;
+		}
+		else if (arg == "-vegetation-seed" && i + 1 < argc)
+			vegetation_seed = static_cast<uint32_t>(std::stoul(argv[++i]));
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "placement") {
+			++i;
+			benchmark_placement = true;
+		}
+		else if (arg == "-trees" && i + 1 < argc)
+			nature_data.tree_count = std::max(std::stoi(argv[++i]), 0);
+		else if (arg == "-bushes" && i + 1 < argc)
+			nature_data.bush_count = std::max(std::stoi(argv[++i]), 0);
+		else if (arg == "-grass" && i + 1 < argc)
+			nature_data.grass_count = std::max(std::stoi(argv[++i]), 0);
+		else if (arg == "-no-instance-cull")
+			instance_culling = false;
+		else if (arg == "-gpu-culling")
+			gpu_culling = true;
+		else if (arg == "-no-occlusion-cull")
+			occlusion_culling = false;
+		else if (arg == "-software-occlusion")
+			software_occlusion = true;
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "raster") {
+			++i;
+			benchmark_raster = true;
+		}
+		else if (arg == "-check" && i + 1 < argc && std::string(argv[i + 1]) == "raster") {
+			++i;
+			check_raster = true;
+		}
+		else if (arg == "-no-lod")
+			vegetation_lods = false;
+		else if (arg == "-grass-cutoff" && i + 1 < argc)
+			grass_cutoff = std::max(std::stof(argv[++i]), 0.0f);
+		else if (arg == "-no-impostors")
+			use_impostors = false;
+		else if (arg == "-cook-impostors") {
+			// Bake the impostor atlases and exit, the bake needs no GL context
+			ilInit();
+			return cookImpostors() ? 0 : 1;
+		}
+		else if (arg == "-benchmark" && i + 1 < argc && std::string(argv[i + 1]) == "cull") {
+			++i;
+			benchmark_cull = true;
+		}
+		else if (arg == "-matrix-instances")
+			instance_format = InstanceBuffer::Format::Matrix;
+		else if (arg == "-reflection-scale" && i + 1 < argc)
+			reflection_scale = std::min(std::max(std::stof(argv[++i]), 0.1f), 1.0f);
+		else if (arg == "-reflection-interval" && i + 1 < argc)
+			reflection_interval = std::max(std::stoi(argv[++i]), 1);
+		else if (arg == "-reflection-no-cull")
+			reflection_culling = false;
+		else if (arg == "-tiled-water")
+			projected_water = false;
+		else if (arg == "-static-water")
+			ocean_waves = false;
+		else if (arg == "-ocean-resolution" && i + 1 < argc)
+			water_data.ocean_settings.resolution = std::stoi(argv[++i]);
+		else if (arg == "-ocean-rate" && i + 1 < argc)
+			water_data.ocean_settings.update_rate = std::max(std::stof(argv[++i]), 0.0f);
+		else if (arg == "-no-splat")
+			use_splat_map = false;
+		else if (arg == "-macro-distance" && i + 1 < argc)
+			macro_distance = std::max(std::stof(argv[++i]), 0.0f);
+		else if (arg == "-mesh-step" && i + 1 < argc)
+			mesh_step = std::max(std::stoi(argv[++i]), 1);
+		else if (arg == "-pvs" && i + 1 < argc) {
+			use_pvs = true;
+			std::string file = argv[++i];
+			pvs_file = std::basic_string<maybewchar>(file.begin(), file.end());
+		}
+		else if (arg == "-procedural" && i + 1 < argc) {
+			procedural_terrain = true;
+			procedural_settings.seed = static_cast<uint32_t>(std::stoul(argv[++i]));
+		}
+		else if (arg == "-procedural-size" && i + 1 < argc)
+			procedural_size = std::max(std::stoi(argv[++i]), 2);
+		else if (arg == "-heightmap" && i + 1 < argc) {
+			std::string file = argv[++i];
+			heightmap_file = std::basic_string<maybewchar>(file.begin(), file.end());
+		}
+		else if (arg == "-cook-heightmap" && i + 1 < argc) {
+			// Convert the heightmap into a tiled .hft file and exit
+			std::string file = argv[++i];
+			ilInit();
+			bool cooked = Terrain::CookHeightmap(heightmap_file.c_str(), std::basic_string<maybewchar>(file.begin(), file.end()).c_str());
+			std::cout << (cooked ? "Cooked heightmap to " : "Failed to cook heightmap to ") << file << std::endl;
+			return cooked ? 0 : 1;
+		}
+	}
+	if ((benchmark_splat || benchmark_macro) && streaming_world) {
+		std::cout << "The splat and macro benchmarks render the single terrain, they cannot be combined with -streaming" << std::endl;
+		return 1;
+	}
+	if (benchmark_reflection) {
+		if (streaming_world) {
+			std::cout << "The reflection benchmark renders the single terrain, it cannot be combined with -streaming" << std::endl;
+			return 1;
+		}
+		reflection_scale = REFLECTION_SETUPS[0].scale;
+		reflection_interval = REFLECTION_SETUPS[0].interval;
+		reflection_culling = REFLECTION_SETUPS[0].culling;
+	}
+	if (benchmark_instances && streaming_world) {
+		std::cout << "The instance benchmark renders the single terrain, it cannot be combined with -streaming" << std::endl;
+		return 1;
+	}
+	if (benchmark_occlusion && (streaming_world || !occlusion_culling)) {
+		std::cout << "The occlusion benchmark renders the single terrain with and without occlusion culling, it cannot be combined with -streaming or -no-occlusion-cull" << std::endl;
+		return 1;
+	}
+	if (benchmark_water_lod && streaming_world) {
+		std::cout << "The water LOD benchmark renders the single terrain, it cannot be combined with -streaming" << std::endl;
+		return 1;
+	}
+	if (benchmark_splat && benchmark_macro) {
+		std::cout << "Run the splat and macro benchmarks separately" << std::endl;
+		return 1;
+	}
+	if (benchmark_macro) {
+		// First run without the macro map, the second one at the requested distance
+		macro_benchmark_distance = macro_distance > 0.0f ? macro_distance : 35.0f;
+		macro_distance = 0.0f;
+	}
+	if (benchmark_noise) {
+		// Time the procedural generator on a large map and exit
+		ProceduralTerrain::RunBenchmark(procedural_settings, 8192);
+		return 0;
+	}
+	if (benchmark_raycast) {
+		// Ray queries need no GL context
+		ilInit();
+		TerrainRaycaster::RunBenchmark(Terrain::ReadHeightmap(heightmap_file.c_str()), 1000000);
+		TerrainRaycaster::RunBenchmark(ProceduralTerrain::Generate(procedural_settings, 8192, 8192), 1000000);
+		return 0;
+	}
+	if (benchmark_ao) {
+		TerrainOcclusion::RunBenchmark();
+		return 0;
+	}
+	if (check_raster)
+		return OcclusionRasterizer::RunCheck() ? 0 : 1;
+	if (benchmark_raster) {
+		// The software rasterizer needs no GL context
+		ilInit();
+		OcclusionRasterizer::RunBenchmark(Terrain::ReadHeightmap(heightmap_file.c_str()));
+		return 0;
+	}
+	if (benchmark_placement) {
+		// The placement needs no GL context
+		ilInit();
+		VegetationPlacement::RunBenchmark(Terrain::ReadHeightmap(heightmap_file.c_str()));
+		return 0;
+	}
+	if (benchmark_fft) {
+		OceanWaves::RunBenchmark();
+		return 0;
+	}
+	if (benchmark_cull) {
+		InstanceCulling::RunBenchmark();
+		return 0;
+	}
+	if (benchmark_normal_map) {
+		ilInit();
+		runNormalMapBenchmark();
+		return 0;
+	}
+	if (benchmark_pvs) {
+		ilInit();
+		runVisibilityBenchmark();
+		return 0;
+	}
+	if (benchmark_water) {
+		ilInit();
+		runWaterBenchmark();
+		return 0;
+	}
 	glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGBA);
 	glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
 
 	// Set OpenGL Context parameters
+	// A 3.3 core context everywhere, drivers give the newest compatible version. The GPU culling checks for 4.3 (or the
+	// compute and indirect draw extensions) after glewInit and keeps the CPU culling without them.
 	glutInitContextVersion(3, 3);
 	glutInitContextProfile(GLUT_CORE_PROFILE);
 	glutInitContextFlags(GLUT_DEBUG);
@@ -680,6 +2707,11 @@ int main(int argc, char** argv)
 	// Initialize our OpenGL stuff
 	init();
 
+	if (benchmark_brush) {
+		runBrushBenchmark();
+		return 0;
+	}
+
 	// Register callbacks
 	glutDisplayFunc(render);
 	glutKeyboardFunc(key_down);
@@ -688,6 +2720,17 @@ int main(int argc, char** argv)
 	glutMotionFunc(mouse_moved);
 	glutPassiveMotionFunc(mouse_moved);
 
+	if (benchmark_splat)
+		reportSplatCost(terrain_data.geometry);
+
+	if (benchmark_occlusion)
+		valleyPose(valley_eye, valley_target);
+
+	// Benchmarks render as fast as possible
+	if (benchmark_flythrough || benchmark_splat || benchmark_macro || benchmark_water_lod || benchmark_reflection || benchmark_instances
+		|| benchmark_occlusion)
+		glutIdleFunc(glutPostRedisplay);
+
 	glutSetCursor(GLUT_CURSOR_NONE);
 
 	// Run the main loop
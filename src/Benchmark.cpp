@@ -0,0 +1,94 @@
+#include "Benchmark.h"
+#include <algorithm>
+#include <numeric>
+
+double FrameStats::Mean() const
+{
+	if (frames.empty())
+		return 0.0;
+	return std::accumulate(frames.begin(), frames.end(), 0.0) / frames.size();
+}
+
+double FrameStats::Percentile(double p) const
+{
+	if (frames.empty())
+		return 0.0;
+	std::vector<double> sorted = frames;
+	size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p * (sorted.size() - 1) + 0.5));
+	std::nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+	return sorted[i];
+}
+
+int FrameStats::Hitches(double factor) const
+{
+	double limit = Median() * factor;
+	return static_cast<int>(std::count_if(frames.begin(), frames.end(), [limit](double ms) { return ms > limit; }));
+}
+
+void FrameStats::Report(const std::string& name, std::ostream& out) const
+{
+	double max = frames.empty() ? 0.0 : *std::max_element(frames.begin(), frames.end());
+	out << name << ": " << frames.size() << " frames, mean " << Mean() << " ms, median " << Median()
+		<< " ms, p99 " << Percentile(0.99) << " ms, max " << max << " ms, hitches (>2x median) " << Hitches() << std::endl;
+}
+
+CameraPath::CameraPath(const std::vector<glm::vec3>& waypoints, float speed)
+	: waypoints(waypoints), speed(speed)
+{
+	cumulative.push_back(0.0f);
+	for (size_t i = 1; i < waypoints.size(); ++i)
+		cumulative.push_back(cumulative.back() + glm::distance(waypoints[i - 1], waypoints[i]));
+	length = cumulative.back();
+}
+
+glm::vec3 CameraPath::PositionAt(float d) const
+{
+	if (waypoints.size() < 2)
+		return waypoints.empty() ? glm::vec3(0.0f) : waypoints[0];
+	d = std::min(std::max(d, 0.0f), length);
+	size_t i = std::upper_bound(cumulative.begin(), cumulative.end(), d) - cumulative.begin();
+	i = std::min(std::max<size_t>(i, 1), waypoints.size() - 1);
+	float segment = cumulative[i] - cumulative[i - 1];
+	float t = segment > 0.0f ? (d - cumulative[i - 1]) / segment : 0.0f;
+	return glm::mix(waypoints[i - 1], waypoints[i], t);
+}
+
+bool CameraPath::Step(glm::vec3& eye, glm::vec3& target)
+{
+	if (distance >= length)
+		return false;
+	eye = PositionAt(distance);
+	// Look a few units ahead along the path, slightly down
+	target = PositionAt(distance + 5.0f) + glm::vec3(0.0f, -1.0f, 0.0f);
+	if (glm::distance(eye, target) < 0.01f)
+		target = eye + glm::vec3(1.0f, 0.0f, 0.0f);
+	distance += speed;
+	return true;
+}
+
+CameraPath CameraPath::FlyThrough()
+{
+	// Heights are ignored by the streaming benchmark, the camera follows the terrain
+	std::vector<glm::vec3> waypoints = {
+		glm::vec3(0.0f, 0.0f, 0.0f),
+		glm::vec3(400.0f, 0.0f, 50.0f),
+		glm::vec3(450.0f, 0.0f, 500.0f),
+		glm::vec3(-200.0f, 0.0f, 550.0f),
+		glm::vec3(-250.0f, 0.0f, -100.0f),
+		glm::vec3(0.0f, 0.0f, 0.0f),
+	};
+	return CameraPath(waypoints, 0.5f);
+}
+
+CameraPath CameraPath::TerrainLoop()
+{
+	std::vector<glm::vec3> waypoints = {
+		glm::vec3(-40.0f, 0.0f, -40.0f),
+		glm::vec3(40.0f, 0.0f, -35.0f),
+		glm::vec3(35.0f, 0.0f, 40.0f),
+		glm::vec3(-35.0f, 0.0f, 30.0f),
+		glm::vec3(0.0f, 0.0f, 0.0f),
+		glm::vec3(-40.0f, 0.0f, -40.0f),
+	};
+	return CameraPath(waypoints, 0.2f);
+}
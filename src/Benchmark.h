@@ -0,0 +1,61 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <iostream>
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----           BENCHMARK             ----
+//-----------------------------------------
+
+/// Collects frame times and summarizes them (median, percentiles, hitches)
+class FrameStats
+{
+public:
+	void Add(double frame_ms) { frames.push_back(frame_ms); }
+	void Clear() { frames.clear(); }
+	size_t Count() const { return frames.size(); }
+
+	double Mean() const;
+	/// p in [0, 1]
+	double Percentile(double p) const;
+	double Median() const { return Percentile(0.5); }
+	/// Frames longer than 'factor' times the median
+	int Hitches(double factor = 2.0) const;
+
+	/// Prints count, mean, median, p99, max and hitches on one line
+	void Report(const std::string& name, std::ostream& out = std::cout) const;
+
+private:
+	std::vector<double> frames;
+};
+
+/// Scripted camera path through a list of waypoints, evaluated with a fixed step per frame so that every run
+/// renders the same sequence of views regardless of the frame rate
+class CameraPath
+{
+public:
+	CameraPath() = default;
+	/// 'speed' in world units per frame
+	CameraPath(const std::vector<glm::vec3>& waypoints, float speed);
+
+	/// Advances one frame. Returns false once the end of the path was reached.
+	bool Step(glm::vec3& eye, glm::vec3& target);
+
+	float Progress() const { return length > 0.0f ? distance / length : 1.0f; }
+
+	/// A long loop over the mirrored world, crossing many tiles (for the streaming benchmark)
+	static CameraPath FlyThrough();
+
+	/// A loop over the single terrain through valleys and across ridges (for the visibility benchmark)
+	static CameraPath TerrainLoop();
+
+private:
+	std::vector<glm::vec3> waypoints;
+	std::vector<float> cumulative;
+	float speed = 0.0f;
+	float distance = 0.0f;
+	float length = 0.0f;
+
+	glm::vec3 PositionAt(float d) const;
+};
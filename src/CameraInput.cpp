@@ -2,14 +2,12 @@
 
 const float CameraInput::min_elevation = -1.5f;
 const float CameraInput::max_elevation = 1.5f;
-const float CameraInput::min_position = -50.0f;
-const float CameraInput::max_position = 49.0f;
 
 const float CameraInput::angle_sensitivity = 0.008f;
 const float CameraInput::move_speed = 0.2f;
 
 CameraInput::CameraInput(Terrain* terrain, float x, float z)
-	: terrain(terrain), angle_direction(0.0f), angle_elevation(0.0f)
+	: terrain(terrain), min_position(-50.0f), max_position(49.0f), angle_direction(0.0f), angle_elevation(0.0f)
 {
 	eye_position.x = x;
 	eye_position.z = z;
@@ -24,11 +22,30 @@ void CameraInput::UpdateViewOrien() {
 }
 
 float CameraInput::GetHeight(float x, float z) {
-	int xi = static_cast<int>(round((eye_position.x / 50) * 128)) + 128;
-	int zi = static_cast<int>(round((eye_position.z / 50) * 128)) + 128;
-	xi = std::max(std::min(xi, 255), 0);
-	zi = std::max(std::min(zi, 255), 0);
-	return terrain->height[xi][zi] * TERRAIN_HEIGHT;
+	if (height_query)
+		return height_query(x, z);
+
+	return terrain->SampleHeight(eye_position.x, eye_position.z) * TERRAIN_HEIGHT;
+}
+
+void CameraInput::SetBounds(float min_position, float max_position)
+{
+	this->min_position = min_position;
+	this->max_position = max_position;
+}
+
+void CameraInput::SetHeightQuery(std::function<float(float, float)> query)
+{
+	height_query = query;
+}
+
+void CameraInput::SetPose(const glm::vec3& eye, const glm::vec3& target)
+{
+	eye_position = eye;
+	glm::vec3 direction = glm::normalize(target - eye);
+	angle_direction = atan2f(direction.z, direction.x);
+	angle_elevation = glm::clamp(-asinf(direction.y), min_elevation, max_elevation);
+	UpdateViewOrien();
 }
 
 void CameraInput::OnMouseMoved(int dx, int dy)
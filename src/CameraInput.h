@@ -16,13 +16,18 @@ class CameraInput
 private:
 	static const float min_elevation;
 	static const float max_elevation; 
-	static const float min_position;
-	static const float max_position;
 	static const float angle_sensitivity;
 	static const float move_speed;
 
 	Terrain* terrain;
 
+	/// Horizontal bounds of the eye position, the single terrain by default
+	float min_position;
+	float max_position;
+
+	/// Overrides the terrain height lookup when set (e.g. the streamed world)
+	std::function<float(float, float)> height_query;
+
 	float angle_direction;
 	float angle_elevation;
 
@@ -42,12 +47,21 @@ public:
 	bool vel_a = false;
 	bool vel_d = false;
 
-	CameraInput() : terrain(nullptr), angle_direction(0.0f), angle_elevation(0.0f) { };
+	CameraInput() : terrain(nullptr), min_position(-50.0f), max_position(49.0f), angle_direction(0.0f), angle_elevation(0.0f) { };
 
 	CameraInput(Terrain* terrain, float x, float y);
 
 	void Move();
 
+	/// Sets the horizontal bounds of the eye position
+	void SetBounds(float min_position, float max_position);
+
+	/// Replaces the terrain height lookup used to keep the eye on the ground
+	void SetHeightQuery(std::function<float(float, float)> query);
+
+	/// Places the eye and the view orientation directly (scripted cameras)
+	void SetPose(const glm::vec3& eye, const glm::vec3& target);
+
 	/// Call when the user moves with the mouse cursor
 	void OnMouseMoved(int x, int y);
 
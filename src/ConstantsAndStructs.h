@@ -1,8 +1,12 @@
+#include "WaterSurface.h"
+#include "ProjectedWater.h"
+#include "OceanWaves.h"
+#include "InstanceBuffer.h"
+#include "InstanceCulling.h"
+#include "Impostor.h"
+
 // Buffer structures
 static const int LIGHT_COUNT = 2;
-static const int TREE_COUNT = 500;
-static const int BUSH_COUNT = 500;
-static const int GRASS_COUNT = 2000;
 
 struct Light
 {
@@ -36,12 +40,87 @@ struct TerrainData {
 	GLint grass_tex_loc;
 	GLint rocks_tex_loc;
 	GLint model_matrix_loc;
+
+	// Baked ambient occlusion (R8, row major samples), white 1x1 for the streamed world
+	GLuint occlusion_tex;
+	GLint occlusion_tex_loc;
+	GLint compact_occlusion_tex_loc;
+
+	// Normal map of the coarse mesh (Terrain::mesh_step > 1)
+	GLint normal_map_tex_loc;
+	GLint use_normal_map_loc;
+
+	// Baked material weights (Terrain::splat_tex), the per fragment slope test is used without them
+	GLint splat_tex_loc;
+	GLint use_splat_map_loc;
+	GLint compact_splat_tex_loc;
+	GLint compact_use_splat_map_loc;
+
+	// Macro color map of distant terrain (Terrain::macro_tex)
+	GLint macro_tex_loc;
+	GLint macro_step_loc;
+	GLint macro_distance_loc;
+	GLint compact_macro_tex_loc;
+	GLint compact_macro_step_loc;
+	GLint compact_macro_distance_loc;
+
+	// Attribute-less terrain program, used when geometry.compact is set
+	GLuint compact_program;
+	GLint compact_grass_tex_loc;
+	GLint compact_rocks_tex_loc;
+	GLint compact_model_matrix_loc;
+	GLint height_tex_loc;
+	GLint normal_tex_loc;
+};
+
+// LODs of a vegetation mesh: their vertex ranges in the geometry (see ObjectLoader::LoadOBJLods) and the projected
+// sizes where they are used
+struct MeshLods {
+	InstanceCulling::LodSettings settings;
+	int first[InstanceCulling::MAX_LODS] = {};
+	int vertices[InstanceCulling::MAX_LODS] = {};
+	// The last LOD is drawn with the impostor of the mesh instead of its vertex range
+	bool impostor = false;
+};
+
+// Instances per LOD of a buffer filled by the LOD selection, back to back from the first instance
+struct LodCounts {
+	bool selected = false;
+	int count[InstanceCulling::MAX_LODS] = {};
 };
 
 struct NatureData {
 	GLuint program;
 
-	glm::mat4 tree_data[GRASS_COUNT];
+	// Instances placed on the single terrain, -trees, -bushes and -grass set their counts
+	int tree_count = 500;
+	int bush_count = 500;
+	// Per grass kind
+	int grass_count = 2000;
+	std::vector<PackedInstance> tree_instances;
+	std::vector<PackedInstance> bush_instances;
+	std::vector<PackedInstance> long_grass_instances[12];
+	// Bounds of the instances for the per frame culling (see InstanceCulling)
+	InstanceCulling tree_culling;
+	InstanceCulling bush_culling;
+	InstanceCulling long_grass_culling[12];
+	// Instances drawn by the main pass: the ones inside the camera frustum, or with -no-instance-cull all of them
+	// (the ones standing on cells visible from the camera with a PVS)
+	InstanceBuffer tree_buffer;
+	InstanceBuffer bush_buffer;
+	InstanceBuffer long_grass_buffer[12];
+	// Instances of the reflection pass, culled with the mirrored camera (see ReflectionCulling), grass is left out
+	InstanceBuffer reflection_tree_buffer;
+	InstanceBuffer reflection_bush_buffer;
+	// LODs of the meshes and the LOD ranges of the buffers above
+	MeshLods tree_lods;
+	MeshLods bush_lods;
+	MeshLods long_grass_lods[12];
+	LodCounts tree_lod_counts;
+	LodCounts bush_lod_counts;
+	LodCounts long_grass_lod_counts[12];
+	LodCounts reflection_tree_lod_counts;
+	LodCounts reflection_bush_lod_counts;
 	Geometry tree_geometry;
 	Geometry bush_geometry;
 	Geometry long_grass_geometry[12];
@@ -51,30 +130,85 @@ struct NatureData {
 	GLuint bush_tex;
 	GLuint long_grass_tex;
 	GLint tex_loc;
+	GLint occlusion_tex_loc;
 	GLint model_matrix_loc;
 	GLint wind_height_loc;
 	GLint app_time_loc;
+	GLint packed_instances_loc;
+	GLint lod_fade_loc;
+	GLint lod_bounds_loc;
+	GLint lod_eye_loc;
+
+	// Octahedral impostors of the trees and bushes, drawn for their coarsest LOD
+	Impostor tree_impostor;
+	Impostor bush_impostor;
+	GLuint impostor_program = 0;
+	GLint impostor_model_matrix_loc;
+	GLint impostor_packed_instances_loc;
+	GLint impostor_bounds_loc;
+	GLint impostor_frames_loc;
+	GLint impostor_albedo_tex_loc;
+	GLint impostor_normal_depth_tex_loc;
+	GLint impostor_occlusion_tex_loc;
+	GLint impostor_lod_fade_loc;
+	GLint impostor_lod_bounds_loc;
+	GLint impostor_lod_eye_loc;
 };
 
 struct WaterData {
 	GLuint program;
-	Geometry geometry;
+	// Tiled water grid, tiles under the single terrain are masked out
+	WaterSurface surface;
+	WaterSurface::Settings settings;
+	// Tiles drawn this frame
+	std::vector<char> visible;
 
 	GLuint normal_tex;
 	GLint normal_tex_loc;
 	GLint model_matrix_loc;
 	GLint app_time_loc;
 	GLint reflection_tex_loc;
+
+	// Projected grid water (see ProjectedWater), replaces the tiled grid unless -tiled-water is given
+	GLuint projected_program;
+	Geometry projected_grid;
+	ProjectedWater::Settings projected_settings;
+	GLint projected_app_time_loc;
+	GLint projected_normal_tex_loc;
+	GLint projected_reflection_tex_loc;
+	GLint inverse_view_projection_loc;
+	GLint grid_size_loc;
+	GLint overscan_loc;
+	GLint horizon_loc;
+	GLint water_level_loc;
+	GLint water_bounds_loc;
+
+	// FFT ocean waves (see OceanWaves), -static-water keeps the scrolling normal map
+	OceanWaves ocean;
+	OceanWaves::Settings ocean_settings;
+	GLint use_ocean_loc;
+	GLint ocean_displacement_tex_loc;
+	GLint ocean_normal_tex_loc;
+	GLint ocean_patch_loc;
+	GLint ocean_lod_loc;
+	GLint projected_use_ocean_loc;
+	GLint projected_ocean_displacement_tex_loc;
+	GLint projected_ocean_normal_tex_loc;
+	GLint projected_ocean_patch_loc;
+
 	GLuint reflection_framebuffer;
 	GLuint reflection_tex;
 	GLuint reflection_depth;
+	int reflection_width;
+	int reflection_height;
+	// Mirrored camera of the last reflection pass, the water shaders project into the reflection through it
+	glm::mat4 reflection_view_projection;
+	GLint reflection_view_projection_loc;
+	GLint projected_reflection_view_projection_loc;
 };
 
 struct UBO {
 	GLuint lights;
 	GLuint camera;
 	GLuint material;
-	GLuint tree;
-	GLuint bush;
-	GLuint long_grass[12];
 };
\ No newline at end of file
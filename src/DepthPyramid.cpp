@@ -0,0 +1,174 @@
+#include "DepthPyramid.h"
+#include "Loader.h"
+
+namespace {
+	// Largest power of two not above 'size'
+	int FloorPowerOfTwo(int size)
+	{
+		int power = 1;
+		while (power * 2 <= size)
+			power *= 2;
+		return power;
+	}
+}
+
+bool DepthPyramid::Initialize()
+{
+	program = Loader::CreateAndLinkProgram("shaders/depth_pyramid_vertex.glsl", "shaders/depth_pyramid_fragment.glsl");
+	if (program == 0)
+		return false;
+	source_loc = glGetUniformLocation(program, "source");
+	target_size_loc = glGetUniformLocation(program, "target_size");
+
+	// The full screen triangle has no attributes, the core profile still needs a vertex array
+	glGenVertexArrays(1, &vertex_array);
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glGenTextures(1, &depth_tex);
+	glGenTextures(1, &pyramid_tex);
+	for (PendingRead& read : reads)
+		glGenBuffers(1, &read.buffer);
+	return true;
+}
+
+void DepthPyramid::Resize(int viewport_width, int viewport_height)
+{
+	if (!Ready())
+		return;
+	width = std::max(viewport_width, 1);
+	height = std::max(viewport_height, 1);
+	pyramid_width = FloorPowerOfTwo(width);
+	pyramid_height = FloorPowerOfTwo(height);
+	level_count = 1;
+	while (LevelWidth(level_count - 1) > 1 || LevelHeight(level_count - 1) > 1)
+		++level_count;
+	readback_level = 0;
+	while (LevelWidth(readback_level) > READBACK_SIZE || LevelHeight(readback_level) > READBACK_SIZE)
+		++readback_level;
+
+	glBindTexture(GL_TEXTURE_2D, depth_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glBindTexture(GL_TEXTURE_2D, pyramid_tex);
+	for (int level = 0; level < level_count; ++level)
+		glTexImage2D(GL_TEXTURE_2D, level, GL_R32F, LevelWidth(level), LevelHeight(level), 0, GL_RED, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level_count - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// Reads in flight have the old size
+	GLsizeiptr bytes = GLsizeiptr(LevelWidth(readback_level)) * LevelHeight(readback_level) * sizeof(float);
+	for (PendingRead& read : reads) {
+		if (read.fence != 0)
+			glDeleteSync(read.fence);
+		read.fence = 0;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, read.buffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	latest = HiZMap();
+}
+
+void DepthPyramid::Build(const glm::mat4& camera, const glm::vec3& eye)
+{
+	if (!Ready() || level_count == 0)
+		return;
+	view_projection = camera;
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, depth_tex);
+	glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+
+	GLint bound_framebuffer = 0, viewport[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &bound_framebuffer);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+	GLboolean blend = glIsEnabled(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+	glUseProgram(program);
+	glUniform1i(source_loc, 0);
+	glBindVertexArray(vertex_array);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+	// Level 0 from the depth copy, every further level from the one before. Only the level before is sampled while
+	// a level is written, there is no feedback loop.
+	for (int level = 0; level < level_count; ++level) {
+		if (level == 0) {
+			glBindTexture(GL_TEXTURE_2D, depth_tex);
+		}
+		else {
+			glBindTexture(GL_TEXTURE_2D, pyramid_tex);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+		}
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, pyramid_tex, level);
+		glViewport(0, 0, LevelWidth(level), LevelHeight(level));
+		glUniform2f(target_size_loc, float(LevelWidth(level)), float(LevelHeight(level)));
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	}
+	glBindTexture(GL_TEXTURE_2D, pyramid_tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level_count - 1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// The coarse level into the next pixel buffer, a read still pending there is dropped
+	PendingRead& read = reads[next_read];
+	next_read = (next_read + 1) % READBACK_BUFFERS;
+	if (read.fence != 0)
+		glDeleteSync(read.fence);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, pyramid_tex, readback_level);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, read.buffer);
+	glReadPixels(0, 0, LevelWidth(readback_level), LevelHeight(readback_level), GL_RED, GL_FLOAT, nullptr);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	read.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	read.view_projection = camera;
+	read.eye = eye;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, bound_framebuffer);
+	glBindVertexArray(0);
+	glUseProgram(0);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	if (depth_test)
+		glEnable(GL_DEPTH_TEST);
+	if (blend)
+		glEnable(GL_BLEND);
+}
+
+HiZMap* DepthPyramid::Readback()
+{
+	int read_width = LevelWidth(readback_level), read_height = LevelHeight(readback_level);
+	// Oldest first, the reads finish in order
+	for (int i = 0; i < READBACK_BUFFERS; ++i) {
+		PendingRead& read = reads[(next_read + i) % READBACK_BUFFERS];
+		if (read.fence == 0)
+			continue;
+		GLenum state = glClientWaitSync(read.fence, 0, 0);
+		if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED)
+			break;
+		glDeleteSync(read.fence);
+		read.fence = 0;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, read.buffer);
+		const float* depth = static_cast<const float*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+			GLsizeiptr(read_width) * read_height * sizeof(float), GL_MAP_READ_BIT));
+		if (depth) {
+			latest.Build(depth, read_width, read_height, read.view_projection, read.eye);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+	return latest.Empty() ? nullptr : &latest;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "HiZMap.h"
+
+#include <vector>
+#include <algorithm>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----          DEPTH PYRAMID          ----
+//-----------------------------------------
+
+/// Hierarchical depth (Hi-Z) of the main pass on the GPU. Build copies the depth buffer of the window after the
+/// occluders (the terrain) were drawn and reduces it into an R32F texture: level 0 is the viewport rounded down to
+/// powers of two and holds the farthest depth under every texel, every further level the farthest of 2x2 texels,
+/// down to 1x1. The GPU culling samples the texture in the same frame. One coarse level is read back through a
+/// ring of pixel buffers without stalling, Readback returns it as a HiZMap a frame or two later for the
+/// culling on the CPU.
+class DepthPyramid
+{
+public:
+	DepthPyramid() = default;
+	DepthPyramid(const DepthPyramid&) = delete;
+	DepthPyramid& operator =(const DepthPyramid&) = delete;
+
+	/// Compiles the reduction program, returns false on errors
+	bool Initialize();
+
+	bool Ready() const { return program != 0; }
+
+	/// (Re)allocates the textures for a viewport of width * height pixels
+	void Resize(int width, int height);
+
+	/// Copies the depth buffer of the bound read framebuffer (rendered with 'view_projection' from 'eye'), builds the
+	/// levels and starts reading back the coarse one. The framebuffer and viewport are restored.
+	void Build(const glm::mat4& view_projection, const glm::vec3& eye);
+
+	/// The newest level read back, null until the first arrives. Collects finished reads without waiting.
+	HiZMap* Readback();
+
+	GLuint Texture() const { return pyramid_tex; }
+	int Width() const { return pyramid_width; }
+	int Height() const { return pyramid_height; }
+	int Levels() const { return level_count; }
+	/// Camera of the last Build
+	const glm::mat4& ViewProjection() const { return view_projection; }
+
+private:
+	/// Level read back for the CPU, at most this many texels along each side
+	static const int READBACK_SIZE = 128;
+	static const int READBACK_BUFFERS = 3;
+
+	struct PendingRead
+	{
+		GLuint buffer = 0;
+		GLsync fence = 0;
+		glm::mat4 view_projection;
+		glm::vec3 eye;
+	};
+
+	GLuint program = 0;
+	GLint source_loc = -1, target_size_loc = -1;
+	GLuint vertex_array = 0;
+	GLuint framebuffer = 0;
+	GLuint depth_tex = 0;
+	GLuint pyramid_tex = 0;
+
+	int width = 0, height = 0;
+	int pyramid_width = 0, pyramid_height = 0;
+	int level_count = 0;
+	int readback_level = 0;
+	glm::mat4 view_projection = glm::mat4(1.0f);
+
+	PendingRead reads[READBACK_BUFFERS];
+	/// Next read to start
+	int next_read = 0;
+	HiZMap latest;
+
+	int LevelWidth(int level) const { return std::max(pyramid_width >> level, 1); }
+	int LevelHeight(int level) const { return std::max(pyramid_height >> level, 1); }
+};
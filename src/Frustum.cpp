@@ -0,0 +1,48 @@
+#include "Frustum.h"
+
+Frustum::Frustum(const glm::mat4& view_projection)
+{
+	// Rows of the matrix (GLM stores columns)
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; ++i)
+		rows[i] = glm::vec4(view_projection[0][i], view_projection[1][i], view_projection[2][i], view_projection[3][i]);
+
+	// -w <= x, y, z <= w in clip space
+	for (int axis = 0; axis < 3; ++axis) {
+		planes[axis * 2] = rows[3] + rows[axis];
+		planes[axis * 2 + 1] = rows[3] - rows[axis];
+	}
+	for (glm::vec4& plane : planes)
+		plane /= glm::length(glm::vec3(plane));
+}
+
+bool Frustum::IntersectsBox(const glm::vec3& min, const glm::vec3& max) const
+{
+	for (const glm::vec4& plane : planes) {
+		// The corner furthest along the plane normal
+		glm::vec3 corner(plane.x >= 0.0f ? max.x : min.x, plane.y >= 0.0f ? max.y : min.y, plane.z >= 0.0f ? max.z : min.z);
+		if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f)
+			return false;
+	}
+	return true;
+}
+
+bool Frustum::ContainsBox(const glm::vec3& min, const glm::vec3& max) const
+{
+	for (const glm::vec4& plane : planes) {
+		// The corner furthest against the plane normal
+		glm::vec3 corner(plane.x >= 0.0f ? min.x : max.x, plane.y >= 0.0f ? min.y : max.y, plane.z >= 0.0f ? min.z : max.z);
+		if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f)
+			return false;
+	}
+	return true;
+}
+
+bool Frustum::IntersectsSphere(const glm::vec3& center, float radius) const
+{
+	for (const glm::vec4& plane : planes) {
+		if (glm::dot(glm::vec3(plane), center) + plane.w < -radius)
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----            FRUSTUM              ----
+//-----------------------------------------
+
+/// The six planes of a camera's clip volume in world space, used to reject bounding boxes before drawing
+class Frustum
+{
+public:
+	Frustum() = default;
+
+	/// Planes of projection * view (Gribb/Hartmann), normals pointing inside and normalized
+	explicit Frustum(const glm::mat4& view_projection);
+
+	/// False only when the box is certainly outside, boxes near the corners may be reported visible
+	bool IntersectsBox(const glm::vec3& min, const glm::vec3& max) const;
+
+	/// True when the whole box is inside all planes
+	bool ContainsBox(const glm::vec3& min, const glm::vec3& max) const;
+
+	/// Same as IntersectsBox for a sphere
+	bool IntersectsSphere(const glm::vec3& center, float radius) const;
+
+	/// (normal, distance): a point p is inside the plane when dot(normal, p) + distance >= 0.
+	/// Order: left, right, bottom, top, near, far.
+	glm::vec4 planes[6];
+};
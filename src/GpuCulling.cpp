@@ -0,0 +1,198 @@
+#include "GpuCulling.h"
+#include "Loader.h"
+#include <algorithm>
+
+namespace {
+	// DrawArraysIndirectCommand
+	struct DrawCommand
+	{
+		GLuint count;
+		GLuint instance_count;
+		GLuint first;
+		GLuint base_instance;
+	};
+
+	const GLuint GROUP_SIZE = 64;
+}
+
+bool GpuCulling::Supported()
+{
+	return GLEW_VERSION_4_3 || (GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object && GLEW_ARB_multi_draw_indirect
+		&& GLEW_ARB_base_instance);
+}
+
+bool GpuCulling::Initialize(int layer_count)
+{
+	if (!Supported())
+		return false;
+	program = Loader::CreateAndLinkComputeProgram("shaders/instance_cull_compute.glsl");
+	if (program == 0)
+		return false;
+
+	instance_count_loc = glGetUniformLocation(program, "instance_count");
+	capacity_loc = glGetUniformLocation(program, "capacity");
+	first_command_loc = glGetUniformLocation(program, "first_command");
+	planes_loc = glGetUniformLocation(program, "planes");
+	min_y_loc = glGetUniformLocation(program, "min_y");
+	eye_position_loc = glGetUniformLocation(program, "eye_position");
+	lod_count_loc = glGetUniformLocation(program, "lod_count");
+	lod_distance_loc = glGetUniformLocation(program, "lod_distance");
+	model_matrix_loc = glGetUniformLocation(program, "model_matrix");
+	bounds_loc = glGetUniformLocation(program, "bounds");
+	occlusion_loc = glGetUniformLocation(program, "occlusion");
+	depth_pyramid_loc = glGetUniformLocation(program, "depth_pyramid");
+	pyramid_levels_loc = glGetUniformLocation(program, "pyramid_levels");
+	occlusion_view_projection_loc = glGetUniformLocation(program, "occlusion_view_projection");
+
+	layers.resize(layer_count);
+	glGenBuffers(1, &command_buffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, VIEWS * layer_count * MAX_LODS * sizeof(DrawCommand), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glGenBuffers(1, &occluded_buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, occluded_buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, VIEWS * layer_count * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return true;
+}
+
+void GpuCulling::SetInstances(int layer, const std::vector<PackedInstance>& instances, const InstanceCulling::Sphere& bounds)
+{
+	Layer& l = layers[layer];
+	l.bounds = bounds;
+	l.count = static_cast<int>(instances.size());
+	if (l.source == 0)
+		glGenBuffers(1, &l.source);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, l.source);
+	if (l.count > l.capacity) {
+		l.capacity = l.count;
+		glBufferData(GL_SHADER_STORAGE_BUFFER, l.capacity * sizeof(PackedInstance), instances.data(), GL_STATIC_DRAW);
+		// Room for every instance in every LOD region
+		for (InstanceBuffer& visible : l.visible)
+			visible.Reserve(l.capacity * l.lod_count);
+	}
+	else if (l.count > 0) {
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, l.count * sizeof(PackedInstance), instances.data());
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GpuCulling::SetLods(int layer, const Geometry& geometry)
+{
+	int first = 0, count = geometry.DrawArraysCount;
+	float distance = 0.0f;
+	SetLods(layer, 1, &first, &count, &distance);
+}
+
+void GpuCulling::SetLods(int layer, int lod_count, const int* first, const int* count, const float* distance)
+{
+	Layer& l = layers[layer];
+	lod_count = std::min(std::max(lod_count, 1), static_cast<int>(MAX_LODS));
+	// The visible buffers are sized for the LOD count, reallocated by the next SetInstances
+	if (lod_count != l.lod_count)
+		l.capacity = 0;
+	l.lod_count = lod_count;
+	for (int i = 0; i < l.lod_count; ++i) {
+		l.lod_first[i] = first[i];
+		l.lod_vertices[i] = count[i];
+		l.lod_distance[i] = distance[i];
+	}
+}
+
+void GpuCulling::Cull(int view, const Frustum& frustum, const glm::mat4& model, const glm::vec3& eye, float min_y, int layer_count,
+	const DepthPyramid* occlusion)
+{
+	size_t culled = layer_count < 0 ? layers.size() : std::min(static_cast<size_t>(layer_count), layers.size());
+
+	// Fresh commands with zero instances, the shader counts them up
+	std::vector<DrawCommand> commands(culled * MAX_LODS);
+	for (size_t layer = 0; layer < culled; ++layer) {
+		const Layer& l = layers[layer];
+		for (int lod = 0; lod < MAX_LODS; ++lod) {
+			DrawCommand& command = commands[layer * MAX_LODS + lod];
+			command.count = lod < l.lod_count ? l.lod_vertices[lod] : 0;
+			command.instance_count = 0;
+			command.first = l.lod_first[lod];
+			command.base_instance = lod * l.capacity;
+		}
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, command_buffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, FirstCommand(view, 0) * sizeof(DrawCommand), commands.size() * sizeof(DrawCommand), commands.data());
+	std::vector<GLuint> occluded(culled, 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, occluded_buffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, FirstCommand(view, 0) / MAX_LODS * sizeof(GLuint), occluded.size() * sizeof(GLuint), occluded.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	glUseProgram(program);
+	glUniform4fv(planes_loc, 6, &frustum.planes[0].x);
+	glUniform1f(min_y_loc, min_y);
+	glUniform3fv(eye_position_loc, 1, &eye.x);
+	glUniformMatrix4fv(model_matrix_loc, 1, GL_FALSE, &model[0][0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, command_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, occluded_buffer);
+
+	// The pyramid was rendered to, the texture fetches see it without a barrier
+	bool use_occlusion = occlusion && occlusion->Levels() > 0;
+	glUniform1i(occlusion_loc, use_occlusion);
+	glUniform1i(depth_pyramid_loc, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, use_occlusion ? occlusion->Texture() : 0);
+	if (use_occlusion) {
+		glUniform1i(pyramid_levels_loc, occlusion->Levels());
+		glUniformMatrix4fv(occlusion_view_projection_loc, 1, GL_FALSE, &occlusion->ViewProjection()[0][0]);
+	}
+	for (size_t layer = 0; layer < culled; ++layer) {
+		const Layer& l = layers[layer];
+		if (l.count == 0)
+			continue;
+		glUniform1ui(instance_count_loc, l.count);
+		glUniform1ui(capacity_loc, l.capacity);
+		glUniform1ui(first_command_loc, FirstCommand(view, static_cast<int>(layer)));
+		glUniform1i(lod_count_loc, l.lod_count);
+		glUniform1fv(lod_distance_loc, MAX_LODS, l.lod_distance);
+		glUniform4f(bounds_loc, l.bounds.center.x, l.bounds.center.y, l.bounds.center.z, l.bounds.radius);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, l.source);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, l.visible[view].buffer);
+		glDispatchCompute((l.count + GROUP_SIZE - 1) / GROUP_SIZE, 1, 1);
+	}
+	glUseProgram(0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// The draws read the counters as commands and the survivors as vertex attributes
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+void GpuCulling::Draw(int view, int layer, const Geometry& geometry, GLint format_location) const
+{
+	const Layer& l = layers[layer];
+	if (l.count == 0)
+		return;
+
+	l.visible[view].Bind(geometry, format_location);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+	glMultiDrawArraysIndirect(geometry.Mode, (const void*)(FirstCommand(view, layer) * sizeof(DrawCommand)), l.lod_count, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void GpuCulling::ReadCounts(int view, int layer, int& visible, int& occluded) const
+{
+	visible = 0;
+	occluded = 0;
+	const Layer& l = layers[layer];
+	if (l.count == 0)
+		return;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	DrawCommand commands[MAX_LODS];
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, command_buffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, FirstCommand(view, layer) * sizeof(DrawCommand), sizeof(commands), commands);
+	for (int lod = 0; lod < l.lod_count; ++lod)
+		visible += commands[lod].instance_count;
+
+	GLuint count = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, occluded_buffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, FirstCommand(view, layer) / MAX_LODS * sizeof(GLuint), sizeof(count), &count);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	occluded = static_cast<int>(count);
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include "InstanceBuffer.h"
+#include "InstanceCulling.h"
+#include "Frustum.h"
+#include "DepthPyramid.h"
+
+#include <vector>
+
+//-----------------------------------------
+//----          GPU CULLING            ----
+//-----------------------------------------
+
+/// Vegetation culling on the GPU (OpenGL 4.3). Every layer (vegetation type) keeps its instances in a storage
+/// buffer, a compute shader tests them against the frustum of a view, picks a LOD by distance and appends the
+/// survivors to the LOD's region of the layer's visible buffer. The instance counts of the indirect draw commands
+/// are the append counters, Draw issues one glMultiDrawArraysIndirect per layer without reading anything back.
+/// Views are culled independently (the main camera and the mirrored camera of the reflection pass). A view may
+/// also drop the instances hidden in a depth pyramid of the same camera (the occluders drawn before the culling).
+/// The PVS is not applied on this path.
+class GpuCulling
+{
+public:
+	static const int MAX_LODS = 4;
+	static const int VIEWS = 2;
+
+	/// Whether the context has compute shaders, storage buffers and indirect multi draws
+	static bool Supported();
+
+	/// Compiles the compute shader, returns false when unsupported or on errors (then keep culling on the CPU)
+	bool Initialize(int layer_count);
+
+	bool Ready() const { return program != 0; }
+
+	/// LODs of a layer, the vertex ranges [first[i], first[i] + count[i]) of one geometry, LOD i up to distance[i]
+	/// from the eye and the last one beyond. The single LOD version draws the whole geometry. Set before the instances.
+	void SetLods(int layer, const Geometry& geometry);
+	void SetLods(int layer, int lod_count, const int* first, const int* count, const float* distance);
+
+	/// Instances of layer 'layer' with the bounds 'bounds' (model space)
+	void SetInstances(int layer, const std::vector<PackedInstance>& instances, const InstanceCulling::Sphere& bounds);
+
+	/// Culls the first 'layer_count' layers (all for -1) for 'view', 'model' is the model matrix of the vegetation
+	/// (instance * model * position). Instances whose bounds stay under 'min_y' or are hidden in 'occlusion' (when
+	/// given, built from the camera of the view) are dropped.
+	void Cull(int view, const Frustum& frustum, const glm::mat4& model, const glm::vec3& eye, float min_y, int layer_count = -1,
+		const DepthPyramid* occlusion = nullptr);
+
+	/// Instances of a layer drawn in 'view' and dropped by the occlusion test in the last Cull. Reads the counters
+	/// back and waits for the GPU, for statistics only.
+	void ReadCounts(int view, int layer, int& visible, int& occluded) const;
+
+	/// Draws the visible instances of a layer in 'view' with the geometry, sets the packed_instances uniform
+	/// of the bound program at 'format_location'
+	void Draw(int view, int layer, const Geometry& geometry, GLint format_location) const;
+
+private:
+	struct Layer
+	{
+		GLuint source = 0;
+		int count = 0;
+		/// Room of the source buffer and of every LOD region of the visible buffers
+		int capacity = 0;
+		InstanceCulling::Sphere bounds = { glm::vec3(0.0f), 0.0f };
+		int lod_count = 1;
+		int lod_first[MAX_LODS] = {};
+		int lod_vertices[MAX_LODS] = {};
+		float lod_distance[MAX_LODS] = {};
+		/// Survivors per view, LOD regions of 'capacity' instances
+		InstanceBuffer visible[VIEWS];
+	};
+
+	GLuint program = 0;
+	/// MAX_LODS commands per layer and view
+	GLuint command_buffer = 0;
+	/// Instances dropped by the occlusion test, one counter per layer and view
+	GLuint occluded_buffer = 0;
+	std::vector<Layer> layers;
+
+	GLint instance_count_loc, capacity_loc, first_command_loc, planes_loc, min_y_loc, eye_position_loc;
+	GLint lod_count_loc, lod_distance_loc, model_matrix_loc, bounds_loc;
+	GLint occlusion_loc, depth_pyramid_loc, pyramid_levels_loc, occlusion_view_projection_loc;
+
+	int FirstCommand(int view, int layer) const { return (view * static_cast<int>(layers.size()) + layer) * MAX_LODS; }
+};
@@ -0,0 +1,49 @@
+#include "GpuTimer.h"
+
+GpuTimer::~GpuTimer()
+{
+	std::vector<GLuint> queries(free_queries);
+	queries.insert(queries.end(), pending.begin(), pending.end());
+	if (active != 0)
+		queries.push_back(active);
+	if (!queries.empty())
+		glDeleteQueries(static_cast<GLsizei>(queries.size()), queries.data());
+}
+
+void GpuTimer::Begin()
+{
+	if (free_queries.empty()) {
+		glGenQueries(1, &active);
+	}
+	else {
+		active = free_queries.back();
+		free_queries.pop_back();
+	}
+	glBeginQuery(GL_TIME_ELAPSED, active);
+}
+
+void GpuTimer::End()
+{
+	glEndQuery(GL_TIME_ELAPSED);
+	pending.push_back(active);
+	active = 0;
+}
+
+void GpuTimer::Collect(FrameStats& stats, bool wait)
+{
+	while (!pending.empty()) {
+		GLuint query = pending.front();
+		if (!wait) {
+			GLint available = 0;
+			glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+			// Queries finish in order, the later ones are not ready either
+			if (!available)
+				return;
+		}
+		GLuint64 nanoseconds = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+		stats.Add(nanoseconds / 1.0e6);
+		pending.pop_front();
+		free_queries.push_back(query);
+	}
+}
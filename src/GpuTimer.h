@@ -0,0 +1,38 @@
+#pragma once
+#include "Benchmark.h"
+
+#include <vector>
+#include <deque>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+//-----------------------------------------
+//----           GPU TIMER             ----
+//-----------------------------------------
+
+/// Measures the GPU time of a range of commands with GL_TIME_ELAPSED queries. Results arrive a few frames
+/// later, Collect reads the finished ones without stalling the pipeline. Begin/End pairs must not nest
+/// (one GL_TIME_ELAPSED query can be active at a time).
+class GpuTimer
+{
+public:
+	GpuTimer() = default;
+	GpuTimer(const GpuTimer&) = delete;
+	GpuTimer& operator =(const GpuTimer&) = delete;
+	~GpuTimer();
+
+	void Begin();
+	void End();
+
+	/// Adds the milliseconds of every finished range to 'stats', in the order they were issued.
+	/// 'wait' blocks until all ranges are finished (e.g. at the end of a benchmark).
+	void Collect(FrameStats& stats, bool wait = false);
+
+private:
+	/// Queries not in use, reused before new ones are generated
+	std::vector<GLuint> free_queries;
+	/// Ended queries whose result was not read yet, oldest first
+	std::deque<GLuint> pending;
+	GLuint active = 0;
+};
@@ -0,0 +1,94 @@
+#include "HiZMap.h"
+#include <algorithm>
+#include <cmath>
+
+void HiZMap::Build(const float* depth, int width, int height, const glm::mat4& camera, const glm::vec3& camera_eye)
+{
+	view_projection = camera;
+	eye = camera_eye;
+	levels.clear();
+	widths.clear();
+	heights.clear();
+	if (width <= 0 || height <= 0)
+		return;
+
+	levels.emplace_back(depth, depth + size_t(width) * height);
+	widths.push_back(width);
+	heights.push_back(height);
+	while (width > 1 || height > 1) {
+		// The farthest of 2x2 texels, the last row or column of an odd size is folded into the texel before
+		int next_width = std::max(width / 2, 1), next_height = std::max(height / 2, 1);
+		const std::vector<float>& source = levels.back();
+		std::vector<float> level(size_t(next_width) * next_height);
+		for (int y = 0; y < next_height; ++y) {
+			int y0 = y * 2, y1 = y + 1 == next_height ? height : std::min(y * 2 + 2, height);
+			for (int x = 0; x < next_width; ++x) {
+				int x0 = x * 2, x1 = x + 1 == next_width ? width : std::min(x * 2 + 2, width);
+				float farthest = 0.0f;
+				for (int sy = y0; sy < y1; ++sy)
+					for (int sx = x0; sx < x1; ++sx)
+						farthest = std::max(farthest, source[size_t(sy) * width + sx]);
+				level[size_t(y) * next_width + x] = farthest;
+			}
+		}
+		levels.push_back(std::move(level));
+		widths.push_back(next_width);
+		heights.push_back(next_height);
+		width = next_width;
+		height = next_height;
+	}
+}
+
+bool HiZMap::BoxVisible(const glm::vec3& min, const glm::vec3& max) const
+{
+	return Visible((min + max) * 0.5f, (max - min) * 0.5f + margin);
+}
+
+bool HiZMap::SphereVisible(const glm::vec3& center, float radius) const
+{
+	return Visible(center, glm::vec3(radius + margin));
+}
+
+bool HiZMap::Visible(const glm::vec3& center, const glm::vec3& half) const
+{
+	if (levels.empty())
+		return true;
+
+	// Clip space center and extents of the box, every corner lies within center +- extent
+	glm::vec4 clip = view_projection * glm::vec4(center, 1.0f);
+	glm::vec4 extent = glm::abs(view_projection[0]) * half.x + glm::abs(view_projection[1]) * half.y + glm::abs(view_projection[2]) * half.z;
+	float w_near = clip.w - extent.w, w_far = clip.w + extent.w;
+	if (w_near <= 1e-5f)
+		return true;
+
+	// Bounds of the projected corners: the numerator over the denominator that moves it furthest. Depth and w of a
+	// perspective camera grow together (the depth row is a multiple of the w row plus a constant), the nearest depth
+	// is that of the nearest w.
+	auto lowest = [w_near, w_far](float v) { return v >= 0.0f ? v / w_far : v / w_near; };
+	auto highest = [w_near, w_far](float v) { return v >= 0.0f ? v / w_near : v / w_far; };
+	float nearest = (clip.z - extent.z) / w_near;
+	if (nearest <= -1.0f)
+		return true;
+	glm::vec2 low(lowest(clip.x - extent.x), lowest(clip.y - extent.y));
+	glm::vec2 high(highest(clip.x + extent.x), highest(clip.y + extent.y));
+	low = glm::clamp(low * 0.5f + 0.5f, 0.0f, 1.0f);
+	high = glm::clamp(high * 0.5f + 0.5f, 0.0f, 1.0f);
+	if (low.x >= high.x || low.y >= high.y)
+		return true;
+
+	// The level where the rectangle spans at most 2x2 texels
+	float span = std::max((high.x - low.x) * widths[0], (high.y - low.y) * heights[0]);
+	int level = std::min(static_cast<int>(std::ceil(std::log2(std::max(span, 1.0f)))), static_cast<int>(levels.size()) - 1);
+	// Texels of level 0 shifted down, the last texel of a level also holds the folded rest
+	int width = widths[level], height = heights[level];
+	int x0 = std::min(std::min(static_cast<int>(low.x * widths[0]), widths[0] - 1) >> level, width - 1);
+	int x1 = std::min(std::min(static_cast<int>(high.x * widths[0]), widths[0] - 1) >> level, width - 1);
+	int y0 = std::min(std::min(static_cast<int>(low.y * heights[0]), heights[0] - 1) >> level, height - 1);
+	int y1 = std::min(std::min(static_cast<int>(high.y * heights[0]), heights[0] - 1) >> level, height - 1);
+	const std::vector<float>& depth = levels[level];
+	float farthest = 0.0f;
+	for (int y = y0; y <= y1; ++y)
+		for (int x = x0; x <= x1; ++x)
+			farthest = std::max(farthest, depth[size_t(y) * width + x]);
+	return nearest * 0.5f + 0.5f <= farthest;
+}
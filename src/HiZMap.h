@@ -0,0 +1,44 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----            HI-Z MAP             ----
+//-----------------------------------------
+
+/// Hierarchical depth (Hi-Z) of a view on the CPU: level 0 holds the farthest window depth (0 near, 1 far) under every
+/// texel of a low resolution image covering the whole viewport, every further level the farthest of 2x2 texels of
+/// the one before, down to a single texel. A bound is hidden when its nearest depth lies behind the farthest depth
+/// of the texels under its screen rectangle, tested on the level where that rectangle spans at most 2x2 texels.
+/// Bounds are projected with the camera the depth was rendered with, a map of an earlier frame still serves while
+/// the camera moves (see margin).
+class HiZMap
+{
+public:
+	/// Takes a depth image (bottom row first) rendered with 'view_projection' from 'eye' as level 0
+	void Build(const float* depth, int width, int height, const glm::mat4& view_projection, const glm::vec3& eye);
+
+	bool Empty() const { return levels.empty(); }
+
+	/// False only when the box is certainly hidden, bounds crossing the near plane or leaving the viewport count as
+	/// visible
+	bool BoxVisible(const glm::vec3& min, const glm::vec3& max) const;
+	bool SphereVisible(const glm::vec3& center, float radius) const;
+
+	int Width() const { return Empty() ? 0 : widths[0]; }
+	int Height() const { return Empty() ? 0 : heights[0]; }
+
+	glm::mat4 view_projection = glm::mat4(1.0f);
+	glm::vec3 eye = glm::vec3(0.0f);
+	/// World units added to every tested bound. Set to the distance the camera moved since the depth was rendered,
+	/// it hides most of the ground a moving camera uncovers behind the occluders.
+	float margin = 0.0f;
+
+private:
+	std::vector<std::vector<float>> levels;
+	std::vector<int> widths;
+	std::vector<int> heights;
+
+	/// Box given by its center and half extents
+	bool Visible(const glm::vec3& center, const glm::vec3& half) const;
+};
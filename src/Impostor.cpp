@@ -0,0 +1,328 @@
+#include "Impostor.h"
+#include "ThreadPool.h"
+#include <fstream>
+#include <chrono>
+#include <cstring>
+#include <cfloat>
+#include <algorithm>
+
+namespace {
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t frames;
+		uint32_t frame_size;
+		uint32_t supersample;
+		uint32_t checksum;
+		float center[3];
+		float radius;
+	};
+
+	const uint32_t MAGIC = 0x31504d49; // "IMP1"
+
+	/// Passes spreading the colors of covered pixels into their empty neighbours
+	const int DILATE_PASSES = 4;
+
+	uint32_t Hash(uint32_t checksum, const void* data, size_t bytes) {
+		const uint8_t* p = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < bytes; ++i)
+			checksum = (checksum ^ p[i]) * 16777619u;
+		return checksum;
+	}
+
+	// Twice the signed area of (a, b, c)
+	float Edge(const glm::vec2& a, const glm::vec2& b, const glm::vec2& c) {
+		return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+	}
+
+	uint8_t ToByte(float value) {
+		return static_cast<uint8_t>(std::min(std::max(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+	}
+}
+
+glm::vec3 Impostor::Direction(const glm::vec2& uv)
+{
+	glm::vec2 p = uv * 2.0f - 1.0f;
+	float x = (p.x + p.y) * 0.5f;
+	float z = (p.x - p.y) * 0.5f;
+	return glm::normalize(glm::vec3(x, 1.0f - std::fabs(x) - std::fabs(z), z));
+}
+
+void Impostor::FrameAxes(const glm::vec3& direction, glm::vec3& right, glm::vec3& up)
+{
+	right = glm::cross(glm::vec3(0.0f, 1.0f, 0.0f), direction);
+	float length = glm::length(right);
+	right = length > 1e-4f ? right / length : glm::vec3(1.0f, 0.0f, 0.0f);
+	up = glm::cross(direction, right);
+}
+
+uint32_t Impostor::Checksum(const std::vector<glm::vec3>& vertices, const std::vector<glm::vec3>& normals, const std::vector<glm::vec2>& tex_coords,
+	const uint8_t* texels, int texture_width, int texture_height, const glm::vec3& center, float radius)
+{
+	uint32_t checksum = 2166136261u;
+	checksum = Hash(checksum, vertices.data(), vertices.size() * sizeof(glm::vec3));
+	checksum = Hash(checksum, normals.data(), normals.size() * sizeof(glm::vec3));
+	checksum = Hash(checksum, tex_coords.data(), tex_coords.size() * sizeof(glm::vec2));
+	if (texels) {
+		int size[2] = { texture_width, texture_height };
+		checksum = Hash(checksum, size, sizeof(size));
+		checksum = Hash(checksum, texels, size_t(texture_width) * texture_height * 4);
+	}
+	checksum = Hash(checksum, &center, sizeof(center));
+	return Hash(checksum, &radius, sizeof(radius));
+}
+
+void Impostor::Bake(const std::vector<glm::vec3>& vertices, const std::vector<glm::vec3>& normals, const std::vector<glm::vec2>& tex_coords,
+	const uint8_t* texels, int texture_width, int texture_height, const glm::vec3& center, float radius, const Settings& settings)
+{
+	auto start = std::chrono::steady_clock::now();
+	this->settings = settings;
+	this->settings.frames = std::max(settings.frames, 2);
+	this->settings.frame_size = std::max(settings.frame_size, 1);
+	this->settings.supersample = std::max(settings.supersample, 1);
+	this->center = center;
+	this->radius = radius;
+	checksum = Checksum(vertices, normals, tex_coords, texels, texture_width, texture_height, center, radius);
+
+	const int frames = this->settings.frames;
+	const int size = this->settings.frame_size;
+	const int ss = this->settings.supersample;
+	const int atlas = AtlasSize();
+	albedo.assign(size_t(atlas) * atlas * 4, 0);
+	normal_depth.assign(size_t(atlas) * atlas * 4, 0);
+	size_t triangle_count = std::min(vertices.size(), std::min(normals.size(), tex_coords.size())) / 3;
+
+	ThreadPool::Shared().ParallelFor(0, frames * frames, [&](int frame) {
+		int fi = frame % frames, fj = frame / frames;
+		glm::vec3 direction = Direction(glm::vec2(float(fi), float(fj)) / float(frames - 1));
+		glm::vec3 right, up;
+		FrameAxes(direction, right, up);
+
+		// Samples of the view: depth towards the viewer in radii (-FLT_MAX where empty), color and normal
+		int samples = size * ss;
+		float to_samples = samples * 0.5f / radius;
+		std::vector<float> depth(size_t(samples) * samples, -FLT_MAX);
+		std::vector<glm::vec3> color(depth.size());
+		std::vector<glm::vec3> normal(depth.size());
+
+		for (size_t t = 0; t < triangle_count; ++t) {
+			glm::vec2 p[3];
+			float z[3];
+			for (int k = 0; k < 3; ++k) {
+				glm::vec3 relative = vertices[3 * t + k] - center;
+				p[k] = glm::vec2(glm::dot(relative, right), glm::dot(relative, up)) * to_samples + samples * 0.5f;
+				z[k] = glm::dot(relative, direction) / radius;
+			}
+			// Both windings, the foliage is two sided
+			float area = Edge(p[0], p[1], p[2]);
+			if (std::fabs(area) < 1e-12f)
+				continue;
+			int x0 = std::max(static_cast<int>(std::floor(std::min({ p[0].x, p[1].x, p[2].x }))), 0);
+			int x1 = std::min(static_cast<int>(std::ceil(std::max({ p[0].x, p[1].x, p[2].x }))), samples - 1);
+			int y0 = std::max(static_cast<int>(std::floor(std::min({ p[0].y, p[1].y, p[2].y }))), 0);
+			int y1 = std::min(static_cast<int>(std::ceil(std::max({ p[0].y, p[1].y, p[2].y }))), samples - 1);
+			for (int y = y0; y <= y1; ++y) {
+				for (int x = x0; x <= x1; ++x) {
+					glm::vec2 c(x + 0.5f, y + 0.5f);
+					float w0 = Edge(p[1], p[2], c) / area;
+					float w1 = Edge(p[2], p[0], c) / area;
+					float w2 = 1.0f - w0 - w1;
+					if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+						continue;
+					size_t i = size_t(y) * samples + x;
+					float d = w0 * z[0] + w1 * z[1] + w2 * z[2];
+					if (d <= depth[i])
+						continue;
+
+					glm::vec3 texel(1.0f);
+					if (texels) {
+						glm::vec2 uv = w0 * tex_coords[3 * t] + w1 * tex_coords[3 * t + 1] + w2 * tex_coords[3 * t + 2];
+						uv -= glm::floor(uv);
+						int tx = std::min(static_cast<int>(uv.x * texture_width), texture_width - 1);
+						int ty = std::min(static_cast<int>(uv.y * texture_height), texture_height - 1);
+						const uint8_t* rgba = texels + (size_t(ty) * texture_width + tx) * 4;
+						// Alpha test of the vegetation shader
+						if (rgba[3] < 0.1f * 255.0f)
+							continue;
+						texel = glm::vec3(rgba[0], rgba[1], rgba[2]) / 255.0f;
+					}
+					depth[i] = d;
+					color[i] = texel;
+					normal[i] = w0 * normals[3 * t] + w1 * normals[3 * t + 1] + w2 * normals[3 * t + 2];
+				}
+			}
+		}
+
+		// Averaged into the pixels, the coverage becomes the alpha
+		std::vector<float> coverage(size_t(size) * size, 0.0f);
+		std::vector<float> pixel_depth(coverage.size(), 0.0f);
+		std::vector<glm::vec3> pixel_color(coverage.size(), glm::vec3(0.0f));
+		std::vector<glm::vec3> pixel_normal(coverage.size(), glm::vec3(0.0f));
+		for (int py = 0; py < size; ++py) {
+			for (int px = 0; px < size; ++px) {
+				size_t o = size_t(py) * size + px;
+				int covered = 0;
+				float nearest = -FLT_MAX;
+				for (int sy = 0; sy < ss; ++sy) {
+					for (int sx = 0; sx < ss; ++sx) {
+						size_t i = size_t(py * ss + sy) * samples + px * ss + sx;
+						if (depth[i] == -FLT_MAX)
+							continue;
+						++covered;
+						pixel_color[o] += color[i];
+						pixel_normal[o] += normal[i];
+						nearest = std::max(nearest, depth[i]);
+					}
+				}
+				if (covered == 0)
+					continue;
+				coverage[o] = float(covered) / (ss * ss);
+				pixel_color[o] /= float(covered);
+				pixel_depth[o] = nearest;
+			}
+		}
+
+		// Empty pixels take the mean of their filled neighbours, the filtering of the atlas then does not pull
+		// black into the silhouette
+		std::vector<char> filled(coverage.size());
+		for (size_t o = 0; o < coverage.size(); ++o)
+			filled[o] = coverage[o] > 0.0f;
+		for (int pass = 0; pass < DILATE_PASSES; ++pass) {
+			std::vector<char> next = filled;
+			for (int py = 0; py < size; ++py) {
+				for (int px = 0; px < size; ++px) {
+					size_t o = size_t(py) * size + px;
+					if (filled[o])
+						continue;
+					int count = 0;
+					glm::vec3 sum_color(0.0f), sum_normal(0.0f);
+					float sum_depth = 0.0f;
+					for (int y = std::max(py - 1, 0); y <= std::min(py + 1, size - 1); ++y) {
+						for (int x = std::max(px - 1, 0); x <= std::min(px + 1, size - 1); ++x) {
+							size_t n = size_t(y) * size + x;
+							if (!filled[n])
+								continue;
+							++count;
+							sum_color += pixel_color[n];
+							sum_normal += pixel_normal[n];
+							sum_depth += pixel_depth[n];
+						}
+					}
+					if (count == 0)
+						continue;
+					pixel_color[o] = sum_color / float(count);
+					pixel_normal[o] = sum_normal;
+					pixel_depth[o] = sum_depth / count;
+					next[o] = 1;
+				}
+			}
+			filled.swap(next);
+		}
+
+		for (int py = 0; py < size; ++py) {
+			for (int px = 0; px < size; ++px) {
+				size_t o = size_t(py) * size + px;
+				size_t a = ((size_t(fj) * size + py) * atlas + size_t(fi) * size + px) * 4;
+				glm::vec3 n = glm::length(pixel_normal[o]) > 0.0f ? glm::normalize(pixel_normal[o]) : direction;
+				albedo[a + 0] = ToByte(pixel_color[o].r);
+				albedo[a + 1] = ToByte(pixel_color[o].g);
+				albedo[a + 2] = ToByte(pixel_color[o].b);
+				albedo[a + 3] = ToByte(coverage[o]);
+				normal_depth[a + 0] = ToByte(n.x * 0.5f + 0.5f);
+				normal_depth[a + 1] = ToByte(n.y * 0.5f + 0.5f);
+				normal_depth[a + 2] = ToByte(n.z * 0.5f + 0.5f);
+				normal_depth[a + 3] = ToByte(pixel_depth[o] * 0.5f + 0.5f);
+			}
+		}
+	});
+	bake_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool Impostor::Save(const maybewchar* filename) const
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file.is_open() || Empty())
+		return false;
+
+	Header header;
+	header.magic = MAGIC;
+	header.frames = settings.frames;
+	header.frame_size = settings.frame_size;
+	header.supersample = settings.supersample;
+	header.checksum = checksum;
+	header.center[0] = center.x;
+	header.center[1] = center.y;
+	header.center[2] = center.z;
+	header.radius = radius;
+	file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+	file.write(reinterpret_cast<const char*>(albedo.data()), albedo.size());
+	file.write(reinterpret_cast<const char*>(normal_depth.data()), normal_depth.size());
+	return file.good();
+}
+
+bool Impostor::Load(const maybewchar* filename, uint32_t source_checksum, const Settings& settings)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	Header header;
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(Header)))
+		return false;
+	if (header.magic != MAGIC || header.checksum != source_checksum || int(header.frames) != std::max(settings.frames, 2)
+		|| int(header.frame_size) != std::max(settings.frame_size, 1) || int(header.supersample) != std::max(settings.supersample, 1))
+		return false;
+
+	size_t atlas = size_t(header.frames) * header.frame_size;
+	std::vector<uint8_t> color(atlas * atlas * 4);
+	std::vector<uint8_t> normals(color.size());
+	if (!file.read(reinterpret_cast<char*>(color.data()), color.size()) || !file.read(reinterpret_cast<char*>(normals.data()), normals.size()))
+		return false;
+
+	this->settings.frames = header.frames;
+	this->settings.frame_size = header.frame_size;
+	this->settings.supersample = header.supersample;
+	checksum = header.checksum;
+	center = glm::vec3(header.center[0], header.center[1], header.center[2]);
+	radius = header.radius;
+	albedo.swap(color);
+	normal_depth.swap(normals);
+	return true;
+}
+
+void Impostor::CreateTextures()
+{
+	// Coarse mip levels would mix neighbouring frames, stop at 4 pixels per frame
+	int max_level = 0;
+	while ((settings.frame_size >> (max_level + 1)) >= 4)
+		max_level++;
+
+	GLuint* textures[2] = { &albedo_tex, &normal_depth_tex };
+	const std::vector<uint8_t>* data[2] = { &albedo, &normal_depth };
+	for (int i = 0; i < 2; ++i) {
+		glGenTextures(1, textures[i]);
+		glBindTexture(GL_TEXTURE_2D, *textures[i]);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, AtlasSize(), AtlasSize(), 0, GL_RGBA, GL_UNSIGNED_BYTE, data[i]->data());
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, max_level);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	const float corners[] = { -1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
+	glGenVertexArrays(1, &quad.VertexArrayObject);
+	glBindVertexArray(quad.VertexArrayObject);
+	glGenBuffers(1, &quad.VertexBuffers[0]);
+	glBindBuffer(GL_ARRAY_BUFFER, quad.VertexBuffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	quad.Mode = GL_TRIANGLE_STRIP;
+	quad.DrawArraysCount = 4;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include "Geometry.h"
+#include "TextureLoader.h"
+
+#include <vector>
+#include <iostream>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----        OCTAHEDRAL IMPOSTOR      ----
+//-----------------------------------------
+
+/// Octahedral impostor of a vegetation mesh: the mesh is rendered orthographically from frames * frames view
+/// directions over the upper hemisphere into one atlas of albedo (alpha = coverage) and one of normals and depth.
+/// Frame (i, j) sits at atlas pixel (i, j) * frame_size and looks from the hemi-octahedral direction of
+/// (i, j) / (frames - 1), see Direction. The bake is a small software rasterizer running the frames on the thread
+/// pool, it needs no GL context. The impostor shader draws a camera facing quad per instance and blends the three
+/// frames around the view direction of the instance.
+class Impostor
+{
+public:
+	struct Settings
+	{
+		/// Views along each side of the atlas
+		int frames = 12;
+		/// Pixels along each side of a view
+		int frame_size = 64;
+		/// Samples per pixel along each side, averaged into the coverage
+		int supersample = 2;
+	};
+
+	/// Bakes the triangles (3 vertices per triangle as ObjectLoader::ParseOBJFile returns them, model space)
+	/// textured with an RGBA image (bottom row first, white when 'texels' is null) and alpha tested like the
+	/// vegetation shader. 'center' and 'radius' bound the mesh, every view covers the square around the sphere.
+	void Bake(const std::vector<glm::vec3>& vertices, const std::vector<glm::vec3>& normals, const std::vector<glm::vec2>& tex_coords,
+		const uint8_t* texels, int texture_width, int texture_height, const glm::vec3& center, float radius, const Settings& settings);
+
+	/// Writes the atlases. Returns false if the file cannot be written.
+	bool Save(const maybewchar* filename) const;
+
+	/// Reads atlases written by Save. Returns false if the file is missing or damaged, or was baked from another
+	/// 'checksum' (of the source, see Checksum) or with other settings.
+	bool Load(const maybewchar* filename, uint32_t source_checksum, const Settings& settings);
+
+	/// FNV-1a over the mesh, the texture and the bounds, stored in the file to detect changed sources
+	static uint32_t Checksum(const std::vector<glm::vec3>& vertices, const std::vector<glm::vec3>& normals, const std::vector<glm::vec2>& tex_coords,
+		const uint8_t* texels, int texture_width, int texture_height, const glm::vec3& center, float radius);
+
+	/// Uploads the atlases (mipmapped) and creates the quad drawn per instance (corners -1 to 1 at location 0,
+	/// a triangle strip)
+	void CreateTextures();
+
+	bool Empty() const { return albedo.empty(); }
+	int Frames() const { return settings.frames; }
+	int AtlasSize() const { return settings.frames * settings.frame_size; }
+
+	/// View direction (towards the viewer, model space) of the hemi-octahedral coordinate 'uv' in [0, 1]^2
+	static glm::vec3 Direction(const glm::vec2& uv);
+	/// Axes of the view from 'direction', as the impostor shader builds them
+	static void FrameAxes(const glm::vec3& direction, glm::vec3& right, glm::vec3& up);
+
+	glm::vec3 center = glm::vec3(0.0f);
+	float radius = 1.0f;
+	/// RGBA8 atlas of the color, alpha is the coverage of the pixel
+	std::vector<uint8_t> albedo;
+	/// RGBA8 atlas of the model space normal (RGB * 2 - 1) and the depth towards the viewer in radii (A * 2 - 1)
+	std::vector<uint8_t> normal_depth;
+
+	GLuint albedo_tex = 0;
+	GLuint normal_depth_tex = 0;
+	Geometry quad;
+
+	/// Milliseconds of the last bake
+	double bake_ms = 0.0;
+
+private:
+	Settings settings;
+	uint32_t checksum = 0;
+};
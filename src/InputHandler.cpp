@@ -41,6 +41,13 @@ void InputHandler::OnKeyDown(unsigned char key, int mouseX, int mouseY, float* a
 	case 'd':
 		camera_input->vel_d = true;
 		break;
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+		brush = static_cast<Terrain::Brush>(key - '1');
+		brush_active = true;
+		break;
 	}
 }
 
@@ -60,6 +67,13 @@ void InputHandler::OnKeyUp(unsigned char key, int mouseX, int mouseY)
 	case 'd':
 		camera_input->vel_d = false;
 		break;
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+		if (brush == static_cast<Terrain::Brush>(key - '1'))
+			brush_active = false;
+		break;
 	}
 }
 
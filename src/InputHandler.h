@@ -9,6 +9,10 @@ private:
 	static const float SPEED_STEP;
 
 public:
+	/// Terrain brush held down with the keys 1 (raise), 2 (lower), 3 (flatten) and 4 (smooth)
+	bool brush_active = false;
+	Terrain::Brush brush = Terrain::Brush::Raise;
+
 	InputHandler() : camera_input(nullptr){ };
 
 	InputHandler(CameraInput* camera_input);
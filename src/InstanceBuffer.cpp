@@ -0,0 +1,161 @@
+#include "InstanceBuffer.h"
+#include "Loader.h"
+#include <algorithm>
+#include <cstddef>
+
+const float PackedInstance::TILT_STEP = 1.0f / 256.0f;
+
+PackedInstance PackedInstance::Pack(const glm::vec3& position, float yaw, float tilt_z, float tilt_x, float scale)
+{
+	auto quantize = [](float value) { return static_cast<uint8_t>(std::min(std::max(std::round(value), 0.0f), 255.0f)); };
+	float turns = yaw / 6.2831853f;
+	turns -= std::floor(turns);
+
+	PackedInstance instance;
+	instance.position = position;
+	instance.yaw = static_cast<uint8_t>(static_cast<int>(std::round(turns * 256.0f)) & 255);
+	instance.tilt_z = quantize(tilt_z / TILT_STEP + 128.0f);
+	instance.tilt_x = quantize(tilt_x / TILT_STEP + 128.0f);
+	instance.scale = quantize(scale * 64.0f);
+	return instance;
+}
+
+glm::mat4 PackedInstance::Matrix() const
+{
+	glm::mat4 mat(1.0f);
+	mat = glm::translate(mat, position);
+	mat = glm::rotate(mat, (float(tilt_z) - 128.0f) * TILT_STEP, glm::vec3(0.0f, 0.0f, 1.0f));
+	mat = glm::rotate(mat, (float(tilt_x) - 128.0f) * TILT_STEP, glm::vec3(1.0f, 0.0f, 0.0f));
+	mat = glm::rotate(mat, float(yaw) * (6.2831853f / 256.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	return glm::scale(mat, glm::vec3(float(scale) / 64.0f));
+}
+
+void InstanceBuffer::Upload(const PackedInstance* instances, int instance_count, Format upload_format)
+{
+	// Full matrices are only kept to compare the two formats
+	std::vector<glm::mat4> matrices;
+	const void* data = instances;
+	format = upload_format;
+	if (format == Format::Matrix) {
+		matrices.resize(instance_count);
+		for (int i = 0; i < instance_count; ++i)
+			matrices[i] = instances[i].Matrix();
+		data = matrices.data();
+	}
+
+	if (buffer == 0)
+		glGenBuffers(1, &buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	size_t size = size_t(instance_count) * Stride();
+	if (size > bytes) {
+		bytes = size;
+		glBufferData(GL_ARRAY_BUFFER, bytes, data, GL_DYNAMIC_DRAW);
+	}
+	else if (size > 0) {
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	count = instance_count;
+}
+
+PackedInstance* InstanceBuffer::Map(int max_count)
+{
+	if (buffer == 0)
+		glGenBuffers(1, &buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	size_t size = std::max<size_t>(size_t(max_count) * sizeof(PackedInstance), sizeof(PackedInstance));
+	if (size > bytes) {
+		bytes = size;
+		glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+	}
+	// The driver hands out fresh storage while the last frame still draws from the old one
+	void* data = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return static_cast<PackedInstance*>(data);
+}
+
+void InstanceBuffer::Unmap(int written)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	// The contents are lost when the storage was corrupted (e.g. a mode switch), draw nothing this frame
+	bool intact = glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE;
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	format = Format::Packed;
+	count = intact ? written : 0;
+}
+
+void InstanceBuffer::Reserve(int max_count)
+{
+	if (buffer == 0)
+		glGenBuffers(1, &buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	size_t size = std::max<size_t>(size_t(max_count) * sizeof(PackedInstance), sizeof(PackedInstance));
+	if (size > bytes) {
+		bytes = size;
+		glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_DYNAMIC_DRAW);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	format = Format::Packed;
+	count = 0;
+}
+
+void InstanceBuffer::Bind(const Geometry& geometry, GLint format_location, int first_instance) const
+{
+	// The attributes are part of the vertex array, geometries drawn from several buffers are re-pointed per draw.
+	// The attributes of the other format are disabled, their arrays would point past the end of the buffer.
+	glBindVertexArray(geometry.VertexArrayObject);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	bool packed = format == Format::Packed;
+	size_t offset = size_t(first_instance) * Stride();
+	for (GLuint location = PACKED_LOCATION; location < PACKED_LOCATION + 2; ++location) {
+		if (packed)
+			glEnableVertexAttribArray(location);
+		else
+			glDisableVertexAttribArray(location);
+	}
+	for (GLuint column = 0; column < 4; ++column) {
+		if (packed)
+			glDisableVertexAttribArray(MATRIX_LOCATION + column);
+		else
+			glEnableVertexAttribArray(MATRIX_LOCATION + column);
+	}
+	if (packed) {
+		glVertexAttribPointer(PACKED_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(PackedInstance), (const void*)offset);
+		glVertexAttribDivisor(PACKED_LOCATION, 1);
+		glVertexAttribIPointer(PACKED_LOCATION + 1, 4, GL_UNSIGNED_BYTE, sizeof(PackedInstance), (const void*)(offset + offsetof(PackedInstance, yaw)));
+		glVertexAttribDivisor(PACKED_LOCATION + 1, 1);
+	}
+	else {
+		for (GLuint column = 0; column < 4; ++column) {
+			glVertexAttribPointer(MATRIX_LOCATION + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (const void*)(offset + sizeof(glm::vec4) * column));
+			glVertexAttribDivisor(MATRIX_LOCATION + column, 1);
+		}
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glUniform1i(format_location, packed ? 1 : 0);
+}
+
+void InstanceBuffer::Draw(const Geometry& geometry, GLint format_location) const
+{
+	if (count == 0)
+		return;
+	Bind(geometry, format_location);
+	Loader::DrawGeometryInstanced(geometry, count);
+}
+
+void InstanceBuffer::DrawRange(const Geometry& geometry, GLint format_location, int first_instance, int instance_count, int first_vertex, int vertex_count) const
+{
+	if (instance_count <= 0 || vertex_count <= 0)
+		return;
+	Bind(geometry, format_location, first_instance);
+	glDrawArraysInstanced(geometry.Mode, first_vertex, vertex_count, instance_count);
+}
+
+void InstanceBuffer::Release()
+{
+	glDeleteBuffers(1, &buffer);
+	buffer = 0;
+	count = 0;
+	bytes = 0;
+}
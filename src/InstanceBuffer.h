@@ -0,0 +1,91 @@
+#pragma once
+#include "Geometry.h"
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----          INSTANCE BUFFER        ----
+//-----------------------------------------
+
+/// 16 byte instance transform, translate(position) * rotate_z(tilt_z) * rotate_x(tilt_x) * rotate_y(yaw) * scale.
+/// The tilts align the instance with the terrain slope and stay within +-128 TILT_STEP radians.
+struct PackedInstance
+{
+	glm::vec3 position;
+	/// Yaw in 1/256 turns
+	uint8_t yaw;
+	/// Tilts in TILT_STEP radians, biased by 128
+	uint8_t tilt_z;
+	uint8_t tilt_x;
+	/// Uniform scale in 1/64 (64 = 1.0)
+	uint8_t scale;
+
+	static const float TILT_STEP;
+
+	/// Quantizes the transform, angles in radians
+	static PackedInstance Pack(const glm::vec3& position, float yaw, float tilt_z, float tilt_x, float scale = 1.0f);
+
+	/// Model matrix of the instance, as decoded by the vegetation shader
+	glm::mat4 Matrix() const;
+};
+static_assert(sizeof(PackedInstance) == 16, "PackedInstance must stay 16 bytes");
+
+/// Per instance transforms of instanced geometry in a vertex buffer, the instance count is only limited by memory.
+/// The vegetation shader reads either the packed instances (instance_position and instance_packed, from
+/// PACKED_LOCATION) or full model matrices (instance_matrix, one location per column from MATRIX_LOCATION),
+/// selected by its packed_instances uniform. The buffer grows on upload and is never shrunk.
+/// Copies share the GL buffer, Release deletes it.
+class InstanceBuffer
+{
+public:
+	enum class Format
+	{
+		/// PackedInstance, 16 bytes per instance
+		Packed,
+		/// glm::mat4 decoded on upload, 64 bytes per instance
+		Matrix
+	};
+
+	/// Attribute locations of the two formats
+	static const GLuint PACKED_LOCATION = 3;
+	static const GLuint MATRIX_LOCATION = 5;
+
+	/// Replaces the contents with the instances, reallocates the buffer when they do not fit
+	void Upload(const PackedInstance* instances, int instance_count, Format upload_format = Format::Packed);
+	void Upload(const std::vector<PackedInstance>& instances, Format upload_format = Format::Packed) {
+		Upload(instances.data(), static_cast<int>(instances.size()), upload_format);
+	}
+
+	/// Orphans the storage and maps room for 'max_count' packed instances for writing (from any thread), for
+	/// contents rebuilt every frame. Unmap with the number of instances written.
+	PackedInstance* Map(int max_count);
+	void Unmap(int written);
+
+	/// Allocates room for 'max_count' packed instances without contents (written on the GPU), count becomes 0
+	void Reserve(int max_count);
+
+	/// Binds the vertex array of the geometry, points its instance attributes at this buffer (from instance
+	/// 'first_instance' on) and sets the packed_instances uniform of the bound program (at 'format_location')
+	void Bind(const Geometry& geometry, GLint format_location, int first_instance = 0) const;
+
+	/// Bind and draw all instances
+	void Draw(const Geometry& geometry, GLint format_location) const;
+
+	/// Draws the instances [first_instance, first_instance + instance_count) with the vertices
+	/// [first_vertex, first_vertex + vertex_count) of the geometry (a LOD range, see ObjectLoader::LoadOBJLods)
+	void DrawRange(const Geometry& geometry, GLint format_location, int first_instance, int instance_count, int first_vertex, int vertex_count) const;
+
+	void Release();
+
+	/// Bytes of one instance in the current format
+	size_t Stride() const { return format == Format::Packed ? sizeof(PackedInstance) : sizeof(glm::mat4); }
+
+	GLuint buffer = 0;
+	Format format = Format::Packed;
+	/// Instances of the last upload
+	int count = 0;
+	/// Bytes allocated on the GPU
+	size_t bytes = 0;
+};
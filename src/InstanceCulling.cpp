@@ -0,0 +1,354 @@
+#include "InstanceCulling.h"
+#include "InstanceCullingKernels.h"
+#include "ThreadPool.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <cfloat>
+#include <algorithm>
+
+namespace {
+	// Packets of the block with the SIMD kernel the CPU runs, the remainder with the scalar one
+	int CullBlock(const float* x, const float* y, const float* z, const float* r, int begin, int end, const Frustum& frustum, float min_y, int32_t* out, bool simd) {
+		if (!simd)
+			return InstanceCullingKernels::CullBlock<ScalarFloat>(x, y, z, r, begin, end, frustum, min_y, out);
+		if (Simd::Avx2())
+			return InstanceCullingKernels::CullBlock<Avx2::SimdFloat>(x, y, z, r, begin, end, frustum, min_y, out);
+		return InstanceCullingKernels::CullBlock<SimdFloat>(x, y, z, r, begin, end, frustum, min_y, out);
+	}
+}
+
+void InstanceCulling::Build(const std::vector<PackedInstance>& placed, const glm::mat4& model, const Sphere& bounds, const TerrainVisibility* visibility)
+{
+	size_t n = placed.size();
+	bool cells = visibility && !visibility->Empty();
+	int pvs_slots = cells ? visibility->CellCount() + 1 : 1;
+
+	// World spheres in placement order and their extent on the ground
+	std::vector<glm::vec4> spheres(n);
+	glm::vec4 center = model * glm::vec4(bounds.center, 1.0f);
+	glm::vec2 low(FLT_MAX), high(-FLT_MAX);
+	for (size_t i = 0; i < n; ++i) {
+		const PackedInstance& instance = placed[i];
+		glm::vec3 world = glm::vec3(instance.Matrix() * center);
+		spheres[i] = glm::vec4(world, bounds.radius * float(instance.scale) / 64.0f);
+		low = glm::min(low, glm::vec2(world.x, world.z));
+		high = glm::max(high, glm::vec2(world.x, world.z));
+	}
+
+	// Bucket key: grid cell, then PVS cell (0 outside the cells)
+	std::vector<int32_t> keys(n);
+	glm::vec2 scale = float(GRID) / glm::max(high - low, glm::vec2(1e-6f));
+	for (size_t i = 0; i < n; ++i) {
+		int gx = std::min(static_cast<int>((spheres[i].x - low.x) * scale.x), GRID - 1);
+		int gz = std::min(static_cast<int>((spheres[i].z - low.y) * scale.y), GRID - 1);
+		int pvs = cells ? visibility->CellAt(placed[i].position.x, placed[i].position.z) + 1 : 0;
+		keys[i] = (gz * GRID + gx) * pvs_slots + pvs;
+	}
+
+	// Counting sort by key, keeping the placement order inside a bucket
+	std::vector<int> offsets(size_t(GRID) * GRID * pvs_slots + 1, 0);
+	for (int32_t key : keys)
+		++offsets[key + 1];
+	for (size_t key = 1; key < offsets.size(); ++key)
+		offsets[key] += offsets[key - 1];
+	buckets.clear();
+	for (size_t key = 0; key + 1 < offsets.size(); ++key) {
+		if (offsets[key] == offsets[key + 1])
+			continue;
+		Bucket bucket = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX), offsets[key], offsets[key + 1], int32_t(key % pvs_slots) - 1, FLT_MAX, 0.0f };
+		buckets.push_back(bucket);
+	}
+
+	instances.resize(n);
+	center_x.resize(n);
+	center_y.resize(n);
+	center_z.resize(n);
+	radius.resize(n);
+	for (size_t i = 0; i < n; ++i) {
+		int j = offsets[keys[i]]++;
+		instances[j] = placed[i];
+		center_x[j] = spheres[i].x;
+		center_y[j] = spheres[i].y;
+		center_z[j] = spheres[i].z;
+		radius[j] = spheres[i].w;
+	}
+	for (Bucket& bucket : buckets) {
+		for (int i = bucket.begin; i < bucket.end; ++i) {
+			glm::vec3 c(center_x[i], center_y[i], center_z[i]);
+			bucket.min = glm::min(bucket.min, c - radius[i]);
+			bucket.max = glm::max(bucket.max, c + radius[i]);
+			bucket.min_radius = std::min(bucket.min_radius, radius[i]);
+			bucket.max_radius = std::max(bucket.max_radius, radius[i]);
+		}
+	}
+}
+
+int InstanceCulling::Cull(const Frustum& frustum, float min_y, const std::vector<char>* visible_cells, const HiZMap* occlusion, PackedInstance* out) const
+{
+	return CullBuckets(frustum, min_y, visible_cells, occlusion, out, true, true, true);
+}
+
+int InstanceCulling::CullScalar(const Frustum& frustum, float min_y, const std::vector<char>* visible_cells, const HiZMap* occlusion,
+	PackedInstance* out) const
+{
+	return CullBuckets(frustum, min_y, visible_cells, occlusion, out, false, false, false);
+}
+
+void InstanceCulling::TestBuckets(const Frustum& frustum, float min_y, const std::vector<char>* visible_cells, const HiZMap* occlusion, bool parallel,
+	bool simd, bool hierarchical) const
+{
+	int count = static_cast<int>(buckets.size());
+	survivors.resize(instances.size());
+	states.resize(count);
+	bucket_counts.assign(count + 1, 0);
+	occluded_counts.assign(count, 0);
+	bool use_cells = visible_cells && !visible_cells->empty();
+
+	// Boxes first, then the spheres of the intersected buckets
+	auto test = [&](int b) {
+		const Bucket& bucket = buckets[b];
+		BucketState state = BucketState::Intersected;
+		if (use_cells && bucket.pvs_cell >= 0 && !(*visible_cells)[bucket.pvs_cell])
+			state = BucketState::Outside;
+		else if (hierarchical) {
+			if (bucket.max.y <= min_y || !frustum.IntersectsBox(bucket.min, bucket.max))
+				state = BucketState::Outside;
+			else if (bucket.min.y > min_y && frustum.ContainsBox(bucket.min, bucket.max))
+				state = BucketState::Inside;
+		}
+		states[b] = state;
+		if (state == BucketState::Intersected)
+			bucket_counts[b + 1] = CullBlock(center_x.data(), center_y.data(), center_z.data(), radius.data(), bucket.begin, bucket.end, frustum, min_y,
+				&survivors[bucket.begin], simd);
+		else if (state == BucketState::Inside)
+			bucket_counts[b + 1] = bucket.end - bucket.begin;
+
+		// Occlusion of the whole bucket, then of the listed survivors
+		int survived = bucket_counts[b + 1];
+		if (!occlusion || survived == 0)
+			return;
+		if (!occlusion->BoxVisible(bucket.min, bucket.max)) {
+			states[b] = BucketState::Outside;
+			bucket_counts[b + 1] = 0;
+			occluded_counts[b] = survived;
+		}
+		else if (state == BucketState::Intersected) {
+			int32_t* indices = &survivors[bucket.begin];
+			int kept = 0;
+			for (int i = 0; i < survived; ++i) {
+				int j = indices[i];
+				indices[kept] = j;
+				kept += occlusion->SphereVisible(glm::vec3(center_x[j], center_y[j], center_z[j]), radius[j]);
+			}
+			bucket_counts[b + 1] = kept;
+			occluded_counts[b] = survived - kept;
+		}
+	};
+	if (parallel)
+		ThreadPool::Shared().ParallelFor(0, count, test);
+	else
+		for (int b = 0; b < count; ++b)
+			test(b);
+	occluded = 0;
+	for (int hidden : occluded_counts)
+		occluded += hidden;
+}
+
+int InstanceCulling::CullBuckets(const Frustum& frustum, float min_y, const std::vector<char>* visible_cells, const HiZMap* occlusion, PackedInstance* out,
+	bool parallel, bool simd, bool hierarchical) const
+{
+	TestBuckets(frustum, min_y, visible_cells, occlusion, parallel, simd, hierarchical);
+	int count = static_cast<int>(buckets.size());
+
+	// Offsets of the buckets in the output, then the copy
+	auto copy = [&](int b) {
+		const Bucket& bucket = buckets[b];
+		PackedInstance* target = out + bucket_counts[b];
+		if (states[b] == BucketState::Inside) {
+			std::memcpy(target, &instances[bucket.begin], size_t(bucket.end - bucket.begin) * sizeof(PackedInstance));
+			return;
+		}
+		const int32_t* indices = &survivors[bucket.begin];
+		int survived = bucket_counts[b + 1] - bucket_counts[b];
+		for (int i = 0; i < survived; ++i)
+			target[i] = instances[indices[i]];
+	};
+	for (int b = 0; b < count; ++b)
+		bucket_counts[b + 1] += bucket_counts[b];
+	if (parallel)
+		ThreadPool::Shared().ParallelFor(0, count, copy);
+	else
+		for (int b = 0; b < count; ++b)
+			copy(b);
+	return bucket_counts[count];
+}
+
+int InstanceCulling::SelectLods(const Frustum& frustum, float min_y, const std::vector<char>* visible_cells, const HiZMap* occlusion, const LodSettings& lods,
+	const glm::vec3& eye, float pixel_scale, int* lod_counts) const
+{
+	TestBuckets(frustum, min_y, visible_cells, occlusion, true, true, true);
+	int count = static_cast<int>(buckets.size());
+	int lod_count = std::min(std::max(lods.count, 1), static_cast<int>(MAX_LODS));
+	survivor_lods.resize(instances.size());
+	bucket_lods.resize(count);
+	lod_offsets.assign(size_t(count + 1) * MAX_LODS, 0);
+
+	// Squared projected sizes where every LOD ends, above (LOD 0 has no upper end) and below (0 keeps all)
+	float band = std::max(lods.band, 0.0f);
+	float upper[MAX_LODS], lower[MAX_LODS];
+	for (int lod = 0; lod < lod_count; ++lod) {
+		float end = lod + 1 < lod_count ? lods.pixels[lod] : lods.cutoff_pixels;
+		float begin = lod > 0 ? lods.pixels[lod - 1] * (1.0f + band) : FLT_MAX;
+		upper[lod] = lod > 0 ? begin * begin : FLT_MAX;
+		lower[lod] = end * (1.0f - band) * end * (1.0f - band);
+	}
+	// One bit per LOD for a squared size, instances inside a transition get two (or none below the cutoff)
+	for (int lod = lod_count; lod < MAX_LODS; ++lod) {
+		upper[lod] = 0.0f;
+		lower[lod] = FLT_MAX;
+	}
+	auto mask_of = [upper, lower](float pixels2) {
+		int mask = 0;
+		for (int lod = 0; lod < MAX_LODS; ++lod)
+			mask |= int(pixels2 < upper[lod] && pixels2 > lower[lod]) << lod;
+		return uint8_t(mask);
+	};
+	float diameter_scale = 2.0f * pixel_scale;
+
+	auto select = [&](int b) {
+		const Bucket& bucket = buckets[b];
+		int* counts = &lod_offsets[size_t(b + 1) * MAX_LODS];
+		int survived = bucket_counts[b + 1];
+		if (survived == 0) {
+			bucket_lods[b] = 0;
+			return;
+		}
+
+		// The whole bucket in one LOD range when its nearest largest and farthest smallest instance agree
+		glm::vec3 nearest = glm::clamp(eye, bucket.min, bucket.max) - eye;
+		glm::vec3 farthest = glm::max(glm::abs(bucket.min - eye), glm::abs(bucket.max - eye));
+		float largest = diameter_scale * bucket.max_radius, smallest = diameter_scale * bucket.min_radius;
+		uint8_t near_mask = mask_of(largest * largest / std::max(glm::dot(nearest, nearest), 1e-12f));
+		uint8_t far_mask = mask_of(smallest * smallest / std::max(glm::dot(farthest, farthest), 1e-12f));
+		if (near_mask == far_mask) {
+			bucket_lods[b] = near_mask;
+			for (int lod = 0; lod < lod_count; ++lod)
+				counts[lod] = (near_mask >> lod) & 1 ? survived : 0;
+			return;
+		}
+
+		bucket_lods[b] = MIXED_LODS;
+		bool listed = states[b] != BucketState::Inside;
+		const int32_t* indices = &survivors[bucket.begin];
+		uint8_t* masks = &survivor_lods[bucket.begin];
+		int local[MAX_LODS] = {};
+		for (int i = 0; i < survived; ++i) {
+			int j = listed ? indices[i] : bucket.begin + i;
+			float dx = center_x[j] - eye.x, dy = center_y[j] - eye.y, dz = center_z[j] - eye.z;
+			float size = diameter_scale * radius[j];
+			uint8_t mask = mask_of(size * size / std::max(dx * dx + dy * dy + dz * dz, 1e-12f));
+			for (int lod = 0; lod < MAX_LODS; ++lod)
+				local[lod] += (mask >> lod) & 1;
+			masks[i] = mask;
+		}
+		for (int lod = 0; lod < lod_count; ++lod)
+			counts[lod] = local[lod];
+	};
+	ThreadPool::Shared().ParallelFor(0, count, select);
+
+	// Offsets LOD after LOD
+	int total = 0;
+	for (int lod = 0; lod < MAX_LODS; ++lod) {
+		int start = total;
+		for (int b = 0; b < count; ++b) {
+			int n = lod_offsets[size_t(b + 1) * MAX_LODS + lod];
+			lod_offsets[size_t(b) * MAX_LODS + lod] = total;
+			total += n;
+		}
+		lod_offsets[size_t(count) * MAX_LODS + lod] = total;
+		lod_counts[lod] = lod < lod_count ? total - start : 0;
+	}
+	return total;
+}
+
+void InstanceCulling::WriteLods(PackedInstance* out) const
+{
+	int count = static_cast<int>(buckets.size());
+	ThreadPool::Shared().ParallelFor(0, count, [&](int b) {
+		const Bucket& bucket = buckets[b];
+		int survived = bucket_counts[b + 1];
+		bool listed = states[b] != BucketState::Inside;
+		uint8_t mask = bucket_lods[b];
+		if (mask != MIXED_LODS) {
+			// Whole ranges, in one piece for the buckets completely inside
+			for (int lod = 0; mask; ++lod, mask >>= 1) {
+				if (!(mask & 1))
+					continue;
+				PackedInstance* target = out + lod_offsets[size_t(b) * MAX_LODS + lod];
+				if (!listed)
+					std::memcpy(target, &instances[bucket.begin], size_t(survived) * sizeof(PackedInstance));
+				else
+					for (int i = 0; i < survived; ++i)
+						target[i] = instances[survivors[bucket.begin + i]];
+			}
+			return;
+		}
+
+		int cursor[MAX_LODS];
+		for (int lod = 0; lod < MAX_LODS; ++lod)
+			cursor[lod] = lod_offsets[size_t(b) * MAX_LODS + lod];
+		for (int i = 0; i < survived; ++i) {
+			const PackedInstance& instance = instances[listed ? survivors[bucket.begin + i] : bucket.begin + i];
+			for (int lod = 0, bits = survivor_lods[bucket.begin + i]; bits; ++lod, bits >>= 1)
+				if (bits & 1)
+					out[cursor[lod]++] = instance;
+		}
+	});
+}
+
+void InstanceCulling::RunBenchmark(std::ostream& out)
+{
+	// 1M instances over the single terrain, seen from the map center
+	const int COUNT = 1000000;
+	std::mt19937 gen(1);
+	std::uniform_real_distribution<float> area(-50.0f, 50.0f), height(0.0f, 15.0f), angle(0.0f, 6.28f);
+	std::vector<PackedInstance> instances(COUNT);
+	for (PackedInstance& instance : instances)
+		instance = PackedInstance::Pack(glm::vec3(area(gen), height(gen), area(gen)), angle(gen), 0.0f, 0.0f);
+
+	InstanceCulling culling;
+	culling.Build(instances, glm::mat4(1.0f), { glm::vec3(0.0f, 1.0f, 0.0f), 1.9f });
+	glm::mat4 projection = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 1000.0f);
+	glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 6.0f, 0.0f), glm::vec3(50.0f, 2.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	Frustum frustum(projection * view);
+	std::vector<PackedInstance> result(COUNT);
+
+	unsigned threads = ThreadPool::Shared().ThreadCount() + 1;
+	struct Run { const char* name; bool parallel; bool simd; bool hierarchical; unsigned cores; };
+	const Run runs[] = {
+		{ "flat", false, false, false, 1 },
+		{ "flat", false, true, false, 1 },
+		{ "flat", true, true, false, threads },
+		{ "grid", false, true, true, 1 },
+		{ "grid", true, true, true, threads },
+	};
+	for (const Run& run : runs) {
+		const int REPEATS = 20;
+		int visible = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (int repeat = 0; repeat < REPEATS; ++repeat)
+			visible = culling.CullBuckets(frustum, -1e30f, nullptr, nullptr, result.data(), run.parallel, run.simd, run.hierarchical);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / REPEATS;
+		out << "Cull " << COUNT << " instances (" << run.name << ", " << (run.simd ? Simd::Name() : "scalar") << ", " << run.cores
+			<< (run.cores == 1 ? " thread" : " threads") << "): " << ms << " ms per frame, " << (COUNT / (ms * 1000.0)) / run.cores
+			<< " Minstances/s per core, " << visible << " visible" << std::endl;
+	}
+
+	int states[3] = {};
+	for (BucketState state : culling.states)
+		++states[static_cast<int>(state)];
+	out << "Buckets: " << culling.buckets.size() << ", " << states[static_cast<int>(BucketState::Outside)] << " outside, "
+		<< states[static_cast<int>(BucketState::Inside)] << " inside, " << states[static_cast<int>(BucketState::Intersected)] << " intersected" << std::endl;
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include "InstanceBuffer.h"
+#include "Frustum.h"
+#include "TerrainVisibility.h"
+#include "HiZMap.h"
+
+#include <vector>
+#include <iostream>
+#include <cstdint>
+
+//-----------------------------------------
+//----        INSTANCE CULLING         ----
+//-----------------------------------------
+
+/// Per frame culling of one vegetation type. Build buckets the instances into a uniform grid over the ground
+/// (split further by PVS cell when there is one) and keeps them sorted by bucket, with the world bounding sphere
+/// of every instance as structure of arrays and a box per bucket. Cull tests the boxes first: buckets outside the
+/// frustum or on hidden cells are skipped, buckets completely inside are copied as one contiguous range, and only
+/// the intersected ones test their spheres one SIMD packet (8 instances with AVX2) at a time. Buckets are spread
+/// over the thread pool and the survivors compacted in bucket order into the output (usually a mapped
+/// InstanceBuffer). With an occlusion map the visible buckets are tested against it as a whole and the survivors
+/// of the intersected ones one by one. The same lists serve the main camera and the mirrored camera of the
+/// reflection pass, which also drops instances that do not reach above the water.
+class InstanceCulling
+{
+public:
+	/// Bounding sphere of an instanced model in model space
+	struct Sphere
+	{
+		glm::vec3 center;
+		float radius;
+	};
+
+	static const int MAX_LODS = 4;
+
+	/// LOD selection by projected size, the diameter in pixels of an instance's sphere at its distance from the eye
+	struct LodSettings
+	{
+		/// Mesh LODs, LOD i is used down to pixels[i] and the last one down to cutoff_pixels
+		int count = 1;
+		float pixels[MAX_LODS - 1] = {};
+		/// Smaller instances are dropped, 0 keeps them all
+		float cutoff_pixels = 0.0f;
+		/// Half width of the transitions relative to the switch size. Instances inside a transition are written to
+		/// both LODs (or to the last one only at the cutoff), the vegetation shader cross-fades them with a dither pattern.
+		/// The band is a cross-fade only, there is no hysteresis: the selection keeps no state between frames and the
+		/// shares follow the projected size, an instance going back and forth over a switch fades instead of popping.
+		float band = 0.15f;
+	};
+
+	/// Buckets and bounds of 'instances' drawn with the model matrix 'model' (instance * model * position, as the
+	/// vegetation shader). With a non-empty 'visibility' no bucket spans two PVS cells. The instances are copied.
+	void Build(const std::vector<PackedInstance>& instances, const glm::mat4& model, const Sphere& bounds, const TerrainVisibility* visibility = nullptr);
+
+	/// Copies the instances inside the frustum whose spheres reach above 'min_y' to 'out' (room for Size() instances)
+	/// and returns their count. 'visible_cells' (one flag per PVS cell, may be null or empty) drops instances on
+	/// hidden cells, 'occlusion' (may be null) the instances it hides.
+	int Cull(const Frustum& frustum, float min_y, const std::vector<char>* visible_cells, const HiZMap* occlusion, PackedInstance* out) const;
+
+	/// Same on one thread with the scalar kernel (reference)
+	int CullScalar(const Frustum& frustum, float min_y, const std::vector<char>* visible_cells, const HiZMap* occlusion, PackedInstance* out) const;
+
+	/// Culls like Cull and sorts the survivors into LODs. 'pixel_scale' is the viewport height over 2 tan(fov_y / 2).
+	/// Fills the instance count of every LOD and returns their sum (up to twice Size()), WriteLods copies them.
+	int SelectLods(const Frustum& frustum, float min_y, const std::vector<char>* visible_cells, const HiZMap* occlusion, const LodSettings& lods,
+		const glm::vec3& eye, float pixel_scale, int* lod_counts) const;
+
+	/// Writes the instances of the last SelectLods to 'out', LOD after LOD
+	void WriteLods(PackedInstance* out) const;
+
+	int Size() const { return static_cast<int>(instances.size()); }
+
+	/// Instances inside the frustum dropped by the occlusion test of the last Cull or SelectLods
+	int Occluded() const { return occluded; }
+
+	/// Times the culling of 1M instances (scalar, SIMD on one thread and on the pool, each flat and by bucket)
+	/// and prints the time per frame and the rate per core
+	static void RunBenchmark(std::ostream& out = std::cout);
+
+private:
+	/// Grid cells along each side of the instance extent
+	static const int GRID = 32;
+
+	struct Bucket
+	{
+		/// Box around the spheres of the bucket
+		glm::vec3 min;
+		glm::vec3 max;
+		/// Range of the sorted instances
+		int begin;
+		int end;
+		/// PVS cell, -1 outside the cells or without a PVS (always drawn)
+		int32_t pvs_cell;
+		/// Smallest and largest sphere of the bucket
+		float min_radius;
+		float max_radius;
+	};
+
+	enum class BucketState : char { Outside, Inside, Intersected };
+
+	/// Instances sorted by bucket and their world spheres
+	std::vector<PackedInstance> instances;
+	std::vector<float> center_x;
+	std::vector<float> center_y;
+	std::vector<float> center_z;
+	std::vector<float> radius;
+	std::vector<Bucket> buckets;
+
+	/// Survivor indices (at the bucket start), state and survivor count of every bucket, reused between calls
+	mutable std::vector<int32_t> survivors;
+	mutable std::vector<BucketState> states;
+	mutable std::vector<int> bucket_counts;
+	/// Survivors of the frustum test hidden in the occlusion map, per bucket and in total
+	mutable std::vector<int> occluded_counts;
+	mutable int occluded = 0;
+	/// LODs of every survivor (one bit per LOD, next to its index), of whole buckets (MIXED_LODS when they differ)
+	/// and output offset of every bucket and LOD
+	mutable std::vector<uint8_t> survivor_lods;
+	mutable std::vector<uint8_t> bucket_lods;
+	mutable std::vector<int> lod_offsets;
+	static const uint8_t MIXED_LODS = 0xff;
+
+	/// States and survivors of the buckets (not listed for the buckets completely inside), the survivor counts
+	/// (not summed up) at bucket_counts[b + 1]
+	void TestBuckets(const Frustum& frustum, float min_y, const std::vector<char>* visible_cells, const HiZMap* occlusion, bool parallel, bool simd,
+		bool hierarchical) const;
+
+	/// 'hierarchical' false tests every instance of the visible PVS cells (flat culling, for the benchmark)
+	int CullBuckets(const Frustum& frustum, float min_y, const std::vector<char>* visible_cells, const HiZMap* occlusion, PackedInstance* out,
+		bool parallel, bool simd, bool hierarchical) const;
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include "Frustum.h"
+#include "Simd.h"
+
+#include <cstdint>
+
+//-----------------------------------------
+//----    INSTANCE CULLING KERNELS     ----
+//-----------------------------------------
+
+/// SIMD kernels of InstanceCulling, instantiated for the baseline in InstanceCulling.cpp and for AVX2 in SimdAvx2.cpp
+namespace InstanceCullingKernels
+{
+	// Writes the indices of the instances in [begin, end) inside all planes and above min_y to 'out', returns their count
+	template<class S>
+	int CullRange(const float* x, const float* y, const float* z, const float* r, int begin, int end, const Frustum& frustum, float min_y, int32_t* out) {
+		typedef typename S::F F;
+		F px[6], py[6], pz[6], pw[6];
+		for (int p = 0; p < 6; ++p) {
+			px[p] = S::Set(frustum.planes[p].x);
+			py[p] = S::Set(frustum.planes[p].y);
+			pz[p] = S::Set(frustum.planes[p].z);
+			pw[p] = S::Set(frustum.planes[p].w);
+		}
+		F zero = S::Set(0.0f);
+		F low = S::Set(min_y);
+
+		int count = 0;
+		for (int i = begin; i + S::WIDTH <= end; i += S::WIDTH) {
+			F cx = S::Load(x + i), cy = S::Load(y + i), cz = S::Load(z + i), cr = S::Load(r + i);
+			// Outside when the sphere is behind any plane or ends under min_y
+			typename S::M outside = S::LessEqual(S::Add(cy, cr), low);
+			for (int p = 0; p < 6; ++p) {
+				F distance = S::Add(S::Add(S::Mul(px[p], cx), S::Mul(py[p], cy)), S::Add(S::Mul(pz[p], cz), pw[p]));
+				outside = S::Or(outside, S::Less(S::Add(distance, cr), zero));
+			}
+			// Branch free compaction: every lane is written, the count only advances for the inside ones
+			int inside = ~S::MaskBits(outside);
+			for (int lane = 0; lane < S::WIDTH; ++lane) {
+				out[count] = i + lane;
+				count += (inside >> lane) & 1;
+			}
+		}
+		return count;
+	}
+
+	/// Packets of the block with the kernel of S, the remainder with the scalar one
+	template<class S>
+	int CullBlock(const float* x, const float* y, const float* z, const float* r, int begin, int end, const Frustum& frustum, float min_y, int32_t* out) {
+		typedef typename S::Scalar Scalar;
+		int packets = begin + (end - begin) / S::WIDTH * S::WIDTH;
+		int count = CullRange<S>(x, y, z, r, begin, packets, frustum, min_y, out);
+		return count + CullRange<Scalar>(x, y, z, r, packets, end, frustum, min_y, out + count);
+	}
+}
+
+#if !defined(SIMD_AVX2)
+extern template int InstanceCullingKernels::CullBlock<Avx2::SimdFloat>(const float*, const float*, const float*, const float*, int, int,
+	const Frustum&, float, int32_t*);
+#endif
@@ -79,6 +79,7 @@ GLuint Loader::LoadAndCompileShader(GLenum shader_type, const char* file_name)
         case GL_GEOMETRY_SHADER:        cout << "Failed to compile geometry shader " << file_name << endl;                    break;
         case GL_TESS_CONTROL_SHADER:    cout << "Failed to compile tessellation control shader " << file_name << endl;        break;
         case GL_TESS_EVALUATION_SHADER: cout << "Failed to compile tessellation evaluation shader " << file_name << endl;    break;
+        case GL_COMPUTE_SHADER:         cout << "Failed to compile compute shader " << file_name << endl;                    break;
         default:                        cout << "Failed to compile shader " << file_name << endl;                            break;
         }
 
@@ -157,6 +158,37 @@ GLuint Loader::CreateAndLinkProgram(const char* vertex_shader, const char* fragm
         -1, nullptr, -1, nullptr, -1, nullptr);
 }
 
+GLuint Loader::CreateAndLinkComputeProgram(const char* compute_shader)
+{
+    GLuint cs_shader = LoadAndCompileShader(GL_COMPUTE_SHADER, compute_shader);
+    if (0 == cs_shader)
+    {
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, cs_shader);
+    glLinkProgram(program);
+
+    int link_status;
+    glGetProgramiv(program, GL_LINK_STATUS, &link_status);
+    if (GL_FALSE == link_status)
+    {
+        cout << "Failed to link program with compute shader " << compute_shader << endl;
+
+        int log_len = 0;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_len);
+        unique_ptr<char[]> log(new char[log_len]);
+        glGetProgramInfoLog(program, log_len, nullptr, log.get());
+        cout << log.get() << endl;
+
+        glDeleteShader(cs_shader);
+        glDeleteProgram(program);
+        return 0;
+    }
+    else return program;
+}
+
 void Loader::DrawGeometry(const Geometry& geom)
 {
     if (geom.DrawArraysCount > 0)
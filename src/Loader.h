@@ -69,6 +69,11 @@ public:
 	/// Returns program object on success or 0 if failed.
 	static GLuint CreateAndLinkProgram(const char* vertex_shader, const char* fragment_shader);
 
+	/// Creates a program with a single compute shader (OpenGL 4.3), prints errors if some happen.
+	///
+	/// Returns program object on success or 0 if failed.
+	static GLuint CreateAndLinkComputeProgram(const char* compute_shader);
+
 	/// Chooses glDrawArrays or glDrawElements to draw the geometry.
 	static void DrawGeometry(const Geometry& geom);
 
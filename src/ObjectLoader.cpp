@@ -1,4 +1,9 @@
 #include "ObjectLoader.h"
+#include <map>
+#include <set>
+#include <tuple>
+#include <algorithm>
+#include <cfloat>
 using namespace std;
 
 bool ObjectLoader::ParseOBJFile(const char* file_name, std::vector<glm::vec3>& out_vertices, std::vector<glm::vec3>& out_normals, std::vector<glm::vec2>& out_tex_coords)
@@ -153,7 +158,92 @@ bool ObjectLoader::ParseOBJFile(const char* file_name, std::vector<glm::vec3>& o
 	return true;
 }
 
+void ObjectLoader::ClusterVertices(std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& normals, std::vector<glm::vec2>& tex_coords, float cell_size)
+{
+	if (vertices.empty() || cell_size <= 0.0f)
+	{
+		return;
+	}
+
+	glm::vec3 low = vertices[0];
+	for (const glm::vec3& v : vertices)
+	{
+		low = glm::min(low, v);
+	}
+
+	// Cell of every vertex, and the position sum of every cell
+	std::map<std::tuple<int, int, int>, int> cell_ids;
+	std::vector<int> cell_of(vertices.size());
+	std::vector<glm::vec3> sums;
+	std::vector<int> counts;
+	for (size_t i = 0; i < vertices.size(); i++)
+	{
+		glm::vec3 c = (vertices[i] - low) / cell_size;
+		auto key = std::make_tuple(int(c.x), int(c.y), int(c.z));
+		auto found = cell_ids.find(key);
+		if (found == cell_ids.end())
+		{
+			found = cell_ids.emplace(key, int(sums.size())).first;
+			sums.push_back(glm::vec3(0.0f));
+			counts.push_back(0);
+		}
+		cell_of[i] = found->second;
+		sums[found->second] += vertices[i];
+		counts[found->second]++;
+	}
+
+	// The representative of a cell is its vertex closest to the mean
+	std::vector<int> representative(sums.size(), -1);
+	std::vector<float> best(sums.size(), FLT_MAX);
+	for (size_t i = 0; i < vertices.size(); i++)
+	{
+		int cell = cell_of[i];
+		glm::vec3 d = vertices[i] - sums[cell] / float(counts[cell]);
+		float distance = glm::dot(d, d);
+		if (distance < best[cell])
+		{
+			best[cell] = distance;
+			representative[cell] = int(i);
+		}
+	}
+
+	std::set<std::tuple<int, int, int>> kept;
+	std::vector<glm::vec3> out_vertices, out_normals;
+	std::vector<glm::vec2> out_tex_coords;
+	for (size_t t = 0; t + 2 < vertices.size(); t += 3)
+	{
+		int a = cell_of[t], b = cell_of[t + 1], c = cell_of[t + 2];
+		if (a == b || b == c || a == c)
+		{
+			continue;        // Collapsed
+		}
+		// Same triangle with the same winding
+		int first = std::min(a, std::min(b, c));
+		auto key = first == a ? std::make_tuple(a, b, c) : first == b ? std::make_tuple(b, c, a) : std::make_tuple(c, a, b);
+		if (!kept.insert(key).second)
+		{
+			continue;
+		}
+		for (int cell : { a, b, c })
+		{
+			int r = representative[cell];
+			out_vertices.push_back(vertices[r]);
+			out_normals.push_back(normals[r]);
+			out_tex_coords.push_back(tex_coords[r]);
+		}
+	}
+	vertices.swap(out_vertices);
+	normals.swap(out_normals);
+	tex_coords.swap(out_tex_coords);
+}
+
 Geometry ObjectLoader::LoadOBJ(const char* file_name, GLint position_location, GLint normal_location, GLint tex_coord_location)
+{
+	return LoadOBJLods(file_name, 1, nullptr, nullptr, nullptr, position_location, normal_location, tex_coord_location);
+}
+
+Geometry ObjectLoader::LoadOBJLods(const char* file_name, int lod_count, const float* cell_fractions, int* lod_first, int* lod_vertices,
+	GLint position_location, GLint normal_location, GLint tex_coord_location)
 {
 	Geometry geometry;
 
@@ -164,6 +254,33 @@ Geometry ObjectLoader::LoadOBJ(const char* file_name, GLint position_location, G
 	{
 		return geometry;        // Return empty geometry, the error message was already printed
 	}
+	size_t full_count = vertices.size();
+
+	// Coarser copies of the full model, appended to the same arrays
+	if (lod_first && lod_vertices)
+	{
+		lod_first[0] = 0;
+		lod_vertices[0] = int(full_count);
+	}
+	glm::vec3 low = vertices.empty() ? glm::vec3(0.0f) : vertices[0], high = low;
+	for (size_t i = 0; i < full_count; i++)
+	{
+		low = glm::min(low, vertices[i]);
+		high = glm::max(high, vertices[i]);
+	}
+	float side = std::max(high.x - low.x, std::max(high.y - low.y, high.z - low.z));
+	for (int lod = 1; lod < lod_count; lod++)
+	{
+		std::vector<glm::vec3> lod_positions(vertices.begin(), vertices.begin() + full_count);
+		std::vector<glm::vec3> lod_normals(normals.begin(), normals.begin() + full_count);
+		std::vector<glm::vec2> lod_tex_coords(tex_coords.begin(), tex_coords.begin() + full_count);
+		ClusterVertices(lod_positions, lod_normals, lod_tex_coords, cell_fractions[lod - 1] * side);
+		lod_first[lod] = int(vertices.size());
+		lod_vertices[lod] = int(lod_positions.size());
+		vertices.insert(vertices.end(), lod_positions.begin(), lod_positions.end());
+		normals.insert(normals.end(), lod_normals.begin(), lod_normals.end());
+		tex_coords.insert(tex_coords.end(), lod_tex_coords.begin(), lod_tex_coords.end());
+	}
 
 	// Create buffers for vertex data
 	glGenBuffers(3, geometry.VertexBuffers);
@@ -206,7 +323,7 @@ Geometry ObjectLoader::LoadOBJ(const char* file_name, GLint position_location, G
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	geometry.Mode = GL_TRIANGLES;
-	geometry.DrawArraysCount = vertices.size();
+	geometry.DrawArraysCount = full_count;
 	geometry.DrawElementsCount = 0;
 
 	return geometry;
@@ -45,6 +45,17 @@ public:
 	/// obtained by glGetAttribLocation. Use -1 if not necessary.
 	static Geometry LoadOBJ(const char* file_name, GLint position_location, GLint normal_location = -1, GLint tex_coord_location = -1);
 
+	/// Simplifies a triangle list (3 vertices per triangle, as ParseOBJFile returns) by vertex clustering: the vertices
+	/// are snapped to a grid of 'cell_size', every cell keeps the vertex closest to the mean of its vertices, and
+	/// triangles left with less than three cells or repeating another one are dropped.
+	static void ClusterVertices(std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& normals, std::vector<glm::vec2>& tex_coords, float cell_size);
+
+	/// Loads an OBJ file like LoadOBJ, followed by 'lod_count' - 1 coarser copies in the same buffers. LOD i is clustered
+	/// with cells of cell_fractions[i - 1] times the largest side of the model, its vertices are
+	/// [lod_first[i], lod_first[i] + lod_vertices[i]). DrawArraysCount covers the full model (LOD 0) only.
+	static Geometry LoadOBJLods(const char* file_name, int lod_count, const float* cell_fractions, int* lod_first, int* lod_vertices,
+		GLint position_location, GLint normal_location = -1, GLint tex_coord_location = -1);
+
 	/// Creates a simple grid object. The center of the grid is in (0,0,0) and the length of its side is 2, its splitted to size * size squares
 	/// (positions of its vertices are from -0.5 to 0.5).
 	///
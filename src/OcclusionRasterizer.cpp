@@ -0,0 +1,444 @@
+#include "OcclusionRasterizer.h"
+#include "OcclusionRasterizerKernels.h"
+#include "ThreadPool.h"
+#include "TerrainRaycaster.h"
+#include "Benchmark.h"
+#include "Frustum.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <glm/gtc/matrix_transform.hpp>
+
+namespace {
+	/// Quad rows set up by one task
+	const int BLOCK_ROWS = 8;
+	/// Triangles reaching further out than this many viewports (in clip space) are clipped, keeps the edge
+	/// functions precise
+	const float GUARD_BAND = 4.0f;
+
+	// Keeps the part of the convex polygon 'in' where dot(plane, p) >= 0, returns the new corner count
+	int ClipPolygon(const glm::vec4* in, int count, const glm::vec4& plane, glm::vec4* out)
+	{
+		int result = 0;
+		for (int i = 0; i < count; ++i) {
+			const glm::vec4& a = in[i];
+			const glm::vec4& b = in[(i + 1) % count];
+			float da = glm::dot(plane, a), db = glm::dot(plane, b);
+			if (da >= 0.0f)
+				out[result++] = a;
+			if ((da >= 0.0f) != (db >= 0.0f))
+				out[result++] = a + (b - a) * (da / (da - db));
+		}
+		return result;
+	}
+}
+
+void OcclusionRasterizer::Build(const std::vector<std::vector<float>>& height, int quads)
+{
+	size_x = static_cast<int>(height.size());
+	size_z = static_cast<int>(height[0].size());
+	int longest = std::max(size_x, size_z) - 1;
+	cell = std::max((longest + quads - 1) / std::max(quads, 1), 1);
+	vertices_x = (size_x - 1 + cell - 1) / cell + 1;
+	vertices_z = (size_z - 1 + cell - 1) / cell + 1;
+
+	size_t count = size_t(vertices_x) * vertices_z;
+	vertex_x.resize(count);
+	vertex_y.resize(count);
+	vertex_z.resize(count);
+	for (int j = 0; j < vertices_z; ++j)
+		for (int i = 0; i < vertices_x; ++i) {
+			// Placement of the single terrain: sample s at s / size * 100 - 50
+			size_t v = size_t(j) * vertices_x + i;
+			vertex_x[v] = std::min(i * cell, size_x - 1) * 100.0f / size_x - 50.0f;
+			vertex_z[v] = std::min(j * cell, size_z - 1) * 100.0f / size_z - 50.0f;
+		}
+	LowerVertices(height, 0, vertices_x - 1, 0, vertices_z - 1);
+
+	blocks.clear();
+	blocks.resize((vertices_z - 1 + BLOCK_ROWS - 1) / BLOCK_ROWS);
+}
+
+void OcclusionRasterizer::UpdateRegion(const std::vector<std::vector<float>>& height, Terrain::Region region)
+{
+	if (Empty() || region.Empty())
+		return;
+	// A vertex depends on the samples up to one cell away
+	int i0 = std::max(region.x0 / cell - 1, 0), i1 = std::min(region.x1 / cell + 1, vertices_x - 1);
+	int j0 = std::max(region.z0 / cell - 1, 0), j1 = std::min(region.z1 / cell + 1, vertices_z - 1);
+	LowerVertices(height, i0, i1, j0, j1);
+}
+
+void OcclusionRasterizer::LowerVertices(const std::vector<std::vector<float>>& height, int i0, int i1, int j0, int j1)
+{
+	ThreadPool::Shared().ParallelFor(j0, j1 + 1, [&](int j) {
+		int z0 = std::min(std::max(j - 1, 0) * cell, size_z - 1), z1 = std::min((j + 1) * cell, size_z - 1);
+		for (int i = i0; i <= i1; ++i) {
+			int x0 = std::min(std::max(i - 1, 0) * cell, size_x - 1), x1 = std::min((i + 1) * cell, size_x - 1);
+			float lowest = 1.0e30f;
+			for (int x = x0; x <= x1; ++x)
+				for (int z = z0; z <= z1; ++z)
+					lowest = std::min(lowest, height[x][z]);
+			vertex_y[size_t(j) * vertices_x + i] = lowest * TERRAIN_HEIGHT - 2.0f;
+		}
+	});
+}
+
+void OcclusionRasterizer::Resize(int viewport_width, int viewport_height)
+{
+	tiles_x = (std::max(viewport_width, 1) + TILE_WIDTH - 1) / TILE_WIDTH;
+	tiles_y = (std::max(viewport_height, 1) + TILE_HEIGHT - 1) / TILE_HEIGHT;
+	width = tiles_x * TILE_WIDTH;
+	height = tiles_y * TILE_HEIGHT;
+	depth.assign(size_t(width) * height, 1.0f);
+}
+
+int OcclusionRasterizer::RasterizedTriangles() const
+{
+	int count = 0;
+	for (const Block& block : blocks)
+		count += static_cast<int>(block.triangles.size());
+	return count;
+}
+
+HiZMap& OcclusionRasterizer::Rasterize(const glm::mat4& view_projection, const glm::vec3& eye, bool parallel, bool simd)
+{
+	// The map is of this frame, no margin for the camera movement
+	map.margin = 0.0f;
+	if (Empty() || width == 0) {
+		map.Build(nullptr, 0, 0, view_projection, eye);
+		return map;
+	}
+	camera = view_projection;
+
+	bool avx2 = simd && Simd::Avx2();
+	std::function<void(int)> setup = [this, simd, avx2](int block) {
+		if (avx2)
+			SetupBlock<Avx2::SimdFloat>(block);
+		else if (simd)
+			SetupBlock<SimdFloat>(block);
+		else
+			SetupBlock<ScalarFloat>(block);
+	};
+	std::function<void(int)> rasterize = [this, simd, avx2](int tile) {
+		if (avx2)
+			RasterizeTile<Avx2::SimdFloat>(tile);
+		else if (simd)
+			RasterizeTile<SimdFloat>(tile);
+		else
+			RasterizeTile<ScalarFloat>(tile);
+	};
+	int block_count = static_cast<int>(blocks.size()), tile_count = tiles_x * tiles_y;
+	if (parallel) {
+		ThreadPool::Shared().ParallelFor(0, block_count, setup);
+		ThreadPool::Shared().ParallelFor(0, tile_count, rasterize);
+	}
+	else {
+		for (int block = 0; block < block_count; ++block)
+			setup(block);
+		for (int tile = 0; tile < tile_count; ++tile)
+			rasterize(tile);
+	}
+
+	map.Build(depth.data(), width, height, view_projection, eye);
+	return map;
+}
+
+template<class S>
+void OcclusionRasterizer::SetupBlock(int index)
+{
+	Block& block = blocks[index];
+	block.triangles.clear();
+	block.bins.resize(size_t(tiles_x) * tiles_y);
+	for (std::vector<int>& bin : block.bins)
+		bin.clear();
+
+	// Vertex rows of the quad rows [row0, row1), the row shared with the next block is transformed twice
+	int row0 = index * BLOCK_ROWS, row1 = std::min(row0 + BLOCK_ROWS, vertices_z - 1);
+	int first = row0 * vertices_x, count = (row1 - row0 + 1) * vertices_x;
+	block.clip_x.resize(count);
+	block.clip_y.resize(count);
+	block.clip_z.resize(count);
+	block.clip_w.resize(count);
+	const float* x = vertex_x.data() + first;
+	const float* y = vertex_y.data() + first;
+	const float* z = vertex_z.data() + first;
+	OcclusionRasterizerKernels::TransformBlock<S>(&camera[0][0], x, y, z, count, block.clip_x.data(), block.clip_y.data(), block.clip_z.data(),
+		block.clip_w.data());
+
+	auto corner = [&block](int v) { return glm::vec4(block.clip_x[v], block.clip_y[v], block.clip_z[v], block.clip_w[v]); };
+	for (int row = 0; row < row1 - row0; ++row)
+		for (int i = 0; i + 1 < vertices_x; ++i) {
+			// Counter-clockwise seen from above
+			int v00 = row * vertices_x + i, v10 = v00 + 1, v01 = v00 + vertices_x, v11 = v01 + 1;
+			glm::vec4 first_half[3] = { corner(v00), corner(v01), corner(v10) };
+			glm::vec4 second_half[3] = { first_half[2], first_half[1], corner(v11) };
+			Setup(block, first_half);
+			Setup(block, second_half);
+		}
+}
+
+void OcclusionRasterizer::Setup(Block& block, const glm::vec4* corners)
+{
+	// Outside one of the frustum planes
+	bool in_guard_band = true;
+	int outside_all = 0x3f;
+	for (int k = 0; k < 3; ++k) {
+		const glm::vec4& p = corners[k];
+		int outside = (p.x < -p.w) | (p.x > p.w) << 1 | (p.y < -p.w) << 2 | (p.y > p.w) << 3 | (p.z < -p.w) << 4 | (p.z > p.w) << 5;
+		outside_all &= outside;
+		// Corners behind the near plane or beyond the guard band
+		float guard = GUARD_BAND * p.w;
+		if (p.z < -p.w || p.x < -guard || p.x > guard || p.y < -guard || p.y > guard)
+			in_guard_band = false;
+	}
+	if (outside_all != 0)
+		return;
+	if (in_guard_band) {
+		Emit(block, corners[0], corners[1], corners[2]);
+		return;
+	}
+
+	const glm::vec4 planes[5] = {
+		glm::vec4(0.0f, 0.0f, 1.0f, 1.0f),
+		glm::vec4(-1.0f, 0.0f, 0.0f, GUARD_BAND),
+		glm::vec4(1.0f, 0.0f, 0.0f, GUARD_BAND),
+		glm::vec4(0.0f, -1.0f, 0.0f, GUARD_BAND),
+		glm::vec4(0.0f, 1.0f, 0.0f, GUARD_BAND),
+	};
+	// Every plane adds at most one corner
+	glm::vec4 polygon[8], clipped[8];
+	int count = 3;
+	std::copy(corners, corners + 3, polygon);
+	for (const glm::vec4& plane : planes) {
+		count = ClipPolygon(polygon, count, plane, clipped);
+		if (count < 3)
+			return;
+		std::copy(clipped, clipped + count, polygon);
+	}
+	for (int k = 1; k + 1 < count; ++k)
+		Emit(block, polygon[0], polygon[k], polygon[k + 1]);
+}
+
+void OcclusionRasterizer::Emit(Block& block, const glm::vec4& p0, const glm::vec4& p1, const glm::vec4& p2)
+{
+	// Window coordinates in pixels, depth in [0, 1]
+	glm::vec3 v[3];
+	const glm::vec4* clip[3] = { &p0, &p1, &p2 };
+	for (int k = 0; k < 3; ++k) {
+		glm::vec3 ndc = glm::vec3(*clip[k]) / clip[k]->w;
+		v[k] = glm::vec3((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height, ndc.z * 0.5f + 0.5f);
+	}
+
+	// Back faces and degenerate triangles are dropped, the terrain is seen from above
+	float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+	if (!(area > 0.0f))
+		return;
+
+	// Pixels whose centers lie in the bounds
+	Triangle t;
+	float min_x = std::min(std::min(v[0].x, v[1].x), v[2].x), max_x = std::max(std::max(v[0].x, v[1].x), v[2].x);
+	float min_y = std::min(std::min(v[0].y, v[1].y), v[2].y), max_y = std::max(std::max(v[0].y, v[1].y), v[2].y);
+	t.x0 = std::max(static_cast<int>(std::ceil(min_x - 0.5f)), 0);
+	t.x1 = std::min(static_cast<int>(std::floor(max_x - 0.5f)), width - 1);
+	t.y0 = std::max(static_cast<int>(std::ceil(min_y - 0.5f)), 0);
+	t.y1 = std::min(static_cast<int>(std::floor(max_y - 0.5f)), height - 1);
+	if (t.x0 > t.x1 || t.y0 > t.y1)
+		return;
+
+	// Edge from corner k to the next one, positive on the inner side, shifted to the pixel centers
+	for (int k = 0; k < 3; ++k) {
+		const glm::vec3& from = v[k];
+		const glm::vec3& to = v[(k + 1) % 3];
+		t.a[k] = from.y - to.y;
+		t.b[k] = to.x - from.x;
+		t.c[k] = -(t.a[k] * from.x + t.b[k] * from.y) + 0.5f * (t.a[k] + t.b[k]);
+	}
+
+	// Depth plane, moved to the farthest corner of the pixel: the stored depth never lies in front of the occluder
+	t.dzdx = ((v[1].z - v[0].z) * (v[2].y - v[0].y) - (v[2].z - v[0].z) * (v[1].y - v[0].y)) / area;
+	t.dzdy = ((v[1].x - v[0].x) * (v[2].z - v[0].z) - (v[2].x - v[0].x) * (v[1].z - v[0].z)) / area;
+	t.z0 = v[0].z + t.dzdx * (0.5f - v[0].x) + t.dzdy * (0.5f - v[0].y) + 0.5f * (std::abs(t.dzdx) + std::abs(t.dzdy));
+	t.z_max = std::max(std::max(v[0].z, v[1].z), v[2].z);
+
+	int index = static_cast<int>(block.triangles.size());
+	block.triangles.push_back(t);
+	for (int ty = t.y0 / TILE_HEIGHT; ty <= t.y1 / TILE_HEIGHT; ++ty)
+		for (int tx = t.x0 / TILE_WIDTH; tx <= t.x1 / TILE_WIDTH; ++tx)
+			block.bins[size_t(ty) * tiles_x + tx].push_back(index);
+}
+
+template<class S>
+void OcclusionRasterizer::RasterizeTile(int tile)
+{
+	int tile_x0 = (tile % tiles_x) * TILE_WIDTH, tile_y0 = (tile / tiles_x) * TILE_HEIGHT;
+	for (int y = tile_y0; y < tile_y0 + TILE_HEIGHT; ++y)
+		std::fill_n(&depth[size_t(y) * width + tile_x0], TILE_WIDTH, 1.0f);
+
+	for (const Block& block : blocks) {
+		for (int index : block.bins[tile]) {
+			const Triangle& t = block.triangles[index];
+			int x0 = std::max(t.x0, tile_x0), x1 = std::min(t.x1, tile_x0 + TILE_WIDTH - 1);
+			int y0 = std::max(t.y0, tile_y0), y1 = std::min(t.y1, tile_y0 + TILE_HEIGHT - 1);
+			OcclusionRasterizerKernels::RasterizeTriangle<S>(depth.data(), width, x0, x1, y0, y1, t.a, t.b, t.c, t.z0, t.dzdx, t.dzdy, t.z_max);
+		}
+	}
+}
+
+void OcclusionRasterizer::RunBenchmark(const std::vector<std::vector<float>>& height, std::ostream& out)
+{
+	auto start = std::chrono::steady_clock::now();
+	OcclusionRasterizer rasterizer;
+	rasterizer.Build(height);
+	double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	out << "Occlusion rasterizer on " << rasterizer.size_x << "x" << rasterizer.size_z << " samples: " << rasterizer.Triangles()
+		<< " occluder triangles (" << rasterizer.cell << " samples per quad), built in " << build_ms << " ms" << std::endl;
+
+	// Views along the terrain loop at eye height, looking level
+	TerrainRaycaster raycaster(height);
+	std::vector<glm::mat4> cameras;
+	std::vector<glm::vec3> eyes;
+	CameraPath path = CameraPath::TerrainLoop();
+	glm::vec3 eye, target;
+	for (int step = 0; path.Step(eye, target); ++step) {
+		if (step % 25 != 0)
+			continue;
+		RayHit ground = raycaster.Raycast(glm::vec3(eye.x, 100.0f, eye.z), glm::vec3(0.0f, -1.0f, 0.0f));
+		eye.y = (ground.hit ? ground.position.y : 0.0f) + 2.0f;
+		target.y = eye.y;
+		glm::mat4 projection = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 1000.0f);
+		cameras.push_back(projection * glm::lookAt(eye, target, glm::vec3(0.0f, 1.0f, 0.0f)));
+		eyes.push_back(eye);
+	}
+	int views = static_cast<int>(cameras.size());
+
+	// Vegetation sized spheres centered two units above random samples
+	const int SPHERES = 1000000;
+	std::mt19937 gen(1);
+	std::uniform_int_distribution<int> sample_x(0, rasterizer.size_x - 1), sample_z(0, rasterizer.size_z - 1);
+	std::vector<glm::vec3> centers(SPHERES);
+	for (glm::vec3& center : centers) {
+		int x = sample_x(gen), z = sample_z(gen);
+		center = glm::vec3(x * 100.0f / rasterizer.size_x - 50.0f, height[x][z] * TERRAIN_HEIGHT, z * 100.0f / rasterizer.size_z - 50.0f);
+	}
+	const float RADIUS = 2.0f;
+
+	unsigned threads = ThreadPool::Shared().ThreadCount() + 1;
+	for (int resolution : { 256, 512 }) {
+		rasterizer.Resize(resolution, resolution * 9 / 16);
+		out << "Depth buffer " << rasterizer.Width() << "x" << rasterizer.Height() << ", " << views << " views:" << std::endl;
+
+		// RunCheck compares the depth of the three runs
+		struct Run { bool parallel; bool simd; };
+		const Run runs[] = { { false, true }, { false, false }, { true, true } };
+		for (const Run& run : runs) {
+			double ms = 0.0;
+			long long triangles = 0;
+			for (int view = 0; view < views; ++view) {
+				auto t0 = std::chrono::steady_clock::now();
+				rasterizer.Rasterize(cameras[view], eyes[view], run.parallel, run.simd);
+				ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+				triangles += rasterizer.RasterizedTriangles();
+			}
+			ms /= views;
+			unsigned cores = run.parallel ? threads : 1;
+			out << "  rasterize (" << (run.simd ? Simd::Name() : "scalar") << ", " << cores << (cores == 1 ? " thread" : " threads") << "): "
+				<< ms << " ms per view, " << triangles / views << " triangles per view, " << (triangles / views) / (ms * 1000.0)
+				<< " Mtriangles/s" << std::endl;
+		}
+
+		// Sphere tests against the map of every view, one thread and the thread pool. Hidden spheres whose centers
+		// lie on the screen and are still seen across the terrain would be wrong.
+		const int BLOCK = 4096;
+		std::vector<char> visible(SPHERES);
+		double single_ms = 0.0, parallel_ms = 0.0;
+		long long hidden = 0, in_frustum = 0;
+		std::vector<glm::vec3> from, to;
+		for (int view = 0; view < views; ++view) {
+			const HiZMap& map = rasterizer.Rasterize(cameras[view], eyes[view]);
+			auto t0 = std::chrono::steady_clock::now();
+			for (int i = 0; i < SPHERES; ++i)
+				visible[i] = map.SphereVisible(centers[i], RADIUS);
+			auto t1 = std::chrono::steady_clock::now();
+			ThreadPool::Shared().ParallelFor(0, (SPHERES + BLOCK - 1) / BLOCK, [&](int block) {
+				for (int i = block * BLOCK; i < std::min((block + 1) * BLOCK, SPHERES); ++i)
+					visible[i] = map.SphereVisible(centers[i], RADIUS);
+			});
+			auto t2 = std::chrono::steady_clock::now();
+			single_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+			parallel_ms += std::chrono::duration<double, std::milli>(t2 - t1).count();
+			Frustum frustum(cameras[view]);
+			for (int i = 0; i < SPHERES; ++i) {
+				in_frustum += frustum.IntersectsSphere(centers[i], RADIUS);
+				if (visible[i] || hidden++ % 16 != 0)
+					continue;
+				glm::vec4 clip = cameras[view] * glm::vec4(centers[i], 1.0f);
+				if (std::abs(clip.x) < clip.w && std::abs(clip.y) < clip.w) {
+					from.push_back(eyes[view]);
+					to.push_back(centers[i]);
+				}
+			}
+		}
+		std::vector<char> in_sight(from.size());
+		int count = static_cast<int>(from.size());
+		ThreadPool::Shared().ParallelFor(0, (count + BLOCK - 1) / BLOCK, [&](int block) {
+			int first = block * BLOCK;
+			raycaster.LineOfSight(&from[first], &to[first], std::min(BLOCK, count - first), 0.0f, &in_sight[first]);
+		});
+		long long wrong = std::count(in_sight.begin(), in_sight.end(), 1);
+		double tests = double(SPHERES) * views;
+		out << "  sphere tests: " << tests / (single_ms * 1000.0) << " Mtests/s (1 thread), " << tests / (parallel_ms * 1000.0)
+			<< " Mtests/s (" << threads << " threads), " << 100.0 * hidden / std::max(in_frustum, 1LL) << "% of the spheres in the frustum hidden, "
+			<< wrong << " of " << count << " sampled hidden centers on the screen in line of sight" << std::endl;
+	}
+}
+
+bool OcclusionRasterizer::RunCheck(std::ostream& out)
+{
+	// 257 x 257 samples of flat ground with a wall 6 units high across X in [-2, 2], seen along +X from x = -30 at
+	// 2 units above the ground. The wall hides what stays under about 9 units at x = 20.
+	const int SIZE = 257;
+	const float WALL = 6.0f / TERRAIN_HEIGHT;
+	std::vector<std::vector<float>> height(SIZE, std::vector<float>(SIZE, 0.0f));
+	for (int x = 0; x < SIZE; ++x) {
+		float world_x = x * 100.0f / SIZE - 50.0f;
+		if (std::abs(world_x) <= 2.0f)
+			std::fill(height[x].begin(), height[x].end(), WALL);
+	}
+	OcclusionRasterizer rasterizer;
+	rasterizer.Build(height);
+	rasterizer.Resize(256, 144);
+	glm::vec3 eye(-30.0f, 2.0f, 0.0f);
+	glm::mat4 camera = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 1000.0f)
+		* glm::lookAt(eye, glm::vec3(0.0f, 2.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+	bool passed = true;
+	auto report = [&](const char* name, bool ok) {
+		out << "  " << (ok ? "ok    " : "FAILED") << " " << name << std::endl;
+		passed = passed && ok;
+	};
+	out << "Occlusion rasterizer check (" << Simd::Name() << ", " << ThreadPool::Shared().ThreadCount() + 1 << " threads):" << std::endl;
+
+	// The single threaded SIMD run is the reference of the others
+	rasterizer.Rasterize(camera, eye, false, true);
+	std::vector<float> reference = rasterizer.Depth();
+	rasterizer.Rasterize(camera, eye, false, false);
+	report("scalar depth matches SIMD", std::memcmp(reference.data(), rasterizer.Depth().data(), reference.size() * sizeof(float)) == 0);
+	rasterizer.Rasterize(camera, eye, true, true);
+	report("thread pool depth matches SIMD", std::memcmp(reference.data(), rasterizer.Depth().data(), reference.size() * sizeof(float)) == 0);
+	report("wall rasterized", std::count_if(reference.begin(), reference.end(), [](float depth) { return depth < 1.0f; }) > 0);
+
+	const HiZMap& map = rasterizer.Rasterize(camera, eye);
+	struct Sphere { const char* name; glm::vec3 center; float radius; bool visible; };
+	const Sphere spheres[] = {
+		{ "sphere before the wall visible", glm::vec3(-15.0f, 2.0f, 0.0f), 1.0f, true },
+		{ "sphere behind the wall hidden", glm::vec3(20.0f, 2.0f, 0.0f), 1.0f, false },
+		{ "sphere behind the wall off the view axis hidden", glm::vec3(20.0f, 3.0f, 15.0f), 1.0f, false },
+		{ "sphere above the wall visible", glm::vec3(20.0f, 16.0f, 0.0f), 1.0f, true },
+	};
+	for (const Sphere& sphere : spheres)
+		report(sphere.name, map.SphereVisible(sphere.center, sphere.radius) == sphere.visible);
+	out << (passed ? "All checks passed" : "Some checks failed") << std::endl;
+	return passed;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include "Terrain.h"
+#include "HiZMap.h"
+
+#include <vector>
+#include <iostream>
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----      OCCLUSION RASTERIZER       ----
+//-----------------------------------------
+
+/// Software occlusion of the single terrain, without the GPU. A coarse occluder mesh (one quad per cell x cell
+/// heightfield samples) is rasterized into a low resolution depth buffer and reduced into a HiZMap, which then tests
+/// instance and chunk bounds. Every occluder vertex takes the lowest height of the quads around it, the mesh stays
+/// under the terrain and never hides what the terrain does not.
+///
+/// Rasterize transforms the vertices and sets up the triangles (clipped at the near plane and a guard band, back
+/// faces dropped) in blocks of quad rows, binning them into screen tiles. Every tile is then rasterized on its own,
+/// Simd::Width() pixels at a time: the edge functions give the coverage mask, the depth is written where the
+/// mask is set and the triangle is nearer. Depth is taken at the farthest corner of every pixel. Blocks and tiles
+/// are spread over the thread pool, every tile reads the bins in block order, the result does not depend on the
+/// thread count.
+///
+/// The buffer is a plain z-buffer with one float per pixel, not masked occlusion (no compressed two-layer tiles with
+/// coverage masks): the HiZMap the other occlusion paths test against is reduced from it.
+class OcclusionRasterizer
+{
+public:
+	/// Pixels of a screen tile, the width a multiple of every SIMD width
+	static const int TILE_WIDTH = 32;
+	static const int TILE_HEIGHT = 16;
+
+	/// Builds the occluder from a heightfield ([x][z], normalized) placed like the single terrain, with at most
+	/// 'quads' quads along each side
+	void Build(const std::vector<std::vector<float>>& height, int quads = 128);
+
+	/// Lowers the occluder vertices after the heights of 'region' changed (e.g. Terrain::ApplyBrush)
+	void UpdateRegion(const std::vector<std::vector<float>>& height, Terrain::Region region);
+
+	bool Empty() const { return vertex_y.empty(); }
+
+	/// Depth buffer of width * height pixels covering the whole viewport, both rounded up to whole tiles
+	void Resize(int width, int height);
+
+	/// Rasterizes the occluder seen with 'view_projection' from 'eye' and returns the Hi-Z map of the depth.
+	/// 'parallel' spreads the work over the thread pool, 'simd' uses the widest SIMD kernel the CPU runs instead of
+	/// ScalarFloat.
+	HiZMap& Rasterize(const glm::mat4& view_projection, const glm::vec3& eye, bool parallel = true, bool simd = true);
+
+	/// Map of the last Rasterize
+	HiZMap& Map() { return map; }
+	/// Window depth of the last Rasterize (0 near, 1 far), bottom row first
+	const std::vector<float>& Depth() const { return depth; }
+	int Width() const { return width; }
+	int Height() const { return height; }
+	int Triangles() const { return 2 * (vertices_x - 1) * (vertices_z - 1); }
+	/// Triangles of the last Rasterize left after culling and clipping
+	int RasterizedTriangles() const;
+
+	/// Times the rasterization and the sphere tests along the terrain loop (scalar, SIMD, thread pool) at two
+	/// resolutions, checks that the results match and prints triangles/s and tests/s
+	static void RunBenchmark(const std::vector<std::vector<float>>& height, std::ostream& out = std::cout);
+
+	/// Rasterizes a synthetic heightfield (flat ground with a wall across it) from a fixed camera, checks that the
+	/// scalar, SIMD and thread pool runs give the same depth bit for bit and that spheres known to be hidden behind
+	/// the wall or visible are tested so. Needs no GL context and no image loading, returns whether all checks passed.
+	static bool RunCheck(std::ostream& out = std::cout);
+
+private:
+	/// Set up triangle: edge functions and depth plane in pixel coordinates, evaluated at integer pixel positions
+	struct Triangle
+	{
+		/// Edge i covers a * x + b * y + c >= 0 (pixel centers)
+		float a[3], b[3], c[3];
+		/// Depth z0 + dzdx * x + dzdy * y at the farthest corner of the pixel
+		float z0, dzdx, dzdy;
+		float z_max;
+		/// Pixel bounds, inclusive
+		int x0, y0, x1, y1;
+	};
+
+	/// Triangles of a block of quad rows and per tile the ones touching it
+	struct Block
+	{
+		/// Clip space positions of the vertex rows of the block
+		std::vector<float> clip_x, clip_y, clip_z, clip_w;
+		std::vector<Triangle> triangles;
+		std::vector<std::vector<int>> bins;
+	};
+
+	int size_x = 0, size_z = 0;
+	int cell = 8;
+	int vertices_x = 0, vertices_z = 0;
+	/// Occluder vertices in world space, vertex (i, j) at j * vertices_x + i
+	std::vector<float> vertex_x, vertex_y, vertex_z;
+	glm::mat4 camera = glm::mat4(1.0f);
+
+	int width = 0, height = 0;
+	int tiles_x = 0, tiles_y = 0;
+	std::vector<float> depth;
+	std::vector<Block> blocks;
+	HiZMap map;
+
+	/// Lowest heights of the vertices in [i0, i1] x [j0, j1] from the samples of the quads around them
+	void LowerVertices(const std::vector<std::vector<float>>& height, int i0, int i1, int j0, int j1);
+
+	template<class S> void SetupBlock(int block);
+	/// Clips, culls and bins one triangle given by its clip space corners
+	void Setup(Block& block, const glm::vec4* corners);
+	void Emit(Block& block, const glm::vec4& p0, const glm::vec4& p1, const glm::vec4& p2);
+	template<class S> void RasterizeTile(int tile);
+};
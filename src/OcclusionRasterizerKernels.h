@@ -0,0 +1,79 @@
+#pragma once
+#include "Simd.h"
+
+#include <cstddef>
+
+//-----------------------------------------
+//----  OCCLUSION RASTERIZER KERNELS   ----
+//-----------------------------------------
+
+/// SIMD kernels of OcclusionRasterizer, instantiated for the baseline in OcclusionRasterizer.cpp and for AVX2 in
+/// SimdAvx2.cpp
+namespace OcclusionRasterizerKernels
+{
+	// Clip space positions of the vertices in whole vectors of S::WIDTH, returns how many were transformed.
+	// 'm' is the column major matrix.
+	template<class S>
+	int TransformVertices(const float* m, const float* x, const float* y, const float* z, int count,
+		float* clip_x, float* clip_y, float* clip_z, float* clip_w)
+	{
+		int k = 0;
+		for (; k + S::WIDTH <= count; k += S::WIDTH) {
+			typename S::F vx = S::Load(x + k), vy = S::Load(y + k), vz = S::Load(z + k);
+			float* out[4] = { clip_x, clip_y, clip_z, clip_w };
+			for (int row = 0; row < 4; ++row) {
+				typename S::F v = S::Add(S::Mul(S::Set(m[row]), vx), S::Mul(S::Set(m[4 + row]), vy));
+				v = S::Add(v, S::Add(S::Mul(S::Set(m[8 + row]), vz), S::Set(m[12 + row])));
+				S::Store(out[row] + k, v);
+			}
+		}
+		return k;
+	}
+
+	/// Clip space positions of 'count' vertices, S::WIDTH at a time and the remainder one by one
+	template<class S>
+	void TransformBlock(const float* m, const float* x, const float* y, const float* z, int count,
+		float* clip_x, float* clip_y, float* clip_z, float* clip_w)
+	{
+		typedef typename S::Scalar Scalar;
+		int done = TransformVertices<S>(m, x, y, z, count, clip_x, clip_y, clip_z, clip_w);
+		TransformVertices<Scalar>(m, x + done, y + done, z + done, count - done, clip_x + done, clip_y + done, clip_z + done, clip_w + done);
+	}
+
+	/// Writes the depth of a set up triangle (see OcclusionRasterizer::Triangle) to the pixels [x0, x1] x [y0, y1]
+	/// of 'depth' (rows of 'width'), S::WIDTH pixels at a time. The span inside a tile stays in the tile.
+	template<class S>
+	void RasterizeTriangle(float* depth, int width, int x0, int x1, int y0, int y1, const float* a, const float* b, const float* c,
+		float z0, float dzdx, float dzdy, float z_max)
+	{
+		// Whole vectors from the aligned start, the tile width is a multiple of every SIMD width
+		x0 = x0 / S::WIDTH * S::WIDTH;
+		typename S::F zero = S::Set(0.0f);
+		typename S::F a0 = S::Set(a[0]), a1 = S::Set(a[1]), a2 = S::Set(a[2]);
+		typename S::F dzdx_v = S::Set(dzdx), z_max_v = S::Set(z_max);
+		for (int y = y0; y <= y1; ++y) {
+			float* row = &depth[size_t(y) * width];
+			typename S::F e0_row = S::Set(c[0] + b[0] * y), e1_row = S::Set(c[1] + b[1] * y), e2_row = S::Set(c[2] + b[2] * y);
+			typename S::F z_row = S::Set(z0 + dzdy * y);
+			for (int x = x0; x <= x1; x += S::WIDTH) {
+				typename S::F px = S::Ramp(static_cast<float>(x));
+				typename S::M covered = S::And(S::LessEqual(zero, S::Add(S::Mul(a0, px), e0_row)), S::LessEqual(zero, S::Add(S::Mul(a1, px), e1_row)));
+				covered = S::And(covered, S::LessEqual(zero, S::Add(S::Mul(a2, px), e2_row)));
+				if (!S::Any(covered))
+					continue;
+				typename S::F z = S::Min(S::Add(S::Mul(dzdx_v, px), z_row), z_max_v);
+				typename S::F stored = S::Load(row + x);
+				typename S::M nearer = S::And(covered, S::Less(z, stored));
+				if (S::Any(nearer))
+					S::Store(row + x, S::Select(nearer, z, stored));
+			}
+		}
+	}
+}
+
+#if !defined(SIMD_AVX2)
+extern template void OcclusionRasterizerKernels::TransformBlock<Avx2::SimdFloat>(const float*, const float*, const float*, const float*, int,
+	float*, float*, float*, float*);
+extern template void OcclusionRasterizerKernels::RasterizeTriangle<Avx2::SimdFloat>(float*, int, int, int, int, int, const float*, const float*,
+	const float*, float, float, float, float);
+#endif
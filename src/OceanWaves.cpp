@@ -0,0 +1,330 @@
+#include "OceanWaves.h"
+#include "OceanWavesKernels.h"
+#include "ThreadPool.h"
+#include <random>
+#include <chrono>
+#include <stdexcept>
+
+namespace {
+	const float GRAVITY = 9.81f;
+	/// Columns transformed by one task, a multiple of every SIMD width
+	const int COLUMN_BLOCK = 32;
+	/// Side of the tiles swapped by the transpose
+	const int TILE = 16;
+
+	template<class Fn>
+	void Run(bool parallel, int count, const Fn& fn) {
+		if (parallel)
+			ThreadPool::Shared().ParallelFor(0, count, fn);
+		else
+			for (int i = 0; i < count; ++i)
+				fn(i);
+	}
+
+	// Swaps tile (row, column) with tile (column, row), both transposed
+	void TransposeTiles(float* data, int n, int row, int column) {
+		for (int z = 0; z < TILE; ++z) {
+			int x0 = row == column ? z + 1 : 0;
+			for (int x = x0; x < TILE; ++x)
+				std::swap(data[size_t(row * TILE + z) * n + column * TILE + x], data[size_t(column * TILE + x) * n + row * TILE + z]);
+		}
+	}
+
+	// Inverse 2D FFT of 'count' n * n complex fields in place, without the 1 / n^2 scale. The result is transposed:
+	// the value at (x, z) ends up at x * n + z.
+	template<class S>
+	void InverseFft2D(float* const* re, float* const* im, int count, int n, const float* twiddle_re, const float* twiddle_im,
+		const int* reversed, bool parallel) {
+		int block = std::min(COLUMN_BLOCK, n);
+		int blocks = n / block;
+		int tiles = n / TILE;
+		auto columns = [&](int task) {
+			int field = task / blocks, b = task % blocks;
+			OceanWavesKernels::TransformColumns<S>(re[field], im[field], n, b * block, (b + 1) * block, twiddle_re, twiddle_im, reversed);
+		};
+		Run(parallel, count * blocks, columns);
+		// Each task swaps one row of tiles with the column below the diagonal
+		Run(parallel, 2 * count * tiles, [&](int task) {
+			int array = task / tiles, row = task % tiles;
+			float* data = array % 2 == 0 ? re[array / 2] : im[array / 2];
+			for (int column = row; column < tiles; ++column)
+				TransposeTiles(data, n, row, column);
+		});
+		Run(parallel, count * blocks, columns);
+	}
+
+	// InverseFft2D with the widest kernel the CPU runs
+	void InverseFft2DSimd(float* const* re, float* const* im, int count, int n, const float* twiddle_re, const float* twiddle_im,
+		const int* reversed, bool parallel) {
+		if (Simd::Avx2())
+			InverseFft2D<Avx2::SimdFloat>(re, im, count, n, twiddle_re, twiddle_im, reversed, parallel);
+		else
+			InverseFft2D<SimdFloat>(re, im, count, n, twiddle_re, twiddle_im, reversed, parallel);
+	}
+}
+
+OceanWaves::~OceanWaves()
+{
+	if (displacement_tex != 0)
+		glDeleteTextures(1, &displacement_tex);
+	if (normal_tex != 0)
+		glDeleteTextures(1, &normal_tex);
+	if (displacement_pbo != 0)
+		glDeleteBuffers(1, &displacement_pbo);
+	if (normal_pbo != 0)
+		glDeleteBuffers(1, &normal_pbo);
+}
+
+void OceanWaves::Initialize(const Settings& settings)
+{
+	if (settings.resolution < 16 || settings.resolution > 2048 || (settings.resolution & (settings.resolution - 1)) != 0)
+		throw std::invalid_argument("Ocean resolution must be a power of two from 16 to 2048!");
+	this->settings = settings;
+	n = settings.resolution;
+	size_t count = size_t(n) * n;
+
+	twiddle_re.resize(n / 2);
+	twiddle_im.resize(n / 2);
+	for (int j = 0; j < n / 2; ++j) {
+		twiddle_re[j] = std::cos(6.2831853f * j / n);
+		twiddle_im[j] = std::sin(6.2831853f * j / n);
+	}
+	int bits = 0;
+	while ((1 << bits) < n)
+		++bits;
+	reversed.resize(n);
+	for (int i = 0; i < n; ++i) {
+		int r = 0;
+		for (int b = 0; b < bits; ++b)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		reversed[i] = r;
+	}
+	for (auto& field : fields)
+		field.assign(count, 0.0f);
+
+	// Phillips spectrum, waves much shorter than a sample are suppressed to limit aliasing
+	float largest = settings.wind_speed * settings.wind_speed / GRAVITY;
+	float smallest = settings.patch_size / n;
+	glm::vec2 wind = glm::length(settings.wind_direction) > 0.0f ? glm::normalize(settings.wind_direction) : glm::vec2(1.0f, 0.0f);
+	std::mt19937 random(settings.seed);
+	std::normal_distribution<float> gaussian;
+	h0.assign(count * 2, 0.0f);
+	omega.assign(count, 0.0f);
+	for (int z = 0; z < n; ++z) {
+		for (int x = 0; x < n; ++x) {
+			size_t i = size_t(z) * n + x;
+			float xi_re = gaussian(random), xi_im = gaussian(random);
+			// The Nyquist row and column have no negative partner, they stay empty to keep the fields real
+			if (x == n / 2 || z == n / 2)
+				continue;
+			glm::vec2 k = glm::vec2(float(x < n / 2 ? x : x - n), float(z < n / 2 ? z : z - n)) * (6.2831853f / settings.patch_size);
+			float length = glm::length(k);
+			if (length == 0.0f)
+				continue;
+			float along = glm::dot(k / length, wind);
+			float kl = length * largest;
+			float phillips = std::exp(-1.0f / (kl * kl)) / (length * length * length * length) * along * along
+				* std::exp(-length * length * smallest * smallest);
+			float amplitude = std::sqrt(phillips * 0.5f);
+			h0[2 * i] = xi_re * amplitude;
+			h0[2 * i + 1] = xi_im * amplitude;
+			omega[i] = std::sqrt(GRAVITY * length);
+		}
+	}
+	h0_conj.assign(count * 2, 0.0f);
+	for (int z = 0; z < n; ++z) {
+		for (int x = 0; x < n; ++x) {
+			size_t i = size_t(z) * n + x;
+			size_t negative = size_t((n - z) % n) * n + (n - x) % n;
+			h0_conj[2 * i] = h0[2 * negative];
+			h0_conj[2 * i + 1] = -h0[2 * negative + 1];
+		}
+	}
+
+	// Scale the spectrum to the requested RMS height of the waves at time 0
+	EvolveSpectrum(0.0f);
+	float* re[] = { fields[4].data() };
+	float* im[] = { fields[5].data() };
+	InverseFft2DSimd(re, im, 1, n, twiddle_re.data(), twiddle_im.data(), reversed.data(), true);
+	double sum = 0.0;
+	for (float h : fields[4])
+		sum += double(h) * h;
+	float rms = static_cast<float>(std::sqrt(sum / count));
+	float scale = rms > 0.0f ? settings.wave_height / rms : 0.0f;
+	for (size_t i = 0; i < h0.size(); ++i) {
+		h0[i] *= scale;
+		h0_conj[i] *= scale;
+	}
+}
+
+void OceanWaves::EvolveSpectrum(float time)
+{
+	float k_scale = 6.2831853f / settings.patch_size;
+	ThreadPool::Shared().ParallelFor(0, n, [&](int z) {
+		float kz = float(z < n / 2 ? z : z - n) * k_scale;
+		for (int x = 0; x < n; ++x) {
+			size_t i = size_t(z) * n + x;
+			float kx = float(x < n / 2 ? x : x - n) * k_scale;
+			float length = std::sqrt(kx * kx + kz * kz);
+			float c = std::cos(omega[i] * time), s = std::sin(omega[i] * time);
+			float a = h0[2 * i], b = h0[2 * i + 1];
+			float am = h0_conj[2 * i], bm = h0_conj[2 * i + 1];
+			// h(k, t) = h0(k) exp(i w t) + conj(h0(-k)) exp(-i w t)
+			float hr = (a + am) * c + (bm - b) * s;
+			float hi = (a - am) * s + (b + bm) * c;
+			float ux = length > 0.0f ? kx / length : 0.0f;
+			float uz = length > 0.0f ? kz / length : 0.0f;
+
+			// Displacement -i k / |k| h, slope i k h, the Z fields ride in the imaginary parts
+			fields[0][i] = ux * hi + uz * hr;
+			fields[1][i] = uz * hi - ux * hr;
+			fields[2][i] = -kx * hi - kz * hr;
+			fields[3][i] = kx * hr - kz * hi;
+			fields[4][i] = hr;
+			fields[5][i] = hi;
+		}
+	});
+}
+
+void OceanWaves::Simulate(float time, float* displacement, uint8_t* normals)
+{
+	EvolveSpectrum(time);
+	float* re[] = { fields[0].data(), fields[2].data(), fields[4].data() };
+	float* im[] = { fields[1].data(), fields[3].data(), fields[5].data() };
+	InverseFft2DSimd(re, im, 3, n, twiddle_re.data(), twiddle_im.data(), reversed.data(), true);
+
+	// The transforms are transposed, a task reads TILE consecutive values of every column and writes TILE rows
+	float choppiness = settings.choppiness;
+	ThreadPool::Shared().ParallelFor(0, n / TILE, [&](int block) {
+		for (int x = 0; x < n; ++x) {
+			for (int z = block * TILE; z < (block + 1) * TILE; ++z) {
+				size_t source = size_t(x) * n + z;
+				size_t target = size_t(z) * n + x;
+				float* d = displacement + target * 4;
+				d[0] = fields[0][source] * choppiness;
+				d[1] = fields[4][source];
+				d[2] = fields[1][source] * choppiness;
+				d[3] = 0.0f;
+
+				glm::vec3 normal = glm::normalize(glm::vec3(-fields[2][source], 1.0f, -fields[3][source]));
+				uint8_t* c = normals + target * 4;
+				c[0] = static_cast<uint8_t>(normal.x * 127.5f + 127.5f);
+				c[1] = static_cast<uint8_t>(normal.y * 127.5f + 127.5f);
+				c[2] = static_cast<uint8_t>(normal.z * 127.5f + 127.5f);
+				c[3] = 255;
+			}
+		}
+	});
+}
+
+void OceanWaves::CreateTextures()
+{
+	glGenTextures(1, &displacement_tex);
+	glBindTexture(GL_TEXTURE_2D, displacement_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, n, n, 0, GL_RGBA, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	glGenTextures(1, &normal_tex);
+	glBindTexture(GL_TEXTURE_2D, normal_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, n, n, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	if (GLEW_EXT_texture_filter_anisotropic)
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenBuffers(1, &displacement_pbo);
+	glGenBuffers(1, &normal_pbo);
+	uploaded = false;
+	Update(0.0f);
+}
+
+bool OceanWaves::Update(float time)
+{
+	// Time going backwards (e.g. a restarted benchmark) always updates
+	if (uploaded && settings.update_rate > 0.0f && time >= last_update && time - last_update < 1.0f / settings.update_rate)
+		return false;
+
+	// Orphaning the buffers lets the driver hand out fresh storage while the previous upload may still be read
+	GLsizeiptr displacement_bytes = GLsizeiptr(n) * n * 4 * sizeof(float);
+	GLsizeiptr normal_bytes = GLsizeiptr(n) * n * 4;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, displacement_pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, displacement_bytes, nullptr, GL_STREAM_DRAW);
+	void* displacement = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, displacement_bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, normal_pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, normal_bytes, nullptr, GL_STREAM_DRAW);
+	void* normals = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, normal_bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+
+	bool mapped = displacement != nullptr && normals != nullptr;
+	if (mapped)
+		Simulate(time, static_cast<float*>(displacement), static_cast<uint8_t*>(normals));
+
+	if (normals != nullptr)
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, displacement_pbo);
+	if (displacement != nullptr)
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	if (mapped) {
+		glBindTexture(GL_TEXTURE_2D, displacement_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, n, n, GL_RGBA, GL_FLOAT, nullptr);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, normal_pbo);
+		glBindTexture(GL_TEXTURE_2D, normal_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, n, n, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		last_update = time;
+		uploaded = true;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return mapped;
+}
+
+void OceanWaves::RunBenchmark(std::ostream& out)
+{
+	for (int size : { 128, 256, 512 }) {
+		Settings settings;
+		settings.resolution = size;
+		OceanWaves ocean;
+		ocean.Initialize(settings);
+		float* re[] = { ocean.fields[0].data() };
+		float* im[] = { ocean.fields[1].data() };
+		int repeats = std::max(4, (1 << 24) / (size * size));
+
+		auto time_fft = [&](bool simd, bool parallel) {
+			auto start = std::chrono::steady_clock::now();
+			for (int r = 0; r < repeats; ++r) {
+				if (simd)
+					InverseFft2DSimd(re, im, 1, size, ocean.twiddle_re.data(), ocean.twiddle_im.data(), ocean.reversed.data(), parallel);
+				else
+					InverseFft2D<ScalarFloat>(re, im, 1, size, ocean.twiddle_re.data(), ocean.twiddle_im.data(), ocean.reversed.data(), parallel);
+			}
+			return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / repeats;
+		};
+		// 5 N log2(N) flops per complex FFT of N points
+		auto gflops = [&](double ms) { return 5.0 * size * size * std::log2(double(size) * size) / (ms * 1.0e6); };
+		double scalar = time_fft(false, false);
+		double simd = time_fft(true, false);
+		double pool = time_fft(true, true);
+		out << "FFT " << size << "x" << size << ": scalar " << scalar << " ms (" << gflops(scalar) << " GFlop/s), " << Simd::Name()
+			<< " " << simd << " ms (" << gflops(simd) << " GFlop/s), " << Simd::Name() << " on " << ThreadPool::Shared().ThreadCount() + 1
+			<< " threads " << pool << " ms (" << gflops(pool) << " GFlop/s)" << std::endl;
+
+		// A whole update: spectrum, three transforms and the texture data
+		std::vector<float> displacement(size_t(size) * size * 4);
+		std::vector<uint8_t> normals(size_t(size) * size * 4);
+		const int frames = 20;
+		auto start = std::chrono::steady_clock::now();
+		for (int frame = 0; frame < frames; ++frame)
+			ocean.Simulate(frame / 60.0f, displacement.data(), normals.data());
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+		out << "Ocean update " << size << "x" << size << ": " << ms << " ms per update, "
+			<< (displacement.size() * sizeof(float) + normals.size()) / (1024.0 * 1024.0) << " MiB uploaded, "
+			<< ms * settings.update_rate << " ms per second at " << settings.update_rate << " updates/s" << std::endl;
+	}
+}
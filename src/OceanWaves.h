@@ -0,0 +1,88 @@
+#pragma once
+#include <vector>
+#include <iostream>
+#include <cstdint>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----           OCEAN WAVES           ----
+//-----------------------------------------
+
+/// Tessendorf ocean on the CPU: a Phillips spectrum is evolved in time and turned into a repeating patch of
+/// heights, horizontal (choppy) displacements and slopes by inverse FFTs. The 2D transforms run radix-2 over
+/// columns with one SIMD lane per column, the columns and the transposes are spread over the thread pool.
+/// Five real fields are packed into three complex transforms. Update writes the results straight into mapped
+/// pixel unpack buffers, displacement_tex (RGBA32F: X, height, Z) and normal_tex (RGBA8) are filled from them.
+class OceanWaves
+{
+public:
+	struct Settings
+	{
+		/// Samples along each side of the patch, a power of two from 16 to 2048
+		int resolution = 256;
+		/// World size of the repeating patch
+		float patch_size = 20.0f;
+		/// Wind speed (world units per second) and direction, the largest waves are wind_speed^2 / 9.81 long
+		float wind_speed = 6.0f;
+		glm::vec2 wind_direction = glm::vec2(1.0f, 0.3f);
+		/// RMS height of the waves in world units
+		float wave_height = 0.05f;
+		/// Scale of the horizontal displacement, 0 gives round sine-like crests
+		float choppiness = 1.0f;
+		/// Updates per second of animation time, 0 updates on every call
+		float update_rate = 30.0f;
+		uint32_t seed = 1;
+	};
+
+	OceanWaves() = default;
+	OceanWaves(const OceanWaves&) = delete;
+	OceanWaves& operator =(const OceanWaves&) = delete;
+	~OceanWaves();
+
+	/// Draws the initial spectrum, throws std::invalid_argument for an unsupported resolution. Needs no GL context.
+	void Initialize(const Settings& settings);
+
+	/// Creates the textures and pixel buffers and uploads the waves at time 0
+	void CreateTextures();
+
+	/// Recomputes the waves for 'time' (seconds) when an update is due and uploads them. Returns true if it did.
+	bool Update(float time);
+
+	/// Waves at 'time': displacement gets 4 floats and normals 4 bytes per sample, row major. Needs no GL context.
+	void Simulate(float time, float* displacement, uint8_t* normals);
+
+	const Settings& GetSettings() const { return settings; }
+
+	GLuint displacement_tex = 0;
+	GLuint normal_tex = 0;
+
+	/// Times the 2D FFT (scalar and SIMD, one thread and the pool) and a whole update at 128, 256 and 512
+	static void RunBenchmark(std::ostream& out = std::cout);
+
+private:
+	Settings settings;
+	int n = 0;
+	/// Initial amplitudes h0(k) and conj(h0(-k)), interleaved real and imaginary, in FFT order
+	std::vector<float> h0;
+	std::vector<float> h0_conj;
+	/// Angular frequency of every wave vector
+	std::vector<float> omega;
+	/// exp(2 pi i j / n) for j < n / 2
+	std::vector<float> twiddle_re;
+	std::vector<float> twiddle_im;
+	/// Bit reversed index of every row
+	std::vector<int> reversed;
+	/// Three complex fields (X + iZ displacement, X + iZ slope, height), split real and imaginary
+	std::vector<float> fields[6];
+
+	GLuint displacement_pbo = 0;
+	GLuint normal_pbo = 0;
+	float last_update = 0.0f;
+	bool uploaded = false;
+
+	void EvolveSpectrum(float time);
+};
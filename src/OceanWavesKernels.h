@@ -0,0 +1,62 @@
+#pragma once
+#include "Simd.h"
+
+#include <cstddef>
+
+//-----------------------------------------
+//----       OCEAN WAVES KERNELS       ----
+//-----------------------------------------
+
+/// SIMD kernel of the OceanWaves FFT, instantiated for the baseline in OceanWaves.cpp and for AVX2 in SimdAvx2.cpp
+namespace OceanWavesKernels
+{
+	/// Radix-2 decimation in time inverse FFT along the rows of the columns [x0, x1), one lane per column
+	template<class S>
+	void TransformColumns(float* re, float* im, int n, int x0, int x1, const float* twiddle_re, const float* twiddle_im, const int* reversed) {
+		typedef typename S::F F;
+		for (int z = 0; z < n; ++z) {
+			int r = reversed[z];
+			if (r <= z)
+				continue;
+			float* re_z = re + size_t(z) * n;
+			float* im_z = im + size_t(z) * n;
+			float* re_r = re + size_t(r) * n;
+			float* im_r = im + size_t(r) * n;
+			for (int x = x0; x < x1; ++x) {
+				float swap_re = re_z[x], swap_im = im_z[x];
+				re_z[x] = re_r[x];
+				im_z[x] = im_r[x];
+				re_r[x] = swap_re;
+				im_r[x] = swap_im;
+			}
+		}
+
+		for (int half = 1; half < n; half <<= 1) {
+			int step = n / (2 * half);
+			for (int start = 0; start < n; start += 2 * half) {
+				for (int j = 0; j < half; ++j) {
+					F wr = S::Set(twiddle_re[j * step]);
+					F wi = S::Set(twiddle_im[j * step]);
+					float* ar = re + size_t(start + j) * n;
+					float* ai = im + size_t(start + j) * n;
+					float* br = ar + size_t(half) * n;
+					float* bi = ai + size_t(half) * n;
+					for (int x = x0; x < x1; x += S::WIDTH) {
+						F pr = S::Load(br + x), pi = S::Load(bi + x);
+						F tr = S::Sub(S::Mul(pr, wr), S::Mul(pi, wi));
+						F ti = S::Add(S::Mul(pr, wi), S::Mul(pi, wr));
+						F qr = S::Load(ar + x), qi = S::Load(ai + x);
+						S::Store(ar + x, S::Add(qr, tr));
+						S::Store(ai + x, S::Add(qi, ti));
+						S::Store(br + x, S::Sub(qr, tr));
+						S::Store(bi + x, S::Sub(qi, ti));
+					}
+				}
+			}
+		}
+	}
+}
+
+#if !defined(SIMD_AVX2)
+extern template void OceanWavesKernels::TransformColumns<Avx2::SimdFloat>(float*, float*, int, int, int, const float*, const float*, const int*);
+#endif
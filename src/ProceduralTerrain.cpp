@@ -0,0 +1,66 @@
+#include "ProceduralTerrain.h"
+#include "ProceduralTerrainKernels.h"
+#include "ThreadPool.h"
+#include <chrono>
+
+namespace {
+	// Columns per task
+	const int COLUMN_BLOCK = 16;
+}
+
+const char* ProceduralTerrain::InstructionSet()
+{
+	return Simd::Name();
+}
+
+void ProceduralTerrain::GenerateRegion(const Settings& settings, int gx0, int gz0, int w, int h, std::vector<std::vector<float>>& out)
+{
+	out.assign(w, std::vector<float>(h));
+	bool avx2 = Simd::Avx2();
+
+	int blocks = (w + COLUMN_BLOCK - 1) / COLUMN_BLOCK;
+	ThreadPool::Shared().ParallelFor(0, blocks, [&](int block) {
+		int x_end = std::min(w, (block + 1) * COLUMN_BLOCK);
+		for (int x = block * COLUMN_BLOCK; x < x_end; ++x) {
+			if (avx2)
+				ProceduralTerrainKernels::HeightColumn<Avx2::SimdFloat>(settings, float(gx0 + x), gz0, h, out[x].data());
+			else
+				ProceduralTerrainKernels::HeightColumn<SimdFloat>(settings, float(gx0 + x), gz0, h, out[x].data());
+		}
+	});
+}
+
+std::vector<std::vector<float>> ProceduralTerrain::Generate(const Settings& settings, int size_x, int size_z)
+{
+	std::vector<std::vector<float>> height;
+	GenerateRegion(settings, 0, 0, size_x, size_z, height);
+	return height;
+}
+
+TerrainStreamer::HeightSource ProceduralTerrain::Source(const Settings& settings)
+{
+	return [settings](int gx0, int gz0, int w, int h, std::vector<std::vector<float>>& out) {
+		GenerateRegion(settings, gx0, gz0, w, h, out);
+	};
+}
+
+void ProceduralTerrain::RunBenchmark(const Settings& settings, int size, std::ostream& out)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::vector<float>> height = Generate(settings, size, size);
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	// FNV-1a over the raw sample bits
+	uint32_t checksum = 2166136261u;
+	for (const auto& column : height) {
+		for (float v : column) {
+			uint32_t bits;
+			std::memcpy(&bits, &v, sizeof(bits));
+			checksum = (checksum ^ bits) * 16777619u;
+		}
+	}
+
+	out << "Procedural terrain " << size << "x" << size << " (seed " << settings.seed << ", " << InstructionSet() << ", "
+		<< ThreadPool::Shared().ThreadCount() + 1 << " threads): " << ms << " ms, "
+		<< (double(size) * size / (ms * 1000.0)) << " Msamples/s, checksum " << std::hex << checksum << std::dec << std::endl;
+}
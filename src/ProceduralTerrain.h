@@ -0,0 +1,50 @@
+#pragma once
+#include "TerrainStreamer.h"
+
+#include <vector>
+#include <iostream>
+#include <cstdint>
+
+//-----------------------------------------
+//----       PROCEDURAL TERRAIN        ----
+//-----------------------------------------
+
+/// Noise based heightfields (gradient noise fBm blended with ridged multifractal, with domain warping), an
+/// alternative to authoring heightmap images. Heights are a pure function of (seed, global sample position),
+/// so regions generate independently and seamlessly (one column of samples per SIMD lane group, columns
+/// spread over the thread pool), and a seed always reproduces the same terrain.
+class ProceduralTerrain
+{
+public:
+	struct Settings
+	{
+		uint32_t seed = 1337;
+		/// Base frequency in cycles per sample
+		float frequency = 1.0f / 160.0f;
+		int octaves = 6;
+		float lacunarity = 2.0f;
+		float gain = 0.5f;
+		/// 0 = plain fBm hills, 1 = ridged mountains
+		float ridged = 0.6f;
+		/// Domain warp, displacement in samples
+		int warp_octaves = 2;
+		float warp_strength = 48.0f;
+		/// Stretch of the heights around 0.5 before clamping to [0, 1]
+		float contrast = 2.0f;
+	};
+
+	/// Fills 'out' ([x][z], w * h samples, normalized to [0, 1]) starting at the global sample (gx0, gz0)
+	static void GenerateRegion(const Settings& settings, int gx0, int gz0, int w, int h, std::vector<std::vector<float>>& out);
+
+	/// Heightfield of size_x * size_z samples with the layout of Terrain::height
+	static std::vector<std::vector<float>> Generate(const Settings& settings, int size_x, int size_z);
+
+	/// Unbounded source for the streamed world
+	static TerrainStreamer::HeightSource Source(const Settings& settings);
+
+	/// Name of the instruction set the kernels were compiled for
+	static const char* InstructionSet();
+
+	/// Times the generation of a size * size heightfield and prints it with a checksum (identical for the same seed)
+	static void RunBenchmark(const Settings& settings, int size, std::ostream& out = std::cout);
+};
@@ -0,0 +1,146 @@
+#pragma once
+#include "ProceduralTerrain.h"
+#include "Simd.h"
+
+//-----------------------------------------
+//----   PROCEDURAL TERRAIN KERNELS    ----
+//-----------------------------------------
+
+/// SIMD kernels of ProceduralTerrain, instantiated for the baseline in ProceduralTerrain.cpp and for AVX2 in
+/// SimdAvx2.cpp
+namespace ProceduralTerrainKernels
+{
+	// Integer hash of a lattice point, lanes wrap like uint32_t
+	template<class S>
+	typename S::I Hash(typename S::I ix, typename S::I iz, typename S::I seed) {
+		typename S::I h = S::XorI(S::XorI(S::MulI(ix, S::SetI(int32_t(0x8da6b343u))), S::MulI(iz, S::SetI(int32_t(0xd8163841u)))), seed);
+		h = S::MulI(S::XorI(h, S::template ShrI<15>(h)), S::SetI(int32_t(0x2c1b3c6du)));
+		h = S::MulI(S::XorI(h, S::template ShrI<12>(h)), S::SetI(int32_t(0x297a2d39u)));
+		return S::XorI(h, S::template ShrI<15>(h));
+	}
+
+	// One of 8 gradients picked by the low bits of the hash (as in Gustavson's noise1234)
+	template<class S>
+	typename S::F Grad(typename S::I h, typename S::F x, typename S::F z) {
+		typename S::F u = S::SelectBits(h, 4, x, z);
+		typename S::F v = S::SelectBits(h, 4, z, x);
+		return S::Add(S::FlipSign(u, S::template ShlI<31>(h)), S::FlipSign(S::Add(v, v), S::template ShlI<30>(h)));
+	}
+
+	// Quintic fade 6t^5 - 15t^4 + 10t^3
+	template<class S>
+	typename S::F Fade(typename S::F t) {
+		typename S::F inner = S::Add(S::Mul(t, S::Sub(S::Mul(t, S::Set(6.0f)), S::Set(15.0f))), S::Set(10.0f));
+		return S::Mul(S::Mul(S::Mul(t, t), t), inner);
+	}
+
+	template<class S>
+	typename S::F Lerp(typename S::F a, typename S::F b, typename S::F t) {
+		return S::Add(a, S::Mul(S::Sub(b, a), t));
+	}
+
+	// 2D gradient noise, roughly in [-1, 1]
+	template<class S>
+	typename S::F Noise(typename S::F x, typename S::F z, typename S::I seed) {
+		typename S::F fx = S::Floor(x);
+		typename S::F fz = S::Floor(z);
+		typename S::I ix = S::ToInt(fx);
+		typename S::I iz = S::ToInt(fz);
+		typename S::F dx = S::Sub(x, fx);
+		typename S::F dz = S::Sub(z, fz);
+		typename S::F dx1 = S::Sub(dx, S::Set(1.0f));
+		typename S::F dz1 = S::Sub(dz, S::Set(1.0f));
+		typename S::I one = S::SetI(1);
+		typename S::I ix1 = S::AddI(ix, one);
+		typename S::I iz1 = S::AddI(iz, one);
+
+		typename S::F n00 = Grad<S>(Hash<S>(ix, iz, seed), dx, dz);
+		typename S::F n10 = Grad<S>(Hash<S>(ix1, iz, seed), dx1, dz);
+		typename S::F n01 = Grad<S>(Hash<S>(ix, iz1, seed), dx, dz1);
+		typename S::F n11 = Grad<S>(Hash<S>(ix1, iz1, seed), dx1, dz1);
+
+		typename S::F u = Fade<S>(dx);
+		typename S::F v = Fade<S>(dz);
+		return S::Mul(Lerp<S>(Lerp<S>(n00, n10, u), Lerp<S>(n01, n11, u), v), S::Set(0.507f));
+	}
+
+	// Fractal sum normalized to [-1, 1]
+	template<class S>
+	typename S::F Fbm(typename S::F x, typename S::F z, uint32_t seed, int octaves, float lacunarity, float gain) {
+		typename S::F sum = S::Set(0.0f);
+		float amplitude = 1.0f, total = 0.0f, frequency = 1.0f;
+		for (int i = 0; i < octaves; ++i) {
+			typename S::F n = Noise<S>(S::Mul(x, S::Set(frequency)), S::Mul(z, S::Set(frequency)), S::SetI(int32_t(seed + i * 0x9e3779b9u)));
+			sum = S::Add(sum, S::Mul(n, S::Set(amplitude)));
+			total += amplitude;
+			amplitude *= gain;
+			frequency *= lacunarity;
+		}
+		return S::Mul(sum, S::Set(1.0f / total));
+	}
+
+	// fBm hills (mapped to [0, 1]) and a ridged multifractal in [0, 1] from the same noise octaves. Each ridged
+	// octave is weighted by the previous one so ridges stay sharp and valleys smooth.
+	template<class S>
+	void HillsAndRidges(typename S::F x, typename S::F z, uint32_t seed, int octaves, float lacunarity, float gain,
+		typename S::F& hills, typename S::F& ridges) {
+		typename S::F hill_sum = S::Set(0.0f);
+		typename S::F ridge_sum = S::Set(0.0f);
+		typename S::F weight = S::Set(1.0f);
+		float amplitude = 1.0f, total = 0.0f, frequency = 1.0f;
+		for (int i = 0; i < octaves; ++i) {
+			typename S::F n = Noise<S>(S::Mul(x, S::Set(frequency)), S::Mul(z, S::Set(frequency)), S::SetI(int32_t(seed + i * 0x9e3779b9u)));
+			hill_sum = S::Add(hill_sum, S::Mul(n, S::Set(amplitude)));
+
+			typename S::F r = S::Sub(S::Set(1.0f), S::Abs(n));
+			r = S::Mul(S::Mul(r, r), weight);
+			weight = S::Min(S::Max(S::Mul(r, S::Set(2.0f)), S::Set(0.0f)), S::Set(1.0f));
+			ridge_sum = S::Add(ridge_sum, S::Mul(r, S::Set(amplitude)));
+
+			total += amplitude;
+			amplitude *= gain;
+			frequency *= lacunarity;
+		}
+		hills = S::Add(S::Mul(hill_sum, S::Set(0.5f / total)), S::Set(0.5f));
+		ridges = S::Mul(ridge_sum, S::Set(1.0f / total));
+	}
+
+	// Height of S::WIDTH samples along Z (gz, gz + 1, ...) at the global column gx
+	template<class S>
+	typename S::F Height(const ProceduralTerrain::Settings& settings, float gx, float gz) {
+		typename S::F x = S::Mul(S::Set(gx), S::Set(settings.frequency));
+		typename S::F z = S::Mul(S::Ramp(gz), S::Set(settings.frequency));
+
+		// Domain warp: offset the lookup by two low frequency fBm fields
+		if (settings.warp_octaves > 0) {
+			typename S::F wx = Fbm<S>(S::Add(x, S::Set(5.2f)), S::Add(z, S::Set(1.3f)), settings.seed + 101u, settings.warp_octaves, settings.lacunarity, settings.gain);
+			typename S::F wz = Fbm<S>(S::Add(x, S::Set(1.7f)), S::Add(z, S::Set(9.2f)), settings.seed + 202u, settings.warp_octaves, settings.lacunarity, settings.gain);
+			typename S::F strength = S::Set(settings.warp_strength * settings.frequency);
+			x = S::Add(x, S::Mul(wx, strength));
+			z = S::Add(z, S::Mul(wz, strength));
+		}
+
+		typename S::F hills, ridges;
+		HillsAndRidges<S>(x, z, settings.seed, settings.octaves, settings.lacunarity, settings.gain, hills, ridges);
+		typename S::F h = Lerp<S>(hills, ridges, S::Set(settings.ridged));
+
+		// Fractal sums rarely reach their bounds, stretch around the middle height
+		h = S::Add(S::Mul(S::Sub(h, S::Set(0.5f)), S::Set(settings.contrast)), S::Set(0.5f));
+		return S::Min(S::Max(h, S::Set(0.0f)), S::Set(1.0f));
+	}
+
+	/// Heights of 'count' samples along Z (gz0, gz0 + 1, ...) at the global column gx, S::WIDTH at a time
+	template<class S>
+	void HeightColumn(const ProceduralTerrain::Settings& settings, float gx, int gz0, int count, float* column) {
+		typedef typename S::Scalar Scalar;
+		int z = 0;
+		for (; z + S::WIDTH <= count; z += S::WIDTH)
+			S::Store(column + z, Height<S>(settings, gx, float(gz0 + z)));
+		for (; z < count; ++z)
+			Scalar::Store(column + z, Height<Scalar>(settings, gx, float(gz0 + z)));
+	}
+}
+
+#if !defined(SIMD_AVX2)
+extern template void ProceduralTerrainKernels::HeightColumn<Avx2::SimdFloat>(const ProceduralTerrain::Settings&, float, int, int, float*);
+#endif
@@ -0,0 +1,38 @@
+#include "ProjectedWater.h"
+#include <algorithm>
+
+Geometry ProjectedWater::CreateGrid(const Settings& settings)
+{
+	Geometry grid;
+
+	// The core profile still needs a bound vertex array object, even with no attributes
+	glGenVertexArrays(1, &grid.VertexArrayObject);
+
+	grid.Mode = GL_TRIANGLE_STRIP;
+	grid.DrawArraysCount = settings.columns * 2;
+	grid.DrawElementsCount = 0;
+	return grid;
+}
+
+glm::vec3 ProjectedWater::VertexPosition(const glm::mat4& inverse_view_projection, const Settings& settings, float level,
+	const glm::vec4& bounds, int column, int row, bool& inside)
+{
+	glm::vec2 ndc = (glm::vec2(float(column) / (settings.columns - 1), float(row) / (settings.rows - 1)) * 2.0f - 1.0f) * (1.0f + settings.overscan);
+	auto unproject = [&](float depth) {
+		glm::vec4 position = inverse_view_projection * glm::vec4(ndc, depth, 1.0f);
+		return glm::vec3(position) / position.w;
+	};
+
+	glm::vec3 near = unproject(-1.0f);
+	glm::vec3 ray = unproject(1.0f) - near;
+	glm::vec2 horizontal(ray.x, ray.z);
+	glm::vec2 heading = glm::length(horizontal) > 0.0f ? glm::normalize(horizontal) : glm::vec2(0.0f);
+	float reach = settings.horizon;
+	if (ray.y < 0.0f)
+		reach = std::min(std::max((level - near.y) / ray.y, 0.0f) * glm::length(horizontal), settings.horizon);
+	glm::vec2 xz = glm::vec2(near.x, near.z) + heading * reach;
+
+	glm::vec2 clamped = glm::clamp(xz, glm::vec2(bounds.x, bounds.y), glm::vec2(bounds.z, bounds.w));
+	inside = clamped == xz && reach < settings.horizon;
+	return glm::vec3(clamped.x, level, clamped.y);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "Geometry.h"
+
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----         PROJECTED WATER         ----
+//-----------------------------------------
+
+/// Projected grid water: a columns * rows grid spread evenly over the screen, water_projected_vertex.glsl casts
+/// a ray through every vertex and places it where the ray meets the water plane. The mesh is rebuilt by the
+/// vertex shader every frame from the camera matrices and gl_VertexID, so there are no vertex buffers and the
+/// vertex count does not depend on the view.
+class ProjectedWater
+{
+public:
+	struct Settings
+	{
+		int columns = 160;
+		int rows = 90;
+		/// Extra NDC reach past the screen edges
+		float overscan = 0.1f;
+		/// Greatest horizontal distance of the water from the eye
+		float horizon = 400.0f;
+	};
+
+	/// Attribute-less grid, one triangle strip per row: draw with DrawGeometryInstanced(geometry, rows - 1)
+	static Geometry CreateGrid(const Settings& settings);
+
+	/// World position of vertex (column, row) without the waves, as computed by the vertex shader. 'bounds' is
+	/// the water rectangle (min X, min Z, max X, max Z), 'inside' is false when the vertex was pulled onto its
+	/// border (or past the horizon), such vertices only form degenerate triangles.
+	static glm::vec3 VertexPosition(const glm::mat4& inverse_view_projection, const Settings& settings, float level,
+		const glm::vec4& bounds, int column, int row, bool& inside);
+
+	static size_t VertexCount(const Settings& settings) { return size_t(settings.columns) * settings.rows; }
+	static size_t TriangleCount(const Settings& settings) { return 2 * size_t(settings.columns - 1) * (settings.rows - 1); }
+};
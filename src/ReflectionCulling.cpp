@@ -0,0 +1,53 @@
+#include "ReflectionCulling.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+
+glm::mat4 ReflectionCulling::Mirror(float level)
+{
+	glm::mat4 mirror = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, level, 0.0f));
+	mirror = glm::scale(mirror, glm::vec3(1.0f, -1.0f, 1.0f));
+	return glm::translate(mirror, glm::vec3(0.0f, -level, 0.0f));
+}
+
+void ReflectionCulling::Build(const Terrain& terrain)
+{
+	int quads_x = terrain.size_x - 1, quads_z = terrain.size_z - 1;
+	int chunks = terrain.chunks_x * terrain.chunks_z;
+	chunk_min.assign(chunks, glm::vec3(0.0f));
+	chunk_max.assign(chunks, glm::vec3(0.0f));
+	for (int cz = 0; cz < terrain.chunks_z; ++cz) {
+		for (int cx = 0; cx < terrain.chunks_x; ++cx) {
+			int x0 = Terrain::ChunkBegin(cx, terrain.chunks_x, quads_x), x1 = Terrain::ChunkBegin(cx + 1, terrain.chunks_x, quads_x);
+			int z0 = Terrain::ChunkBegin(cz, terrain.chunks_z, quads_z), z1 = Terrain::ChunkBegin(cz + 1, terrain.chunks_z, quads_z);
+			float low = 1.0f, high = 0.0f;
+			for (int x = x0; x <= x1; ++x) {
+				auto range = std::minmax_element(terrain.height[x].begin() + z0, terrain.height[x].begin() + z1 + 1);
+				low = std::min(low, *range.first);
+				high = std::max(high, *range.second);
+			}
+			// Placement of the single terrain: translate(0, -2, 0) * scale(100, TERRAIN_HEIGHT, 100)
+			int i = cz * terrain.chunks_x + cx;
+			chunk_min[i] = glm::vec3(float(x0) / terrain.size_x * 100.0f - 50.0f, low * TERRAIN_HEIGHT - 2.0f, float(z0) / terrain.size_z * 100.0f - 50.0f);
+			chunk_max[i] = glm::vec3(float(x1) / terrain.size_x * 100.0f - 50.0f, high * TERRAIN_HEIGHT - 2.0f, float(z1) / terrain.size_z * 100.0f - 50.0f);
+		}
+	}
+}
+
+void ReflectionCulling::CullChunks(const Frustum& frustum, float level, std::vector<char>& visible) const
+{
+	visible.resize(chunk_min.size());
+	for (size_t i = 0; i < chunk_min.size(); ++i)
+		visible[i] = chunk_max[i].y > level && frustum.IntersectsBox(chunk_min[i], chunk_max[i]);
+}
+
+int ReflectionCulling::OccludeChunks(const HiZMap& occlusion, std::vector<char>& visible) const
+{
+	int hidden = 0;
+	for (size_t i = 0; i < chunk_min.size() && i < visible.size(); ++i) {
+		if (visible[i] && !occlusion.BoxVisible(chunk_min[i], chunk_max[i])) {
+			visible[i] = false;
+			++hidden;
+		}
+	}
+	return hidden;
+}
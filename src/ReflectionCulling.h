@@ -0,0 +1,37 @@
+#pragma once
+#include "Terrain.h"
+#include "Frustum.h"
+#include "HiZMap.h"
+
+#include <vector>
+
+//-----------------------------------------
+//----       REFLECTION CULLING        ----
+//-----------------------------------------
+
+/// Cull lists of the planar reflection pass. The reflection camera is the main camera mirrored in the water plane,
+/// its frustum (Frustum of projection * view * Mirror) tests world space bounds directly. Everything under the
+/// water plane is clipped away by the reflection pass anyway, so terrain chunks that do not reach above it are
+/// dropped as well. Instances are culled by InstanceCulling with the same frustum. The chunk bounds also serve the
+/// occlusion test of the main pass.
+class ReflectionCulling
+{
+public:
+	/// Reflection of world space in the plane y = level
+	static glm::mat4 Mirror(float level);
+
+	/// World bounds of the chunks of the single terrain (after Terrain::BuildChunks), call again after brush edits
+	void Build(const Terrain& terrain);
+
+	bool Empty() const { return chunk_min.empty(); }
+
+	/// Flags the chunks inside the mirrored frustum that reach above the water, one flag per chunk
+	void CullChunks(const Frustum& frustum, float level, std::vector<char>& visible) const;
+
+	/// Clears the flags of the chunks hidden in 'occlusion', returns how many were cleared
+	int OccludeChunks(const HiZMap& occlusion, std::vector<char>& visible) const;
+
+private:
+	std::vector<glm::vec3> chunk_min;
+	std::vector<glm::vec3> chunk_max;
+};
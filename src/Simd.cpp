@@ -0,0 +1,61 @@
+#include "Simd.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace {
+	bool CpuHasAvx2()
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		int ecx1 = info[2];
+		__cpuidex(info, 7, 0);
+		int ebx7 = info[1];
+		// FMA (bit 12), OSXSAVE (27), AVX (28), then the OS saves the XMM and YMM state
+		if ((ecx1 & (1 << 12)) == 0 || (ecx1 & (1 << 27)) == 0 || (ecx1 & (1 << 28)) == 0)
+			return false;
+		if ((_xgetbv(0) & 6) != 6)
+			return false;
+		return (ebx7 & (1 << 5)) != 0;
+#elif defined(__x86_64__) || defined(__i386__)
+		unsigned eax, ebx, ecx, edx;
+		if (__get_cpuid_max(0, nullptr) < 7)
+			return false;
+		__cpuid(1, eax, ebx, ecx, edx);
+		if ((ecx & (1u << 12)) == 0 || (ecx & (1u << 27)) == 0 || (ecx & (1u << 28)) == 0)
+			return false;
+		unsigned xcr0_low, xcr0_high;
+		__asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+		if ((xcr0_low & 6) != 6)
+			return false;
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		return (ebx & (1u << 5)) != 0;
+#else
+		return false;
+#endif
+	}
+}
+
+bool Simd::Avx2()
+{
+	static const bool supported = CpuHasAvx2();
+	return supported;
+}
+
+const char* Simd::Name()
+{
+	return Avx2() ? "AVX2" : SimdFloat::Name();
+}
+
+int Simd::Width()
+{
+	return Avx2() ? SIMD_MAX_WIDTH : SimdFloat::WIDTH;
+}
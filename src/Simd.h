@@ -0,0 +1,276 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <math.h>
+#include <algorithm>
+#include <cstring>
+
+//-----------------------------------------
+//----          SIMD HELPERS           ----
+//-----------------------------------------
+
+// Instruction set the unit is compiled for. The project builds for the SSE2 baseline, only SimdAvx2.cpp is compiled
+// with /arch:AVX2 (-mavx2 -mfma) and holds the AVX2 instantiations of the kernels, picked at run time when
+// Simd::Avx2() says the CPU runs them. Kernels are written once against the lane types below and instantiated for
+// SimdFloat (the widest of the unit) and ScalarFloat (remainders, reference). The lane types of every instruction
+// set live in their own namespace, so the AVX2 code of a kernel never stands in for its baseline code at link time.
+// For the same reason the kernels call no inline code the baseline units also use (containers, std::min, GLM): the
+// linker keeps one copy of such a function and it may be the AVX2 one. They take raw arrays and plain structs, and
+// the scalar lanes call the C math functions.
+#if defined(__AVX2__)
+#define SIMD_AVX2 1
+#define SIMD_NAMESPACE Avx2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2 1
+#define SIMD_NAMESPACE Sse2
+#include <emmintrin.h>
+#else
+#define SIMD_NAMESPACE Scalar
+#endif
+
+/// Lanes of the widest SimdFloat of any unit, for buffers and layouts shared by the kernels of all instruction sets
+const int SIMD_MAX_WIDTH = 8;
+
+namespace Simd
+{
+	/// Whether the AVX2 kernels can run: the CPU has AVX2 and FMA and the OS saves the YMM registers. Checked once.
+	bool Avx2();
+	/// Name and lanes of the SimdFloat the kernels dispatch to
+	const char* Name();
+	int Width();
+}
+
+// Defined in the units compiled for AVX2 only, the others call the kernels instantiated there
+namespace Avx2 { struct SimdFloat; }
+
+namespace SIMD_NAMESPACE {
+
+/// One lane, also the reference implementation of every operation
+struct ScalarFloat
+{
+	typedef float F;
+	typedef int32_t I;
+	typedef bool M;
+	typedef ScalarFloat Scalar;
+	static const int WIDTH = 1;
+	static const char* Name() { return "scalar"; }
+
+	static F Load(const float* p) { return *p; }
+	static void Store(float* p, F v) { *p = v; }
+	static F Set(float v) { return v; }
+	static I SetI(int32_t v) { return v; }
+	/// v, v + 1, v + 2, ...
+	static F Ramp(float v) { return v; }
+
+	static F Add(F a, F b) { return a + b; }
+	static F Sub(F a, F b) { return a - b; }
+	static F Mul(F a, F b) { return a * b; }
+	static F Div(F a, F b) { return a / b; }
+	static F Min(F a, F b) { return b < a ? b : a; }
+	static F Max(F a, F b) { return a < b ? b : a; }
+	static F Abs(F a) { return fabsf(a); }
+	static F Sqrt(F a) { return sqrtf(a); }
+	static F Floor(F a) { return floorf(a); }
+
+	/// Converts an integral valued float
+	static I ToInt(F a) { return static_cast<int32_t>(a); }
+	static F ToFloat(I a) { return static_cast<float>(a); }
+
+	static I AddI(I a, I b) { return static_cast<int32_t>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b)); }
+	static I MulI(I a, I b) { return static_cast<int32_t>(static_cast<uint32_t>(a) * static_cast<uint32_t>(b)); }
+	static I XorI(I a, I b) { return a ^ b; }
+	static I AndI(I a, I b) { return a & b; }
+	template<int N> static I ShrI(I a) { return static_cast<int32_t>(static_cast<uint32_t>(a) >> N); }
+	template<int N> static I ShlI(I a) { return static_cast<int32_t>(static_cast<uint32_t>(a) << N); }
+
+	/// Flips the sign of 'v' where bit 31 of 'sign' is set
+	static F FlipSign(F v, I sign) {
+		uint32_t bits;
+		std::memcpy(&bits, &v, sizeof(bits));
+		bits ^= static_cast<uint32_t>(sign) & 0x80000000u;
+		std::memcpy(&v, &bits, sizeof(bits));
+		return v;
+	}
+	/// Where (bits & mask) != 0 returns b, otherwise a ('mask' is a single bit)
+	static F SelectBits(I bits, int32_t mask, F a, F b) { return (bits & mask) ? b : a; }
+	/// Where a < b returns 'if_less', otherwise 'otherwise'
+	static F SelectLess(F a, F b, F if_less, F otherwise) { return a < b ? if_less : otherwise; }
+	/// Bit i of the result is set where lane i of a < b
+	static int LessMask(F a, F b) { return a < b ? 1 : 0; }
+
+	/// Lane masks
+	static M Less(F a, F b) { return a < b; }
+	static M LessEqual(F a, F b) { return a <= b; }
+	static M And(M a, M b) { return a && b; }
+	static M Or(M a, M b) { return a || b; }
+	/// a and not b
+	static M AndNot(M a, M b) { return a && !b; }
+	static bool Any(M m) { return m; }
+	/// Bit i of the result is set where lane i of the mask is set
+	static int MaskBits(M m) { return m ? 1 : 0; }
+	/// Where 'm' is set returns a, otherwise b
+	static F Select(M m, F a, F b) { return m ? a : b; }
+	static I SelectI(M m, I a, I b) { return m ? a : b; }
+
+	static I LoadI(const int32_t* p) { return *p; }
+	static void StoreI(int32_t* p, I v) { *p = v; }
+	/// base[index] for every lane
+	static F Gather(const float* base, I index) { return base[index]; }
+	static I GatherI(const int32_t* base, I index) { return base[index]; }
+};
+
+#if defined(SIMD_AVX2)
+struct SimdFloat
+{
+	typedef __m256 F;
+	typedef __m256i I;
+	typedef __m256 M;
+	typedef ScalarFloat Scalar;
+	static const int WIDTH = 8;
+	static const char* Name() { return "AVX2"; }
+
+	static F Load(const float* p) { return _mm256_loadu_ps(p); }
+	static void Store(float* p, F v) { _mm256_storeu_ps(p, v); }
+	static F Set(float v) { return _mm256_set1_ps(v); }
+	static I SetI(int32_t v) { return _mm256_set1_epi32(v); }
+	static F Ramp(float v) { return _mm256_add_ps(_mm256_set1_ps(v), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)); }
+
+	static F Add(F a, F b) { return _mm256_add_ps(a, b); }
+	static F Sub(F a, F b) { return _mm256_sub_ps(a, b); }
+	static F Mul(F a, F b) { return _mm256_mul_ps(a, b); }
+	static F Div(F a, F b) { return _mm256_div_ps(a, b); }
+	static F Min(F a, F b) { return _mm256_min_ps(a, b); }
+	static F Max(F a, F b) { return _mm256_max_ps(a, b); }
+	static F Abs(F a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+	static F Sqrt(F a) { return _mm256_sqrt_ps(a); }
+	static F Floor(F a) { return _mm256_floor_ps(a); }
+
+	static I ToInt(F a) { return _mm256_cvttps_epi32(a); }
+	static F ToFloat(I a) { return _mm256_cvtepi32_ps(a); }
+
+	static I AddI(I a, I b) { return _mm256_add_epi32(a, b); }
+	static I MulI(I a, I b) { return _mm256_mullo_epi32(a, b); }
+	static I XorI(I a, I b) { return _mm256_xor_si256(a, b); }
+	static I AndI(I a, I b) { return _mm256_and_si256(a, b); }
+	template<int N> static I ShrI(I a) { return _mm256_srli_epi32(a, N); }
+	template<int N> static I ShlI(I a) { return _mm256_slli_epi32(a, N); }
+
+	static F FlipSign(F v, I sign) {
+		return _mm256_xor_ps(v, _mm256_castsi256_ps(_mm256_and_si256(sign, _mm256_set1_epi32(int32_t(0x80000000u)))));
+	}
+	static F SelectBits(I bits, int32_t mask, F a, F b) {
+		I m = _mm256_set1_epi32(mask);
+		return _mm256_blendv_ps(a, b, _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(bits, m), m)));
+	}
+	static F SelectLess(F a, F b, F if_less, F otherwise) {
+		return _mm256_blendv_ps(otherwise, if_less, _mm256_cmp_ps(a, b, _CMP_LT_OQ));
+	}
+	static int LessMask(F a, F b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+
+	static M Less(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static M LessEqual(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	static M And(M a, M b) { return _mm256_and_ps(a, b); }
+	static M Or(M a, M b) { return _mm256_or_ps(a, b); }
+	static M AndNot(M a, M b) { return _mm256_andnot_ps(b, a); }
+	static bool Any(M m) { return _mm256_movemask_ps(m) != 0; }
+	static int MaskBits(M m) { return _mm256_movemask_ps(m); }
+	static F Select(M m, F a, F b) { return _mm256_blendv_ps(b, a, m); }
+	static I SelectI(M m, I a, I b) { return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b), _mm256_castsi256_ps(a), m)); }
+
+	static I LoadI(const int32_t* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+	static void StoreI(int32_t* p, I v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+	static F Gather(const float* base, I index) { return _mm256_i32gather_ps(base, index, 4); }
+	static I GatherI(const int32_t* base, I index) { return _mm256_i32gather_epi32(base, index, 4); }
+};
+#elif defined(SIMD_SSE2)
+struct SimdFloat
+{
+	typedef __m128 F;
+	typedef __m128i I;
+	typedef __m128 M;
+	typedef ScalarFloat Scalar;
+	static const int WIDTH = 4;
+	static const char* Name() { return "SSE2"; }
+
+	static F Load(const float* p) { return _mm_loadu_ps(p); }
+	static void Store(float* p, F v) { _mm_storeu_ps(p, v); }
+	static F Set(float v) { return _mm_set1_ps(v); }
+	static I SetI(int32_t v) { return _mm_set1_epi32(v); }
+	static F Ramp(float v) { return _mm_add_ps(_mm_set1_ps(v), _mm_setr_ps(0, 1, 2, 3)); }
+
+	static F Add(F a, F b) { return _mm_add_ps(a, b); }
+	static F Sub(F a, F b) { return _mm_sub_ps(a, b); }
+	static F Mul(F a, F b) { return _mm_mul_ps(a, b); }
+	static F Div(F a, F b) { return _mm_div_ps(a, b); }
+	static F Min(F a, F b) { return _mm_min_ps(a, b); }
+	static F Max(F a, F b) { return _mm_max_ps(a, b); }
+	static F Abs(F a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+	static F Sqrt(F a) { return _mm_sqrt_ps(a); }
+	static F Floor(F a) {
+		// SSE2 has no floor: truncate, then step down where the truncation rounded up (negative values)
+		F t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+		return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1.0f)));
+	}
+
+	static I ToInt(F a) { return _mm_cvttps_epi32(a); }
+	static F ToFloat(I a) { return _mm_cvtepi32_ps(a); }
+
+	static I AddI(I a, I b) { return _mm_add_epi32(a, b); }
+	static I MulI(I a, I b) {
+		// SSE2 has no 32-bit low multiply, multiply even and odd lanes separately
+		__m128i even = _mm_mul_epu32(a, b);
+		__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+		return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+	}
+	static I XorI(I a, I b) { return _mm_xor_si128(a, b); }
+	static I AndI(I a, I b) { return _mm_and_si128(a, b); }
+	template<int N> static I ShrI(I a) { return _mm_srli_epi32(a, N); }
+	template<int N> static I ShlI(I a) { return _mm_slli_epi32(a, N); }
+
+	static F FlipSign(F v, I sign) {
+		return _mm_xor_ps(v, _mm_castsi128_ps(_mm_and_si128(sign, _mm_set1_epi32(int32_t(0x80000000u)))));
+	}
+	static F SelectBits(I bits, int32_t mask, F a, F b) {
+		I m = _mm_set1_epi32(mask);
+		F sel = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(bits, m), m));
+		return _mm_or_ps(_mm_and_ps(sel, b), _mm_andnot_ps(sel, a));
+	}
+	static F SelectLess(F a, F b, F if_less, F otherwise) {
+		F sel = _mm_cmplt_ps(a, b);
+		return _mm_or_ps(_mm_and_ps(sel, if_less), _mm_andnot_ps(sel, otherwise));
+	}
+	static int LessMask(F a, F b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+
+	static M Less(F a, F b) { return _mm_cmplt_ps(a, b); }
+	static M LessEqual(F a, F b) { return _mm_cmple_ps(a, b); }
+	static M And(M a, M b) { return _mm_and_ps(a, b); }
+	static M Or(M a, M b) { return _mm_or_ps(a, b); }
+	static M AndNot(M a, M b) { return _mm_andnot_ps(b, a); }
+	static bool Any(M m) { return _mm_movemask_ps(m) != 0; }
+	static int MaskBits(M m) { return _mm_movemask_ps(m); }
+	static F Select(M m, F a, F b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+	static I SelectI(M m, I a, I b) { return _mm_castps_si128(Select(m, _mm_castsi128_ps(a), _mm_castsi128_ps(b))); }
+
+	static I LoadI(const int32_t* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+	static void StoreI(int32_t* p, I v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+	// No gathers before AVX2, load the lanes one by one
+	static F Gather(const float* base, I index) {
+		alignas(16) int32_t i[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(i), index);
+		return _mm_setr_ps(base[i[0]], base[i[1]], base[i[2]], base[i[3]]);
+	}
+	static I GatherI(const int32_t* base, I index) {
+		alignas(16) int32_t i[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(i), index);
+		return _mm_setr_epi32(base[i[0]], base[i[1]], base[i[2]], base[i[3]]);
+	}
+};
+#else
+typedef ScalarFloat SimdFloat;
+#endif
+
+}
+
+using SIMD_NAMESPACE::ScalarFloat;
+using SIMD_NAMESPACE::SimdFloat;
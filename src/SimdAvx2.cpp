@@ -0,0 +1,27 @@
+// AVX2 instantiations of the SIMD kernels. This is the only unit built with /arch:AVX2 (-mavx2 -mfma), the kernels
+// here run only after Simd::Avx2() said the CPU has AVX2 and FMA.
+#if !defined(__AVX2__)
+#error SimdAvx2.cpp must be compiled with /arch:AVX2 (-mavx2 -mfma)
+#endif
+
+#include "ProceduralTerrainKernels.h"
+#include "TerrainKernels.h"
+#include "TerrainOcclusionKernels.h"
+#include "TerrainRaycasterKernels.h"
+#include "InstanceCullingKernels.h"
+#include "OceanWavesKernels.h"
+#include "OcclusionRasterizerKernels.h"
+
+template void ProceduralTerrainKernels::HeightColumn<Avx2::SimdFloat>(const ProceduralTerrain::Settings&, float, int, int, float*);
+template void TerrainKernels::SobelColumn<Avx2::SimdFloat>(const float*, const float*, const float*, int, int, float, float, float*, float*);
+template void TerrainOcclusionKernels::OcclusionRow<Avx2::SimdFloat>(const TerrainOcclusionKernels::Pattern&, const float*, int, int,
+	int, int, int, uint8_t*);
+template void TerrainRaycasterKernels::Trace<Avx2::SimdFloat>(const TerrainRaycasterKernels::Pyramid&, const float*, const float*,
+	const float*, const float*, const float*, const float*, const float*, float*, int32_t*, int32_t*);
+template int InstanceCullingKernels::CullBlock<Avx2::SimdFloat>(const float*, const float*, const float*, const float*, int, int,
+	const Frustum&, float, int32_t*);
+template void OceanWavesKernels::TransformColumns<Avx2::SimdFloat>(float*, float*, int, int, int, const float*, const float*, const int*);
+template void OcclusionRasterizerKernels::TransformBlock<Avx2::SimdFloat>(const float*, const float*, const float*, const float*, int,
+	float*, float*, float*, float*);
+template void OcclusionRasterizerKernels::RasterizeTriangle<Avx2::SimdFloat>(float*, int, int, int, int, int, const float*, const float*,
+	const float*, float, float, float, float);
@@ -1,12 +1,75 @@
 #include "Terrain.h"
+#include "TiledHeightfield.h"
+#include "ThreadPool.h"
+#include "TerrainKernels.h"
 #include <iostream>
-#include <functional>
-#include <random>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
 #include <glm/gtc/matrix_transform.hpp>
 
-Terrain Terrain:: LoadHeightmapTerrain(const maybewchar* filename, GLint position_location, GLint normal_location, GLint tex_coord_location) {
+namespace {
+	bool HasExtension(const maybewchar* filename, const maybewchar* extension) {
+		std::basic_string<maybewchar> name(filename), ext(extension);
+		if (name.size() < ext.size())
+			return false;
+		std::basic_string<maybewchar> tail = name.substr(name.size() - ext.size());
+		std::transform(tail.begin(), tail.end(), tail.begin(), [](maybewchar c) { return static_cast<maybewchar>(tolower(c)); });
+		return tail == ext;
+	}
+}
 
-	Terrain terrain;
+std::vector<std::vector<float>> Terrain::ReadRawHeightmap(const maybewchar* filename, bool is_float) {
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+		throw std::invalid_argument("Cannot load heightmap!");
+
+	// Raw heightmaps have no header, they must be square
+	size_t sample_bytes = is_float ? sizeof(float) : sizeof(uint16_t);
+	size_t samples = static_cast<size_t>(file.tellg()) / sample_bytes;
+	int size = static_cast<int>(sqrt(double(samples)) + 0.5);
+	if (size < 2 || size_t(size) * size != samples)
+		throw std::invalid_argument("Cannot load heightmap, raw heightmaps must be square!");
+	file.seekg(0);
+
+	std::vector< std::vector<float> > height(size, std::vector<float>(size));
+	std::vector<unsigned char> row(size * sample_bytes);
+
+	// Same layout as the images: row x holds the samples (x, 0..size-1), little endian
+	for (int x = 0; x < size; x++) {
+		file.read(reinterpret_cast<char*>(row.data()), row.size());
+		for (int y = 0; y < size; y++) {
+			if (is_float) {
+				float h;
+				memcpy(&h, &row[y * sizeof(float)], sizeof(float));
+				height[x][y] = h;
+			}
+			else {
+				height[x][y] = float(row[y * 2] | (row[y * 2 + 1] << 8)) / 65535.0f;
+			}
+		}
+	}
+	if (!file)
+		throw std::invalid_argument("Cannot load heightmap, unexpected end of file!");
+
+	return height;
+}
+
+std::vector<std::vector<float>> Terrain::ReadHeightmap(const maybewchar* filename) {
+
+	if (HasExtension(filename, MAYBEWIDE(".r16")))
+		return ReadRawHeightmap(filename, false);
+	if (HasExtension(filename, MAYBEWIDE(".f32")))
+		return ReadRawHeightmap(filename, true);
+	if (HasExtension(filename, MAYBEWIDE(".hft"))) {
+		TiledHeightfield tiled;
+		if (!tiled.Open(filename))
+			throw std::invalid_argument("Cannot load heightmap!");
+		std::vector< std::vector<float> > height;
+		tiled.ReadRegion(0, 0, tiled.SizeX(), tiled.SizeZ(), height);
+		return height;
+	}
 
 	// Create IL image
 	ILuint IL_tex;
@@ -33,132 +96,448 @@ Terrain Terrain:: LoadHeightmapTerrain(const maybewchar* filename, GLint positio
 	int img_format = ilGetInteger(IL_IMAGE_FORMAT);
 	int img_type = ilGetInteger(IL_IMAGE_TYPE);
 
-	std::vector< std::vector< glm::vec3> > vertexes(img_width, std::vector<glm::vec3>(img_height));
-	std::vector< std::vector< glm::vec2> > coords(img_width, std::vector<glm::vec2>(img_height));
+	int bl;
+	switch (img_format)
+	{
+	case IL_LUMINANCE: bl = 1; break;
+	case IL_LUMINANCE_ALPHA: bl = 2; break;
+	case IL_RGB:  bl = 3;  break;
+	case IL_RGBA: bl = 4; break;
+	default:
+		// Unsupported format
+		ilBindImage(0);
+		ilDeleteImages(1, &IL_tex);
+		throw std::invalid_argument("Cannot load heightmap, invalid format!");
+	}
+	if (img_type != IL_UNSIGNED_BYTE && img_type != IL_UNSIGNED_SHORT)
+	{
+		ilBindImage(0);
+		ilDeleteImages(1, &IL_tex);
+		throw std::invalid_argument("Cannot load heightmap, only 8 and 16 bit images are supported!");
+	}
 
-	terrain.height = std::vector< std::vector<float> >(img_width, std::vector<float>(img_height));
+	std::vector< std::vector<float> > height(img_width, std::vector<float>(img_height));
 
+	// 16-bit images (e.g. 16-bit PNG) keep all 65536 height levels
 	ILubyte* imageData = ilGetData();
+	const ILushort* imageData16 = reinterpret_cast<const ILushort*>(imageData);
 
 	for (int x = 0; x < img_width; x++) {
 		for (int y = 0; y < img_height; y++) {
-			float s = float(x) / float(img_width);
-			float t = float(y) / float(img_height);
-
-			int bl;
-			switch (img_format)
-			{
-			case IL_RGB:  bl = 3;  break;
-			case IL_RGBA: bl = 4; break;
-			default:
-				// Unsupported format
-				ilBindImage(0);
-				ilDeleteImages(1, &IL_tex);
-				throw std::invalid_argument("Cannot load heightmap, invalid format!");
-			}
-
-			float height = float(imageData[(x * img_width + y) * bl]) / 255.0f;
-
-			vertexes[x][y] = glm::vec3(-0.5f + s, height, -0.5f + t);
-			coords[x][y] = glm::vec2(s, t);
-			terrain.height[x][y] = height;
+			if (img_type == IL_UNSIGNED_SHORT)
+				height[x][y] = float(imageData16[(x * img_width + y) * bl]) / 65535.0f;
+			else
+				height[x][y] = float(imageData[(x * img_width + y) * bl]) / 255.0f;
 		}
 	}
 
 	ilBindImage(0);
 	ilDeleteImages(1, &IL_tex);
 
-	std::vector< std::vector<glm::vec3> > normals[2];
+	return height;
+}
+
+bool Terrain::CookHeightmap(const maybewchar* source, const maybewchar* destination, int tile_size) {
+	std::vector< std::vector<float> > height = ReadHeightmap(source);
+	bool is_normalized = true;
+	for (const auto& column : height)
+		for (float h : column)
+			is_normalized = is_normalized && h >= 0.0f && h <= 1.0f;
+
+	// 16 bits are enough for normalized sources, float heightmaps outside [0, 1] keep 32 bits
+	return TiledHeightfield::Cook(height, destination, tile_size, is_normalized ? TiledHeightfield::R16 : TiledHeightfield::F32);
+}
+
+namespace {
+	// Normals of the two triangles of the quad (x, y) - (x + 1, y + 1), in the unit terrain space. The triangles are
+	// (x + 1, y + 1), (x + 1, y), (x, y) and (x, y), (x, y + 1), (x + 1, y + 1), the cross products of their edges
+	// are expanded since the X/Z components of the edges are the constant sample spacing.
+	void TriangleNormals(const std::vector<std::vector<float>>& height, int x, int y, glm::vec3& triangleNorm0, glm::vec3& triangleNorm1) {
+		float dx = 1.0f / float(height.size());
+		float dz = 1.0f / float(height[0].size());
+
+		float h00 = height[x][y];
+		float h01 = height[x][y + 1];
+		float h10 = height[x + 1][y];
+		float h11 = height[x + 1][y + 1];
+
+		triangleNorm0 = glm::normalize(glm::vec3(-dz * (h10 - h00), dx * dz, -dx * (h11 - h10)));
+		triangleNorm1 = glm::normalize(glm::vec3(-dz * (h11 - h01), dx * dz, -dx * (h01 - h00)));
+	}
+
+	// Sum of the normals of the triangles around a sample. 'normals(i, qx, qy)' returns triangle i of the quad (qx, qy).
+	template<class Normals>
+	glm::vec3 SampleNormal(int x, int y, int img_width, int img_height, Normals normals) {
+		glm::vec3 finalNormal = glm::vec3(0.0f, 0.0f, 0.0f);
+
+		// Look for bottom-right triangles
+		if (x < img_width - 1 && y < img_height - 1) {
+			finalNormal += normals(0, x, y);
+			finalNormal += normals(1, x, y);
+		}
+		// Look for upper-left triangles
+		if (x - 1 >= 0 && y - 1 >= 0) {
+			finalNormal += normals(0, x - 1, y - 1);
+			finalNormal += normals(1, x - 1, y - 1);
+		}
+		// Look for upper-right triangles
+		if (x < img_width - 1 && y - 1 >= 0) {
+			finalNormal += normals(0, x, y - 1);
+		}
+		// Look for bottom-left triangles
+		if (x - 1 >= 0 && y < img_height - 1) {
+			finalNormal += normals(1, x - 1, y);
+		}
+
+		return glm::normalize(finalNormal);
+	}
+}
+
+glm::vec3 Terrain::ComputeNormal(const std::vector<std::vector<float>>& height, int x, int z) {
+	int img_width = static_cast<int>(height.size());
+	int img_height = static_cast<int>(height[0].size());
+
+	return SampleNormal(x, z, img_width, img_height, [&](int i, int qx, int qy) {
+		glm::vec3 normals[2];
+		TriangleNormals(height, qx, qy, normals[0], normals[1]);
+		return normals[i];
+	});
+}
+
+std::vector<glm::vec3> Terrain::ComputeNormals(const std::vector<std::vector<float>>& height, Region region) {
+	int img_width = static_cast<int>(height.size());
+	int img_height = static_cast<int>(height[0].size());
+	int w = region.x1 - region.x0 + 1;
+	int h = region.z1 - region.z0 + 1;
+
+	// Triangle normals of every quad touching the region, each computed once
+	int qx0 = std::max(region.x0 - 1, 0), qx1 = std::min(region.x1, img_width - 2);
+	int qy0 = std::max(region.z0 - 1, 0), qy1 = std::min(region.z1, img_height - 2);
+	int qw = std::max(qx1 - qx0 + 1, 0);
+	int qh = std::max(qy1 - qy0 + 1, 0);
+	std::vector<glm::vec3> normals[2];
 	for (int i = 0; i < 2; i++)
 	{
-		normals[i] = std::vector< std::vector<glm::vec3> >(img_width - 1, std::vector<glm::vec3>(img_height - 1));
+		normals[i].resize(size_t(qw) * qh);
 	}
+	// Walk along the height columns (height[x] is contiguous), quad normals are stored column by column too
+	ThreadPool::Shared().ParallelFor(0, qw, [&](int qx) {
+		for (int qy = 0; qy < qh; qy++) {
+			size_t i = size_t(qx) * qh + qy;
+			TriangleNormals(height, qx0 + qx, qy0 + qy, normals[0][i], normals[1][i]);
+		}
+	});
+
+	// The output is row major, blocks of columns keep both the reads and the writes in a few cache lines
+	const int block_size = 16;
+	std::vector<glm::vec3> finalNormals(size_t(w) * h);
+	ThreadPool::Shared().ParallelFor(0, (w + block_size - 1) / block_size, [&](int block) {
+		int x_end = std::min(w, (block + 1) * block_size);
+		for (int row = 0; row < h; row++) {
+			for (int x = block * block_size; x < x_end; x++) {
+				finalNormals[size_t(row) * w + x] = SampleNormal(region.x0 + x, region.z0 + row, img_width, img_height, [&](int i, int qx, int qy) {
+					return normals[i][size_t(qx - qx0) * qh + (qy - qy0)];
+				});
+			}
+		}
+	});
 
-	for (int x = 0; x < img_width - 1; x++) {
-		for (int y = 0; y < img_height - 1; y++) {
-			glm::vec3 triangle0[] =
-			{
-				vertexes[x + 1][y + 1],
-				vertexes[x + 1][y],
-				vertexes[x][y]
-			};
-			glm::vec3 triangle1[] =
-			{
-				vertexes[x][y],
-				vertexes[x][y + 1],
-				vertexes[x + 1][y + 1],
-			};
+	return finalNormals;
+}
 
-			glm::vec3 triangleNorm0 = glm::cross(triangle0[0] - triangle0[1], triangle0[1] - triangle0[2]);
-			glm::vec3 triangleNorm1 = glm::cross(triangle1[0] - triangle1[1], triangle1[1] - triangle1[2]);
+std::vector<std::vector<glm::vec3>> Terrain::ComputeNormals(const std::vector<std::vector<float>>& height) {
+	int img_width = static_cast<int>(height.size());
+	int img_height = static_cast<int>(height[0].size());
 
-			normals[0][x][y] = glm::normalize(triangleNorm0);
-			normals[1][x][y] = glm::normalize(triangleNorm1);
-		}
-	}
+	Region all;
+	all.x1 = img_width - 1;
+	all.z1 = img_height - 1;
+	std::vector<glm::vec3> normals = ComputeNormals(height, all);
 
 	std::vector< std::vector<glm::vec3> > finalNormals(img_width, std::vector<glm::vec3>(img_height));
-
 	for (int x = 0; x < img_width; x++) {
 		for (int y = 0; y < img_height; y++) {
+			finalNormals[x][y] = normals[size_t(y) * img_width + x];
+		}
+	}
 
-			glm::vec3 finalNormal = glm::vec3(0.0f, 0.0f, 0.0f);
+	return finalNormals;
+}
 
-			// Look for bottom-right triangles
-			if (x < img_width - 1 && y < img_height - 1) {
-				finalNormal += normals[0][x][y];
-				finalNormal += normals[1][x][y];
-			}
-			// Look for upper-left triangles
-			if (x - 1 >= 0 && y - 1 >= 0) {
-				finalNormal += normals[0][x - 1][y - 1];
-				finalNormal += normals[1][x - 1][y - 1];
-			}
-			// Look for upper-right triangles
-			if (x < img_width - 1 && y - 1 >= 0) {
-				finalNormal += normals[0][x][y - 1];
-			}
-			// Look for bottom-left triangles
-			if (x - 1 >= 0 && y < img_height - 1) {
-				finalNormal += normals[1][x - 1][y];
+std::vector<GLbyte> Terrain::BakeNormalMap(const std::vector<std::vector<float>>& height, Region region) {
+	int size_x = static_cast<int>(height.size());
+	int size_z = static_cast<int>(height[0].size());
+	int w = region.x1 - region.x0 + 1;
+	int h = region.z1 - region.z0 + 1;
+	std::vector<GLbyte> normals(size_t(w) * h * 2);
+
+	// Columns (contiguous along Z) go to the SIMD lanes, blocks of columns to the threads
+	const int block_size = 16;
+	bool avx2 = Simd::Avx2();
+	ThreadPool::Shared().ParallelFor(0, (w + block_size - 1) / block_size, [&](int block) {
+		std::vector<float> nx(h), nz(h);
+		int x_end = std::min(w, (block + 1) * block_size);
+		for (int i = block * block_size; i < x_end; i++) {
+			int x = region.x0 + i;
+			int xl = std::max(x - 1, 0), xr = std::min(x + 1, size_x - 1);
+			const float* left = height[xl].data();
+			const float* center = height[x].data();
+			const float* right = height[xr].data();
+			// Sobel sums weigh 4 samples per side, divided by the distance of the sides in samples
+			float x_scale = float(size_x) / (4.0f * (xr - xl));
+			float z_scale = float(size_z) / 8.0f;
+
+			auto write = [&](int z, float x_normal, float z_normal) {
+				GLbyte* out = &normals[(size_t(z - region.z0) * w + i) * 2];
+				out[0] = static_cast<GLbyte>(glm::round(x_normal * 127.0f));
+				out[1] = static_cast<GLbyte>(glm::round(z_normal * 127.0f));
+			};
+			// The first and last rows clamp their neighbours
+			auto edge = [&](int z) {
+				int zl = std::max(z - 1, 0), zr = std::min(z + 1, size_z - 1);
+				float gx = ((right[zl] + 2.0f * right[z] + right[zr]) - (left[zl] + 2.0f * left[z] + left[zr])) * x_scale;
+				float gz = ((left[zr] + 2.0f * center[zr] + right[zr]) - (left[zl] + 2.0f * center[zl] + right[zl])) * float(size_z) / (4.0f * (zr - zl));
+				float inv = 1.0f / std::sqrt(gx * gx + gz * gz + 1.0f);
+				write(z, -gx * inv, -gz * inv);
+			};
+
+			int z_begin = std::max(region.z0, 1), z_end = std::min(region.z1 + 1, size_z - 1);
+			if (region.z0 == 0)
+				edge(0);
+			if (z_begin < z_end) {
+				if (avx2)
+					TerrainKernels::SobelColumn<Avx2::SimdFloat>(left, center, right, z_begin, z_end, x_scale, z_scale, nx.data(), nz.data());
+				else
+					TerrainKernels::SobelColumn<SimdFloat>(left, center, right, z_begin, z_end, x_scale, z_scale, nx.data(), nz.data());
+				for (int z = z_begin; z < z_end; z++)
+					write(z, nx[z - z_begin], nz[z - z_begin]);
 			}
+			if (region.z1 == size_z - 1 && region.z1 > 0)
+				edge(region.z1);
+		}
+	});
+
+	return normals;
+}
+
+namespace {
+	// Splat rules, the same the terrain shader applied per fragment before: rock above this slope (1 - normal.y)
+	// or under this world height, the threshold is widened a little so the filtered texels blend smoothly
+	const float ROCK_SLOPE = 0.7f;
+	const float ROCK_SLOPE_BLEND = 0.05f;
+	const float ROCK_BELOW = 0.1f;
+	// The textures are projected in world space, where the terrain is far flatter than in the unit space of the
+	// normals. The top projection alone is used up to this world slope (cosine of the angle), the side projections
+	// fade in up to the second one.
+	const float PLANAR_ABOVE = 0.906f;     // 25 degrees
+	const float TRIPLANAR_BELOW = 0.819f;  // 35 degrees
+
+	float Smoothstep(float edge0, float edge1, float x) {
+		float t = glm::clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+		return t * t * (3.0f - 2.0f * t);
+	}
+}
 
-			finalNormals[x][y] = glm::normalize(finalNormal);
+std::vector<GLubyte> Terrain::BakeSplatMap(const std::vector<std::vector<float>>& height, const std::vector<glm::vec3>& normals, Region region) {
+	int w = region.x1 - region.x0 + 1;
+	int h = region.z1 - region.z0 + 1;
+	std::vector<GLubyte> splat(size_t(w) * h * 2);
+
+	ThreadPool::Shared().ParallelFor(0, h, [&](int row) {
+		int z = region.z0 + row;
+		for (int x = region.x0; x <= region.x1; x++) {
+			size_t i = size_t(row) * w + (x - region.x0);
+			const glm::vec3& n = normals[i];
+			float world_y = height[x][z] * TERRAIN_HEIGHT - 2.0f;
+			float rock = world_y < ROCK_BELOW ? 1.0f : Smoothstep(ROCK_SLOPE - ROCK_SLOPE_BLEND, ROCK_SLOPE + ROCK_SLOPE_BLEND, 1.0f - n.y);
+			// Normals transform with the inverse of the terrain scale
+			glm::vec3 world = glm::normalize(n / glm::vec3(100.0f, TERRAIN_HEIGHT, 100.0f));
+			float triplanar = 1.0f - Smoothstep(TRIPLANAR_BELOW, PLANAR_ABOVE, world.y);
+			splat[i * 2] = static_cast<GLubyte>(rock * 255.0f + 0.5f);
+			splat[i * 2 + 1] = static_cast<GLubyte>(triplanar * 255.0f + 0.5f);
 		}
+	});
+
+	return splat;
+}
+
+void Terrain::CreateSplatMap(const std::vector<glm::vec3>& normals) {
+	Region all;
+	all.x1 = size_x - 1;
+	all.z1 = size_z - 1;
+	splat_data = BakeSplatMap(height, normals, all);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glGenTextures(1, &splat_tex);
+	glBindTexture(GL_TEXTURE_2D, splat_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8, size_x, size_z, 0, GL_RG, GL_UNSIGNED_BYTE, splat_data.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+std::vector<GLubyte> Terrain::BakeMacroColors(Region texels) const {
+	int w = texels.x1 - texels.x0 + 1;
+	int h = texels.z1 - texels.z0 + 1;
+	std::vector<GLubyte> colors(size_t(w) * h * 3);
+
+	ThreadPool::Shared().ParallelFor(0, h, [&](int row) {
+		int tz = texels.z0 + row;
+		int z0 = tz * macro_step, z1 = std::min(z0 + macro_step, size_z);
+		for (int tx = texels.x0; tx <= texels.x1; tx++) {
+			int x0 = tx * macro_step, x1 = std::min(x0 + macro_step, size_x);
+			// The colors mix linearly, the mean rock weight of the block gives the mean color
+			unsigned rock = 0;
+			for (int z = z0; z < z1; z++)
+				for (int x = x0; x < x1; x++)
+					rock += splat_data[(size_t(z) * size_x + x) * 2];
+			float weight = rock / (255.0f * (z1 - z0) * (x1 - x0));
+			glm::vec3 color = glm::clamp(glm::mix(macro_grass, macro_rock, weight), 0.0f, 1.0f);
+			GLubyte* out = &colors[(size_t(row) * w + (tx - texels.x0)) * 3];
+			for (int c = 0; c < 3; c++)
+				out[c] = static_cast<GLubyte>(color[c] * 255.0f + 0.5f);
+		}
+	});
+
+	return colors;
+}
+
+void Terrain::CreateMacroMap(const glm::vec3& grass, const glm::vec3& rock, int step) {
+	macro_grass = grass;
+	macro_rock = rock;
+	macro_step = std::max(step, 1);
+	Region all;
+	all.x1 = MacroSizeX() - 1;
+	all.z1 = MacroSizeZ() - 1;
+	std::vector<GLubyte> macroData = BakeMacroColors(all);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glGenTextures(1, &macro_tex);
+	glBindTexture(GL_TEXTURE_2D, macro_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, MacroSizeX(), MacroSizeZ(), 0, GL_RGB, GL_UNSIGNED_BYTE, macroData.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+size_t Terrain::TriangleCount(int size_x, int size_z, int mesh_step) {
+	// Mesh columns and rows: every mesh_step-th sample plus the last one
+	size_t columns = (size_x - 2) / mesh_step + 2;
+	size_t rows = (size_z - 2) / mesh_step + 2;
+	return 2 * (columns - 1) * (rows - 1);
+}
+
+void Terrain::AppendStrips(std::vector<unsigned int>& indices, int x0, int x1, int z0, int z1) const {
+	for (int y = z0; y < z1; y = std::min(y + mesh_step, z1)) {
+		int next = std::min(y + mesh_step, z1);
+		for (int x = x0; ; x = std::min(x + mesh_step, x1)) {
+			indices.push_back(next * size_x + x);
+			indices.push_back(y * size_x + x);
+			if (x == x1)
+				break;
+		}
+		// Restart triangle strips
+		indices.push_back(2643261405U);
+	}
+}
+
+size_t Terrain::VertexModeBytes(int size_x, int size_z) {
+	// 8 floats per vertex, 2 indices per vertex in each strip plus one restart index per strip
+	size_t vertex_bytes = size_t(size_x) * size_z * 8 * sizeof(float);
+	size_t index_bytes = (size_t(size_z - 1) * ((size_x - 1) * 2 + 1)) * sizeof(unsigned int);
+	return vertex_bytes + index_bytes;
+}
+
+size_t Terrain::CompactModeBytes(int size_x, int size_z) {
+	// R16 height + RG8 normal
+	return size_t(size_x) * size_z * (sizeof(GLushort) + 2 * sizeof(GLbyte));
+}
+
+void Terrain::PackVertex(int x, int z, const glm::vec3& normal, float* out) const {
+	float s = float(x) / float(size_x);
+	float t = float(z) / float(size_z);
+
+	out[0] = -0.5f + s;
+	out[1] = height[x][z];
+	out[2] = -0.5f + t;
+
+	out[3] = normal.x;
+	out[4] = normal.y;
+	out[5] = normal.z;
+
+	out[6] = s;
+	out[7] = t;
+}
+
+namespace {
+	// Compact mode texels: R16 height, RG8 snorm normal X/Z
+	void PackCompactSample(float height, const glm::vec3& normal, GLushort* height_out, GLbyte* normal_out) {
+		*height_out = static_cast<GLushort>(glm::clamp(height, 0.0f, 1.0f) * 65535.0f + 0.5f);
+		normal_out[0] = static_cast<GLbyte>(glm::round(normal.x * 127.0f));
+		normal_out[1] = static_cast<GLbyte>(glm::round(normal.z * 127.0f));
 	}
+}
+
+Terrain Terrain:: LoadHeightmapTerrain(const maybewchar* filename, GLint position_location, GLint normal_location, GLint tex_coord_location, int mesh_step) {
+	return CreateTerrain(ReadHeightmap(filename), position_location, normal_location, tex_coord_location, mesh_step);
+}
+
+Terrain Terrain::CreateTerrain(std::vector<std::vector<float>> height, GLint position_location, GLint normal_location, GLint tex_coord_location, int mesh_step) {
+
+	Terrain terrain;
+	terrain.height = std::move(height);
+
+	int img_width = static_cast<int>(terrain.height.size());
+	int img_height = static_cast<int>(terrain.height[0].size());
+	terrain.size_x = img_width;
+	terrain.size_z = img_height;
+	terrain.mesh_step = std::max(mesh_step, 1);
+
+	Region all;
+	all.x1 = img_width - 1;
+	all.z1 = img_height - 1;
+	std::vector<glm::vec3> normals = ComputeNormals(terrain.height, all);
+	terrain.CreateSplatMap(normals);
 
 	/*
 		Indices
 	*/
 	std::vector<unsigned int> indices;
-	for (int y = 0; y < img_height - 1; y++) {
-		for (int x = 0; x < img_width - 1; x++) {
-			for (int r = 0; r < 2; r++) {
-				int row = y + (1 - r);
-				int index = row * img_width + x;
-				indices.push_back(index);
-			}
-		}
-		// Restart triangle strips
-		indices.push_back(2643261405U);
+	terrain.AppendStrips(indices, 0, img_width - 1, 0, img_height - 1);
+
+	/*
+		Normal map, the coarse mesh alone would lose the shading detail between its vertices
+	*/
+	if (terrain.mesh_step > 1) {
+		std::vector<GLbyte> normalData = BakeNormalMap(terrain.height, all);
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glGenTextures(1, &terrain.normal_map_tex);
+		glBindTexture(GL_TEXTURE_2D, terrain.normal_map_tex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8_SNORM, img_width, img_height, 0, GL_RG, GL_BYTE, normalData.data());
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		std::cout << "Terrain mesh step " << terrain.mesh_step << ": " << TriangleCount(img_width, img_height, terrain.mesh_step)
+			<< " triangles (full mesh: " << TriangleCount(img_width, img_height, 1) << ")" << std::endl;
 	}
 
 	/*
 		Normalize data
 	*/
-	std::vector<float> vertexData(img_width * img_height * 8);
+	std::vector<float> vertexData(size_t(img_width) * img_height * 8);
 	for (int x = 0; x < img_width; x++) {
 		for (int y = 0; y < img_height; y++) {
-			vertexData[(x + y * img_width) * 8 + 0] = vertexes[x][y].x;
-			vertexData[(x + y * img_width) * 8 + 1] = vertexes[x][y].y;
-			vertexData[(x + y * img_width) * 8 + 2] = vertexes[x][y].z;
-
-			vertexData[(x + y * img_width) * 8 + 3] = finalNormals[x][y].x;
-			vertexData[(x + y * img_width) * 8 + 4] = finalNormals[x][y].y;
-			vertexData[(x + y * img_width) * 8 + 5] = finalNormals[x][y].z;
-
-			vertexData[(x + y * img_width) * 8 + 6] = coords[x][y].x;
-			vertexData[(x + y * img_width) * 8 + 7] = coords[x][y].y;
+			size_t i = x + size_t(y) * img_width;
+			terrain.PackVertex(x, y, normals[i], &vertexData[i * 8]);
 		}
 	}
 
@@ -211,37 +590,283 @@ Terrain Terrain:: LoadHeightmapTerrain(const maybewchar* filename, GLint positio
 	return terrain;
 }
 
-void Terrain::GenerateRandomModel(const Terrain& terrain_geometry, glm::mat4* model_matrixes, int no_generated_models, std::function<float(float, float, float)> callable) {
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_real_distribution<> disArea(-50.0f, 49.0f);
-	std::uniform_real_distribution<> disAngle(0.0f, 6.28f);
-	std::uniform_real_distribution<> disGeneral(0.1f, 1.0f);
-	for (size_t i = 0; i < no_generated_models; i++)
-	{
-		float x = disArea(gen);
-		int xdata = static_cast<int>((x + 50) * 256 / 100);
-		float z = disArea(gen);
-		int zdata = static_cast<int>((z + 50) * 256 / 100);
+Terrain Terrain::LoadCompactHeightmapTerrain(const maybewchar* filename) {
+	return CreateCompactTerrain(ReadHeightmap(filename));
+}
 
-		float y1 = terrain_geometry.height[xdata][zdata];
-		float y2 = terrain_geometry.height[xdata + 1][zdata + 1];
+Terrain Terrain::CreateCompactTerrain(std::vector<std::vector<float>> height) {
 
-		float dx = x - static_cast<int>(x);
-		float dz = z - static_cast<int>(z);
-		float t = sqrt(dx * dx + dz * dz) / sqrt(2.0f);
-		float y = (1 - t) * y1 + t * y2;
+	Terrain terrain;
+	terrain.compact = true;
+	terrain.height = std::move(height);
 
-		if (disGeneral(gen) > callable(x, y, z)) {
-			i -= 1;
-			continue;
+	int size_x = static_cast<int>(terrain.height.size());
+	int size_z = static_cast<int>(terrain.height[0].size());
+	terrain.size_x = size_x;
+	terrain.size_z = size_z;
+
+	Region all;
+	all.x1 = size_x - 1;
+	all.z1 = size_z - 1;
+	std::vector<glm::vec3> normals = ComputeNormals(terrain.height, all);
+	terrain.CreateSplatMap(normals);
+
+	/*
+		Pack heights (R16) and normals (RG8 snorm, Y >= 0 is reconstructed), texel (x, z) is height[x][z]
+	*/
+	std::vector<GLushort> heightData(size_t(size_x) * size_z);
+	std::vector<GLbyte> normalData(size_t(size_x) * size_z * 2);
+	for (int x = 0; x < size_x; x++) {
+		for (int z = 0; z < size_z; z++) {
+			size_t i = size_t(z) * size_x + x;
+			PackCompactSample(terrain.height[x][z], normals[i], &heightData[i], &normalData[i * 2]);
+		}
+	}
+
+	/*
+		Load to opengl
+	*/
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	glGenTextures(1, &terrain.height_tex);
+	glBindTexture(GL_TEXTURE_2D, terrain.height_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, size_x, size_z, 0, GL_RED, GL_UNSIGNED_SHORT, heightData.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glGenTextures(1, &terrain.normal_tex);
+	glBindTexture(GL_TEXTURE_2D, terrain.normal_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8_SNORM, size_x, size_z, 0, GL_RG, GL_BYTE, normalData.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// The core profile still needs a bound vertex array object, even with no attributes
+	glGenVertexArrays(1, &terrain.VertexArrayObject);
+
+	// One triangle strip per row, drawn as instances
+	terrain.Mode = GL_TRIANGLE_STRIP;
+	terrain.DrawArraysCount = (size_x - 1) * 2;
+	terrain.DrawElementsCount = 0;
+
+	std::cout << "Compact terrain " << size_x << "x" << size_z << ": "
+		<< CompactModeBytes(size_x, size_z) / 1024 << " KiB (vertex mode: "
+		<< VertexModeBytes(size_x, size_z) / 1024 << " KiB)" << std::endl;
+
+	return terrain;
+}
+
+Terrain::Region Terrain::ApplyBrush(Brush brush, float x, float z, float radius, float strength) {
+	// Brush footprint in samples, sample s lies at -0.5 + s / size in the unit terrain
+	float cx = (x / 100.0f + 0.5f) * size_x;
+	float cz = (z / 100.0f + 0.5f) * size_z;
+	float rx = std::max(radius / 100.0f * size_x, 0.5f);
+	float rz = std::max(radius / 100.0f * size_z, 0.5f);
+
+	Region region;
+	region.x0 = std::max(static_cast<int>(std::ceil(cx - rx)), 0);
+	region.z0 = std::max(static_cast<int>(std::ceil(cz - rz)), 0);
+	region.x1 = std::min(static_cast<int>(std::floor(cx + rx)), size_x - 1);
+	region.z1 = std::min(static_cast<int>(std::floor(cz + rz)), size_z - 1);
+	if (region.Empty())
+		return region;
+
+	// Smoothing reads the neighbours, take them from a copy of the region (plus border) so the result
+	// does not depend on the order in which the threads update the samples
+	int bx0 = std::max(region.x0 - 1, 0), bz0 = std::max(region.z0 - 1, 0);
+	int bx1 = std::min(region.x1 + 1, size_x - 1), bz1 = std::min(region.z1 + 1, size_z - 1);
+	std::vector<std::vector<float>> source;
+	if (brush == Brush::Smooth) {
+		source.resize(bx1 - bx0 + 1);
+		for (int sx = bx0; sx <= bx1; sx++)
+			source[sx - bx0].assign(height[sx].begin() + bz0, height[sx].begin() + bz1 + 1);
+	}
+	float target = SampleHeight(x, z);
+
+	ThreadPool::Shared().ParallelFor(region.x0, region.x1 + 1, [&](int sx) {
+		for (int sz = region.z0; sz <= region.z1; sz++) {
+			float dx = (float(sx) - cx) / rx;
+			float dz = (float(sz) - cz) / rz;
+			float d2 = dx * dx + dz * dz;
+			if (d2 >= 1.0f)
+				continue;
+			float falloff = (1.0f - d2) * (1.0f - d2);
+
+			float& h = height[sx][sz];
+			switch (brush) {
+			case Brush::Raise:
+				h += strength * falloff;
+				break;
+			case Brush::Lower:
+				h -= strength * falloff;
+				break;
+			case Brush::Flatten:
+				h += (target - h) * std::min(strength * falloff, 1.0f);
+				break;
+			case Brush::Smooth: {
+				float sum = 0.0f;
+				int count = 0;
+				for (int nx = std::max(sx - 1, bx0); nx <= std::min(sx + 1, bx1); nx++) {
+					for (int nz = std::max(sz - 1, bz0); nz <= std::min(sz + 1, bz1); nz++) {
+						sum += source[nx - bx0][nz - bz0];
+						count++;
+					}
+				}
+				h += (sum / count - h) * std::min(strength * falloff, 1.0f);
+				break;
+			}
+			}
+			h = glm::clamp(h, 0.0f, 1.0f);
+		}
+	});
+
+	UpdateRegion(region);
+	return region;
+}
+
+void Terrain::UpdateRegion(Region region) {
+	// Normals of the samples next to the region depend on its heights
+	region.x0 = std::max(region.x0 - 1, 0);
+	region.z0 = std::max(region.z0 - 1, 0);
+	region.x1 = std::min(region.x1 + 1, size_x - 1);
+	region.z1 = std::min(region.z1 + 1, size_z - 1);
+	if (region.Empty())
+		return;
+
+	int w = region.x1 - region.x0 + 1;
+	int h = region.z1 - region.z0 + 1;
+	std::vector<glm::vec3> normals = ComputeNormals(height, region);
+
+	if (splat_tex != 0) {
+		std::vector<GLubyte> splatData = BakeSplatMap(height, normals, region);
+		for (int row = 0; row < h; row++)
+			std::copy_n(&splatData[size_t(row) * w * 2], w * 2, &splat_data[(size_t(region.z0 + row) * size_x + region.x0) * 2]);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_2D, splat_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, region.x0, region.z0, w, h, GL_RG, GL_UNSIGNED_BYTE, splatData.data());
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	if (macro_tex != 0) {
+		Region texels;
+		texels.x0 = region.x0 / macro_step;
+		texels.z0 = region.z0 / macro_step;
+		texels.x1 = region.x1 / macro_step;
+		texels.z1 = region.z1 / macro_step;
+		std::vector<GLubyte> macroData = BakeMacroColors(texels);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_2D, macro_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, texels.x0, texels.z0, texels.x1 - texels.x0 + 1, texels.z1 - texels.z0 + 1,
+			GL_RGB, GL_UNSIGNED_BYTE, macroData.data());
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	if (compact) {
+		// Row major rectangle, texel (x, z) at z * w + x like the full textures
+		std::vector<GLushort> heightData(size_t(w) * h);
+		std::vector<GLbyte> normalData(size_t(w) * h * 2);
+		ThreadPool::Shared().ParallelFor(0, h, [&](int row) {
+			int z = region.z0 + row;
+			for (int x = region.x0; x <= region.x1; x++) {
+				size_t i = size_t(row) * w + (x - region.x0);
+				PackCompactSample(height[x][z], normals[i], &heightData[i], &normalData[i * 2]);
+			}
+		});
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_2D, height_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, region.x0, region.z0, w, h, GL_RED, GL_UNSIGNED_SHORT, heightData.data());
+		glBindTexture(GL_TEXTURE_2D, normal_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, region.x0, region.z0, w, h, GL_RG, GL_BYTE, normalData.data());
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return;
+	}
+
+	// Vertices are stored row by row (vertex (x, z) at z * size_x + x), each changed row is a contiguous range
+	std::vector<float> vertexData(size_t(w) * h * 8);
+	ThreadPool::Shared().ParallelFor(0, h, [&](int row) {
+		int z = region.z0 + row;
+		for (int x = region.x0; x <= region.x1; x++) {
+			size_t i = size_t(row) * w + (x - region.x0);
+			PackVertex(x, z, normals[i], &vertexData[i * 8]);
+		}
+	});
+
+	const GLsizeiptr vertex_bytes = 8 * sizeof(float);
+	glBindBuffer(GL_ARRAY_BUFFER, VertexBuffers[0]);
+	if (w == size_x) {
+		glBufferSubData(GL_ARRAY_BUFFER, GLintptr(region.z0) * size_x * vertex_bytes, GLsizeiptr(w) * h * vertex_bytes, vertexData.data());
+	}
+	else {
+		for (int row = 0; row < h; row++) {
+			GLintptr offset = (GLintptr(region.z0 + row) * size_x + region.x0) * vertex_bytes;
+			glBufferSubData(GL_ARRAY_BUFFER, offset, GLsizeiptr(w) * vertex_bytes, &vertexData[size_t(row) * w * 8]);
 		}
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-		glm::mat4 mat(1.0);
-		mat = glm::translate(mat, glm::vec3(x, y * TERRAIN_HEIGHT, z));
-		mat = glm::rotate(mat, -tan(y1 - terrain_geometry.height[xdata + 1][zdata]), glm::vec3(0.0, 0.0, 1.0));
-		mat = glm::rotate(mat, -tan(y1 - terrain_geometry.height[xdata][zdata + 1]), glm::vec3(1.0, 0.0, 0.0));
-		mat = glm::rotate(mat, static_cast<float>(disAngle(gen)), glm::vec3(0.0, 1.0, 0.0));
-		model_matrixes[i] = mat;
+	if (normal_map_tex != 0) {
+		std::vector<GLbyte> normalData = BakeNormalMap(height, region);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_2D, normal_map_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, region.x0, region.z0, w, h, GL_RG, GL_BYTE, normalData.data());
+		glBindTexture(GL_TEXTURE_2D, 0);
 	}
+}
+
+void Terrain::BuildChunks(int chunks_x, int chunks_z) {
+	this->chunks_x = chunks_x;
+	this->chunks_z = chunks_z;
+	chunk_count.clear();
+	chunk_offset.clear();
+
+	int quads_x = size_x - 1;
+	int quads_z = size_z - 1;
+	std::vector<unsigned int> indices;
+	for (int cz = 0; cz < chunks_z; cz++) {
+		for (int cx = 0; cx < chunks_x; cx++) {
+			int x0 = ChunkBegin(cx, chunks_x, quads_x), x1 = ChunkBegin(cx + 1, chunks_x, quads_x);
+			int z0 = ChunkBegin(cz, chunks_z, quads_z), z1 = ChunkBegin(cz + 1, chunks_z, quads_z);
+			size_t first = indices.size();
+			AppendStrips(indices, x0, x1, z0, z1);
+			chunk_count.push_back(static_cast<GLsizei>(indices.size() - first));
+			chunk_offset.push_back(reinterpret_cast<const void*>(first * sizeof(unsigned int)));
+		}
+	}
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IndexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	DrawElementsCount = static_cast<GLsizei>(indices.size());
+}
+
+void Terrain::DrawChunks(const std::vector<char>& visible) const {
+	std::vector<GLsizei> counts;
+	std::vector<const void*> offsets;
+	for (size_t i = 0; i < chunk_count.size(); i++) {
+		if (!visible[i])
+			continue;
+		// Chunks are stored in order, extend the previous range when it ends where this one starts
+		if (!offsets.empty() && static_cast<const char*>(offsets.back()) + counts.back() * sizeof(unsigned int) == chunk_offset[i])
+			counts.back() += chunk_count[i];
+		else {
+			counts.push_back(chunk_count[i]);
+			offsets.push_back(chunk_offset[i]);
+		}
+	}
+	if (!counts.empty())
+		glMultiDrawElements(Mode, counts.data(), GL_UNSIGNED_INT, offsets.data(), static_cast<GLsizei>(counts.size()));
+}
+
+float Terrain::SampleHeight(float x, float z) const {
+	int xi = static_cast<int>(round((x / 100 + 0.5f) * size_x));
+	int zi = static_cast<int>(round((z / 100 + 0.5f) * size_z));
+	xi = std::max(std::min(xi, size_x - 1), 0);
+	zi = std::max(std::min(zi, size_z - 1), 0);
+	return height[xi][zi];
 }
\ No newline at end of file
@@ -1,7 +1,9 @@
 #pragma once
 #include "Geometry.h"
+#include "InstanceBuffer.h"
 
 #include<vector>
+#include <cstdint>
 // Include DevIL for image loading
 #if defined(_WIN32)
 #pragma comment(lib, "glew32s.lib")
@@ -25,13 +27,144 @@ typedef char maybewchar;
 
 static const float TERRAIN_HEIGHT = 15.0f;
 #include <glm/glm.hpp>
-#include<functional>
 
 class Terrain : public Geometry {
+private:
+	static std::vector<std::vector<float>> ReadRawHeightmap(const maybewchar* filename, bool is_float);
+
+	/// Writes the interleaved vertex (position, normal, texture coordinate) of sample (x, z) to 'out' (8 floats)
+	void PackVertex(int x, int z, const glm::vec3& normal, float* out) const;
+
+	/// Appends one strip per mesh row of the samples [x0, x1] x [z0, z1], every mesh_step-th sample plus the last
+	void AppendStrips(std::vector<unsigned int>& indices, int x0, int x1, int z0, int z1) const;
+
+	/// Bakes and uploads splat_tex from the normals of all samples (row major)
+	void CreateSplatMap(const std::vector<glm::vec3>& normals);
+
 public:
+	/// Deformation brushes, see ApplyBrush
+	enum class Brush { Raise, Lower, Flatten, Smooth };
+
+	/// Inclusive rectangle of samples
+	struct Region
+	{
+		int x0 = 0, z0 = 0, x1 = -1, z1 = -1;
+		bool Empty() const { return x1 < x0 || z1 < z0; }
+	};
+
 	std::vector<std::vector<float>> height;
 
-	static Terrain LoadHeightmapTerrain(const maybewchar* filename, GLint position_location, GLint normal_location, GLint tex_coord_location);
+	/// Reads a heightmap into 'height', indexed [x][z]. Supported sources are images read through DevIL
+	/// (first channel, 8 or 16 bits per channel, normalized to [0, 1]), raw square .r16 (little endian
+	/// unsigned 16-bit) and .f32 (32-bit float) files, and tiled .hft files (see TiledHeightfield).
+	static std::vector<std::vector<float>> ReadHeightmap(const maybewchar* filename);
+
+	/// Number of height samples along the X and Z axes
+	int size_x = 0;
+	int size_z = 0;
+
+	/// Vertex mode chunks (see BuildChunks), chunk cz * chunks_x + cx is the range of chunk_count[i] indices at
+	/// byte offset chunk_offset[i] of the index buffer
+	int chunks_x = 0;
+	int chunks_z = 0;
+	std::vector<GLsizei> chunk_count;
+	std::vector<const void*> chunk_offset;
+
+	/// Coarse mesh (vertex mode): the strips only use every mesh_step-th sample (and the last one), the vertex buffer
+	/// keeps every sample. Shading then comes from the full resolution normal_map_tex (0 when mesh_step is 1).
+	int mesh_step = 1;
+	GLuint normal_map_tex = 0;
+
+	/// Material weights baked from slope and height (RG8, see BakeSplatMap), used by both terrain modes.
+	/// splat_data keeps the texels (row major) for the macro color map.
+	GLuint splat_tex = 0;
+	std::vector<GLubyte> splat_data;
+
+	/// Macro color map (RGB8, mipmapped) for distant terrain: the mean grass and rock colors mixed by the splat
+	/// weights, texel (x, z) covers the samples [x, x + 1) * macro_step by [z, z + 1) * macro_step. 0 until
+	/// CreateMacroMap is called.
+	GLuint macro_tex = 0;
+	int macro_step = 0;
+	glm::vec3 macro_grass = glm::vec3(0.0f);
+	glm::vec3 macro_rock = glm::vec3(0.0f);
+
+	/// Compact mode: no vertex buffers, positions and normals are fetched from these textures in the vertex shader
+	bool compact = false;
+	GLuint height_tex = 0;
+	GLuint normal_tex = 0;
+
+	/// 'mesh_step' > 1 builds a coarse mesh and bakes the normal map (see mesh_step)
+	static Terrain LoadHeightmapTerrain(const maybewchar* filename, GLint position_location, GLint normal_location, GLint tex_coord_location, int mesh_step = 1);
+
+	/// Builds the terrain from heights already in memory ([x][z], normalized), e.g. from ProceduralTerrain
+	static Terrain CreateTerrain(std::vector<std::vector<float>> height, GLint position_location, GLint normal_location, GLint tex_coord_location, int mesh_step = 1);
+
+	/// Loads a heightmap for the attribute-less terrain mode. Heights are stored in an R16 texture and normals
+	/// in an RG8 snorm texture (Y is reconstructed in the shader), the vertex shader derives X/Z and the texture
+	/// coordinates from gl_VertexID (column) and gl_InstanceID (row strip). Draw with DrawGeometryInstanced(terrain, size_z - 1).
+	static Terrain LoadCompactHeightmapTerrain(const maybewchar* filename);
+	static Terrain CreateCompactTerrain(std::vector<std::vector<float>> height);
+
+	/// Converts any supported heightmap into a tiled, memory-mappable .hft file. Returns false if it cannot be written.
+	static bool CookHeightmap(const maybewchar* source, const maybewchar* destination, int tile_size = 256);
+
+	/// Computes smooth per-sample normals of a heightfield in the unit terrain space ([-0.5, 0.5] x [0, 1] x [-0.5, 0.5]).
+	static std::vector<std::vector<glm::vec3>> ComputeNormals(const std::vector<std::vector<float>>& height);
+
+	/// Normal of the sample (x, z), the sum of the adjacent triangle normals as in ComputeNormals
+	static glm::vec3 ComputeNormal(const std::vector<std::vector<float>>& height, int x, int z);
+
+	/// Normals of the samples in 'region', row major (sample (x, z) at (z - z0) * width + (x - x0))
+	static std::vector<glm::vec3> ComputeNormals(const std::vector<std::vector<float>>& height, Region region);
+
+	/// Sobel filtered normals of 'region' packed like the compact normal texture (RG8 snorm X/Z), row major
+	static std::vector<GLbyte> BakeNormalMap(const std::vector<std::vector<float>>& height, Region region);
+
+	/// Material weights of 'region' as RG8 texels, row major: R is the rock weight (steep or under the water line,
+	/// grass elsewhere), G how much of the triplanar projection a steep sample needs (0 = the top projection alone).
+	/// 'normals' are the normals of the same region (see ComputeNormals).
+	static std::vector<GLubyte> BakeSplatMap(const std::vector<std::vector<float>>& height, const std::vector<glm::vec3>& normals, Region region);
+
+	/// Bakes and uploads macro_tex from the splat map, 'grass' and 'rock' are the mean colors of the detail textures
+	void CreateMacroMap(const glm::vec3& grass, const glm::vec3& rock, int step = 2);
+
+	/// Macro map texels along X and Z
+	int MacroSizeX() const { return (size_x + macro_step - 1) / macro_step; }
+	int MacroSizeZ() const { return (size_z + macro_step - 1) / macro_step; }
+
+	/// Macro colors of the texel rectangle 'texels' as RGB8, row major
+	std::vector<GLubyte> BakeMacroColors(Region texels) const;
+
+	/// Triangles drawn by a size_x * size_z terrain with the given mesh step
+	static size_t TriangleCount(int size_x, int size_z, int mesh_step);
+
+	/// GPU memory used by a size_x * size_z terrain in the vertex (interleaved VBO + strip indices) and compact (R16 + RG8) modes
+	static size_t VertexModeBytes(int size_x, int size_z);
+	static size_t CompactModeBytes(int size_x, int size_z);
+
+	/// Deforms the heightfield in place within 'radius' (world units) of the world position (x, z) with a smooth
+	/// falloff. 'strength' is the height change per application (normalized units) for Raise and Lower, and the
+	/// blend factor towards the target (the height under the brush center, the 3x3 average) for Flatten and Smooth.
+	/// The GPU data is updated (see UpdateRegion). Returns the changed samples.
+	Region ApplyBrush(Brush brush, float x, float z, float radius, float strength);
+
+	/// Recomputes the normals of 'region' plus a one-sample border (the normals that depend on its heights) and
+	/// uploads only those samples: one glBufferSubData per row (a single one for full-width rows) in vertex
+	/// mode, glTexSubImage2D of the rectangle in compact mode, in the splat, macro and normal maps.
+	void UpdateRegion(Region region);
+
+	/// Rebuilds the index buffer as chunks_x * chunks_z rectangles of quads, each a contiguous range of row strips,
+	/// so chunks can be rejected at draw time. Drawing the whole buffer still draws the whole terrain.
+	void BuildChunks(int chunks_x, int chunks_z);
+
+	/// Draws the chunks flagged in 'visible' (one flag per chunk) with a single glMultiDrawElements, neighbouring
+	/// ranges merged. Bind the vertex array object and enable primitive restart first.
+	void DrawChunks(const std::vector<char>& visible) const;
+
+	/// First quad of chunk 'chunk' when 'quads' quads are split into 'chunks' chunks, and the chunk of a quad
+	static int ChunkBegin(int chunk, int chunks, int quads) { return static_cast<int>(int64_t(chunk) * quads / chunks); }
+	static int ChunkOf(int quad, int chunks, int quads) { return static_cast<int>((int64_t(quad + 1) * chunks - 1) / quads); }
 
-	static void GenerateRandomModel(const Terrain& terrain_geometry, glm::mat4* model_matrixes, int no_generated_models, std::function<float(float, float, float)> callable); 
+	/// Normalized height of the sample nearest to the world position (x, z), clamped to the terrain
+	float SampleHeight(float x, float z) const;
 };
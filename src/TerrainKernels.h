@@ -0,0 +1,45 @@
+#pragma once
+#include "Simd.h"
+
+//-----------------------------------------
+//----         TERRAIN KERNELS         ----
+//-----------------------------------------
+
+/// SIMD kernels of Terrain, instantiated for the baseline in Terrain.cpp and for AVX2 in SimdAvx2.cpp
+namespace TerrainKernels
+{
+	// Sobel normals of S::WIDTH samples along Z starting at z, the columns left, center and right of X are clamped
+	// at the edges ('x_scale' accounts for it). Rows z - 1 and z + S::WIDTH must exist.
+	template<class S>
+	void SobelNormals(const float* left, const float* center, const float* right, int z, float x_scale, float z_scale, float* nx, float* nz) {
+		typedef typename S::F F;
+		F two = S::Set(2.0f);
+		F l0 = S::Load(left + z - 1), l1 = S::Load(left + z), l2 = S::Load(left + z + 1);
+		F r0 = S::Load(right + z - 1), r1 = S::Load(right + z), r2 = S::Load(right + z + 1);
+		F c0 = S::Load(center + z - 1), c2 = S::Load(center + z + 1);
+
+		// Height change per sample, scaled to the unit terrain: the normal is (-dh/dx, 1, -dh/dz) normalized
+		F gx = S::Mul(S::Sub(S::Add(S::Add(r0, S::Mul(r1, two)), r2), S::Add(S::Add(l0, S::Mul(l1, two)), l2)), S::Set(x_scale));
+		F gz = S::Mul(S::Sub(S::Add(S::Add(l2, S::Mul(c2, two)), r2), S::Add(S::Add(l0, S::Mul(c0, two)), r0)), S::Set(z_scale));
+		F inv = S::Div(S::Set(1.0f), S::Sqrt(S::Add(S::Add(S::Mul(gx, gx), S::Mul(gz, gz)), S::Set(1.0f))));
+		S::Store(nx, S::Mul(S::Sub(S::Set(0.0f), gx), inv));
+		S::Store(nz, S::Mul(S::Sub(S::Set(0.0f), gz), inv));
+	}
+
+	/// Sobel normals of the rows [z_begin, z_end) of a column, written from nx[0] and nz[0]. The rows z_begin - 1
+	/// and z_end must exist.
+	template<class S>
+	void SobelColumn(const float* left, const float* center, const float* right, int z_begin, int z_end, float x_scale, float z_scale,
+		float* nx, float* nz) {
+		typedef typename S::Scalar Scalar;
+		int z = z_begin;
+		for (; z + S::WIDTH <= z_end; z += S::WIDTH)
+			SobelNormals<S>(left, center, right, z, x_scale, z_scale, nx + (z - z_begin), nz + (z - z_begin));
+		for (; z < z_end; z++)
+			SobelNormals<Scalar>(left, center, right, z, x_scale, z_scale, nx + (z - z_begin), nz + (z - z_begin));
+	}
+}
+
+#if !defined(SIMD_AVX2)
+extern template void TerrainKernels::SobelColumn<Avx2::SimdFloat>(const float*, const float*, const float*, int, int, float, float, float*, float*);
+#endif
@@ -0,0 +1,164 @@
+#include "TerrainOcclusion.h"
+#include "ProceduralTerrain.h"
+#include "TerrainOcclusionKernels.h"
+#include "ThreadPool.h"
+#include <chrono>
+
+namespace {
+	// Arrays of the kernel pattern
+	struct Pattern
+	{
+		int packets = 0;
+		int steps = 0;
+		int margin = 0;
+		std::vector<float> offset_x;
+		std::vector<float> offset_z;
+		std::vector<int32_t> offset_flat;
+		std::vector<float> slope_scale;
+
+		TerrainOcclusionKernels::Pattern Kernel() const {
+			return { packets, steps, margin, offset_x.data(), offset_z.data(), offset_flat.data(), slope_scale.data() };
+		}
+	};
+
+	// Directions are rounded up to SIMD_MAX_WIDTH so every kernel width searches the same ones, the pattern is laid
+	// out in packets of 'width' lanes
+	Pattern MakePattern(const TerrainOcclusion::Settings& settings, int size_x, int size_z, int window_x, int width) {
+		const int W = width;
+		int directions = (std::max(settings.directions, 1) + SIMD_MAX_WIDTH - 1) / SIMD_MAX_WIDTH * SIMD_MAX_WIDTH;
+		Pattern pattern;
+		pattern.packets = directions / W;
+		pattern.steps = std::max(settings.steps, 1);
+
+		float spacing_x = 100.0f / size_x, spacing_z = 100.0f / size_z;
+		float first = std::max(spacing_x, spacing_z);
+		float radius = std::max(settings.radius, first);
+		size_t count = size_t(pattern.packets) * pattern.steps * W;
+		pattern.offset_x.resize(count);
+		pattern.offset_z.resize(count);
+		pattern.offset_flat.resize(count);
+		pattern.slope_scale.resize(count);
+		for (int p = 0; p < pattern.packets; ++p) {
+			for (int k = 0; k < pattern.steps; ++k) {
+				float distance = pattern.steps > 1 ? first * std::pow(radius / first, float(k) / (pattern.steps - 1)) : radius;
+				for (int lane = 0; lane < W; ++lane) {
+					float angle = 6.2831853f * (p * W + lane + 0.5f) / directions;
+					float ox = std::round(std::cos(angle) * distance / spacing_x);
+					float oz = std::round(std::sin(angle) * distance / spacing_z);
+					float world = std::sqrt(ox * spacing_x * ox * spacing_x + oz * spacing_z * oz * spacing_z);
+					size_t i = (size_t(p) * pattern.steps + k) * W + lane;
+					pattern.offset_x[i] = ox;
+					pattern.offset_z[i] = oz;
+					pattern.offset_flat[i] = int32_t(oz) * window_x + int32_t(ox);
+					pattern.slope_scale[i] = world > 0.0f ? TERRAIN_HEIGHT / world : 0.0f;
+					pattern.margin = std::max(pattern.margin, int(std::max(std::fabs(ox), std::fabs(oz))));
+				}
+			}
+		}
+		return pattern;
+	}
+}
+
+Terrain::Region TerrainOcclusion::AffectedRegion(const std::vector<std::vector<float>>& height, const Settings& settings, Terrain::Region region)
+{
+	int size_x = static_cast<int>(height.size());
+	int size_z = static_cast<int>(height[0].size());
+	int margin = MakePattern(settings, size_x, size_z, size_x, 1).margin;
+	region.x0 = std::max(region.x0 - margin, 0);
+	region.z0 = std::max(region.z0 - margin, 0);
+	region.x1 = std::min(region.x1 + margin, size_x - 1);
+	region.z1 = std::min(region.z1 + margin, size_z - 1);
+	return region;
+}
+
+void TerrainOcclusion::BakeRegion(const std::vector<std::vector<float>>& height, const Settings& settings, Terrain::Region region, std::vector<uint8_t>& occlusion)
+{
+	if (region.Empty())
+		return;
+	int size_x = static_cast<int>(height.size());
+
+	// Row major copy of the heights the region reads, lookups outside the window are clamped like at the map edges
+	Terrain::Region window = AffectedRegion(height, settings, region);
+	int window_x = window.x1 - window.x0 + 1;
+	int window_z = window.z1 - window.z0 + 1;
+	std::vector<float> heights(size_t(window_x) * window_z);
+	for (int x = 0; x < window_x; ++x) {
+		const float* column = height[window.x0 + x].data() + window.z0;
+		for (int z = 0; z < window_z; ++z)
+			heights[size_t(z) * window_x + x] = column[z];
+	}
+
+	bool avx2 = Simd::Avx2();
+	Pattern storage = MakePattern(settings, size_x, static_cast<int>(height[0].size()), window_x, Simd::Width());
+	TerrainOcclusionKernels::Pattern pattern = storage.Kernel();
+	ThreadPool::Shared().ParallelFor(region.z0, region.z1 + 1, [&](int z) {
+		uint8_t* row = &occlusion[size_t(z) * size_x + region.x0];
+		int wx0 = region.x0 - window.x0, wx1 = region.x1 - window.x0, wz = z - window.z0;
+		if (avx2)
+			TerrainOcclusionKernels::OcclusionRow<Avx2::SimdFloat>(pattern, heights.data(), window_x, window_z, wx0, wx1, wz, row);
+		else
+			TerrainOcclusionKernels::OcclusionRow<SimdFloat>(pattern, heights.data(), window_x, window_z, wx0, wx1, wz, row);
+	});
+}
+
+std::vector<uint8_t> TerrainOcclusion::Bake(const std::vector<std::vector<float>>& height, const Settings& settings)
+{
+	Terrain::Region all;
+	all.x1 = static_cast<int>(height.size()) - 1;
+	all.z1 = static_cast<int>(height[0].size()) - 1;
+	std::vector<uint8_t> occlusion(height.size() * height[0].size());
+	BakeRegion(height, settings, all, occlusion);
+	return occlusion;
+}
+
+std::vector<uint8_t> TerrainOcclusion::BakeScalar(const std::vector<std::vector<float>>& height, const Settings& settings)
+{
+	int size_x = static_cast<int>(height.size());
+	int size_z = static_cast<int>(height[0].size());
+	std::vector<float> heights(size_t(size_x) * size_z);
+	for (int x = 0; x < size_x; ++x)
+		for (int z = 0; z < size_z; ++z)
+			heights[size_t(z) * size_x + x] = height[x][z];
+
+	Pattern storage = MakePattern(settings, size_x, size_z, size_x, 1);
+	TerrainOcclusionKernels::Pattern pattern = storage.Kernel();
+	std::vector<uint8_t> occlusion(heights.size());
+	for (int z = 0; z < size_z; ++z)
+		TerrainOcclusionKernels::OcclusionRow<ScalarFloat>(pattern, heights.data(), size_x, size_z, 0, size_x - 1, z, &occlusion[size_t(z) * size_x]);
+	return occlusion;
+}
+
+void TerrainOcclusion::RunBenchmark(std::ostream& out)
+{
+	Settings settings;
+	ProceduralTerrain::Settings terrain;
+	for (int size : { 1024, 4096 }) {
+		std::vector<std::vector<float>> height = ProceduralTerrain::Generate(terrain, size, size);
+		auto start = std::chrono::steady_clock::now();
+		std::vector<uint8_t> occlusion = Bake(height, settings);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		double mean = 0.0;
+		for (uint8_t v : occlusion)
+			mean += v;
+		mean /= 255.0 * occlusion.size();
+		out << "Occlusion " << size << "x" << size << " (" << Simd::Name() << ", " << ThreadPool::Shared().ThreadCount() + 1
+			<< " threads, " << settings.directions << " directions, " << settings.steps << " steps): " << ms << " ms, "
+			<< (double(size) * size / (ms * 1000.0)) << " Msamples/s, mean " << mean << std::endl;
+
+		if (size > 1024)
+			continue;
+		// The scalar kernel sums the directions in another order, the bytes may differ by one
+		start = std::chrono::steady_clock::now();
+		std::vector<uint8_t> reference = BakeScalar(height, settings);
+		double scalar_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		int max_difference = 0, differences = 0;
+		for (size_t i = 0; i < occlusion.size(); ++i) {
+			int difference = std::abs(int(occlusion[i]) - int(reference[i]));
+			max_difference = std::max(max_difference, difference);
+			differences += difference != 0;
+		}
+		out << "  scalar reference: " << scalar_ms << " ms, " << differences << " samples differ, by up to " << max_difference
+			<< (max_difference <= 1 ? " (ok)" : " (FAILED)") << std::endl;
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "Terrain.h"
+
+#include <vector>
+#include <iostream>
+#include <cstdint>
+
+//-----------------------------------------
+//----     TERRAIN AMBIENT OCCLUSION   ----
+//-----------------------------------------
+
+/// Baked ambient occlusion of the heightfield from horizon angles: for every sample the highest horizon is searched
+/// along a set of directions and the occlusion is the mean sine of the horizon angles. The directions of a sample
+/// are traced together, one per SIMD lane, and rows are spread over the thread pool. The result (one byte per
+/// sample, 255 = open sky) is sampled by the terrain and vegetation shaders at uv = position.xz / 100 + 0.5.
+class TerrainOcclusion
+{
+public:
+	struct Settings
+	{
+		/// Horizon directions, rounded up to a multiple of SIMD_MAX_WIDTH (8)
+		int directions = 16;
+		/// Search radius of the horizon in world units
+		float radius = 12.0f;
+		/// Height lookups along each direction, spaced geometrically from one sample to the radius
+		int steps = 12;
+	};
+
+	/// Occlusion of every sample of a heightfield ([x][z], normalized) placed like the single terrain,
+	/// row major (sample (x, z) at z * size_x + x)
+	static std::vector<uint8_t> Bake(const std::vector<std::vector<float>>& height, const Settings& settings);
+
+	/// Same as Bake on one thread with the scalar kernel (reference)
+	static std::vector<uint8_t> BakeScalar(const std::vector<std::vector<float>>& height, const Settings& settings);
+
+	/// Re-bakes the samples of 'region' in 'occlusion' (after Bake, e.g. for the AffectedRegion of a brush)
+	static void BakeRegion(const std::vector<std::vector<float>>& height, const Settings& settings, Terrain::Region region, std::vector<uint8_t>& occlusion);
+
+	/// Samples whose occlusion depends on the heights of 'region'
+	static Terrain::Region AffectedRegion(const std::vector<std::vector<float>>& height, const Settings& settings, Terrain::Region region);
+
+	/// Times the bake of procedural maps of 1024 and 4096 samples and prints the mean occlusion. The 1024 map is
+	/// compared to BakeScalar.
+	static void RunBenchmark(std::ostream& out = std::cout);
+};
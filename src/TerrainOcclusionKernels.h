@@ -0,0 +1,81 @@
+#pragma once
+#include "Simd.h"
+
+#include <cstdint>
+#include <cstddef>
+
+//-----------------------------------------
+//----   TERRAIN OCCLUSION KERNELS     ----
+//-----------------------------------------
+
+/// SIMD kernels of TerrainOcclusion, instantiated for the baseline in TerrainOcclusion.cpp and for AVX2 in
+/// SimdAvx2.cpp
+namespace TerrainOcclusionKernels
+{
+	/// Horizon search pattern of one heightfield resolution, lanes of a packet are consecutive directions
+	struct Pattern
+	{
+		int packets;
+		int steps;
+		/// Largest offset in samples, samples this far from the window edges skip the clamping
+		int margin;
+		/// Per (packet, step) and lane: offset in samples, flattened offset in the window and TERRAIN_HEIGHT over
+		/// the world distance (turns a height difference into the slope)
+		const float* offset_x;
+		const float* offset_z;
+		const int32_t* offset_flat;
+		const float* slope_scale;
+	};
+
+	// Occlusion of the window sample (x, z), 'interior' when all lookups stay inside the window. The pattern is laid
+	// out for S::WIDTH lanes.
+	template<class S>
+	float SampleOcclusion(const Pattern& pattern, const float* heights, int window_x, int window_z, int x, int z, bool interior) {
+		typedef typename S::F F;
+		int32_t center = z * window_x + x;
+		F h0 = S::Set(heights[center]);
+		F sum = S::Set(0.0f);
+		for (int p = 0; p < pattern.packets; ++p) {
+			F max_slope = S::Set(0.0f);
+			for (int k = 0; k < pattern.steps; ++k) {
+				size_t i = (size_t(p) * pattern.steps + k) * S::WIDTH;
+				typename S::I index;
+				if (interior)
+					index = S::AddI(S::SetI(center), S::LoadI(&pattern.offset_flat[i]));
+				else {
+					F px = S::Min(S::Max(S::Add(S::Set(float(x)), S::Load(&pattern.offset_x[i])), S::Set(0.0f)), S::Set(float(window_x - 1)));
+					F pz = S::Min(S::Max(S::Add(S::Set(float(z)), S::Load(&pattern.offset_z[i])), S::Set(0.0f)), S::Set(float(window_z - 1)));
+					index = S::AddI(S::MulI(S::ToInt(pz), S::SetI(window_x)), S::ToInt(px));
+				}
+				F slope = S::Mul(S::Sub(S::Gather(heights, index), h0), S::Load(&pattern.slope_scale[i]));
+				max_slope = S::Max(max_slope, slope);
+			}
+			// Sine of the horizon angle
+			sum = S::Add(sum, S::Div(max_slope, S::Sqrt(S::Add(S::Mul(max_slope, max_slope), S::Set(1.0f)))));
+		}
+
+		float lanes[S::WIDTH];
+		S::Store(lanes, sum);
+		float total = 0.0f;
+		for (int lane = 0; lane < S::WIDTH; ++lane)
+			total += lanes[lane];
+		return 1.0f - total / (pattern.packets * S::WIDTH);
+	}
+
+	/// Occlusion bytes of the window samples [x0, x1] of row z, written from out[0]
+	template<class S>
+	void OcclusionRow(const Pattern& pattern, const float* heights, int window_x, int window_z, int x0, int x1, int z, uint8_t* out) {
+		typedef typename S::Scalar Scalar;
+		bool interior_z = z >= pattern.margin && z < window_z - pattern.margin;
+		for (int x = x0; x <= x1; ++x) {
+			bool interior = interior_z && x >= pattern.margin && x < window_x - pattern.margin;
+			float value = SampleOcclusion<S>(pattern, heights, window_x, window_z, x, z, interior);
+			out[x - x0] = static_cast<uint8_t>(Scalar::Min(Scalar::Max(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+		}
+	}
+}
+
+#if !defined(SIMD_AVX2)
+extern template void TerrainOcclusionKernels::OcclusionRow<Avx2::SimdFloat>(const TerrainOcclusionKernels::Pattern&, const float*, int, int,
+	int, int, int, uint8_t*);
+#endif
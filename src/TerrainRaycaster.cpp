@@ -0,0 +1,404 @@
+#include "TerrainRaycaster.h"
+#include "TerrainRaycasterKernels.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+namespace {
+	// Rows (columns) per task when building the pyramid
+	const int ROW_BLOCK = 16;
+}
+
+void TerrainRaycaster::Build(const std::vector<std::vector<float>>& height)
+{
+	size_x = static_cast<int>(height.size());
+	size_z = static_cast<int>(height[0].size());
+
+	// Transpose in blocks of columns, reads and writes both stay in a few cache lines
+	heights.resize(size_t(size_x) * size_z);
+	ThreadPool::Shared().ParallelFor(0, (size_x + ROW_BLOCK - 1) / ROW_BLOCK, [&](int block) {
+		int x_end = std::min(size_x, (block + 1) * ROW_BLOCK);
+		for (int z = 0; z < size_z; ++z)
+			for (int x = block * ROW_BLOCK; x < x_end; ++x)
+				heights[size_t(z) * size_x + x] = height[x][z];
+	});
+
+	int quads_x = size_x - 1;
+	int quads_z = size_z - 1;
+	level_offset.assign(1, 0);
+	level_width.assign(1, quads_x);
+	level_width_f.assign(1, float(quads_x));
+	level_height_f.assign(1, float(quads_z));
+	level_cell.assign(1, 1.0f);
+
+	int total = 0;
+	int w = quads_x, h = quads_z;
+	top_level = 0;
+	while (w > 1 || h > 1) {
+		++top_level;
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+		level_offset.push_back(total);
+		level_width.push_back(w);
+		level_width_f.push_back(float(w));
+		level_height_f.push_back(float(h));
+		level_cell.push_back(float(1 << top_level));
+		total += w * h;
+	}
+	// Never empty, the kernel gathers from it even when every lane is at the quad level
+	min_height.assign(std::max(total, 1), 0.0f);
+	max_height.assign(std::max(total, 1), 1.0f);
+
+	if (top_level >= 1) {
+		BuildLevel1Cells(0, 0, level_width[1] - 1, int(level_height_f[1]) - 1);
+		for (int level = 2; level <= top_level; ++level)
+			BuildCells(level, 0, 0, level_width[level] - 1, int(level_height_f[level]) - 1);
+	}
+}
+
+void TerrainRaycaster::BuildLevel1Cells(int cx0, int cz0, int cx1, int cz1)
+{
+	int offset = level_offset[1];
+	int width = level_width[1];
+	int rows = cz1 - cz0 + 1;
+	ThreadPool::Shared().ParallelFor(0, (rows + ROW_BLOCK - 1) / ROW_BLOCK, [&](int block) {
+		int cz_end = std::min(cz1, cz0 + (block + 1) * ROW_BLOCK - 1);
+		for (int cz = cz0 + block * ROW_BLOCK; cz <= cz_end; ++cz) {
+			// The 2x2 quads of the cell span 3x3 samples
+			int z_end = std::min(cz * 2 + 2, size_z - 1);
+			for (int cx = cx0; cx <= cx1; ++cx) {
+				int x_end = std::min(cx * 2 + 2, size_x - 1);
+				float lo = heights[size_t(cz * 2) * size_x + cx * 2];
+				float hi = lo;
+				for (int z = cz * 2; z <= z_end; ++z) {
+					for (int x = cx * 2; x <= x_end; ++x) {
+						float v = heights[size_t(z) * size_x + x];
+						lo = std::min(lo, v);
+						hi = std::max(hi, v);
+					}
+				}
+				min_height[offset + cz * width + cx] = lo;
+				max_height[offset + cz * width + cx] = hi;
+			}
+		}
+	});
+}
+
+void TerrainRaycaster::BuildCells(int level, int cx0, int cz0, int cx1, int cz1)
+{
+	int offset = level_offset[level];
+	int width = level_width[level];
+	int child_offset = level_offset[level - 1];
+	int child_width = level_width[level - 1];
+	int child_rows = int(level_height_f[level - 1]);
+	int rows = cz1 - cz0 + 1;
+	ThreadPool::Shared().ParallelFor(0, (rows + ROW_BLOCK - 1) / ROW_BLOCK, [&](int block) {
+		int cz_end = std::min(cz1, cz0 + (block + 1) * ROW_BLOCK - 1);
+		for (int cz = cz0 + block * ROW_BLOCK; cz <= cz_end; ++cz) {
+			for (int cx = cx0; cx <= cx1; ++cx) {
+				float lo = 1.0e30f, hi = -1.0e30f;
+				for (int z = cz * 2; z <= std::min(cz * 2 + 1, child_rows - 1); ++z) {
+					for (int x = cx * 2; x <= std::min(cx * 2 + 1, child_width - 1); ++x) {
+						lo = std::min(lo, min_height[child_offset + z * child_width + x]);
+						hi = std::max(hi, max_height[child_offset + z * child_width + x]);
+					}
+				}
+				min_height[offset + cz * width + cx] = lo;
+				max_height[offset + cz * width + cx] = hi;
+			}
+		}
+	});
+}
+
+void TerrainRaycaster::UpdateRegion(const std::vector<std::vector<float>>& height, Terrain::Region region)
+{
+	if (region.Empty() || heights.empty())
+		return;
+
+	for (int x = region.x0; x <= region.x1; ++x)
+		for (int z = region.z0; z <= region.z1; ++z)
+			heights[size_t(z) * size_x + x] = height[x][z];
+
+	if (top_level == 0)
+		return;
+
+	// Quads touching the changed samples, then their cells up the pyramid
+	int cx0 = std::max(region.x0 - 1, 0) / 2;
+	int cz0 = std::max(region.z0 - 1, 0) / 2;
+	int cx1 = std::min(region.x1, size_x - 2) / 2;
+	int cz1 = std::min(region.z1, size_z - 2) / 2;
+	BuildLevel1Cells(cx0, cz0, cx1, cz1);
+	for (int level = 2; level <= top_level; ++level) {
+		cx0 /= 2; cz0 /= 2; cx1 /= 2; cz1 /= 2;
+		BuildCells(level, cx0, cz0, cx1, cz1);
+	}
+}
+
+template<class S>
+void TerrainRaycaster::Trace(const float* ox, const float* oy, const float* oz, const float* dx, const float* dy, const float* dz,
+	const float* max_t, float* t_out, int32_t* quad_out, int32_t* triangle_out) const
+{
+	TerrainRaycasterKernels::Pyramid pyramid;
+	pyramid.size_x = size_x;
+	pyramid.size_z = size_z;
+	pyramid.heights = heights.data();
+	pyramid.min_height = min_height.data();
+	pyramid.max_height = max_height.data();
+	pyramid.level_offset = level_offset.data();
+	pyramid.level_width = level_width.data();
+	pyramid.level_width_f = level_width_f.data();
+	pyramid.level_height_f = level_height_f.data();
+	pyramid.level_cell = level_cell.data();
+	pyramid.top_level = top_level;
+	pyramid.global_min = top_level > 0 ? min_height[level_offset[top_level]] : *std::min_element(heights.begin(), heights.end());
+	pyramid.global_max = top_level > 0 ? max_height[level_offset[top_level]] : *std::max_element(heights.begin(), heights.end());
+	TerrainRaycasterKernels::Trace<S>(pyramid, ox, oy, oz, dx, dy, dz, max_t, t_out, quad_out, triangle_out);
+}
+
+void TerrainRaycaster::TraceWide(const float* ox, const float* oy, const float* oz, const float* dx, const float* dy, const float* dz,
+	const float* max_t, float* t_out, int32_t* quad_out, int32_t* triangle_out) const
+{
+	if (Simd::Avx2())
+		Trace<Avx2::SimdFloat>(ox, oy, oz, dx, dy, dz, max_t, t_out, quad_out, triangle_out);
+	else
+		Trace<SimdFloat>(ox, oy, oz, dx, dy, dz, max_t, t_out, quad_out, triangle_out);
+}
+
+void TerrainRaycaster::ToGrid(const glm::vec3& origin, const glm::vec3& direction, glm::vec3& grid_origin, glm::vec3& grid_direction) const
+{
+	// Inverse of the terrain placement: sample s at (s / size - 0.5) * 100, height h at h * TERRAIN_HEIGHT - 2
+	glm::vec3 scale(size_x / 100.0f, 1.0f / TERRAIN_HEIGHT, size_z / 100.0f);
+	grid_origin = (origin + glm::vec3(50.0f, 2.0f, 50.0f)) * scale;
+	grid_direction = direction * scale;
+}
+
+RayHit TerrainRaycaster::MakeHit(const glm::vec3& origin, const glm::vec3& direction, float t, int32_t quad, int32_t triangle) const
+{
+	RayHit hit;
+	if (t < 0.0f)
+		return hit;
+
+	hit.hit = true;
+	hit.distance = t;
+	hit.position = origin + direction * t;
+
+	int qx = quad % size_x;
+	int qz = quad / size_x;
+	auto vertex = [&](int x, int z) {
+		return glm::vec3(x * 100.0f / size_x - 50.0f, heights[size_t(z) * size_x + x] * TERRAIN_HEIGHT - 2.0f, z * 100.0f / size_z - 50.0f);
+	};
+	glm::vec3 a, b, c;
+	if (triangle == 0) {
+		a = vertex(qx + 1, qz + 1); b = vertex(qx + 1, qz); c = vertex(qx, qz);
+	}
+	else {
+		a = vertex(qx, qz); b = vertex(qx, qz + 1); c = vertex(qx + 1, qz + 1);
+	}
+	hit.normal = glm::normalize(glm::cross(a - b, b - c));
+	if (hit.normal.y < 0.0f)
+		hit.normal = -hit.normal;
+	return hit;
+}
+
+RayHit TerrainRaycaster::Raycast(const glm::vec3& origin, const glm::vec3& direction, float max_distance) const
+{
+	if (heights.empty() || glm::length(direction) == 0.0f)
+		return RayHit();
+
+	glm::vec3 unit = glm::normalize(direction);
+	glm::vec3 o, d;
+	ToGrid(origin, unit, o, d);
+
+	float t;
+	int32_t quad, triangle;
+	Trace<ScalarFloat>(&o.x, &o.y, &o.z, &d.x, &d.y, &d.z, &max_distance, &t, &quad, &triangle);
+	return MakeHit(origin, unit, t, quad, triangle);
+}
+
+RayHit TerrainRaycaster::RaycastBruteForce(const glm::vec3& origin, const glm::vec3& direction, float max_distance) const
+{
+	if (heights.empty() || glm::length(direction) == 0.0f)
+		return RayHit();
+
+	glm::vec3 unit = glm::normalize(direction);
+	glm::vec3 o, d;
+	ToGrid(origin, unit, o, d);
+
+	// Part of the ray above the heightfield, clipped in x and z only
+	float t0 = 0.0f, t1 = max_distance;
+	auto clip = [&](float origin_c, float direction_c, float hi) {
+		if (std::abs(direction_c) < 1.0e-12f) {
+			if (origin_c < 0.0f || origin_c > hi)
+				t1 = -1.0f;
+			return;
+		}
+		float ta = (0.0f - origin_c) / direction_c;
+		float tb = (hi - origin_c) / direction_c;
+		t0 = std::max(t0, std::min(ta, tb));
+		t1 = std::min(t1, std::max(ta, tb));
+	};
+	clip(o.x, d.x, float(size_x - 1));
+	clip(o.z, d.z, float(size_z - 1));
+	if (t0 > t1)
+		return RayHit();
+
+	typedef TerrainRaycasterKernels::Vec3<ScalarFloat> Vec3;
+	Vec3 ray_origin = { o.x, o.y, o.z };
+	Vec3 ray_direction = { d.x, d.y, d.z };
+	auto vertex = [&](int x, int z) {
+		Vec3 v = { float(x), heights[size_t(z) * size_x + x], float(z) };
+		return v;
+	};
+
+	float best = TerrainRaycasterKernels::NO_HIT;
+	int32_t best_quad = 0, best_triangle = 0;
+	int qx0 = std::min(int(std::floor(std::min(o.x + d.x * t0, o.x + d.x * t1))), size_x - 2);
+	int qx1 = std::min(int(std::floor(std::max(o.x + d.x * t0, o.x + d.x * t1))), size_x - 2);
+	for (int qx = std::max(qx0, 0); qx <= qx1; ++qx) {
+		// Ray span over the column, every quad it passes over and one more on each side
+		float ta = t0, tb = t1;
+		if (std::abs(d.x) >= 1.0e-12f) {
+			float ea = (qx - o.x) / d.x;
+			float eb = (qx + 1 - o.x) / d.x;
+			ta = std::max(t0, std::min(ea, eb));
+			tb = std::min(t1, std::max(ea, eb));
+		}
+		float za = o.z + d.z * ta, zb = o.z + d.z * tb;
+		int qz0 = std::max(int(std::floor(std::min(za, zb))) - 1, 0);
+		int qz1 = std::min(int(std::floor(std::max(za, zb))) + 1, size_z - 2);
+		for (int qz = qz0; qz <= qz1; ++qz) {
+			Vec3 v00 = vertex(qx, qz), v10 = vertex(qx + 1, qz), v01 = vertex(qx, qz + 1), v11 = vertex(qx + 1, qz + 1);
+			float t_triangle0 = TerrainRaycasterKernels::IntersectTriangle<ScalarFloat>(ray_origin, ray_direction, v11, v10, v00, 0.0f, max_distance);
+			float t_triangle1 = TerrainRaycasterKernels::IntersectTriangle<ScalarFloat>(ray_origin, ray_direction, v00, v01, v11, 0.0f, max_distance);
+			float t = std::min(t_triangle0, t_triangle1);
+			if (t < best) {
+				best = t;
+				best_quad = qz * size_x + qx;
+				best_triangle = t_triangle0 <= t_triangle1 ? 0 : 1;
+			}
+		}
+	}
+	return MakeHit(origin, unit, best < TerrainRaycasterKernels::NO_HIT ? best : -1.0f, best_quad, best_triangle);
+}
+
+void TerrainRaycaster::RaycastPacket(const glm::vec3* origins, const glm::vec3* directions, int count, float max_distance, RayHit* hits) const
+{
+	const int W = Simd::Width(), M = SIMD_MAX_WIDTH;
+	for (int first = 0; first < count; first += W) {
+		float ox[M], oy[M], oz[M], dx[M], dy[M], dz[M], max_t[M], t[M];
+		int32_t quad[M], triangle[M];
+		glm::vec3 units[M];
+		for (int lane = 0; lane < W; ++lane) {
+			int i = first + lane;
+			// Unused lanes and degenerate rays start inactive
+			bool used = i < count && glm::length(directions[i]) > 0.0f;
+			units[lane] = used ? glm::normalize(directions[i]) : glm::vec3(0.0f, 1.0f, 0.0f);
+			glm::vec3 o, d;
+			ToGrid(used ? origins[i] : glm::vec3(0.0f), units[lane], o, d);
+			ox[lane] = o.x; oy[lane] = o.y; oz[lane] = o.z;
+			dx[lane] = d.x; dy[lane] = d.y; dz[lane] = d.z;
+			max_t[lane] = used ? max_distance : -1.0f;
+		}
+
+		TraceWide(ox, oy, oz, dx, dy, dz, max_t, t, quad, triangle);
+
+		for (int lane = 0; lane < W && first + lane < count; ++lane)
+			hits[first + lane] = MakeHit(origins[first + lane], units[lane], t[lane], quad[lane], triangle[lane]);
+	}
+}
+
+void TerrainRaycaster::LineOfSight(const glm::vec3* from, const glm::vec3* to, int count, float tolerance, char* visible) const
+{
+	const int W = Simd::Width(), M = SIMD_MAX_WIDTH;
+	for (int first = 0; first < count; first += W) {
+		float ox[M], oy[M], oz[M], dx[M], dy[M], dz[M], max_t[M], t[M];
+		int32_t quad[M], triangle[M];
+		for (int lane = 0; lane < W; ++lane) {
+			int i = first + lane;
+			glm::vec3 segment = i < count ? to[i] - from[i] : glm::vec3(0.0f);
+			float length = glm::length(segment);
+			// Unused lanes and segments shorter than the tolerance start inactive
+			bool used = length > tolerance;
+			glm::vec3 o, d;
+			ToGrid(used ? from[i] : glm::vec3(0.0f), used ? segment / length : glm::vec3(0.0f, 1.0f, 0.0f), o, d);
+			ox[lane] = o.x; oy[lane] = o.y; oz[lane] = o.z;
+			dx[lane] = d.x; dy[lane] = d.y; dz[lane] = d.z;
+			max_t[lane] = used ? length - tolerance : -1.0f;
+		}
+
+		TraceWide(ox, oy, oz, dx, dy, dz, max_t, t, quad, triangle);
+
+		for (int lane = 0; lane < W && first + lane < count; ++lane)
+			visible[first + lane] = t[lane] < 0.0f;
+	}
+}
+
+void TerrainRaycaster::RunBenchmark(const std::vector<std::vector<float>>& height, int ray_count, int reference_count, std::ostream& out)
+{
+	auto start = std::chrono::steady_clock::now();
+	TerrainRaycaster raycaster(height);
+	double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	out << "Raycast " << raycaster.size_x << "x" << raycaster.size_z << " (" << Simd::Name() << ", "
+		<< raycaster.top_level << " pyramid levels built in " << build_ms << " ms)" << std::endl;
+
+	std::mt19937 gen(42);
+	std::uniform_real_distribution<float> position(-45.0f, 45.0f);
+	std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+	std::uniform_real_distribution<float> slope(-0.08f, 0.02f);
+
+	for (int set = 0; set < 2; ++set) {
+		std::vector<glm::vec3> origins(ray_count), directions(ray_count);
+		for (int i = 0; i < ray_count; ++i) {
+			if (set == 0) {
+				// Steep: from above the terrain to a random point on it (picking, projectiles)
+				origins[i] = glm::vec3(position(gen), 30.0f, position(gen));
+				directions[i] = glm::vec3(position(gen), 0.0f, position(gen)) - origins[i];
+			}
+			else {
+				// Grazing: from eye height along the ground (line of sight), the worst case for the pyramid
+				RayHit ground = raycaster.Raycast(glm::vec3(position(gen), 30.0f, position(gen)), glm::vec3(0.0f, -1.0f, 0.0f));
+				float a = angle(gen);
+				origins[i] = ground.position + glm::vec3(0.0f, 1.7f, 0.0f);
+				directions[i] = glm::vec3(cos(a), slope(gen), sin(a));
+			}
+		}
+
+		std::vector<RayHit> single(ray_count), packet(ray_count), threaded(ray_count);
+		auto t0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < ray_count; ++i)
+			single[i] = raycaster.Raycast(origins[i], directions[i]);
+		auto t1 = std::chrono::steady_clock::now();
+		raycaster.RaycastPacket(origins.data(), directions.data(), ray_count, 1.0e30f, packet.data());
+		auto t2 = std::chrono::steady_clock::now();
+		const int block = 1024;
+		ThreadPool::Shared().ParallelFor(0, (ray_count + block - 1) / block, [&](int b) {
+			int first = b * block;
+			raycaster.RaycastPacket(&origins[first], &directions[first], std::min(block, ray_count - first), 1.0e30f, &threaded[first]);
+		});
+		auto t3 = std::chrono::steady_clock::now();
+
+		int hits = 0, mismatches = 0;
+		for (int i = 0; i < ray_count; ++i) {
+			hits += single[i].hit;
+			if (single[i].hit != packet[i].hit || (single[i].hit && std::abs(single[i].distance - packet[i].distance) > 1.0e-3f))
+				mismatches++;
+		}
+
+		// Brute force reference on the first rays of the fixed set
+		int references = std::min(reference_count, ray_count), reference_mismatches = 0;
+		for (int i = 0; i < references; ++i) {
+			RayHit reference = raycaster.RaycastBruteForce(origins[i], directions[i]);
+			if (reference.hit != single[i].hit || (reference.hit && std::abs(reference.distance - single[i].distance) > 1.0e-3f))
+				reference_mismatches++;
+		}
+
+		auto rate = [&](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+			return ray_count / std::chrono::duration<double>(b - a).count() / 1.0e6;
+		};
+		out << (set == 0 ? "  steep:   " : "  grazing: ") << ray_count << " rays, " << hits << " hits, "
+			<< rate(t0, t1) << " Mrays/s single, " << rate(t1, t2) << " Mrays/s packets, "
+			<< rate(t2, t3) << " Mrays/s packets on " << ThreadPool::Shared().ThreadCount() + 1 << " threads, "
+			<< mismatches << " single/packet mismatches, " << reference_mismatches << " of " << references << " differ from brute force" << std::endl;
+	}
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include "Terrain.h"
+
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----       TERRAIN RAYCASTER         ----
+//-----------------------------------------
+
+/// Result of a terrain ray query, in world space
+struct RayHit
+{
+	bool hit = false;
+	glm::vec3 position = glm::vec3(0.0f);
+	/// Normal of the hit triangle
+	glm::vec3 normal = glm::vec3(0.0f, 1.0f, 0.0f);
+	/// Distance from the ray origin (the direction is normalized)
+	float distance = 0.0f;
+};
+
+/// Ray queries against the terrain mesh (picking, line of sight, projectile hits). A min/max height pyramid over the
+/// quads lets rays skip whole cells that they pass above or below, only the quads whose bounds the ray overlaps are
+/// intersected with their two triangles (the same triangles as the rendered strips). Rays are traced one by one or
+/// as packets of Simd::Width() rays, one ray per lane, with the same kernel.
+class TerrainRaycaster
+{
+public:
+	TerrainRaycaster() = default;
+	explicit TerrainRaycaster(const std::vector<std::vector<float>>& height) { Build(height); }
+
+	/// Builds the pyramid from a heightfield ([x][z], normalized) placed like the single terrain
+	void Build(const std::vector<std::vector<float>>& height);
+
+	/// Refits the pyramid after the heights of 'region' changed (e.g. Terrain::ApplyBrush)
+	void UpdateRegion(const std::vector<std::vector<float>>& height, Terrain::Region region);
+
+	bool Empty() const { return heights.empty(); }
+
+	/// First hit along the ray within 'max_distance', 'direction' does not need to be normalized
+	RayHit Raycast(const glm::vec3& origin, const glm::vec3& direction, float max_distance = 1.0e30f) const;
+
+	/// Same as Raycast without the pyramid: intersects every quad under the ray, column after column (reference)
+	RayHit RaycastBruteForce(const glm::vec3& origin, const glm::vec3& direction, float max_distance = 1.0e30f) const;
+
+	/// Traces 'count' rays, Simd::Width() at a time
+	void RaycastPacket(const glm::vec3* origins, const glm::vec3* directions, int count, float max_distance, RayHit* hits) const;
+
+	/// Line of sight between 'count' pairs of points, Simd::Width() at a time: visible[i] is 1 when the terrain
+	/// does not cross the segment from[i] to to[i] (ignoring its last 'tolerance' world units, so points lying on the
+	/// ground see each other)
+	void LineOfSight(const glm::vec3* from, const glm::vec3* to, int count, float tolerance, char* visible) const;
+
+	/// Times single rays and packets (one thread and the thread pool) on steep and grazing rays and prints rays/s.
+	/// Compares the packets to the single rays and the first 'reference_count' rays to RaycastBruteForce.
+	static void RunBenchmark(const std::vector<std::vector<float>>& height, int ray_count, int reference_count = 2048,
+		std::ostream& out = std::cout);
+
+private:
+	int size_x = 0;
+	int size_z = 0;
+
+	/// Row major copy of the heights (sample (x, z) at z * size_x + x), gathered by the packet kernel
+	std::vector<float> heights;
+
+	/// Levels 1 to top_level, cell (cx, cz) of level L covers the quads [cx * 2^L, (cx + 1) * 2^L) x [cz * 2^L, (cz + 1) * 2^L).
+	/// Level 0 are the quads themselves, which are intersected exactly instead.
+	std::vector<float> min_height;
+	std::vector<float> max_height;
+	std::vector<int32_t> level_offset;
+	std::vector<int32_t> level_width;
+	std::vector<float> level_width_f;
+	std::vector<float> level_height_f;
+	/// Cell size of each level in quads
+	std::vector<float> level_cell;
+	int top_level = 0;
+
+	void BuildLevel1Cells(int cx0, int cz0, int cx1, int cz1);
+	void BuildCells(int level, int cx0, int cz0, int cx1, int cz1);
+
+	/// Traces S::WIDTH rays given in the grid space (x, z in quads, y normalized height). Writes the hit parameter
+	/// (negative when missed), the quad (z * size_x + x of its first sample) and the triangle of each lane.
+	template<class S>
+	void Trace(const float* ox, const float* oy, const float* oz, const float* dx, const float* dy, const float* dz,
+		const float* max_t, float* t_out, int32_t* quad_out, int32_t* triangle_out) const;
+	/// Trace with the widest kernel the CPU runs, Simd::Width() rays
+	void TraceWide(const float* ox, const float* oy, const float* oz, const float* dx, const float* dy, const float* dz,
+		const float* max_t, float* t_out, int32_t* quad_out, int32_t* triangle_out) const;
+
+	/// Grid space ray of a world space ray, the ray parameter is the same in both spaces
+	void ToGrid(const glm::vec3& origin, const glm::vec3& direction, glm::vec3& grid_origin, glm::vec3& grid_direction) const;
+
+	/// World space hit from a traced lane
+	RayHit MakeHit(const glm::vec3& origin, const glm::vec3& direction, float t, int32_t quad, int32_t triangle) const;
+};
@@ -0,0 +1,230 @@
+#pragma once
+#include "Simd.h"
+
+#include <cstdint>
+
+//-----------------------------------------
+//----   TERRAIN RAYCASTER KERNELS     ----
+//-----------------------------------------
+
+/// Packet kernel of TerrainRaycaster, instantiated for the baseline in TerrainRaycaster.cpp and for AVX2 in
+/// SimdAvx2.cpp
+namespace TerrainRaycasterKernels
+{
+	template<class S>
+	struct Vec3
+	{
+		typename S::F x, y, z;
+	};
+
+	template<class S>
+	Vec3<S> Sub(const Vec3<S>& a, const Vec3<S>& b) {
+		return { S::Sub(a.x, b.x), S::Sub(a.y, b.y), S::Sub(a.z, b.z) };
+	}
+
+	template<class S>
+	Vec3<S> Cross(const Vec3<S>& a, const Vec3<S>& b) {
+		return {
+			S::Sub(S::Mul(a.y, b.z), S::Mul(a.z, b.y)),
+			S::Sub(S::Mul(a.z, b.x), S::Mul(a.x, b.z)),
+			S::Sub(S::Mul(a.x, b.y), S::Mul(a.y, b.x))
+		};
+	}
+
+	template<class S>
+	typename S::F Dot(const Vec3<S>& a, const Vec3<S>& b) {
+		return S::Add(S::Add(S::Mul(a.x, b.x), S::Mul(a.y, b.y)), S::Mul(a.z, b.z));
+	}
+
+	const float NO_HIT = 1.0e30f;
+
+	// Moller-Trumbore, returns the ray parameter of the hit in [lo, hi] or NO_HIT
+	template<class S>
+	typename S::F IntersectTriangle(const Vec3<S>& origin, const Vec3<S>& direction, const Vec3<S>& v0, const Vec3<S>& v1, const Vec3<S>& v2,
+		typename S::F lo, typename S::F hi) {
+		typename S::F one = S::Set(1.0f);
+		// Shared edges are hit by both triangles, no ray slips through the cracks
+		typename S::F edge = S::Set(-1.0e-5f);
+
+		Vec3<S> e1 = Sub(v1, v0);
+		Vec3<S> e2 = Sub(v2, v0);
+		Vec3<S> p = Cross(direction, e2);
+		typename S::F det = Dot(e1, p);
+		typename S::M ok = S::Less(S::Set(1.0e-12f), S::Abs(det));
+		typename S::F inv = S::Div(one, S::Select(ok, det, one));
+
+		Vec3<S> s = Sub(origin, v0);
+		typename S::F u = S::Mul(Dot(s, p), inv);
+		Vec3<S> q = Cross(s, e1);
+		typename S::F v = S::Mul(Dot(direction, q), inv);
+		typename S::F t = S::Mul(Dot(e2, q), inv);
+
+		ok = S::And(ok, S::And(S::LessEqual(edge, u), S::LessEqual(edge, v)));
+		ok = S::And(ok, S::LessEqual(S::Add(u, v), S::Sub(one, edge)));
+		ok = S::And(ok, S::And(S::LessEqual(lo, t), S::LessEqual(t, hi)));
+		return S::Select(ok, t, S::Set(NO_HIT));
+	}
+
+	/// Raw arrays of the min/max pyramid, see TerrainRaycaster
+	struct Pyramid
+	{
+		int size_x, size_z;
+		const float* heights;
+		const float* min_height;
+		const float* max_height;
+		const int32_t* level_offset;
+		const int32_t* level_width;
+		const float* level_width_f;
+		const float* level_height_f;
+		const float* level_cell;
+		int top_level;
+		/// Height range of the whole heightfield
+		float global_min, global_max;
+	};
+
+	/// TerrainRaycaster::Trace on the arrays of 'pyramid'
+	template<class S>
+	void Trace(const Pyramid& pyramid, const float* ox, const float* oy, const float* oz, const float* dx, const float* dy, const float* dz,
+		const float* max_t, float* t_out, int32_t* quad_out, int32_t* triangle_out)
+	{
+		typedef typename S::F F;
+		typedef typename S::I I;
+		typedef typename S::M M;
+
+		Vec3<S> origin = { S::Load(ox), S::Load(oy), S::Load(oz) };
+		Vec3<S> direction = { S::Load(dx), S::Load(dy), S::Load(dz) };
+
+		F zero = S::Set(0.0f);
+		F one = S::Set(1.0f);
+		F half = S::Set(0.5f);
+		F big = S::Set(NO_HIT);
+		F tiny = S::Set(1.0e-12f);
+		// Step past cell boundaries, in ray parameter units (world units)
+		F eps = S::Set(1.0e-4f);
+
+		// Clip the rays to the bounds of the heightfield
+		F t0 = zero;
+		F t1 = S::Load(max_t);
+		auto slab = [&](F o, F d, float lo, float hi) {
+			M flat = S::Less(S::Abs(d), tiny);
+			F inv = S::Div(one, S::Select(flat, one, d));
+			F ta = S::Mul(S::Sub(S::Set(lo), o), inv);
+			F tb = S::Mul(S::Sub(S::Set(hi), o), inv);
+			// Rays parallel to the slab are either always inside or never
+			M inside = S::And(S::LessEqual(S::Set(lo), o), S::LessEqual(o, S::Set(hi)));
+			F near_t = S::Select(flat, S::Select(inside, S::Set(-NO_HIT), big), S::Min(ta, tb));
+			F far_t = S::Select(flat, S::Select(inside, big, S::Set(-NO_HIT)), S::Max(ta, tb));
+			t0 = S::Max(t0, near_t);
+			t1 = S::Min(t1, far_t);
+		};
+		slab(origin.x, direction.x, 0.0f, float(pyramid.size_x - 1));
+		slab(origin.y, direction.y, pyramid.global_min, pyramid.global_max);
+		slab(origin.z, direction.z, 0.0f, float(pyramid.size_z - 1));
+		M active = S::And(S::LessEqual(t0, t1), S::LessEqual(zero, t1));
+
+		M flat_x = S::Less(S::Abs(direction.x), tiny);
+		M flat_z = S::Less(S::Abs(direction.z), tiny);
+		M positive_x = S::Less(zero, direction.x);
+		M positive_z = S::Less(zero, direction.z);
+		F inv_x = S::Div(one, S::Select(flat_x, one, direction.x));
+		F inv_z = S::Div(one, S::Select(flat_z, one, direction.z));
+
+		F t = t0;
+		F top = S::Set(float(pyramid.top_level));
+		F level = top;
+		F hit_t = S::Set(-1.0f);
+		I hit_quad = S::SetI(0);
+		I hit_triangle = S::SetI(0);
+		I zero_i = S::SetI(0);
+		I row_i = S::SetI(pyramid.size_x);
+
+		while (S::Any(active)) {
+			I li = S::ToInt(level);
+			F cell = S::Gather(pyramid.level_cell, li);
+			M leaf = S::Less(level, half);
+
+			// Cell the ray enters at t
+			F te = S::Add(t, eps);
+			F cx = S::Floor(S::Div(S::Add(origin.x, S::Mul(direction.x, te)), cell));
+			F cz = S::Floor(S::Div(S::Add(origin.z, S::Mul(direction.z, te)), cell));
+			cx = S::Max(zero, S::Min(cx, S::Sub(S::Gather(pyramid.level_width_f, li), one)));
+			cz = S::Max(zero, S::Min(cz, S::Sub(S::Gather(pyramid.level_height_f, li), one)));
+
+			// Parameter where the ray leaves the cell
+			F x0 = S::Mul(cx, cell);
+			F z0 = S::Mul(cz, cell);
+			F tx = S::Select(flat_x, big, S::Mul(S::Sub(S::Select(positive_x, S::Add(x0, cell), x0), origin.x), inv_x));
+			F tz = S::Select(flat_z, big, S::Mul(S::Sub(S::Select(positive_z, S::Add(z0, cell), z0), origin.z), inv_z));
+			F t_exit = S::Min(S::Min(tx, tz), t1);
+
+			// Height range of the ray inside the cell
+			F ya = S::Add(origin.y, S::Mul(direction.y, t));
+			F yb = S::Add(origin.y, S::Mul(direction.y, t_exit));
+			F ray_min = S::Min(ya, yb);
+			F ray_max = S::Max(ya, yb);
+
+			I cx_i = S::ToInt(cx);
+			I cz_i = S::ToInt(cz);
+
+			// Pyramid cells: does the ray pass between the lowest and the highest sample?
+			I cell_index = S::AddI(S::GatherI(pyramid.level_offset, li), S::AddI(S::MulI(cz_i, S::GatherI(pyramid.level_width, li)), cx_i));
+			cell_index = S::SelectI(leaf, zero_i, cell_index);
+			F cell_min = S::Gather(pyramid.min_height, cell_index);
+			F cell_max = S::Gather(pyramid.max_height, cell_index);
+			M overlap = S::And(S::LessEqual(ray_min, cell_max), S::LessEqual(cell_min, ray_max));
+
+			// Quads: intersect both triangles, (x + 1, z + 1), (x + 1, z), (x, z) and (x, z), (x, z + 1), (x + 1, z + 1)
+			I quad = S::SelectI(leaf, S::AddI(S::MulI(cz_i, row_i), cx_i), zero_i);
+			F h00 = S::Gather(pyramid.heights, quad);
+			F h10 = S::Gather(pyramid.heights, S::AddI(quad, S::SetI(1)));
+			F h01 = S::Gather(pyramid.heights, S::AddI(quad, row_i));
+			F h11 = S::Gather(pyramid.heights, S::AddI(quad, S::SetI(pyramid.size_x + 1)));
+			F cx1 = S::Add(cx, one);
+			F cz1 = S::Add(cz, one);
+			Vec3<S> v00 = { cx, h00, cz };
+			Vec3<S> v10 = { cx1, h10, cz };
+			Vec3<S> v01 = { cx, h01, cz1 };
+			Vec3<S> v11 = { cx1, h11, cz1 };
+			F lo = S::Sub(t, eps);
+			F hi = S::Add(t_exit, eps);
+			F t_triangle0 = IntersectTriangle<S>(origin, direction, v11, v10, v00, lo, hi);
+			F t_triangle1 = IntersectTriangle<S>(origin, direction, v00, v01, v11, lo, hi);
+			F t_quad = S::Min(t_triangle0, t_triangle1);
+
+			M hit = S::And(S::And(active, leaf), S::Less(t_quad, big));
+			hit_t = S::Select(hit, t_quad, hit_t);
+			hit_quad = S::SelectI(hit, quad, hit_quad);
+			hit_triangle = S::SelectI(hit, S::SelectI(S::LessEqual(t_triangle0, t_triangle1), zero_i, S::SetI(1)), hit_triangle);
+
+			// Go down into overlapped cells, otherwise step into the next cell. Go up a level when that next
+			// cell lies in another parent cell (the ray leaves an odd cell forward or an even cell backward).
+			M exit_x = S::LessEqual(tx, tz);
+			F half_x = S::Mul(cx, half);
+			F half_z = S::Mul(cz, half);
+			F quarter = S::Set(0.25f);
+			M odd_x = S::Less(quarter, S::Sub(half_x, S::Floor(half_x)));
+			M odd_z = S::Less(quarter, S::Sub(half_z, S::Floor(half_z)));
+			M even_x = S::Less(S::Sub(half_x, S::Floor(half_x)), quarter);
+			M even_z = S::Less(S::Sub(half_z, S::Floor(half_z)), quarter);
+			M leaves_parent_x = S::Or(S::And(positive_x, odd_x), S::AndNot(even_x, positive_x));
+			M leaves_parent_z = S::Or(S::And(positive_z, odd_z), S::AndNot(even_z, positive_z));
+			M leaves_parent = S::Or(S::And(exit_x, leaves_parent_x), S::AndNot(leaves_parent_z, exit_x));
+
+			M descend = S::AndNot(S::And(active, overlap), leaf);
+			M advance = S::AndNot(S::AndNot(active, hit), descend);
+			F up = S::Select(leaves_parent, S::Min(S::Add(level, one), top), level);
+			level = S::Select(descend, S::Sub(level, one), S::Select(advance, up, level));
+			t = S::Select(advance, S::Max(t_exit, S::Add(t, eps)), t);
+			active = S::And(S::AndNot(active, hit), S::Less(t, t1));
+		}
+
+		S::Store(t_out, hit_t);
+		S::StoreI(quad_out, hit_quad);
+		S::StoreI(triangle_out, hit_triangle);
+	}
+}
+
+#if !defined(SIMD_AVX2)
+extern template void TerrainRaycasterKernels::Trace<Avx2::SimdFloat>(const TerrainRaycasterKernels::Pyramid&, const float*, const float*,
+	const float*, const float*, const float*, const float*, const float*, float*, int32_t*, int32_t*);
+#endif
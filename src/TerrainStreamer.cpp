@@ -0,0 +1,357 @@
+#include "TerrainStreamer.h"
+#include "Terrain.h"
+#include "ConstantsAndStructs.h"
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <glm/gtc/matrix_transform.hpp>
+
+const float TerrainStreamer::SAMPLE_SPACING = 100.0f / 256.0f;
+
+namespace {
+	const int TILE_SAMPLES = TerrainStreamer::TILE_QUADS + 1;
+
+	// Index of sample 'i' when the heightfield repeats mirrored, a single sample repeats itself
+	int Mirror(int i, int size) {
+		if (size <= 1)
+			return 0;
+		int period = 2 * (size - 1);
+		i %= period;
+		if (i < 0)
+			i += period;
+		return i < size ? i : period - i;
+	}
+
+	// Normalized height at a tile-local position (in samples), bilinear
+	float TileHeight(const std::vector<std::vector<float>>& height, float x, float z) {
+		int x0 = std::min(std::max(static_cast<int>(x), 0), TerrainStreamer::TILE_QUADS - 1);
+		int z0 = std::min(std::max(static_cast<int>(z), 0), TerrainStreamer::TILE_QUADS - 1);
+		float fx = glm::clamp(x - x0, 0.0f, 1.0f);
+		float fz = glm::clamp(z - z0, 0.0f, 1.0f);
+		float h0 = glm::mix(height[x0][z0], height[x0 + 1][z0], fx);
+		float h1 = glm::mix(height[x0][z0 + 1], height[x0 + 1][z0 + 1], fx);
+		return glm::mix(h0, h1, fz);
+	}
+}
+
+TerrainStreamer::TerrainStreamer(HeightSource source, GLint position_location, GLint normal_location, GLint tex_coord_location)
+	: TerrainStreamer(source, position_location, normal_location, tex_coord_location, Settings())
+{
+}
+
+TerrainStreamer::TerrainStreamer(HeightSource source, GLint position_location, GLint normal_location, GLint tex_coord_location, Settings settings)
+	: source(source), settings(settings), position_location(position_location), normal_location(normal_location),
+	tex_coord_location(tex_coord_location), ready(std::make_shared<ReadyQueue>())
+{
+	// Every tile has the same topology, so they all share a single index buffer (same strips as the single terrain)
+	std::vector<unsigned int> indices;
+	for (int y = 0; y < TILE_SAMPLES - 1; y++) {
+		for (int x = 0; x < TILE_SAMPLES; x++) {
+			for (int r = 0; r < 2; r++) {
+				int row = y + (1 - r);
+				int index = row * TILE_SAMPLES + x;
+				indices.push_back(index);
+			}
+		}
+		// Restart triangle strips
+		indices.push_back(2643261405U);
+	}
+
+	glGenBuffers(1, &index_buffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	index_count = static_cast<GLsizei>(indices.size());
+}
+
+TerrainStreamer::~TerrainStreamer()
+{
+	while (!resident.empty())
+		EvictTile(resident.begin());
+	glDeleteBuffers(1, &index_buffer);
+}
+
+TerrainStreamer::HeightSource TerrainStreamer::MirroredSource(const std::vector<std::vector<float>>* height)
+{
+	return [height](int gx0, int gz0, int w, int h, std::vector<std::vector<float>>& out) {
+		int size_x = static_cast<int>(height->size());
+		int size_z = static_cast<int>((*height)[0].size());
+		out.assign(w, std::vector<float>(h));
+		for (int x = 0; x < w; ++x)
+			for (int z = 0; z < h; ++z)
+				out[x][z] = (*height)[Mirror(gx0 + x, size_x)][Mirror(gz0 + z, size_z)];
+	};
+}
+
+TerrainStreamer::HeightSource TerrainStreamer::MirroredSource(const TiledHeightfield* tiled)
+{
+	return [tiled](int gx0, int gz0, int w, int h, std::vector<std::vector<float>>& out) {
+		out.assign(w, std::vector<float>(h));
+		for (int x = 0; x < w; ++x)
+			for (int z = 0; z < h; ++z)
+				out[x][z] = tiled->Get(Mirror(gx0 + x, tiled->SizeX()), Mirror(gz0 + z, tiled->SizeZ()));
+	};
+}
+
+TerrainStreamer::TileBuild TerrainStreamer::BuildTile(const HeightSource& source, int tx, int tz)
+{
+	TileBuild build;
+	build.tx = tx;
+	build.tz = tz;
+
+	// One extra sample on each side for the normals
+	std::vector<std::vector<float>> bordered;
+	source(tx * TILE_QUADS - 1, tz * TILE_QUADS - 1, TILE_SAMPLES + 2, TILE_SAMPLES + 2, bordered);
+
+	build.height.assign(TILE_SAMPLES, std::vector<float>(TILE_SAMPLES));
+	for (int x = 0; x < TILE_SAMPLES; x++)
+		for (int y = 0; y < TILE_SAMPLES; y++)
+			build.height[x][y] = bordered[x + 1][y + 1];
+
+	/*
+		Vertex data, same layout as Terrain (position, normal, tex. coord)
+	*/
+	// Normals in the unit space of the single terrain (a sample is 1/256 wide), so the shading matches it
+	const float unit_spacing = 1.0f / 256.0f;
+	build.vertex_data.resize(TILE_SAMPLES * TILE_SAMPLES * 8);
+	for (int x = 0; x < TILE_SAMPLES; x++) {
+		for (int y = 0; y < TILE_SAMPLES; y++) {
+			float s = float(x) / float(TILE_QUADS);
+			float t = float(y) / float(TILE_QUADS);
+			glm::vec3 normal = glm::normalize(glm::vec3(
+				(bordered[x][y + 1] - bordered[x + 2][y + 1]) / (2.0f * unit_spacing),
+				1.0f,
+				(bordered[x + 1][y] - bordered[x + 1][y + 2]) / (2.0f * unit_spacing)));
+
+			float* v = &build.vertex_data[(x + y * TILE_SAMPLES) * 8];
+			v[0] = s;
+			v[1] = build.height[x][y];
+			v[2] = t;
+			v[3] = normal.x;
+			v[4] = normal.y;
+			v[5] = normal.z;
+			// Texture coordinates continue across tiles
+			v[6] = float(tx * TILE_QUADS + x) / 256.0f;
+			v[7] = float(tz * TILE_QUADS + y) / 256.0f;
+		}
+	}
+
+	/*
+		Vegetation, deterministic per tile
+	*/
+	// Multiplied unsigned, the products wrap instead of overflowing far from the origin
+	std::mt19937 gen((static_cast<uint32_t>(tx) * 73856093u) ^ (static_cast<uint32_t>(tz) * 19349663u));
+	std::uniform_real_distribution<float> disArea(0.0f, float(TILE_QUADS));
+	std::uniform_real_distribution<float> disAngle(0.0f, 6.28f);
+	std::uniform_real_distribution<float> disGeneral(0.1f, 1.0f);
+	float origin_x = tx * TileWorldSize() - 50.0f;
+	float origin_z = tz * TileWorldSize() - 50.0f;
+
+	auto place = [&](std::vector<PackedInstance>& out, int count, std::function<float(float)> density) {
+		for (int attempt = 0; attempt < count * 20 && int(out.size()) < count; ++attempt) {
+			float x = disArea(gen);
+			float z = disArea(gen);
+			float y = TileHeight(build.height, x, z);
+			if (disGeneral(gen) > density(y))
+				continue;
+
+			int xi = std::min(static_cast<int>(x), TILE_QUADS - 1);
+			int zi = std::min(static_cast<int>(z), TILE_QUADS - 1);
+			float y1 = build.height[xi][zi];
+
+			out.push_back(PackedInstance::Pack(glm::vec3(origin_x + x * SAMPLE_SPACING, y * TERRAIN_HEIGHT, origin_z + z * SAMPLE_SPACING),
+				disAngle(gen), -tanf(y1 - build.height[xi + 1][zi]), -tanf(y1 - build.height[xi][zi + 1])));
+		}
+	};
+	place(build.trees, TILE_TREES, [](float y) { return y < 0.2f ? 0.0f : y; });
+	place(build.bushes, TILE_BUSHES, [](float y) { return y < 0.3f ? 0.0f : 1.0f; });
+
+	return build;
+}
+
+void TerrainStreamer::UploadTile(TileBuild& build)
+{
+	TerrainTile tile;
+	tile.tx = build.tx;
+	tile.tz = build.tz;
+	tile.height = std::move(build.height);
+	tile.last_used = frame;
+
+	Geometry& geometry = tile.geometry;
+	glGenBuffers(1, &geometry.VertexBuffers[0]);
+	glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, build.vertex_data.size() * sizeof(float), build.vertex_data.data(), GL_STATIC_DRAW);
+
+	glGenVertexArrays(1, &geometry.VertexArrayObject);
+	glBindVertexArray(geometry.VertexArrayObject);
+	if (position_location >= 0)
+	{
+		glEnableVertexAttribArray(position_location);
+		glVertexAttribPointer(position_location, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, 0);
+	}
+	if (normal_location >= 0)
+	{
+		glEnableVertexAttribArray(normal_location);
+		glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (const void*)(sizeof(float) * 3));
+	}
+	if (tex_coord_location >= 0)
+	{
+		glEnableVertexAttribArray(tex_coord_location);
+		glVertexAttribPointer(tex_coord_location, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (const void*)(sizeof(float) * 6));
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	geometry.Mode = GL_TRIANGLE_STRIP;
+	geometry.DrawArraysCount = 0;
+	geometry.DrawElementsCount = index_count;
+
+	tile.trees.Upload(build.trees);
+	tile.bushes.Upload(build.bushes);
+
+	tile.bytes = build.vertex_data.size() * sizeof(float) + tile.trees.bytes + tile.bushes.bytes
+		+ TILE_SAMPLES * TILE_SAMPLES * sizeof(float);
+
+	auto key = std::make_pair(tile.tx, tile.tz);
+	stats.bytes += tile.bytes;
+	stats.loaded++;
+	stats.frame_loaded++;
+	if (ever_evicted.count(key))
+		stats.reloaded++;
+	resident[key] = std::move(tile);
+}
+
+void TerrainStreamer::EvictTile(std::map<std::pair<int, int>, TerrainTile>::iterator it)
+{
+	TerrainTile& tile = it->second;
+	glDeleteVertexArrays(1, &tile.geometry.VertexArrayObject);
+	glDeleteBuffers(1, &tile.geometry.VertexBuffers[0]);
+	tile.trees.Release();
+	tile.bushes.Release();
+
+	stats.bytes -= tile.bytes;
+	ever_evicted.insert(it->first);
+	resident.erase(it);
+}
+
+void TerrainStreamer::Update(const glm::vec3& eye)
+{
+	auto start = std::chrono::steady_clock::now();
+	frame++;
+	stats.frame_loaded = 0;
+	stats.frame_evicted = 0;
+
+	/*
+		Request the tiles around the camera, nearest first
+	*/
+	int ctx = static_cast<int>(floorf((eye.x + 50.0f) / TileWorldSize()));
+	int ctz = static_cast<int>(floorf((eye.z + 50.0f) / TileWorldSize()));
+	std::vector<std::pair<int, int>> requests;
+	wanted.clear();
+	for (int dz = -settings.view_radius; dz <= settings.view_radius; ++dz) {
+		for (int dx = -settings.view_radius; dx <= settings.view_radius; ++dx) {
+			auto key = std::make_pair(ctx + dx, ctz + dz);
+			wanted.insert(key);
+			auto it = resident.find(key);
+			if (it != resident.end())
+				it->second.last_used = frame;
+			else if (!pending.count(key))
+				requests.push_back(key);
+		}
+	}
+	std::sort(requests.begin(), requests.end(), [ctx, ctz](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+		return std::max(abs(a.first - ctx), abs(a.second - ctz)) < std::max(abs(b.first - ctx), abs(b.second - ctz));
+	});
+	for (const auto& key : requests) {
+		pending.insert(key);
+		HeightSource tile_source = source;
+		std::shared_ptr<ReadyQueue> queue = ready;
+		ThreadPool::Shared().Enqueue([tile_source, queue, key]() {
+			TileBuild build = BuildTile(tile_source, key.first, key.second);
+			std::lock_guard<std::mutex> lock(queue->mutex);
+			queue->builds.push_back(std::move(build));
+		});
+	}
+
+	/*
+		Upload finished tiles until the time budget is spent, the rest waits for the next frame
+	*/
+	std::vector<TileBuild> builds;
+	{
+		std::lock_guard<std::mutex> lock(ready->mutex);
+		builds.swap(ready->builds);
+	}
+	size_t next = 0;
+	for (; next < builds.size(); ++next) {
+		double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if (stats.frame_loaded > 0 && elapsed > settings.upload_budget_ms)
+			break;
+
+		auto key = std::make_pair(builds[next].tx, builds[next].tz);
+		pending.erase(key);
+		if (!wanted.count(key)) {
+			stats.discarded++;
+			continue;
+		}
+		UploadTile(builds[next]);
+	}
+	if (next < builds.size()) {
+		std::lock_guard<std::mutex> lock(ready->mutex);
+		for (; next < builds.size(); ++next)
+			ready->builds.push_back(std::move(builds[next]));
+	}
+
+	/*
+		Evict least recently used tiles outside the view radius while over the memory budget
+	*/
+	while (stats.bytes > settings.memory_budget) {
+		auto lru = resident.end();
+		for (auto it = resident.begin(); it != resident.end(); ++it) {
+			if (wanted.count(it->first))
+				continue;
+			if (lru == resident.end() || it->second.last_used < lru->second.last_used)
+				lru = it;
+		}
+		if (lru == resident.end())
+			break;
+		EvictTile(lru);
+		stats.evicted++;
+		stats.frame_evicted++;
+	}
+
+	stats.resident = static_cast<int>(resident.size());
+	stats.pending = static_cast<int>(pending.size());
+	stats.frame_upload_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::vector<const TerrainTile*> TerrainStreamer::VisibleTiles() const
+{
+	std::vector<const TerrainTile*> tiles;
+	for (const auto& key : wanted) {
+		auto it = resident.find(key);
+		if (it != resident.end())
+			tiles.push_back(&it->second);
+	}
+	return tiles;
+}
+
+glm::mat4 TerrainStreamer::TileModelMatrix(int tx, int tz)
+{
+	glm::mat4 model_matrix(1.0f);
+	model_matrix = glm::translate(model_matrix, glm::vec3(tx * TileWorldSize() - 50.0f, -2.0f, tz * TileWorldSize() - 50.0f));
+	model_matrix = glm::scale(model_matrix, glm::vec3(TileWorldSize(), TERRAIN_HEIGHT, TileWorldSize()));
+	return model_matrix;
+}
+
+float TerrainStreamer::GetHeight(float x, float z, float fallback) const
+{
+	float gx = (x + 50.0f) / SAMPLE_SPACING;
+	float gz = (z + 50.0f) / SAMPLE_SPACING;
+	int tx = static_cast<int>(floorf(gx / TILE_QUADS));
+	int tz = static_cast<int>(floorf(gz / TILE_QUADS));
+	auto it = resident.find(std::make_pair(tx, tz));
+	if (it == resident.end())
+		return fallback;
+	return TileHeight(it->second.height, gx - tx * TILE_QUADS, gz - tz * TILE_QUADS) * TERRAIN_HEIGHT;
+}
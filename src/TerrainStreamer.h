@@ -0,0 +1,146 @@
+#pragma once
+#include "Geometry.h"
+#include "InstanceBuffer.h"
+#include "ThreadPool.h"
+#include "TiledHeightfield.h"
+
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+//-----------------------------------------
+//----       TERRAIN STREAMER          ----
+//-----------------------------------------
+
+/// Terrain tile resident on the GPU
+struct TerrainTile
+{
+	int tx = 0;
+	int tz = 0;
+
+	/// Tile mesh, local positions in [0, 1] x [0, 1] (height) x [0, 1], shares the streamer's index buffer
+	Geometry geometry;
+
+	/// Heights with the same layout as Terrain::height ([x][z], normalized)
+	std::vector<std::vector<float>> height;
+
+	/// Vegetation placed on the tile
+	InstanceBuffer trees;
+	InstanceBuffer bushes;
+
+	size_t bytes = 0;
+	uint64_t last_used = 0;
+};
+
+/// Tiled world around the camera. Tiles are generated on the thread pool (heights, mesh, vegetation), uploaded
+/// on the main thread under a per-frame time budget and kept in an LRU cache bounded by a memory budget.
+class TerrainStreamer
+{
+public:
+	/// Fills 'out' ([x][z], w * h samples) with normalized heights starting at the global sample (gx0, gz0).
+	/// Called from worker threads.
+	typedef std::function<void(int gx0, int gz0, int w, int h, std::vector<std::vector<float>>& out)> HeightSource;
+
+	/// Quads per tile side, tiles have TILE_QUADS + 1 samples per side and share their border samples
+	static const int TILE_QUADS = 128;
+	/// World units per sample, matches the 256 samples over 100 units of the single terrain
+	static const float SAMPLE_SPACING;
+	/// Vegetation per tile
+	static const int TILE_TREES = 48;
+	static const int TILE_BUSHES = 48;
+
+	struct Settings
+	{
+		/// Tiles within this distance (in tiles) of the camera tile are requested
+		int view_radius = 3;
+		size_t memory_budget = 256u * 1024u * 1024u;
+		double upload_budget_ms = 2.0;
+	};
+
+	struct Stats
+	{
+		int resident = 0;
+		int pending = 0;
+		size_t bytes = 0;
+		/// Totals since creation
+		int loaded = 0;
+		int evicted = 0;
+		/// Tiles loaded again after having been evicted
+		int reloaded = 0;
+		/// Finished tiles dropped because they were no longer wanted when their upload came up
+		int discarded = 0;
+		/// Last Update only
+		int frame_loaded = 0;
+		int frame_evicted = 0;
+		double frame_upload_ms = 0.0;
+	};
+
+	TerrainStreamer(HeightSource source, GLint position_location, GLint normal_location, GLint tex_coord_location);
+	TerrainStreamer(HeightSource source, GLint position_location, GLint normal_location, GLint tex_coord_location, Settings settings);
+	~TerrainStreamer();
+	TerrainStreamer(const TerrainStreamer&) = delete;
+	TerrainStreamer& operator =(const TerrainStreamer&) = delete;
+
+	/// Requests tiles around 'eye', uploads finished ones under the time budget and evicts over the memory budget.
+	/// Call once per frame from the GL thread.
+	void Update(const glm::vec3& eye);
+
+	/// Resident tiles in the view radius of the last Update
+	std::vector<const TerrainTile*> VisibleTiles() const;
+
+	/// World space model matrix of a tile (same vertical scale and offset as the single terrain)
+	static glm::mat4 TileModelMatrix(int tx, int tz);
+	static float TileWorldSize() { return TILE_QUADS * SAMPLE_SPACING; }
+
+	/// Height in world units at (x, z) from resident tiles, 'fallback' if the tile is not resident
+	float GetHeight(float x, float z, float fallback) const;
+
+	const Stats& GetStats() const { return stats; }
+
+	/// Mirror-repeated sources, seamless at any tile
+	static HeightSource MirroredSource(const std::vector<std::vector<float>>* height);
+	static HeightSource MirroredSource(const TiledHeightfield* tiled);
+
+private:
+	/// CPU side result of a background tile build
+	struct TileBuild
+	{
+		int tx, tz;
+		std::vector<std::vector<float>> height;
+		std::vector<float> vertex_data;
+		std::vector<PackedInstance> trees;
+		std::vector<PackedInstance> bushes;
+	};
+
+	HeightSource source;
+	Settings settings;
+	GLint position_location, normal_location, tex_coord_location;
+
+	GLuint index_buffer = 0;
+	GLsizei index_count = 0;
+
+	std::map<std::pair<int, int>, TerrainTile> resident;
+	std::set<std::pair<int, int>> pending;
+	std::set<std::pair<int, int>> ever_evicted;
+	std::set<std::pair<int, int>> wanted;
+
+	/// Finished builds, shared with the tasks so they can outlive the streamer
+	struct ReadyQueue
+	{
+		std::mutex mutex;
+		std::vector<TileBuild> builds;
+	};
+	std::shared_ptr<ReadyQueue> ready;
+
+	uint64_t frame = 0;
+	Stats stats;
+
+	static TileBuild BuildTile(const HeightSource& source, int tx, int tz);
+	void UploadTile(TileBuild& build);
+	void EvictTile(std::map<std::pair<int, int>, TerrainTile>::iterator it);
+};
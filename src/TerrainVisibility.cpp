@@ -0,0 +1,230 @@
+#include "TerrainVisibility.h"
+#include "ThreadPool.h"
+#include <fstream>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+
+namespace {
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t cells_x;
+		uint32_t cells_z;
+		uint32_t size_x;
+		uint32_t size_z;
+		uint32_t checksum;
+		uint32_t raw_bytes;
+		uint32_t packed_bytes;
+	};
+
+	const uint32_t MAGIC = 0x31535650; // "PVS1"
+
+	// PackBits: a control byte n < 128 is followed by n + 1 literal bytes, n > 128 by one byte repeated 257 - n times
+	std::vector<uint8_t> Pack(const std::vector<uint8_t>& data) {
+		std::vector<uint8_t> out;
+		size_t i = 0;
+		while (i < data.size()) {
+			size_t run = 1;
+			while (i + run < data.size() && run < 128 && data[i + run] == data[i])
+				++run;
+			if (run >= 3) {
+				out.push_back(uint8_t(257 - run));
+				out.push_back(data[i]);
+				i += run;
+				continue;
+			}
+			// Literals up to the next run of 3
+			size_t start = i;
+			while (i < data.size() && i - start < 128) {
+				if (i + 2 < data.size() && data[i] == data[i + 1] && data[i] == data[i + 2])
+					break;
+				++i;
+			}
+			out.push_back(uint8_t(i - start - 1));
+			out.insert(out.end(), data.begin() + start, data.begin() + i);
+		}
+		return out;
+	}
+
+	bool Unpack(const std::vector<uint8_t>& packed, std::vector<uint8_t>& data) {
+		size_t out = 0, i = 0;
+		while (i < packed.size() && out < data.size()) {
+			uint8_t n = packed[i++];
+			if (n < 128) {
+				size_t count = size_t(n) + 1;
+				if (i + count > packed.size() || out + count > data.size())
+					return false;
+				std::memcpy(&data[out], &packed[i], count);
+				i += count;
+				out += count;
+			}
+			else if (n > 128) {
+				size_t count = 257 - size_t(n);
+				if (i >= packed.size() || out + count > data.size())
+					return false;
+				std::memset(&data[out], packed[i++], count);
+				out += count;
+			}
+		}
+		return out == data.size();
+	}
+}
+
+uint32_t TerrainVisibility::Checksum(const std::vector<std::vector<float>>& height)
+{
+	uint32_t checksum = 2166136261u;
+	for (const auto& column : height) {
+		for (float v : column) {
+			uint32_t value;
+			std::memcpy(&value, &v, sizeof(value));
+			checksum = (checksum ^ value) * 16777619u;
+		}
+	}
+	return checksum;
+}
+
+void TerrainVisibility::Bake(const std::vector<std::vector<float>>& height, const TerrainRaycaster& raycaster, const Settings& settings)
+{
+	cells_x = settings.cells_x;
+	cells_z = settings.cells_z;
+	size_x = static_cast<int>(height.size());
+	size_z = static_cast<int>(height[0].size());
+	checksum = Checksum(height);
+	row_bytes = (CellCount() + 7) / 8;
+	bits.assign(size_t(row_bytes) * CellCount(), 0);
+
+	// Viewpoints and targets spread evenly over each cell, placed on the ground by a vertical ray
+	int n = settings.samples;
+	int per_cell = n * n;
+	std::vector<glm::vec3> eyes(size_t(CellCount()) * per_cell);
+	std::vector<glm::vec3> targets(eyes.size());
+	for (int cz = 0; cz < cells_z; ++cz) {
+		for (int cx = 0; cx < cells_x; ++cx) {
+			float x0 = float(Terrain::ChunkBegin(cx, cells_x, size_x - 1)), x1 = float(Terrain::ChunkBegin(cx + 1, cells_x, size_x - 1));
+			float z0 = float(Terrain::ChunkBegin(cz, cells_z, size_z - 1)), z1 = float(Terrain::ChunkBegin(cz + 1, cells_z, size_z - 1));
+			for (int j = 0; j < n; ++j) {
+				for (int i = 0; i < n; ++i) {
+					float x = (x0 + (x1 - x0) * (i + 0.5f) / n) * 100.0f / size_x - 50.0f;
+					float z = (z0 + (z1 - z0) * (j + 0.5f) / n) * 100.0f / size_z - 50.0f;
+					RayHit ground = raycaster.Raycast(glm::vec3(x, TERRAIN_HEIGHT, z), glm::vec3(0.0f, -1.0f, 0.0f));
+					float y = ground.hit ? ground.position.y : -2.0f;
+					size_t index = size_t(cz * cells_x + cx) * per_cell + j * n + i;
+					eyes[index] = glm::vec3(x, y + settings.eye_height, z);
+					targets[index] = glm::vec3(x, y + settings.target_height, z);
+				}
+			}
+		}
+	}
+
+	// Every task writes its own row of the matrix
+	std::atomic<uint64_t> rays(0);
+	ThreadPool::Shared().ParallelFor(0, CellCount(), [&](int from) {
+		int fx = from % cells_x, fz = from / cells_x;
+		std::vector<glm::vec3> origins(per_cell);
+		std::vector<char> visible(per_cell);
+		uint64_t traced = 0;
+		for (int to = 0; to < CellCount(); ++to) {
+			int tx = to % cells_x, tz = to / cells_x;
+			// The camera cell and its neighbours are always drawn
+			bool seen = std::abs(tx - fx) <= 1 && std::abs(tz - fz) <= 1;
+			// One packet of all targets per viewpoint, stop at the first line of sight
+			for (int e = 0; e < per_cell && !seen; ++e) {
+				std::fill(origins.begin(), origins.end(), eyes[size_t(from) * per_cell + e]);
+				raycaster.LineOfSight(origins.data(), &targets[size_t(to) * per_cell], per_cell, 0.05f, visible.data());
+				traced += per_cell;
+				seen = std::find(visible.begin(), visible.end(), 1) != visible.end();
+			}
+			if (seen)
+				SetVisible(from, to);
+		}
+		rays += traced;
+	});
+	ray_count = rays;
+
+	if (settings.dilate) {
+		std::vector<uint8_t> sampled = bits;
+		for (int from = 0; from < CellCount(); ++from) {
+			for (int to = 0; to < CellCount(); ++to) {
+				if (!((sampled[size_t(from) * row_bytes + (to >> 3)] >> (to & 7)) & 1))
+					continue;
+				int tx = to % cells_x, tz = to / cells_x;
+				for (int z = std::max(tz - 1, 0); z <= std::min(tz + 1, cells_z - 1); ++z)
+					for (int x = std::max(tx - 1, 0); x <= std::min(tx + 1, cells_x - 1); ++x)
+						SetVisible(from, z * cells_x + x);
+			}
+		}
+	}
+}
+
+bool TerrainVisibility::Save(const maybewchar* filename) const
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	std::vector<uint8_t> packed = Pack(bits);
+	Header header;
+	header.magic = MAGIC;
+	header.cells_x = cells_x;
+	header.cells_z = cells_z;
+	header.size_x = size_x;
+	header.size_z = size_z;
+	header.checksum = checksum;
+	header.raw_bytes = static_cast<uint32_t>(bits.size());
+	header.packed_bytes = static_cast<uint32_t>(packed.size());
+	file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+	file.write(reinterpret_cast<const char*>(packed.data()), packed.size());
+	file_bytes = sizeof(Header) + packed.size();
+	return file.good();
+}
+
+bool TerrainVisibility::Load(const maybewchar* filename, const std::vector<std::vector<float>>& height)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	Header header;
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(Header)))
+		return false;
+	int cells = int(header.cells_x * header.cells_z);
+	if (header.magic != MAGIC || header.cells_x == 0 || header.cells_z == 0 || header.raw_bytes != uint32_t((cells + 7) / 8 * cells)
+		|| header.size_x != height.size() || header.size_z != height[0].size() || header.checksum != Checksum(height))
+		return false;
+
+	std::vector<uint8_t> packed(header.packed_bytes);
+	std::vector<uint8_t> data(header.raw_bytes);
+	if (!file.read(reinterpret_cast<char*>(packed.data()), packed.size()) || !Unpack(packed, data))
+		return false;
+
+	cells_x = header.cells_x;
+	cells_z = header.cells_z;
+	size_x = header.size_x;
+	size_z = header.size_z;
+	checksum = header.checksum;
+	row_bytes = (cells + 7) / 8;
+	bits.swap(data);
+	file_bytes = sizeof(Header) + packed.size();
+	return true;
+}
+
+int TerrainVisibility::CellAt(float x, float z) const
+{
+	float sx = (x / 100.0f + 0.5f) * size_x;
+	float sz = (z / 100.0f + 0.5f) * size_z;
+	if (sx < 0.0f || sz < 0.0f || sx > float(size_x - 1) || sz > float(size_z - 1))
+		return -1;
+	int qx = std::min(static_cast<int>(sx), size_x - 2);
+	int qz = std::min(static_cast<int>(sz), size_z - 2);
+	return Terrain::ChunkOf(qz, cells_z, size_z - 1) * cells_x + Terrain::ChunkOf(qx, cells_x, size_x - 1);
+}
+
+void TerrainVisibility::VisibleFrom(int cell, std::vector<char>& visible) const
+{
+	visible.assign(CellCount(), 1);
+	if (cell < 0)
+		return;
+	for (int to = 0; to < CellCount(); ++to)
+		visible[to] = Visible(cell, to);
+}
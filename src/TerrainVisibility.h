@@ -0,0 +1,82 @@
+#pragma once
+#include "TerrainRaycaster.h"
+
+#include <vector>
+#include <cstdint>
+
+//-----------------------------------------
+//----   TERRAIN POTENTIALLY VISIBLE   ----
+//-----------------------------------------
+
+/// Precomputed cell to cell visibility (PVS) of the single terrain. The terrain is split into cells_x * cells_z
+/// rectangles of quads (the chunks of Terrain::BuildChunks), a cell sees another when any line of sight from a
+/// viewpoint at eye height above the first reaches a point above the ground of the second. The bake runs the
+/// source cells on the thread pool and the rays as packets (TerrainRaycaster::LineOfSight). At runtime the
+/// camera cell selects a row of the bit matrix, hidden terrain chunks and the vegetation on them are skipped.
+/// The matrix is only valid for the heights it was baked from (brush edits are not tracked).
+class TerrainVisibility
+{
+public:
+	struct Settings
+	{
+		int cells_x = 16;
+		int cells_z = 16;
+		/// Viewpoints and targets per cell along each axis (samples * samples of each)
+		int samples = 3;
+		/// Viewpoints above the ground (the camera height)
+		float eye_height = 2.0f;
+		/// Targets above the ground, covers most of the vegetation standing on a cell
+		float target_height = 3.0f;
+		/// Also mark the neighbours of visible cells, hides the gaps between the sampled points
+		bool dilate = true;
+	};
+
+	/// Bakes the matrix of a heightfield ([x][z], normalized) placed like the single terrain
+	void Bake(const std::vector<std::vector<float>>& height, const TerrainRaycaster& raycaster, const Settings& settings);
+
+	/// Writes the matrix PackBits compressed. Returns false if the file cannot be written.
+	bool Save(const maybewchar* filename) const;
+
+	/// Reads a matrix written by Save. Returns false if the file is missing, damaged or was baked from other heights.
+	bool Load(const maybewchar* filename, const std::vector<std::vector<float>>& height);
+
+	bool Empty() const { return bits.empty(); }
+
+	int CellsX() const { return cells_x; }
+	int CellsZ() const { return cells_z; }
+	int CellCount() const { return cells_x * cells_z; }
+
+	/// Cell (cz * cells_x + cx) under the world position (x, z), -1 outside the terrain
+	int CellAt(float x, float z) const;
+
+	bool Visible(int from, int to) const { return (bits[size_t(from) * row_bytes + (to >> 3)] >> (to & 7)) & 1; }
+
+	/// One flag per cell, everything is visible from outside the terrain (cell -1)
+	void VisibleFrom(int cell, std::vector<char>& visible) const;
+
+	/// Size of the uncompressed matrix and of the last file saved or loaded
+	size_t RawBytes() const { return bits.size(); }
+	size_t FileBytes() const { return file_bytes; }
+
+	/// Line of sight rays traced by the last bake
+	uint64_t RayCount() const { return ray_count; }
+
+	/// FNV-1a over the height samples, stored in the file to detect a changed heightmap
+	static uint32_t Checksum(const std::vector<std::vector<float>>& height);
+
+private:
+	int cells_x = 0;
+	int cells_z = 0;
+	int size_x = 0;
+	int size_z = 0;
+	uint32_t checksum = 0;
+
+	/// Row 'from' holds one bit per target cell
+	int row_bytes = 0;
+	std::vector<uint8_t> bits;
+
+	mutable size_t file_bytes = 0;
+	uint64_t ray_count = 0;
+
+	void SetVisible(int from, int to) { bits[size_t(from) * row_bytes + (to >> 3)] |= uint8_t(1 << (to & 7)); }
+};
@@ -80,4 +80,49 @@ GLuint TextureLoader::CreateAndLoadTexture(const maybewchar* filename)
 	glBindTexture(GL_TEXTURE_2D, 0);
 
 	return tex_obj;
-}
\ No newline at end of file
+}
+
+bool TextureLoader::LoadImageRGBA(const maybewchar* filename, int& width, int& height, std::vector<uint8_t>& pixels)
+{
+	ILuint IL_tex;
+	ilGenImages(1, &IL_tex);
+	ilBindImage(IL_tex);
+
+	// Same orientation as LoadAndSetTexture
+	ilEnable(IL_ORIGIN_SET);
+	ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
+
+	bool success = ilLoadImage(filename) && ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE);
+	if (success) {
+		width = ilGetInteger(IL_IMAGE_WIDTH);
+		height = ilGetInteger(IL_IMAGE_HEIGHT);
+		const uint8_t* data = ilGetData();
+		pixels.assign(data, data + size_t(width) * height * 4);
+	}
+	else
+		cerr << "Couldn't load image: " << filename << endl;
+
+	ilBindImage(0);
+	ilDeleteImages(1, &IL_tex);
+	return success;
+}
+
+glm::vec3 TextureLoader::AverageColor(GLuint texture)
+{
+	glBindTexture(GL_TEXTURE_2D, texture);
+	GLint width = 0, height = 0;
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+
+	// The 1x1 level holds the mean of all texels
+	int level = 0;
+	while ((width >> level) > 1 || (height >> level) > 1)
+		level++;
+
+	float color[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glGetTexImage(GL_TEXTURE_2D, level, GL_RGBA, GL_FLOAT, color);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return glm::vec3(color[0], color[1], color[2]);
+}
@@ -1,5 +1,8 @@
 #pragma once
 #include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
 // Include DevIL for image loading
 #if defined(_WIN32)
 #pragma comment(lib, "glew32s.lib")
@@ -30,4 +33,10 @@ public:
 	static bool LoadAndSetTexture(const maybewchar* filename, GLenum target);
 
 	static GLuint CreateAndLoadTexture(const maybewchar* filename);
+
+	/// Loads an image as RGBA bytes, the first row is the bottom one like in the textures. Needs no GL context.
+	static bool LoadImageRGBA(const maybewchar* filename, int& width, int& height, std::vector<uint8_t>& pixels);
+
+	/// Mean color of a mipmapped 2D texture, read from its smallest mip level (call glGenerateMipmap first)
+	static glm::vec3 AverageColor(GLuint texture);
 };
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "ThreadPool.h"
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned thread_count)
+{
+	if (thread_count == 0) {
+		// hardware_concurrency is 0 when unknown
+		unsigned hardware = std::thread::hardware_concurrency();
+		thread_count = hardware > 1 ? hardware - 1 : 1;
+	}
+
+	for (unsigned i = 0; i < thread_count; ++i)
+		workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+void ThreadPool::Enqueue(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back(std::move(task));
+	}
+	condition.notify_one();
+}
+
+void ThreadPool::WorkerLoop()
+{
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if (stopping && tasks.empty())
+				return;
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
+
+void ThreadPool::ParallelFor(int begin, int end, const std::function<void(int)>& fn)
+{
+	if (end <= begin)
+		return;
+
+	// Shared by the helpers, which may start after this call returned (and then find no work left)
+	struct State
+	{
+		std::atomic<int> next;
+		std::atomic<int> done;
+		int end;
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+	auto state = std::make_shared<State>();
+	state->next = begin;
+	state->done = 0;
+	state->end = end;
+	int total = end - begin;
+
+	const std::function<void(int)>* body = &fn;
+	auto run = [state, body, total]() {
+		for (int i = state->next++; i < state->end; i = state->next++) {
+			(*body)(i);
+			if (++state->done == total) {
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->finished.notify_all();
+			}
+		}
+	};
+
+	unsigned helpers = std::min<unsigned>(ThreadCount(), static_cast<unsigned>(total - 1));
+	for (unsigned i = 0; i < helpers; ++i)
+		Enqueue(run);
+
+	run();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->finished.wait(lock, [&] { return state->done == total; });
+}
+
+ThreadPool& ThreadPool::Shared()
+{
+	static ThreadPool pool;
+	return pool;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+//-----------------------------------------
+//----          THREAD POOL            ----
+//-----------------------------------------
+
+/// Fixed set of worker threads consuming a FIFO of tasks. Used for background work (tile generation)
+/// and for data-parallel loops over rows/tiles.
+class ThreadPool
+{
+public:
+	/// Creates 'thread_count' workers, 0 means one per hardware thread (minus the calling thread, at least one)
+	explicit ThreadPool(unsigned thread_count = 0);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator =(const ThreadPool&) = delete;
+
+	/// Queues a task and returns immediately
+	void Enqueue(std::function<void()> task);
+
+	/// Calls fn(i) for every i in [begin, end), spread over the workers and the calling thread.
+	/// Returns when all calls finished. Safe to call from a worker (the caller keeps taking indices).
+	void ParallelFor(int begin, int end, const std::function<void(int)>& fn);
+
+	unsigned ThreadCount() const { return static_cast<unsigned>(workers.size()); }
+
+	/// Pool shared by the whole application
+	static ThreadPool& Shared();
+
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping = false;
+
+	void WorkerLoop();
+};
@@ -0,0 +1,207 @@
+#include "TiledHeightfield.h"
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t size_x;
+		uint32_t size_z;
+		uint32_t tile_size;
+		uint32_t format;
+	};
+
+	size_t SampleBytes(TiledHeightfield::Format format) {
+		return format == TiledHeightfield::F32 ? sizeof(float) : sizeof(uint16_t);
+	}
+}
+
+TiledHeightfield::~TiledHeightfield()
+{
+	Close();
+}
+
+bool TiledHeightfield::Cook(const std::vector<std::vector<float>>& height, const maybewchar* file_name, int tile_size, Format format)
+{
+	std::ofstream file(file_name, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	Header header;
+	header.magic = MAGIC;
+	header.size_x = static_cast<uint32_t>(height.size());
+	header.size_z = static_cast<uint32_t>(height[0].size());
+	header.tile_size = tile_size;
+	header.format = format;
+
+	std::vector<char> header_data(HEADER_SIZE, 0);
+	std::memcpy(header_data.data(), &header, sizeof(Header));
+	file.write(header_data.data(), header_data.size());
+
+	int tiles_x = (header.size_x + tile_size - 1) / tile_size;
+	int tiles_z = (header.size_z + tile_size - 1) / tile_size;
+	size_t sample_bytes = SampleBytes(format);
+	std::vector<unsigned char> tile(size_t(tile_size) * tile_size * sample_bytes);
+
+	for (int tz = 0; tz < tiles_z; ++tz) {
+		for (int tx = 0; tx < tiles_x; ++tx) {
+			for (int lz = 0; lz < tile_size; ++lz) {
+				for (int lx = 0; lx < tile_size; ++lx) {
+					// Edge tiles are padded by repeating the last sample
+					int x = std::min(tx * tile_size + lx, int(header.size_x) - 1);
+					int z = std::min(tz * tile_size + lz, int(header.size_z) - 1);
+					float h = height[x][z];
+					size_t i = size_t(lz) * tile_size + lx;
+					if (format == F32) {
+						std::memcpy(&tile[i * sizeof(float)], &h, sizeof(float));
+					}
+					else {
+						uint16_t v = static_cast<uint16_t>(std::min(std::max(h, 0.0f), 1.0f) * 65535.0f + 0.5f);
+						std::memcpy(&tile[i * sizeof(uint16_t)], &v, sizeof(uint16_t));
+					}
+				}
+			}
+			file.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+		}
+	}
+
+	return file.good();
+}
+
+bool TiledHeightfield::Open(const maybewchar* file_name)
+{
+	Close();
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileW(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		CloseHandle(file);
+		return false;
+	}
+	data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	file_handle = file;
+	mapping_handle = mapping;
+	data_size = static_cast<size_t>(file_size.QuadPart);
+#else
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	fstat(fd, &st);
+	void* view = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (view != MAP_FAILED) {
+		// Tiles are accessed in no particular order, do not read ahead
+		madvise(view, st.st_size, MADV_RANDOM);
+		data = static_cast<const unsigned char*>(view);
+	}
+	data_size = static_cast<size_t>(st.st_size);
+#endif
+	if (data == nullptr || data_size < HEADER_SIZE) {
+		Close();
+		return false;
+	}
+
+	Header header;
+	std::memcpy(&header, data, sizeof(Header));
+	if (header.magic != MAGIC || header.tile_size == 0 || header.format > F32) {
+		Close();
+		return false;
+	}
+
+	size_x = header.size_x;
+	size_z = header.size_z;
+	tile_size = header.tile_size;
+	format = static_cast<Format>(header.format);
+	tiles_x = (size_x + tile_size - 1) / tile_size;
+	int tiles_z = (size_z + tile_size - 1) / tile_size;
+
+	size_t expected = HEADER_SIZE + size_t(tiles_x) * tiles_z * tile_size * tile_size * SampleBytes(format);
+	if (data_size < expected) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void TiledHeightfield::Close()
+{
+#if defined(_WIN32)
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle)
+		CloseHandle(file_handle);
+#else
+	if (data)
+		munmap(const_cast<unsigned char*>(data), data_size);
+#endif
+	data = nullptr;
+	data_size = 0;
+	file_handle = nullptr;
+	mapping_handle = nullptr;
+	size_x = size_z = tile_size = tiles_x = 0;
+}
+
+const unsigned char* TiledHeightfield::TileData(int tx, int tz) const
+{
+	size_t tile_bytes = size_t(tile_size) * tile_size * SampleBytes(format);
+	return data + HEADER_SIZE + (size_t(tz) * tiles_x + tx) * tile_bytes;
+}
+
+float TiledHeightfield::Get(int x, int z) const
+{
+	x = std::min(std::max(x, 0), size_x - 1);
+	z = std::min(std::max(z, 0), size_z - 1);
+
+	const unsigned char* tile = TileData(x / tile_size, z / tile_size);
+	size_t i = size_t(z % tile_size) * tile_size + (x % tile_size);
+	if (format == F32) {
+		float h;
+		std::memcpy(&h, tile + i * sizeof(float), sizeof(float));
+		return h;
+	}
+	uint16_t v;
+	std::memcpy(&v, tile + i * sizeof(uint16_t), sizeof(uint16_t));
+	return float(v) / 65535.0f;
+}
+
+void TiledHeightfield::ReadRegion(int x0, int z0, int w, int h, std::vector<std::vector<float>>& out) const
+{
+	out.assign(w, std::vector<float>(h));
+
+	// Walk tile by tile so each touched tile is paged in once
+	for (int tz = std::max(z0, 0) / tile_size; tz * tile_size < std::min(z0 + h, size_z); ++tz) {
+		for (int tx = std::max(x0, 0) / tile_size; tx * tile_size < std::min(x0 + w, size_x); ++tx) {
+			int zb = std::max(z0, tz * tile_size), ze = std::min(std::min(z0 + h, size_z), (tz + 1) * tile_size);
+			int xb = std::max(x0, tx * tile_size), xe = std::min(std::min(x0 + w, size_x), (tx + 1) * tile_size);
+			for (int z = zb; z < ze; ++z)
+				for (int x = xb; x < xe; ++x)
+					out[x - x0][z - z0] = Get(x, z);
+		}
+	}
+
+	// Samples outside the heightfield repeat the border
+	for (int x = 0; x < w; ++x)
+		for (int z = 0; z < h; ++z)
+			if (x0 + x < 0 || z0 + z < 0 || x0 + x >= size_x || z0 + z >= size_z)
+				out[x][z] = Get(x0 + x, z0 + z);
+}
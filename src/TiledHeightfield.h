@@ -0,0 +1,65 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// File names are wide on Windows, the same type as in the headers loading images with DevIL
+#if defined(_WIN32)
+typedef wchar_t maybewchar;
+#else
+typedef char maybewchar;
+#endif
+
+//-----------------------------------------
+//----    TILED HEIGHTFIELD STORAGE    ----
+//-----------------------------------------
+
+/// Heightfield stored on disk as square tiles (.hft) and memory-mapped, so reading a region only pages in
+/// the tiles it touches. The file is a 4096 byte header followed by tiles_x * tiles_z tiles of
+/// tile_size * tile_size samples, tile by tile (row-major), samples inside a tile row-major too.
+/// Samples are either normalized 16-bit integers or 32-bit floats.
+class TiledHeightfield
+{
+public:
+	enum Format : uint32_t { R16 = 0, F32 = 1 };
+
+	static const uint32_t MAGIC = 0x31544648; // "HFT1"
+	static const int HEADER_SIZE = 4096;
+
+	TiledHeightfield() = default;
+	~TiledHeightfield();
+	TiledHeightfield(const TiledHeightfield&) = delete;
+	TiledHeightfield& operator =(const TiledHeightfield&) = delete;
+
+	/// Writes 'height' (indexed [x][z], values in [0, 1] for R16) as a tiled file. Returns false if the file cannot be written.
+	static bool Cook(const std::vector<std::vector<float>>& height, const maybewchar* file_name, int tile_size = 256, Format format = R16);
+
+	/// Maps the file into memory. Returns false if it cannot be opened or is not a tiled heightfield.
+	bool Open(const maybewchar* file_name);
+	void Close();
+	bool IsOpen() const { return data != nullptr; }
+
+	int SizeX() const { return size_x; }
+	int SizeZ() const { return size_z; }
+	int TileSize() const { return tile_size; }
+
+	/// Height of the sample (x, z), coordinates are clamped to the heightfield
+	float Get(int x, int z) const;
+
+	/// Copies a w * h region starting at (x0, z0) into 'out' (indexed [x][z]), touching only the tiles it covers
+	void ReadRegion(int x0, int z0, int w, int h, std::vector<std::vector<float>>& out) const;
+
+private:
+	const unsigned char* data = nullptr;
+	size_t data_size = 0;
+	void* file_handle = nullptr;
+	void* mapping_handle = nullptr;
+
+	int size_x = 0;
+	int size_z = 0;
+	int tile_size = 0;
+	int tiles_x = 0;
+	Format format = R16;
+
+	const unsigned char* TileData(int tx, int tz) const;
+};
@@ -0,0 +1,406 @@
+#include "VegetationPlacement.h"
+#include "Terrain.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <cfloat>
+
+namespace {
+	/// Rounds of candidates per layer at most, every round fills the gaps the ones before left
+	const int MAX_ROUNDS = 8;
+	/// Candidates of a round per wanted instance (where the density keeps them all)
+	const float CANDIDATES_PER_INSTANCE = 1.5f;
+	/// A round placing fewer than this share of the wanted instances ends the layer, the terrain is full
+	const float SATURATED = 0.01f;
+	/// A layer keeps its radius while count * radius^2 stays below this share of the area it grows on, random
+	/// Poisson disk sets fill up at about 0.7
+	const float PACKING = 0.35f;
+	/// Tiles along each side at most
+	const int MAX_TILES = 32;
+	/// Samples along each side estimating the mean density of a layer
+	const int DENSITY_SAMPLES = 64;
+
+	uint32_t Hash(uint32_t a, uint32_t b)
+	{
+		uint32_t h = a * 0x9E3779B9u ^ (b + 0x7F4A7C15u + (a << 6) + (a >> 2));
+		h ^= h >> 16;
+		h *= 0x85EBCA6Bu;
+		h ^= h >> 13;
+		h *= 0xC2B2AE35u;
+		h ^= h >> 16;
+		return h;
+	}
+
+	/// Counter based random numbers, a key gives the same sequence on every thread
+	struct Random
+	{
+		uint32_t key;
+		uint32_t counter = 0;
+
+		explicit Random(uint32_t key) : key(key) {}
+		uint32_t Next() { return Hash(key, counter++); }
+		/// In [0, 1)
+		float Uniform() { return (Next() >> 8) * (1.0f / 16777216.0f); }
+	};
+
+	struct Point
+	{
+		float x, z;
+		/// Normalized terrain height
+		float y;
+		float yaw;
+		/// Random order of the instances, the lowest are kept when a layer placed too many
+		uint32_t rank;
+	};
+
+	/// Positions of a layer, at most one per cell. Empty cells hold FLT_MAX, far from everything.
+	struct Grid
+	{
+		float min_x = 0.0f, min_z = 0.0f;
+		float cell = 1.0f;
+		int cells_x = 0, cells_z = 0;
+		std::vector<glm::vec2> points;
+
+		void Reset(float x, float z, float extent_x, float extent_z, float cell_size)
+		{
+			min_x = x;
+			min_z = z;
+			cell = cell_size;
+			cells_x = std::max(static_cast<int>(std::ceil(extent_x / cell)), 1);
+			cells_z = std::max(static_cast<int>(std::ceil(extent_z / cell)), 1);
+			points.assign(size_t(cells_x) * cells_z, glm::vec2(FLT_MAX));
+		}
+
+		void Release() { std::vector<glm::vec2>().swap(points); }
+
+		int CellX(float x) const { return std::min(std::max(static_cast<int>((x - min_x) / cell), 0), cells_x - 1); }
+		int CellZ(float z) const { return std::min(std::max(static_cast<int>((z - min_z) / cell), 0), cells_z - 1); }
+
+		/// Whether a point lies closer than 'distance' to (x, z)
+		bool Near(float x, float z, float distance) const
+		{
+			int x0 = CellX(x - distance), x1 = CellX(x + distance);
+			int z0 = CellZ(z - distance), z1 = CellZ(z + distance);
+			float limit = distance * distance;
+			for (int cz = z0; cz <= z1; ++cz) {
+				const glm::vec2* row = points.data() + size_t(cz) * cells_x;
+				for (int cx = x0; cx <= x1; ++cx) {
+					float dx = row[cx].x - x, dz = row[cx].y - z;
+					if (dx * dx + dz * dz < limit)
+						return true;
+				}
+			}
+			return false;
+		}
+
+		void Insert(float x, float z) { points[size_t(CellZ(z)) * cells_x + CellX(x)] = glm::vec2(x, z); }
+	};
+
+	/// Terrain placed like the single one, heights interpolated between the samples
+	struct Heightfield
+	{
+		const std::vector<std::vector<float>>& height;
+		int size_x, size_z;
+
+		/// Quad under the world position (x, z), its first sample
+		void Quad(float x, float z, int& xi, int& zi) const
+		{
+			xi = std::min(std::max(static_cast<int>((x + 50.0f) * size_x / 100.0f), 0), size_x - 2);
+			zi = std::min(std::max(static_cast<int>((z + 50.0f) * size_z / 100.0f), 0), size_z - 2);
+		}
+
+		float Sample(float x, float z) const
+		{
+			float fx = (x + 50.0f) * size_x / 100.0f, fz = (z + 50.0f) * size_z / 100.0f;
+			int xi, zi;
+			Quad(x, z, xi, zi);
+			float tx = std::min(std::max(fx - xi, 0.0f), 1.0f), tz = std::min(std::max(fz - zi, 0.0f), 1.0f);
+			float near_z = height[xi][zi] + (height[xi + 1][zi] - height[xi][zi]) * tx;
+			float far_z = height[xi][zi + 1] + (height[xi + 1][zi + 1] - height[xi][zi + 1]) * tx;
+			return near_z + (far_z - near_z) * tz;
+		}
+
+		/// Instance standing on the ground at (x, z), tilted along the slope of its quad
+		PackedInstance Seat(float x, float z, float yaw) const
+		{
+			int xi, zi;
+			Quad(x, z, xi, zi);
+			float h = height[xi][zi];
+			return PackedInstance::Pack(glm::vec3(x, Sample(x, z) * TERRAIN_HEIGHT, z), yaw, -tanf(h - height[xi + 1][zi]), -tanf(h - height[xi][zi + 1]));
+		}
+	};
+
+	/// Instances of 'a' with an instance of 'b' (other than themselves) closer than 'distance'
+	long long CountCloserThan(const std::vector<PackedInstance>& a, const std::vector<PackedInstance>& b, float distance)
+	{
+		if (a.empty() || b.empty() || distance <= 0.0f)
+			return 0;
+		// Counting sort of 'b' into cells of 'distance', a test reads the 3x3 cells around
+		float min_x = FLT_MAX, min_z = FLT_MAX, max_x = -FLT_MAX, max_z = -FLT_MAX;
+		for (const PackedInstance& instance : b) {
+			min_x = std::min(min_x, instance.position.x);
+			min_z = std::min(min_z, instance.position.z);
+			max_x = std::max(max_x, instance.position.x);
+			max_z = std::max(max_z, instance.position.z);
+		}
+		int cells_x = std::min(static_cast<int>((max_x - min_x) / distance) + 1, 8192);
+		int cells_z = std::min(static_cast<int>((max_z - min_z) / distance) + 1, 8192);
+		float cell = std::max((max_x - min_x) / cells_x, (max_z - min_z) / cells_z) * 1.0001f;
+		cell = std::max(cell, distance);
+		auto cell_of = [&](const glm::vec3& p, int dx, int dz) {
+			int cx = static_cast<int>((p.x - min_x) / cell) + dx, cz = static_cast<int>((p.z - min_z) / cell) + dz;
+			return cx < 0 || cz < 0 || cx >= cells_x || cz >= cells_z ? -1 : cz * cells_x + cx;
+		};
+		std::vector<int> first(size_t(cells_x) * cells_z + 1, 0), order(b.size());
+		for (const PackedInstance& instance : b)
+			++first[cell_of(instance.position, 0, 0) + 1];
+		for (size_t i = 1; i < first.size(); ++i)
+			first[i] += first[i - 1];
+		std::vector<int> next(first.begin(), first.end() - 1);
+		for (size_t i = 0; i < b.size(); ++i)
+			order[next[cell_of(b[i].position, 0, 0)]++] = static_cast<int>(i);
+
+		long long count = 0;
+		float limit = distance * distance;
+		for (size_t i = 0; i < a.size(); ++i) {
+			const glm::vec3& p = a[i].position;
+			bool close = false;
+			for (int dz = -1; dz <= 1 && !close; ++dz)
+				for (int dx = -1; dx <= 1 && !close; ++dx) {
+					int c = cell_of(p, dx, dz);
+					if (c < 0)
+						continue;
+					for (int k = first[c]; k < first[c + 1] && !close; ++k) {
+						const PackedInstance& other = b[order[k]];
+						if (&a == &b && size_t(order[k]) == i)
+							continue;
+						float ox = other.position.x - p.x, oz = other.position.z - p.z;
+						close = ox * ox + oz * oz < limit;
+					}
+				}
+			count += close;
+		}
+		return count;
+	}
+}
+
+std::vector<std::vector<PackedInstance>> VegetationPlacement::Place(const std::vector<std::vector<float>>& height, const std::vector<Layer>& layers,
+	uint32_t seed, bool parallel, Statistics* statistics)
+{
+	int layer_count = static_cast<int>(layers.size());
+	std::vector<std::vector<PackedInstance>> placed(layer_count);
+	if (statistics) {
+		statistics->candidates = 0;
+		statistics->radius.assign(layer_count, 0.0f);
+		statistics->footprint.assign(layer_count, 0.0f);
+	}
+	if (height.size() < 2 || height[0].size() < 2)
+		return placed;
+	Heightfield terrain = { height, static_cast<int>(height.size()), static_cast<int>(height[0].size()) };
+	// From the first sample to the last
+	const float min_x = -50.0f, min_z = -50.0f;
+	float extent_x = (terrain.size_x - 1) * 100.0f / terrain.size_x;
+	float extent_z = (terrain.size_z - 1) * 100.0f / terrain.size_z;
+
+	std::vector<Grid> grids(layer_count);
+	std::vector<float> footprints(layer_count, 0.0f);
+	for (int l = 0; l < layer_count; ++l) {
+		const Layer& layer = layers[l];
+		if (layer.count <= 0 || !layer.density)
+			continue;
+
+		// Share of the terrain the layer grows on
+		double density_sum = 0.0;
+		for (int j = 0; j < DENSITY_SAMPLES; ++j)
+			for (int i = 0; i < DENSITY_SAMPLES; ++i) {
+				float x = min_x + (i + 0.5f) * extent_x / DENSITY_SAMPLES, z = min_z + (j + 0.5f) * extent_z / DENSITY_SAMPLES;
+				density_sum += std::min(std::max(layer.density(x, terrain.Sample(x, z), z), 0.0f), 1.0f);
+			}
+		float mean_density = static_cast<float>(density_sum / (DENSITY_SAMPLES * DENSITY_SAMPLES));
+		if (mean_density <= 0.0f)
+			continue;
+
+		// Spacing the count fits in, the footprint shrinks with it
+		float wanted_radius = std::max(layer.radius, 1e-4f);
+		float radius = std::min(wanted_radius, std::sqrt(PACKING * extent_x * extent_z * mean_density / layer.count));
+		float footprint = layer.footprint * radius / wanted_radius;
+		footprints[l] = footprint;
+		if (statistics) {
+			statistics->radius[l] = radius;
+			statistics->footprint[l] = footprint;
+		}
+		Grid& grid = grids[l];
+		grid.Reset(min_x, min_z, extent_x, extent_z, radius / std::sqrt(2.0f));
+
+		// Tiles of a phase are two tiles apart, their candidates never read a cell another one writes
+		int tiles_x = std::min(std::max(static_cast<int>(extent_x / (2.0f * radius)), 1), MAX_TILES);
+		int tiles_z = std::min(std::max(static_cast<int>(extent_z / (2.0f * radius)), 1), MAX_TILES);
+		float tile_w = extent_x / tiles_x, tile_h = extent_z / tiles_z;
+		int tiles = tiles_x * tiles_z;
+		std::vector<int> phases[4];
+		for (int t = 0; t < tiles; ++t)
+			phases[(t % tiles_x & 1) + 2 * (t / tiles_x & 1)].push_back(t);
+		std::vector<std::vector<Point>> tile_points(tiles);
+		std::vector<long long> tile_candidates(tiles, 0);
+		float tile_share = CANDIDATES_PER_INSTANCE * layer.count / mean_density / tiles;
+
+		int placed_count = 0;
+		for (int round = 0; round < MAX_ROUNDS && placed_count < layer.count; ++round) {
+			uint32_t round_key = Hash(Hash(seed, static_cast<uint32_t>(l)), static_cast<uint32_t>(round));
+			auto place_tile = [&](int tile) {
+				Random random(Hash(round_key, static_cast<uint32_t>(tile)));
+				// The fraction of a candidate decided by the tile's own numbers
+				int candidates = static_cast<int>(tile_share);
+				candidates += random.Uniform() < tile_share - candidates;
+				tile_candidates[tile] += candidates;
+				float x0 = min_x + (tile % tiles_x) * tile_w, z0 = min_z + (tile / tiles_x) * tile_h;
+				std::vector<Point>& points = tile_points[tile];
+				for (int c = 0; c < candidates; ++c) {
+					// Every candidate draws the same numbers, kept or not
+					Point point;
+					point.x = x0 + random.Uniform() * tile_w;
+					point.z = z0 + random.Uniform() * tile_h;
+					float keep = random.Uniform();
+					point.yaw = random.Uniform() * 6.28f;
+					point.rank = random.Next();
+
+					point.y = terrain.Sample(point.x, point.z);
+					if (keep >= layer.density(point.x, point.y, point.z) || grid.Near(point.x, point.z, radius))
+						continue;
+					bool covered = false;
+					for (int e = 0; e < l && !covered; ++e)
+						covered = footprints[e] > 0.0f && !grids[e].points.empty() && grids[e].Near(point.x, point.z, footprints[e] + footprint);
+					if (covered)
+						continue;
+					grid.Insert(point.x, point.z);
+					points.push_back(point);
+				}
+			};
+			for (const std::vector<int>& phase : phases) {
+				if (parallel)
+					ThreadPool::Shared().ParallelFor(0, static_cast<int>(phase.size()), [&](int i) { place_tile(phase[i]); });
+				else
+					for (int tile : phase)
+						place_tile(tile);
+			}
+
+			int before = placed_count;
+			placed_count = 0;
+			for (const std::vector<Point>& points : tile_points)
+				placed_count += static_cast<int>(points.size());
+			if (placed_count - before < SATURATED * layer.count)
+				break;
+		}
+
+		// Tile order, the ones of lowest rank when there are too many
+		std::vector<Point> points;
+		points.reserve(placed_count);
+		for (const std::vector<Point>& tile : tile_points)
+			points.insert(points.end(), tile.begin(), tile.end());
+		std::vector<std::vector<Point>>().swap(tile_points);
+		if (placed_count > layer.count) {
+			std::vector<uint32_t> ranks(points.size());
+			for (size_t i = 0; i < points.size(); ++i)
+				ranks[i] = points[i].rank;
+			std::nth_element(ranks.begin(), ranks.begin() + (layer.count - 1), ranks.end());
+			uint32_t threshold = ranks[layer.count - 1];
+			int below = 0;
+			for (const Point& point : points)
+				below += point.rank < threshold;
+			int ties = layer.count - below;
+			size_t kept = 0;
+			for (const Point& point : points) {
+				if (point.rank < threshold || (point.rank == threshold && ties-- > 0))
+					points[kept++] = point;
+			}
+			points.resize(kept);
+		}
+
+		// The grid stays for the layers after when the layer has a footprint, without the dropped instances
+		if (footprint > 0.0f) {
+			if (placed_count > layer.count) {
+				grid.Reset(min_x, min_z, extent_x, extent_z, radius / std::sqrt(2.0f));
+				for (const Point& point : points)
+					grid.Insert(point.x, point.z);
+			}
+		}
+		else
+			grid.Release();
+
+		std::vector<PackedInstance>& instances = placed[l];
+		instances.resize(points.size());
+		for (size_t i = 0; i < points.size(); ++i)
+			instances[i] = terrain.Seat(points[i].x, points[i].z, points[i].yaw);
+		if (statistics)
+			for (long long candidates : tile_candidates)
+				statistics->candidates += candidates;
+	}
+	return placed;
+}
+
+int VegetationPlacement::Reseat(const std::vector<std::vector<float>>& height, Terrain::Region region, std::vector<PackedInstance>& instances)
+{
+	if (region.Empty() || height.size() < 2 || height[0].size() < 2)
+		return 0;
+	Heightfield terrain = { height, static_cast<int>(height.size()), static_cast<int>(height[0].size()) };
+	int moved = 0;
+	for (PackedInstance& instance : instances) {
+		// The instance reads the four samples of its quad
+		int xi, zi;
+		terrain.Quad(instance.position.x, instance.position.z, xi, zi);
+		if (xi + 1 < region.x0 || xi > region.x1 || zi + 1 < region.z0 || zi > region.z1)
+			continue;
+		PackedInstance seated = terrain.Seat(instance.position.x, instance.position.z, 0.0f);
+		seated.yaw = instance.yaw;
+		seated.scale = instance.scale;
+		instance = seated;
+		moved++;
+	}
+	return moved;
+}
+
+void VegetationPlacement::RunBenchmark(const std::vector<std::vector<float>>& height, std::ostream& out)
+{
+	if (height.size() < 2 || height[0].size() < 2) {
+		out << "Vegetation placement: no heightmap" << std::endl;
+		return;
+	}
+	out << "Vegetation placement on " << height.size() << "x" << height[0].size() << " samples:" << std::endl;
+	const uint32_t SEED = 1;
+	unsigned threads = ThreadPool::Shared().ThreadCount() + 1;
+	for (int count : { 100000, 1000000, 2000000 }) {
+		// Trees keep the grass off their trunks, the grass fills the rest
+		std::vector<Layer> layers = {
+			{ count / 20, 2.5f, 0.6f, [](float, float y, float) { return y < 0.2f ? 0.0f : y; } },
+			{ count, 0.3f, 0.0f, [](float, float y, float) { return y < 0.15f ? 0.02f : 1.0f - y / 2.0f; } },
+		};
+		Statistics statistics;
+		auto t0 = std::chrono::steady_clock::now();
+		std::vector<std::vector<PackedInstance>> single = Place(height, layers, SEED, false, &statistics);
+		auto t1 = std::chrono::steady_clock::now();
+		std::vector<std::vector<PackedInstance>> pooled = Place(height, layers, SEED, true);
+		auto t2 = std::chrono::steady_clock::now();
+		double single_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+		double pooled_ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+		bool identical = true;
+		for (size_t l = 0; l < layers.size(); ++l)
+			identical = identical && single[l].size() == pooled[l].size()
+				&& std::memcmp(single[l].data(), pooled[l].data(), single[l].size() * sizeof(PackedInstance)) == 0;
+		// Pairs below the spacing within the float rounding of the test
+		long long too_close = 0;
+		for (size_t l = 0; l < layers.size(); ++l)
+			too_close += CountCloserThan(single[l], single[l], statistics.radius[l] * 0.9999f);
+		too_close += CountCloserThan(single[1], single[0], (statistics.footprint[0] + statistics.footprint[1]) * 0.9999f);
+
+		double candidates = static_cast<double>(statistics.candidates);
+		out << "  " << layers[0].count << " trees and " << layers[1].count << " grass wanted, " << single[0].size() << " and "
+			<< single[1].size() << " placed (spacing " << statistics.radius[0] << " and " << statistics.radius[1] << ") from "
+			<< candidates / 1e6 << " M candidates" << std::endl;
+		out << "    " << single_ms << " ms, " << candidates / (single_ms * 1000.0) << " Mcandidates/s (1 thread), "
+			<< pooled_ms << " ms, " << candidates / (pooled_ms * 1000.0) << " Mcandidates/s (" << threads << " threads), "
+			<< (identical ? "same" : "different") << " instances, " << too_close << " instances closer than the spacing" << std::endl;
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include "InstanceBuffer.h"
+#include "Terrain.h"
+
+#include <vector>
+#include <functional>
+#include <iostream>
+#include <cstdint>
+
+//-----------------------------------------
+//----      VEGETATION PLACEMENT       ----
+//-----------------------------------------
+
+/// Poisson disk placement of the vegetation on the single terrain. The kinds (layers) are placed one after the
+/// other: no two instances of a layer are closer than its radius, and an instance keeps off the footprints of the
+/// earlier layers (grass does not grow inside a trunk). Every layer keeps its instances in a grid of radius / sqrt(2)
+/// cells, one instance per cell, a test reads the few cells around the candidate.
+///
+/// The terrain is split into tiles at least twice the interaction distance wide and the tiles are run in four
+/// phases (2x2 colors) over the thread pool: tiles of a phase never touch the same cells, a candidate near the tile
+/// border still sees the instances of the neighbours placed in the phases before. Candidates come in rounds, drawn
+/// from counter based random numbers keyed by the seed, layer, round and tile, and every tile tests them in order,
+/// the result depends on the seed only, not on the thread count.
+class VegetationPlacement
+{
+public:
+	struct Layer
+	{
+		/// Instances wanted, fewer come back when the terrain is full
+		int count;
+		/// Least distance between two instances of the layer, shrunk when 'count' does not fit at that spacing
+		float radius;
+		/// Disk around every instance the later layers keep their instances out of, shrunk with the radius. Two
+		/// footprints do not overlap.
+		float footprint;
+		/// Chance to keep a spot, from (x, normalized height, z)
+		std::function<float(float, float, float)> density;
+	};
+
+	struct Statistics
+	{
+		/// Candidates tested over all layers
+		long long candidates = 0;
+		/// Spacing and footprint used per layer
+		std::vector<float> radius;
+		std::vector<float> footprint;
+	};
+
+	/// Places the layers on a heightfield ([x][z], normalized) placed like the single terrain, one instance list per
+	/// layer. 'parallel' spreads the tiles over the thread pool.
+	static std::vector<std::vector<PackedInstance>> Place(const std::vector<std::vector<float>>& height, const std::vector<Layer>& layers,
+		uint32_t seed, bool parallel = true, Statistics* statistics = nullptr);
+
+	/// Puts the instances standing on the samples of 'region' back on the ground after the heights there changed
+	/// (e.g. Terrain::ApplyBrush): height and tilt as Place gives them, position, yaw and scale are kept. Returns
+	/// the number of instances re-seated.
+	static int Reseat(const std::vector<std::vector<float>>& height, Terrain::Region region, std::vector<PackedInstance>& instances);
+
+	/// Places trees and grass at up to millions of instances on one thread and on the thread pool, checks that both
+	/// give the same instances and no pair is closer than the spacing, and prints candidates/s
+	static void RunBenchmark(const std::vector<std::vector<float>>& height, std::ostream& out = std::cout);
+};
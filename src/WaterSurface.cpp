@@ -0,0 +1,132 @@
+#include "WaterSurface.h"
+#include <algorithm>
+#include <cmath>
+
+void WaterSurface::Build(const std::vector<std::vector<float>>& height, int grid_size, const Settings& settings)
+{
+	tiles_x = settings.tiles_x;
+	tiles_z = settings.tiles_z;
+	mask.assign(TileCount(), 1);
+	bounds_min.resize(TileCount());
+	bounds_max.resize(TileCount());
+	quads.resize(TileCount());
+	indices.clear();
+	tile_count.clear();
+	tile_offset.clear();
+
+	int grid_quads = grid_size - 1;
+	// Vertex v of the grid lies at (v / grid_size - 0.5) * 100, terrain sample s at (s / size - 0.5) * 100
+	auto grid_world = [grid_size](int v) { return (float(v) / grid_size - 0.5f) * 100.0f; };
+
+	for (int tz = 0; tz < tiles_z; ++tz) {
+		for (int tx = 0; tx < tiles_x; ++tx) {
+			int tile = tz * tiles_x + tx;
+			int x0 = Terrain::ChunkBegin(tx, tiles_x, grid_quads), x1 = Terrain::ChunkBegin(tx + 1, tiles_x, grid_quads);
+			int z0 = Terrain::ChunkBegin(tz, tiles_z, grid_quads), z1 = Terrain::ChunkBegin(tz + 1, tiles_z, grid_quads);
+			bounds_min[tile] = glm::vec3(grid_world(x0) - settings.margin, settings.level - settings.margin, grid_world(z0) - settings.margin);
+			bounds_max[tile] = glm::vec3(grid_world(x1) + settings.margin, settings.level + settings.margin, grid_world(z1) + settings.margin);
+			quads[tile] = size_t(x1 - x0) * (z1 - z0);
+
+			mask[tile] = MaskTile(height, tile);
+
+			// Row strips of the tile, same winding as the whole grid
+			size_t first = indices.size();
+			for (int z = z0; z < z1; ++z) {
+				for (int x = x0; x <= x1; ++x) {
+					indices.push_back((z + 1) * grid_size + x);
+					indices.push_back(z * grid_size + x);
+				}
+				// Restart triangle strips
+				indices.push_back(2643261405U);
+			}
+			tile_count.push_back(static_cast<GLsizei>(indices.size() - first));
+			tile_offset.push_back(reinterpret_cast<const void*>(first * sizeof(unsigned int)));
+		}
+	}
+}
+
+Terrain::Region WaterSurface::TileSamples(int tile, int size_x, int size_z) const
+{
+	// The terrain surface over the footprint is interpolated from these samples, it never dips below the lowest
+	Terrain::Region samples;
+	samples.x0 = std::max(static_cast<int>(std::floor((bounds_min[tile].x / 100.0f + 0.5f) * size_x)), 0);
+	samples.x1 = std::min(static_cast<int>(std::ceil((bounds_max[tile].x / 100.0f + 0.5f) * size_x)), size_x - 1);
+	samples.z0 = std::max(static_cast<int>(std::floor((bounds_min[tile].z / 100.0f + 0.5f) * size_z)), 0);
+	samples.z1 = std::min(static_cast<int>(std::ceil((bounds_max[tile].z / 100.0f + 0.5f) * size_z)), size_z - 1);
+	return samples;
+}
+
+char WaterSurface::MaskTile(const std::vector<std::vector<float>>& height, int tile) const
+{
+	Terrain::Region samples = TileSamples(tile, static_cast<int>(height.size()), static_cast<int>(height[0].size()));
+	float lowest = 1.0f;
+	for (int x = samples.x0; x <= samples.x1; ++x)
+		lowest = std::min(lowest, *std::min_element(height[x].begin() + samples.z0, height[x].begin() + samples.z1 + 1));
+	// The top of the bounds is the water level plus the margin
+	return lowest * TERRAIN_HEIGHT - 2.0f > bounds_max[tile].y ? 0 : 1;
+}
+
+void WaterSurface::UpdateMask(const std::vector<std::vector<float>>& height, Terrain::Region region)
+{
+	if (region.Empty())
+		return;
+	int size_x = static_cast<int>(height.size());
+	int size_z = static_cast<int>(height[0].size());
+	for (int tile = 0; tile < TileCount(); ++tile) {
+		Terrain::Region samples = TileSamples(tile, size_x, size_z);
+		if (samples.x1 < region.x0 || samples.x0 > region.x1 || samples.z1 < region.z0 || samples.z0 > region.z1)
+			continue;
+		mask[tile] = MaskTile(height, tile);
+	}
+}
+
+void WaterSurface::Upload(const Geometry& grid)
+{
+	geometry = grid;
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	geometry.DrawElementsCount = static_cast<GLsizei>(indices.size());
+	indices.clear();
+	indices.shrink_to_fit();
+}
+
+void WaterSurface::Cull(const Frustum& frustum, std::vector<char>& visible) const
+{
+	visible.resize(TileCount());
+	for (int tile = 0; tile < TileCount(); ++tile)
+		visible[tile] = mask[tile] && frustum.IntersectsBox(bounds_min[tile], bounds_max[tile]);
+}
+
+void WaterSurface::Draw(const std::vector<char>& visible) const
+{
+	std::vector<GLsizei> counts;
+	std::vector<const void*> offsets;
+	for (size_t i = 0; i < tile_count.size(); ++i) {
+		if (!visible[i])
+			continue;
+		// Tiles are stored in order, extend the previous range when it ends where this one starts
+		if (!offsets.empty() && static_cast<const char*>(offsets.back()) + counts.back() * sizeof(unsigned int) == tile_offset[i])
+			counts.back() += tile_count[i];
+		else {
+			counts.push_back(tile_count[i]);
+			offsets.push_back(tile_offset[i]);
+		}
+	}
+	if (!counts.empty())
+		glMultiDrawElements(geometry.Mode, counts.data(), GL_UNSIGNED_INT, offsets.data(), static_cast<GLsizei>(counts.size()));
+}
+
+size_t WaterSurface::TriangleCount(const std::vector<char>& visible) const
+{
+	size_t triangles = 0;
+	for (int tile = 0; tile < TileCount(); ++tile)
+		if (visible[tile])
+			triangles += 2 * quads[tile];
+	return triangles;
+}
+
+size_t WaterSurface::TriangleCount() const
+{
+	return TriangleCount(std::vector<char>(TileCount(), 1));
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include "Terrain.h"
+#include "Frustum.h"
+
+#include <vector>
+
+//-----------------------------------------
+//----          WATER SURFACE          ----
+//-----------------------------------------
+
+/// The water grid (Loader::CreateGrid, drawn scaled to 100 x 100 world units at the water level) split into
+/// tiles_x * tiles_z tiles. The index buffer holds the row strips tile by tile so any set of tiles is drawn with
+/// one glMultiDrawElements. Tiles whose whole footprint is under the terrain (the ground higher than the water
+/// level everywhere) are masked out at load and again where the terrain is edited, the others are frustum culled
+/// every frame.
+class WaterSurface
+{
+public:
+	struct Settings
+	{
+		int tiles_x = 10;
+		int tiles_z = 10;
+		/// World height of the water plane
+		float level = 0.0f;
+		/// Slack in world units around the tiles, covers the wave displacement of the vertex shader
+		float margin = 1.0f;
+	};
+
+	Geometry geometry;
+
+	/// Splits a grid of grid_size * grid_size vertices into tiles and builds the mask from the heights of the
+	/// single terrain ([x][z], normalized). Needs no GL context.
+	void Build(const std::vector<std::vector<float>>& height, int grid_size, const Settings& settings);
+
+	/// Masks the tiles again whose footprint reads the samples of 'region', after their heights changed (e.g.
+	/// Terrain::ApplyBrush)
+	void UpdateMask(const std::vector<std::vector<float>>& height, Terrain::Region region);
+
+	/// Takes over 'grid' (created with the same grid_size) and replaces its index buffer with the tiled one
+	void Upload(const Geometry& grid);
+
+	int TileCount() const { return tiles_x * tiles_z; }
+
+	/// Tiles with water above the terrain, one flag per tile (tz * tiles_x + tx)
+	const std::vector<char>& Mask() const { return mask; }
+
+	/// Masked tiles whose bounds intersect the frustum, one flag per tile
+	void Cull(const Frustum& frustum, std::vector<char>& visible) const;
+
+	/// Draws the flagged tiles (e.g. from Cull, or all ones for the whole grid). Bind the vertex array object
+	/// and enable primitive restart first.
+	void Draw(const std::vector<char>& visible) const;
+
+	/// Triangles of the flagged tiles, and of the whole grid
+	size_t TriangleCount(const std::vector<char>& visible) const;
+	size_t TriangleCount() const;
+
+private:
+	int tiles_x = 0;
+	int tiles_z = 0;
+	std::vector<char> mask;
+	/// World bounds of every tile, including the margin
+	std::vector<glm::vec3> bounds_min;
+	std::vector<glm::vec3> bounds_max;
+	/// Quads of every tile
+	std::vector<size_t> quads;
+
+	std::vector<unsigned int> indices;
+	std::vector<GLsizei> tile_count;
+	std::vector<const void*> tile_offset;
+
+	/// Samples of the single terrain under the footprint of a tile, margin included
+	Terrain::Region TileSamples(int tile, int size_x, int size_z) const;
+	/// 0 when the terrain is above the water everywhere over the tile
+	char MaskTile(const std::vector<std::vector<float>>& height, int tile) const;
+};